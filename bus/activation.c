@@ -27,6 +27,7 @@
 #include "activation.h"
 #include "activation-exit-codes.h"
 #include "desktop-file.h"
+#include "dir-watch.h"
 #include "dispatch.h"
 #include "services.h"
 #include "test.h"
@@ -55,6 +56,8 @@ struct BusActivation
                               */
   DBusHashTable *directories;
   DBusHashTable *environment;
+  DBusHashTable *unknown_names; /**< Names recently not found in unwatched directories */
+  long unknown_names_time;      /**< Monotonic second unknown_names was filled in */
 };
 
 typedef struct
@@ -62,6 +65,7 @@ typedef struct
   int refcount;
   char *dir_c;
   DBusHashTable *entries;
+  unsigned int watched : 1; /**< entries is kept current by the directory watch */
 } BusServiceDirectory;
 
 typedef struct
@@ -820,6 +824,18 @@ bus_activation_reload (BusActivation     *activation,
       goto failed;
     }
 
+  if (activation->unknown_names != NULL)
+    _dbus_hash_table_unref (activation->unknown_names);
+  activation->unknown_names = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                    (DBusFreeFunction) dbus_free,
+                                                    NULL);
+
+  if (activation->unknown_names == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   link = _dbus_list_get_first_link (directories);
   while (link != NULL)
     {
@@ -842,6 +858,8 @@ bus_activation_reload (BusActivation     *activation,
 
       s_dir->refcount = 1;
       s_dir->dir_c = dir;
+      /* if the watch predates this scan, its events keep us current */
+      s_dir->watched = bus_dir_is_watched (dir);
 
       s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
                                              (DBusFreeFunction)bus_activation_entry_unref);
@@ -867,6 +885,8 @@ bus_activation_reload (BusActivation     *activation,
             goto failed;
           else
             dbus_error_free (error);
+
+          s_dir->watched = FALSE;
         }
 
       link = _dbus_list_get_next_link (directories, link);
@@ -964,6 +984,8 @@ bus_activation_unref (BusActivation *activation)
     _dbus_hash_table_unref (activation->directories);
   if (activation->environment)
     _dbus_hash_table_unref (activation->environment);
+  if (activation->unknown_names)
+    _dbus_hash_table_unref (activation->unknown_names);
 
   dbus_free (activation);
 }
@@ -1506,6 +1528,57 @@ add_cancel_pending_to_transaction (BusTransaction       *transaction,
   return TRUE;
 }
 
+/* Names which a rescan didn't find are remembered for the rest of the
+ * current second, so a client repeatedly asking for a service that
+ * doesn't exist can't make us walk every service directory each time.
+ * Service files are only tracked to one-second mtime resolution anyway.
+ */
+#define MAX_UNKNOWN_NAMES 64
+
+static void
+expire_unknown_names (BusActivation *activation)
+{
+  long now;
+
+  _dbus_get_monotonic_time (&now, NULL);
+
+  if (now != activation->unknown_names_time)
+    {
+      _dbus_hash_table_remove_all (activation->unknown_names);
+      activation->unknown_names_time = now;
+    }
+}
+
+static dbus_bool_t
+unknown_name_is_cached (BusActivation *activation,
+                        const char    *service_name)
+{
+  expire_unknown_names (activation);
+
+  return _dbus_hash_table_lookup_string (activation->unknown_names,
+                                         service_name) != NULL;
+}
+
+static void
+cache_unknown_name (BusActivation *activation,
+                    const char    *service_name)
+{
+  char *name;
+
+  expire_unknown_names (activation);
+
+  if (_dbus_hash_table_get_n_entries (activation->unknown_names) >= MAX_UNKNOWN_NAMES)
+    _dbus_hash_table_remove_all (activation->unknown_names);
+
+  /* it's only a cache, so OOM just means we rescan next time */
+  name = _dbus_strdup (service_name);
+  if (name == NULL)
+    return;
+
+  if (!_dbus_hash_table_insert_string (activation->unknown_names, name, name))
+    dbus_free (name);
+}
+
 static dbus_bool_t
 update_service_cache (BusActivation *activation, DBusError *error)
 {
@@ -1516,9 +1589,15 @@ update_service_cache (BusActivation *activation, DBusError *error)
     {
       DBusError tmp_error;
       BusServiceDirectory *s_dir;
+      dbus_bool_t watched;
 
       s_dir = _dbus_hash_iter_get_value (&iter);
 
+      /* The directory watch has been keeping these entries current */
+      watched = bus_dir_is_watched (s_dir->dir_c);
+      if (s_dir->watched && watched)
+        continue;
+
       dbus_error_init (&tmp_error);
       if (!update_directory (activation, s_dir, &tmp_error))
         {
@@ -1531,6 +1610,11 @@ update_service_cache (BusActivation *activation, DBusError *error)
           dbus_error_free (&tmp_error);
           continue;
         }
+
+      /* We've read the directory since the watch was set up, so from
+       * now on its events are enough to keep the entries current.
+       */
+      s_dir->watched = watched;
     }
 
   return TRUE;
@@ -1546,13 +1630,27 @@ activation_find_entry (BusActivation *activation,
   entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
   if (!entry)
     {
-      if (!update_service_cache (activation, error))
-        return NULL;
+      /* Pick up service files installed since we last ran the main loop */
+      bus_drain_watched_dirs ();
 
       entry = _dbus_hash_table_lookup_string (activation->entries,
                                               service_name);
     }
-  else
+
+  if (!entry)
+    {
+      if (!unknown_name_is_cached (activation, service_name))
+        {
+          if (!update_service_cache (activation, error))
+            return NULL;
+
+          entry = _dbus_hash_table_lookup_string (activation->entries,
+                                                  service_name);
+          if (!entry)
+            cache_unknown_name (activation, service_name);
+        }
+    }
+  else if (!entry->s_dir->watched)
     {
       BusActivationEntry *updated_entry;
 
@@ -1573,6 +1671,173 @@ activation_find_entry (BusActivation *activation,
   return entry;
 }
 
+/**
+ * Updates the activation entry for a single file in a service directory,
+ * after the directory watch saw it being written, moved or deleted.
+ *
+ * @param activation the activation
+ * @param dir the directory containing the file
+ * @param filename the name of the file within dir
+ * @param error set on OOM, in which case the caller should reload
+ *   everything instead
+ * @returns #FALSE without setting error if dir is not a service directory
+ */
+dbus_bool_t
+bus_activation_service_file_changed (BusActivation *activation,
+                                     const char    *dir,
+                                     const char    *filename,
+                                     DBusError     *error)
+{
+  BusServiceDirectory *s_dir;
+  BusActivationEntry *entry, *dropped;
+  BusDesktopFile *desktop_file;
+  DBusString file_str, full_path;
+  DBusError tmp_error;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  s_dir = _dbus_hash_table_lookup_string (activation->directories, dir);
+  if (s_dir == NULL)
+    return FALSE;
+
+  _dbus_string_init_const (&file_str, filename);
+
+  /* other files in service directories are ignored by update_directory() */
+  if (!_dbus_string_ends_with_c_str (&file_str, ".service"))
+    return TRUE;
+
+  if (!_dbus_string_init (&full_path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  retval = FALSE;
+  desktop_file = NULL;
+  dropped = NULL;
+  dbus_error_init (&tmp_error);
+
+  if (!_dbus_string_append (&full_path, s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&full_path, &file_str))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  /* Forget what the file used to say, then read it again if it's
+   * still there.
+   */
+  entry = _dbus_hash_table_lookup_string (s_dir->entries, filename);
+  if (entry != NULL)
+    {
+      if (_dbus_hash_table_lookup_string (activation->entries, entry->name) == entry)
+        {
+          dropped = bus_activation_entry_ref (entry);
+          _dbus_hash_table_remove_string (activation->entries, entry->name);
+        }
+      _dbus_hash_table_remove_string (s_dir->entries, filename);
+    }
+
+  desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
+  if (desktop_file == NULL)
+    {
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+
+      _dbus_verbose ("Dropped %s from activation entry list: %s\n",
+                     _dbus_string_get_const_data (&full_path), tmp_error.message);
+      dbus_error_free (&tmp_error);
+    }
+  else if (!update_desktop_file_entry (activation, s_dir, &file_str, desktop_file, &tmp_error))
+    {
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+
+      _dbus_verbose ("Could not add %s to activation entry list: %s\n",
+                     _dbus_string_get_const_data (&full_path), tmp_error.message);
+      dbus_error_free (&tmp_error);
+    }
+
+  /* A file for the same name in another directory was passed over
+   * while this one held the name, and its directory's watch won't
+   * report it again, so look for it now.
+   */
+  if (dropped != NULL &&
+      _dbus_hash_table_lookup_string (activation->entries, dropped->name) == NULL)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (activation->directories, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          BusServiceDirectory *other = _dbus_hash_iter_get_value (&iter);
+
+          if (other == s_dir)
+            continue;
+
+          if (!update_directory (activation, other, &tmp_error))
+            {
+              if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+                {
+                  dbus_move_error (&tmp_error, error);
+                  goto out;
+                }
+
+              dbus_error_free (&tmp_error);
+            }
+        }
+    }
+
+  retval = TRUE;
+
+ out:
+  if (dropped != NULL)
+    bus_activation_entry_unref (dropped);
+  if (desktop_file != NULL)
+    bus_desktop_file_free (desktop_file);
+  dbus_error_free (&tmp_error);
+  _dbus_string_free (&full_path);
+
+  return retval;
+}
+
+/**
+ * Checks whether a new configuration names a different set of service
+ * directories, i.e. whether bus_activation_reload() is needed.
+ *
+ * @param activation the activation
+ * @param directories list of service directory paths
+ * @returns #TRUE if the set of directories differs from the current one
+ */
+dbus_bool_t
+bus_activation_directories_changed (BusActivation  *activation,
+                                    DBusList      **directories)
+{
+  DBusList *link;
+  int n_dirs;
+
+  n_dirs = 0;
+  for (link = _dbus_list_get_first_link (directories);
+       link != NULL;
+       link = _dbus_list_get_next_link (directories, link))
+    {
+      if (_dbus_hash_table_lookup_string (activation->directories,
+                                          link->data) == NULL)
+        return TRUE;
+
+      n_dirs += 1;
+    }
+
+  return n_dirs != _dbus_hash_table_get_n_entries (activation->directories);
+}
+
 static char **
 bus_activation_get_environment (BusActivation *activation)
 {
@@ -2132,48 +2397,52 @@ bus_activation_activate_service (BusActivation  *activation,
   return TRUE;
 }
 
+/**
+ * Appends the activatable names to an array of strings that is being
+ * built in a message, straight from the activation entries without
+ * copying them first.
+ *
+ * @param activation the activation
+ * @param array iterator for an open array of strings
+ * @param prefix only names starting with this are appended
+ * @param skip_owned if not #NULL, names that have an owner in this
+ *   registry are left out
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_activation_list_services (BusActivation *activation,
-			      char        ***listp,
-			      int           *array_len)
+bus_activation_append_names (BusActivation   *activation,
+                             DBusMessageIter *array,
+                             const char      *prefix,
+                             BusRegistry     *skip_owned)
 {
-  int i, j, len;
-  char **retval;
   DBusHashIter iter;
+  size_t prefix_len;
 
-  len = _dbus_hash_table_get_n_entries (activation->entries);
-  retval = dbus_new (char *, len + 1);
-
-  if (retval == NULL)
-    return FALSE;
+  prefix_len = strlen (prefix);
 
   _dbus_hash_iter_init (activation->entries, &iter);
-  i = 0;
   while (_dbus_hash_iter_next (&iter))
     {
       BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
 
-      retval[i] = _dbus_strdup (entry->name);
-      if (retval[i] == NULL)
-	goto error;
+      if (strncmp (entry->name, prefix, prefix_len) != 0)
+        continue;
 
-      i++;
-    }
+      if (skip_owned != NULL)
+        {
+          DBusString name;
 
-  retval[i] = NULL;
+          _dbus_string_init_const (&name, entry->name);
+          if (bus_registry_lookup (skip_owned, &name) != NULL)
+            continue;
+        }
 
-  if (array_len)
-    *array_len = len;
+      if (!dbus_message_iter_append_basic (array, DBUS_TYPE_STRING,
+                                           &entry->name))
+        return FALSE;
+    }
 
-  *listp = retval;
   return TRUE;
-
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
 }
 
 dbus_bool_t
@@ -2454,6 +2723,11 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   DBusString     address;
   DBusList      *directories;
   CheckData      d;
+  DBusError      error;
+  DBusString     other_dir;
+  DBusString    *owner_dir;
+  const char    *owner_file;
+  BusActivationEntry *entry;
 
   directories = NULL;
   _dbus_string_init_const (&address, "");
@@ -2520,9 +2794,107 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Updated service file, part 2", oom_test, &d))
     return FALSE;
 
+  /* Check that a change reported by the directory watch is applied
+   * without rescanning */
+  dbus_error_init (&error);
+
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+    return FALSE;
+
+  if (!bus_activation_service_file_changed (activation,
+                                            _dbus_string_get_const_data (dir),
+                                            SERVICE_FILE_2, &error))
+    return FALSE;
+
+  _dbus_assert (_dbus_hash_table_lookup_string (activation->entries,
+                                                SERVICE_NAME_2) != NULL);
+
+  if (!test_remove_service_file (dir, SERVICE_FILE_2))
+    return FALSE;
+
+  if (!bus_activation_service_file_changed (activation,
+                                            _dbus_string_get_const_data (dir),
+                                            SERVICE_FILE_2, &error))
+    return FALSE;
+
+  _dbus_assert (_dbus_hash_table_lookup_string (activation->entries,
+                                                SERVICE_NAME_2) == NULL);
+
+  /* Changes outside the service directories need a config reload */
+  _dbus_assert (!bus_activation_service_file_changed (activation,
+                                                      "/nonexistent",
+                                                      SERVICE_FILE_2,
+                                                      &error));
+  _DBUS_ASSERT_ERROR_IS_CLEAR (&error);
+
+  /* ... which only needs to rescan if the directories changed */
+  _dbus_assert (!bus_activation_directories_changed (activation,
+                                                     &directories));
+
+  if (!_dbus_list_append (&directories, "/nonexistent"))
+    return FALSE;
+
+  _dbus_assert (bus_activation_directories_changed (activation,
+                                                    &directories));
+
   bus_activation_unref (activation);
   _dbus_list_clear (&directories);
 
+  /* A name provided by files in two directories is still found after
+   * the file it was taken from is deleted, although the other file
+   * was passed over when the directories were read */
+  if (!_dbus_string_init (&other_dir))
+    return FALSE;
+
+  if (!_dbus_string_copy (dir, 0, &other_dir, 0) ||
+      !_dbus_string_append (&other_dir, "-2") ||
+      !_dbus_create_directory (&other_dir, NULL) ||
+      !test_create_service_file (&other_dir, SERVICE_FILE_2, SERVICE_NAME_3, "exec-3"))
+    return FALSE;
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)) ||
+      !_dbus_list_append (&directories, _dbus_string_get_data (&other_dir)))
+    return FALSE;
+
+  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  if (!activation)
+    return FALSE;
+
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_3);
+  _dbus_assert (entry != NULL);
+
+  if (strcmp (entry->s_dir->dir_c, _dbus_string_get_const_data (dir)) == 0)
+    {
+      owner_dir = dir;
+      owner_file = SERVICE_FILE_1;
+    }
+  else
+    {
+      owner_dir = &other_dir;
+      owner_file = SERVICE_FILE_2;
+    }
+
+  if (!test_remove_service_file (owner_dir, owner_file))
+    return FALSE;
+
+  if (!bus_activation_service_file_changed (activation,
+                                            _dbus_string_get_const_data (owner_dir),
+                                            owner_file, &error))
+    return FALSE;
+
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_3);
+  _dbus_assert (entry != NULL);
+  _dbus_assert (strcmp (entry->s_dir->dir_c,
+                        _dbus_string_get_const_data (owner_dir)) != 0);
+
+  bus_activation_unref (activation);
+  _dbus_list_clear (&directories);
+
+  if (!test_remove_directory (&other_dir))
+    return FALSE;
+
+  _dbus_string_free (&other_dir);
+
   return TRUE;
 }
 
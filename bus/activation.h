@@ -54,9 +54,16 @@ dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 						const char        *service_name,
 						BusTransaction    *transaction,
 						DBusError         *error);
-dbus_bool_t    bus_activation_list_services    (BusActivation     *registry,
-						char            ***listp,
-						int               *array_len);
+dbus_bool_t    bus_activation_service_file_changed (BusActivation *activation,
+                                                    const char    *dir,
+                                                    const char    *filename,
+                                                    DBusError     *error);
+dbus_bool_t    bus_activation_directories_changed  (BusActivation  *activation,
+                                                    DBusList      **directories);
+dbus_bool_t    bus_activation_append_names     (BusActivation     *activation,
+                                                DBusMessageIter   *array,
+                                                const char        *prefix,
+                                                BusRegistry       *skip_owned);
 dbus_bool_t    dbus_activation_systemd_failure (BusActivation     *activation,
                                                 DBusMessage       *message);
 
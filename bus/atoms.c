@@ -0,0 +1,195 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.c  Shared copies of names used throughout the bus
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "atoms.h"
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <string.h>
+
+typedef struct
+{
+  int refcount;
+  char str[1]; /**< Allocated as long as the string needs */
+} BusAtom;
+
+#define ATOM_FROM_STRING(s) \
+  ((BusAtom *) ((s) - _DBUS_STRUCT_OFFSET (BusAtom, str)))
+
+/* Maps each atom's string to its BusAtom. The bus is single-threaded,
+ * and match rules are created without a BusContext in the tests, so
+ * there is one table for the whole process; it exists only while
+ * there are atoms in it, so that leak checking sees any that weren't
+ * released.
+ */
+static DBusHashTable *atoms = NULL;
+
+/**
+ * Gets the atom with the same contents as a string, creating it if
+ * there isn't one yet. Like _dbus_strdup(), returns #NULL for #NULL.
+ *
+ * @param str the string, or #NULL
+ * @returns a new reference to the atom, or #NULL if no memory
+ */
+const char *
+bus_atom_intern (const char *str)
+{
+  BusAtom *atom;
+  size_t len;
+
+  if (str == NULL)
+    return NULL;
+
+  if (atoms != NULL)
+    {
+      atom = _dbus_hash_table_lookup_string (atoms, str);
+      if (atom != NULL)
+        {
+          atom->refcount += 1;
+          return atom->str;
+        }
+    }
+  else
+    {
+      atoms = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+      if (atoms == NULL)
+        return NULL;
+    }
+
+  len = strlen (str);
+  atom = dbus_malloc (_DBUS_STRUCT_OFFSET (BusAtom, str) + len + 1);
+  if (atom == NULL)
+    goto failed;
+
+  atom->refcount = 1;
+  memcpy (atom->str, str, len + 1);
+
+  if (!_dbus_hash_table_insert_string (atoms, atom->str, atom))
+    {
+      dbus_free (atom);
+      goto failed;
+    }
+
+  return atom->str;
+
+ failed:
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+
+  return NULL;
+}
+
+/**
+ * Adds a reference to an atom.
+ *
+ * @param atom the atom
+ * @returns the atom
+ */
+const char *
+bus_atom_ref (const char *atom)
+{
+  BusAtom *a = ATOM_FROM_STRING (atom);
+
+  _dbus_assert (a->refcount > 0);
+  _dbus_assert (_dbus_hash_table_lookup_string (atoms, atom) == a);
+
+  a->refcount += 1;
+
+  return atom;
+}
+
+/**
+ * Drops a reference to an atom, freeing it if it was the last one.
+ *
+ * @param atom the atom, or #NULL
+ */
+void
+bus_atom_unref (const char *atom)
+{
+  BusAtom *a;
+
+  if (atom == NULL)
+    return;
+
+  a = ATOM_FROM_STRING (atom);
+
+  _dbus_assert (a->refcount > 0);
+  _dbus_assert (_dbus_hash_table_lookup_string (atoms, atom) == a);
+
+  a->refcount -= 1;
+  if (a->refcount > 0)
+    return;
+
+  _dbus_hash_table_remove_string (atoms, atom);
+  dbus_free (a);
+
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+}
+
+/**
+ * Gets the atom with the same contents as a string, if there is one,
+ * without adding a reference. If there isn't one, nothing that holds
+ * atoms can be equal to the string.
+ *
+ * @param str the string
+ * @returns the atom, or #NULL
+ */
+const char *
+bus_atom_lookup (const char *str)
+{
+  BusAtom *atom;
+
+  if (atoms == NULL)
+    return NULL;
+
+  atom = _dbus_hash_table_lookup_string (atoms, str);
+
+  return atom != NULL ? atom->str : NULL;
+}
+
+/**
+ * Like bus_atom_lookup(), for a string whose hash is already known,
+ * such as a header field of a message.
+ *
+ * @param str the string
+ * @param hash the hash of the string from _dbus_hash_string_len()
+ * @returns the atom, or #NULL
+ */
+const char *
+bus_atom_lookup_hashed (const char   *str,
+                        unsigned int  hash)
+{
+  BusAtom *atom;
+
+  if (atoms == NULL)
+    return NULL;
+
+  atom = _dbus_hash_table_lookup_string_hashed (atoms, str, hash);
+
+  return atom != NULL ? atom->str : NULL;
+}
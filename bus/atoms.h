@@ -0,0 +1,39 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.h  Shared copies of names used throughout the bus
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_ATOMS_H
+#define BUS_ATOMS_H
+
+#include <dbus/dbus.h>
+
+/* An atom is a nul-terminated string that can be used like any other,
+ * but of which there is only ever one copy with given contents, so two
+ * atoms are equal if and only if they are the same pointer.
+ */
+
+const char *bus_atom_intern        (const char   *str);
+const char *bus_atom_ref           (const char   *atom);
+void        bus_atom_unref         (const char   *atom);
+const char *bus_atom_lookup        (const char   *str);
+const char *bus_atom_lookup_hashed (const char   *str,
+                                    unsigned int  hash);
+
+#endif /* BUS_ATOMS_H */
@@ -35,10 +35,12 @@
 #include "signals.h"
 #include "selinux.h"
 #include "dir-watch.h"
+#include "workers.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-credentials.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-message-internal.h>
 
 #ifdef DBUS_CYGWIN
 #include <signal.h>
@@ -62,12 +64,18 @@ struct BusContext
   BusRegistry *registry;
   BusPolicy *policy;
   BusMatchmaker *matchmaker;
+  BusWorkers *workers;
   BusLimits limits;
   unsigned int fork : 1;
   unsigned int syslog : 1;
   unsigned int keep_umask : 1;
   unsigned int allow_anonymous : 1;
   unsigned int systemd_activation : 1;
+#ifdef DBUS_ENABLE_STATS
+  int n_reloads;
+  int last_reload_usec;
+  int peak_reload_usec;
+#endif
 };
 
 static dbus_int32_t server_data_slot = -1;
@@ -496,6 +504,7 @@ static dbus_bool_t
 process_config_every_time (BusContext      *context,
 			   BusConfigParser *parser,
 			   dbus_bool_t      is_reload,
+			   dbus_bool_t      rescan_services,
 			   DBusError       *error)
 {
   DBusString full_address;
@@ -521,6 +530,9 @@ process_config_every_time (BusContext      *context,
   /* get our limits and timeout lengths */
   bus_config_parser_get_limits (parser, &context->limits);
 
+  _dbus_message_set_cache_limits (context->limits.max_cached_messages,
+                                  context->limits.max_cached_message_size);
+
   if (context->policy)
     bus_policy_unref (context->policy);
   context->policy = bus_config_parser_steal_policy (parser);
@@ -590,7 +602,9 @@ process_config_every_time (BusContext      *context,
   /* Create activation subsystem */
   if (context->activation)
     {
-      if (!bus_activation_reload (context->activation, &full_address, dirs, error))
+      if ((rescan_services ||
+           bus_activation_directories_changed (context->activation, dirs)) &&
+          !bus_activation_reload (context->activation, &full_address, dirs, error))
         goto failed;
     }
   else
@@ -765,7 +779,7 @@ bus_context_new (const DBusString *config_file,
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
     }
-  if (!process_config_every_time (context, parser, FALSE, error))
+  if (!process_config_every_time (context, parser, FALSE, TRUE, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
@@ -926,6 +940,32 @@ bus_context_new (const DBusString *config_file,
 #endif
     }
 
+  /* Start the workers late, so they don't have to survive forking,
+   * and they run as the daemon user.
+   */
+  if (context->limits.worker_threads > 0)
+    {
+      if (!dbus_threads_init_default ())
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      if (!_dbus_loop_enable_threads (context->loop, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      context->workers = bus_workers_new (context->limits.worker_threads,
+                                          error);
+      if (context->workers == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+    }
+
   dbus_server_free_data_slot (&server_data_slot);
 
   return context;
@@ -949,16 +989,27 @@ bus_context_get_id (BusContext       *context,
   return _dbus_uuid_encode (&context->uuid, uuid);
 }
 
-dbus_bool_t
-bus_context_reload_config (BusContext *context,
-			   DBusError  *error)
+static dbus_bool_t
+reload_config (BusContext  *context,
+               dbus_bool_t  full,
+               DBusError   *error)
 {
   BusConfigParser *parser;
   DBusString config_file;
   dbus_bool_t ret;
+#ifdef DBUS_ENABLE_STATS
+  long start_sec, start_usec, end_sec, end_usec, elapsed;
 
-  /* Flush the user database cache */
-  _dbus_flush_caches ();
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+#endif
+
+  /* Flush the user database cache, and the groups connections got
+   * from it */
+  if (full)
+    {
+      _dbus_flush_caches ();
+      bus_connections_invalidate_unix_groups (context->connections);
+    }
 
   ret = FALSE;
   _dbus_string_init_const (&config_file, context->config_file);
@@ -969,7 +1020,7 @@ bus_context_reload_config (BusContext *context,
       goto failed;
     }
 
-  if (!process_config_every_time (context, parser, TRUE, error))
+  if (!process_config_every_time (context, parser, TRUE, full, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
@@ -987,9 +1038,41 @@ bus_context_reload_config (BusContext *context,
     bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Unable to reload configuration: %s", error->message);
   if (parser != NULL)
     bus_config_parser_unref (parser);
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_get_monotonic_time (&end_sec, &end_usec);
+  elapsed = (end_sec - start_sec) * 1000000 + (end_usec - start_usec);
+
+  context->n_reloads += 1;
+  context->last_reload_usec = elapsed;
+  if (elapsed > context->peak_reload_usec)
+    context->peak_reload_usec = elapsed;
+#endif
+
   return ret;
 }
 
+dbus_bool_t
+bus_context_reload_config (BusContext *context,
+			   DBusError  *error)
+{
+  return reload_config (context, TRUE, error);
+}
+
+/**
+ * Re-reads the configuration files after the directory watch saw some
+ * of them change. Unlike bus_context_reload_config(), this keeps the
+ * user database cache, and keeps the activation entries as long as the
+ * set of service directories is the same: the watch keeps those
+ * current by itself.
+ */
+dbus_bool_t
+bus_context_reload_policy (BusContext *context,
+                           DBusError  *error)
+{
+  return reload_config (context, FALSE, error);
+}
+
 static void
 shutdown_server (BusContext *context,
                  DBusServer *server)
@@ -1050,12 +1133,23 @@ bus_context_unref (BusContext *context)
 
       bus_context_shutdown (context);
 
+      /* stop the workers before closing the connections they service,
+       * but free them afterwards */
+      if (context->workers)
+        bus_workers_stop (context->workers);
+
       if (context->connections)
         {
           bus_connections_unref (context->connections);
           context->connections = NULL;
         }
 
+      if (context->workers)
+        {
+          bus_workers_free (context->workers);
+          context->workers = NULL;
+        }
+
       if (context->registry)
         {
           bus_registry_unref (context->registry);
@@ -1175,12 +1269,20 @@ bus_context_get_loop (BusContext *context)
   return context->loop;
 }
 
+BusWorkers*
+bus_context_get_workers (BusContext *context)
+{
+  return context->workers;
+}
+
 dbus_bool_t
-bus_context_allow_unix_user (BusContext   *context,
-                             unsigned long uid)
+bus_context_allow_unix_user (BusContext          *context,
+                             unsigned long        uid,
+                             const unsigned long *group_ids,
+                             int                  n_group_ids)
 {
   return bus_policy_allow_unix_user (context->policy,
-                                     uid);
+                                     uid, group_ids, n_group_ids);
 }
 
 /* For now this is never actually called because the default
@@ -1646,3 +1748,16 @@ bus_context_check_security_policy (BusContext     *context,
   _dbus_verbose ("security policy allowing message\n");
   return TRUE;
 }
+
+#ifdef DBUS_ENABLE_STATS
+void
+bus_context_get_reload_stats (BusContext *context,
+                              int        *n_reloads,
+                              int        *last_reload_usec,
+                              int        *peak_reload_usec)
+{
+  *n_reloads = context->n_reloads;
+  *last_reload_usec = context->last_reload_usec;
+  *peak_reload_usec = context->peak_reload_usec;
+}
+#endif /* DBUS_ENABLE_STATS */
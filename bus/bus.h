@@ -43,6 +43,7 @@ typedef struct BusOwner		BusOwner;
 typedef struct BusTransaction   BusTransaction;
 typedef struct BusMatchmaker    BusMatchmaker;
 typedef struct BusMatchRule     BusMatchRule;
+typedef struct BusWorkers       BusWorkers;
 
 typedef struct
 {
@@ -62,6 +63,9 @@ typedef struct
   int max_match_rules_per_connection; /**< Max number of match rules for a single connection */
   int max_replies_per_connection;     /**< Max number of replies that can be pending for each connection */
   int reply_timeout;                  /**< How long to wait before timing out a reply */
+  int max_cached_messages;            /**< Max number of freed messages kept for reuse */
+  int max_cached_message_size;        /**< Max bytes allocated for a message kept for reuse */
+  int worker_threads;                 /**< Threads that do connections' I/O, or 0 to do it in the main loop */
 } BusLimits;
 
 typedef enum
@@ -81,6 +85,8 @@ BusContext*       bus_context_new                                (const DBusStri
                                                                   DBusError        *error);
 dbus_bool_t       bus_context_reload_config                      (BusContext       *context,
 								  DBusError        *error);
+dbus_bool_t       bus_context_reload_policy                      (BusContext       *context,
+                                                                  DBusError        *error);
 void              bus_context_shutdown                           (BusContext       *context);
 BusContext*       bus_context_ref                                (BusContext       *context);
 void              bus_context_unref                              (BusContext       *context);
@@ -95,8 +101,11 @@ BusConnections*   bus_context_get_connections                    (BusContext
 BusActivation*    bus_context_get_activation                     (BusContext       *context);
 BusMatchmaker*    bus_context_get_matchmaker                     (BusContext       *context);
 DBusLoop*         bus_context_get_loop                           (BusContext       *context);
+BusWorkers*       bus_context_get_workers                        (BusContext       *context);
 dbus_bool_t       bus_context_allow_unix_user                    (BusContext       *context,
-                                                                  unsigned long     uid);
+                                                                  unsigned long     uid,
+                                                                  const unsigned long *group_ids,
+                                                                  int               n_group_ids);
 dbus_bool_t       bus_context_allow_windows_user                 (BusContext       *context,
                                                                   const char       *windows_sid);
 BusPolicy*        bus_context_get_policy                         (BusContext       *context);
@@ -126,4 +135,10 @@ dbus_bool_t       bus_context_check_security_policy              (BusContext
                                                                   DBusMessage      *message,
                                                                   DBusError        *error);
 
+/* called by stats.c, only present if DBUS_ENABLE_STATS */
+void              bus_context_get_reload_stats                   (BusContext       *context,
+                                                                  int              *n_reloads,
+                                                                  int              *last_reload_usec,
+                                                                  int              *peak_reload_usec);
+
 #endif /* BUS_BUS_H */
@@ -28,6 +28,7 @@
 #include "utils.h"
 #include "policy.h"
 #include "selinux.h"
+#include "atoms.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-sysdeps.h>
@@ -457,6 +458,14 @@ bus_config_parser_new (const DBusString      *basedir,
        * that require a reply
        */
       parser->limits.max_replies_per_connection = 1024*8;
+
+      /* The bus frees and allocates a message for nearly everything it
+       * routes, so keep more of them around for reuse than clients do
+       */
+      parser->limits.max_cached_messages = 128;
+      parser->limits.max_cached_message_size = 32 * 1024;
+
+      parser->limits.worker_threads = 0;
     }
       
   parser->refcount = 1;
@@ -1396,11 +1405,11 @@ append_rule_from_element (BusConfigParser   *parser,
         rule->d.send.requested_reply = (strcmp (send_requested_reply, "true") == 0);
 
       rule->d.send.message_type = message_type;
-      rule->d.send.path = _dbus_strdup (send_path);
-      rule->d.send.interface = _dbus_strdup (send_interface);
-      rule->d.send.member = _dbus_strdup (send_member);
-      rule->d.send.error = _dbus_strdup (send_error);
-      rule->d.send.destination = _dbus_strdup (send_destination);
+      rule->d.send.path = bus_atom_intern (send_path);
+      rule->d.send.interface = bus_atom_intern (send_interface);
+      rule->d.send.member = bus_atom_intern (send_member);
+      rule->d.send.error = bus_atom_intern (send_error);
+      rule->d.send.destination = bus_atom_intern (send_destination);
       if (send_path && rule->d.send.path == NULL)
         goto nomem;
       if (send_interface && rule->d.send.interface == NULL)
@@ -1475,11 +1484,11 @@ append_rule_from_element (BusConfigParser   *parser,
         rule->d.receive.requested_reply = (strcmp (receive_requested_reply, "true") == 0);
       
       rule->d.receive.message_type = message_type;
-      rule->d.receive.path = _dbus_strdup (receive_path);
-      rule->d.receive.interface = _dbus_strdup (receive_interface);
-      rule->d.receive.member = _dbus_strdup (receive_member);
-      rule->d.receive.error = _dbus_strdup (receive_error);
-      rule->d.receive.origin = _dbus_strdup (receive_sender);
+      rule->d.receive.path = bus_atom_intern (receive_path);
+      rule->d.receive.interface = bus_atom_intern (receive_interface);
+      rule->d.receive.member = bus_atom_intern (receive_member);
+      rule->d.receive.error = bus_atom_intern (receive_error);
+      rule->d.receive.origin = bus_atom_intern (receive_sender);
 
       if (receive_path && rule->d.receive.path == NULL)
         goto nomem;
@@ -1504,14 +1513,14 @@ append_rule_from_element (BusConfigParser   *parser,
             own = NULL;
       
           rule->d.own.prefix = 0;
-          rule->d.own.service_name = _dbus_strdup (own);
+          rule->d.own.service_name = bus_atom_intern (own);
           if (own && rule->d.own.service_name == NULL)
             goto nomem;
         }
       else
         {
           rule->d.own.prefix = 1;
-          rule->d.own.service_name = _dbus_strdup (own_prefix);
+          rule->d.own.service_name = bus_atom_intern (own_prefix);
           if (rule->d.own.service_name == NULL)
             goto nomem;
         }
@@ -1939,6 +1948,24 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_replies_per_connection = value;
     }
+  else if (strcmp (name, "max_cached_messages") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_cached_messages = value;
+    }
+  else if (strcmp (name, "max_cached_message_size") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_cached_message_size = value;
+    }
+  else if (strcmp (name, "worker_threads") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.worker_threads = value;
+    }
   else
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -3104,6 +3131,9 @@ limits_equal (const BusLimits *a,
      || a->max_services_per_connection == b->max_services_per_connection
      || a->max_match_rules_per_connection == b->max_match_rules_per_connection
      || a->max_replies_per_connection == b->max_replies_per_connection
+     || a->max_cached_messages == b->max_cached_messages
+     || a->max_cached_message_size == b->max_cached_message_size
+     || a->worker_threads == b->worker_threads
      || a->reply_timeout == b->reply_timeout);
 }
 
@@ -30,8 +30,10 @@
 #include "signals.h"
 #include "expirelist.h"
 #include "selinux.h"
+#include "workers.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
 #include <dbus/dbus-timeout.h>
 
 /* Trim executed commands to this length; we want to keep logs readable */
@@ -39,7 +41,8 @@
 
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
-typedef struct
+typedef struct BusPendingReply BusPendingReply;
+struct BusPendingReply
 {
   BusExpireItem expire_item;
 
@@ -47,8 +50,30 @@ typedef struct
   DBusConnection *will_send_reply;
 
   dbus_uint32_t reply_serial;
-  
-} BusPendingReply;
+
+  DBusList *expire_link;        /**< Our link in connections->pending_replies */
+  BusPendingReply *next_with_serial; /**< Next in will_get_reply's pending_replies
+                                      *   entry for the same serial */
+  DBusList *link_in_replier;    /**< Our link in will_send_reply's replies_owed */
+
+  unsigned int indexed : 1;     /**< In will_get_reply's pending_replies */
+  unsigned int replying : 1;    /**< A reply is in a not-yet-executed transaction,
+                                 *   and expire_link is not in the expire list */
+};
+
+/* The list links are embedded so that queueing a message in a
+ * transaction (once per recipient of a broadcast) needs a single
+ * allocation from BusConnections' pool besides the preallocated send.
+ */
+typedef struct
+{
+  BusTransaction *transaction;
+  DBusMessage    *message;
+  DBusPreallocatedSend *preallocated;
+  DBusList link_in_connection;  /**< in the recipient's transaction_messages */
+  DBusList link_in_transaction; /**< in transaction->connections, only used by
+                                 *   the recipient's first message in it */
+} MessageToSend;
 
 struct BusConnections
 {
@@ -62,6 +87,8 @@ struct BusConnections
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
   int stamp;                   /**< Incrementing number */
   BusExpireList *pending_replies; /**< List of pending replies */
+  DBusMemPool *messages_to_send; /**< Pool of MessageToSend for transactions */
+  int unix_groups_generation;  /**< Bumped when cached group lists may be stale */
 
 #ifdef DBUS_ENABLE_STATS
   int total_match_rules;
@@ -87,10 +114,20 @@ typedef struct
   int n_match_rules;
   char *name;
   DBusList *transaction_messages; /**< Stuff we need to send as part of a transaction */
+  DBusHashTable *pending_replies; /**< Replies we're waiting for: serial -> BusPendingReply */
+  int n_pending_replies;          /**< Number of those not currently being replied to */
+  DBusList *replies_owed;         /**< BusPendingReply we're expected to answer */
   DBusMessage *oom_message;
   DBusPreallocatedSend *oom_preallocated;
   BusClientPolicy *policy;
 
+  unsigned long *unix_groups;     /**< Sorted groups of unix_groups_uid */
+  int n_unix_groups;              /**< Length of unix_groups */
+  unsigned long unix_groups_uid;  /**< The user unix_groups belong to */
+  int unix_groups_generation;     /**< connections->unix_groups_generation
+                                   *   when unix_groups was looked up */
+  unsigned int have_unix_groups : 1;
+
   char *cached_loginfo_string;
   BusSELinuxID *selinux_id;
 
@@ -368,18 +405,86 @@ dispatch_status_function (DBusConnection    *connection,
     }
 }
 
+/* Group lists are short, so a simple insertion sort will do */
+static void
+sort_unix_groups (unsigned long *groups,
+                  int            n_groups)
+{
+  int i, j;
+
+  for (i = 1; i < n_groups; i++)
+    {
+      unsigned long gid = groups[i];
+
+      for (j = i; j > 0 && groups[j - 1] > gid; j--)
+        groups[j] = groups[j - 1];
+
+      groups[j] = gid;
+    }
+}
+
+/* The groups are looked up once per connection, and again only if the
+ * user database cache was flushed by a config reload since then. The
+ * uid is passed in because this is also used while authenticating,
+ * when dbus_connection_get_unix_user() can't be called yet.
+ */
+static dbus_bool_t
+connection_get_unix_groups_for_uid (BusConnectionData     *d,
+                                    unsigned long          uid,
+                                    const unsigned long  **groups,
+                                    int                   *n_groups)
+{
+  if (!d->have_unix_groups ||
+      d->unix_groups_uid != uid ||
+      d->unix_groups_generation != d->connections->unix_groups_generation)
+    {
+      dbus_gid_t *group_ids;
+      int n_group_ids;
+
+      if (!_dbus_unix_groups_from_uid (uid, &group_ids, &n_group_ids))
+        {
+          _dbus_verbose ("Did not get any groups for UID %lu\n",
+                         uid);
+          return FALSE;
+        }
+
+      _dbus_verbose ("Got %d groups for UID %lu\n",
+                     n_group_ids, uid);
+
+      sort_unix_groups (group_ids, n_group_ids);
+
+      dbus_free (d->unix_groups);
+      d->unix_groups = group_ids;
+      d->n_unix_groups = n_group_ids;
+      d->unix_groups_uid = uid;
+      d->unix_groups_generation = d->connections->unix_groups_generation;
+      d->have_unix_groups = TRUE;
+    }
+
+  *groups = d->unix_groups;
+  *n_groups = d->n_unix_groups;
+  return TRUE;
+}
+
 static dbus_bool_t
 allow_unix_user_function (DBusConnection *connection,
                           unsigned long   uid,
                           void           *data)
 {
   BusConnectionData *d;
+  const unsigned long *groups;
+  int n_groups;
     
   d = BUS_CONNECTION_DATA (connection);
 
   _dbus_assert (d != NULL);
+
+  /* On OOM or error we always reject the user */
+  if (!connection_get_unix_groups_for_uid (d, uid, &groups, &n_groups))
+    return FALSE;
   
-  return bus_context_allow_unix_user (d->connections->context, uid);
+  return bus_context_allow_unix_user (d->connections->context, uid,
+                                      groups, n_groups);
 }
 
 static void
@@ -392,6 +497,14 @@ free_connection_data (void *data)
   _dbus_assert (d->n_services_owned == 0);
   /* similarly */
   _dbus_assert (d->transaction_messages == NULL);
+  _dbus_assert (d->replies_owed == NULL);
+  _dbus_assert (d->n_pending_replies == 0);
+
+  if (d->pending_replies)
+    {
+      _dbus_assert (_dbus_hash_table_get_n_entries (d->pending_replies) == 0);
+      _dbus_hash_table_unref (d->pending_replies);
+    }
 
   if (d->oom_preallocated)
     dbus_connection_free_preallocated_send (d->connection, d->oom_preallocated);
@@ -404,6 +517,8 @@ free_connection_data (void *data)
 
   if (d->selinux_id)
     bus_selinux_id_unref (d->selinux_id);
+
+  dbus_free (d->unix_groups);
   
   dbus_free (d->cached_loginfo_string);
   
@@ -444,15 +559,22 @@ bus_connections_new (BusContext *context)
   if (connections->pending_replies == NULL)
     goto failed_4;
   
+  connections->messages_to_send = _dbus_mem_pool_new (sizeof (MessageToSend),
+                                                      FALSE);
+  if (connections->messages_to_send == NULL)
+    goto failed_5;
+
   if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
                                connections->expire_timeout))
-    goto failed_5;
+    goto failed_6;
   
   connections->refcount = 1;
   connections->context = context;
   
   return connections;
 
+ failed_6:
+  _dbus_mem_pool_free (connections->messages_to_send);
  failed_5:
   bus_expire_list_free (connections->pending_replies);
  failed_4:
@@ -521,6 +643,8 @@ bus_connections_unref (BusConnections *connections)
       _dbus_timeout_unref (connections->expire_timeout);
       
       _dbus_hash_table_unref (connections->completed_by_user);
+
+      _dbus_mem_pool_free (connections->messages_to_send);
       
       dbus_free (connections);
 
@@ -833,32 +957,28 @@ expire_incomplete_timeout (void *data)
   return TRUE;
 }
 
+/**
+ * Gets the groups of the connection's user, sorted by gid. The array
+ * belongs to the connection, and is only valid until the next call to
+ * this function or bus_connections_invalidate_unix_groups().
+ */
 dbus_bool_t
-bus_connection_get_unix_groups  (DBusConnection   *connection,
-                                 unsigned long   **groups,
-                                 int              *n_groups,
-                                 DBusError        *error)
+bus_connection_get_unix_groups  (DBusConnection        *connection,
+                                 const unsigned long  **groups,
+                                 int                   *n_groups,
+                                 DBusError             *error)
 {
+  BusConnectionData *d;
   unsigned long uid;
 
   *groups = NULL;
   *n_groups = 0;
 
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
   if (dbus_connection_get_unix_user (connection, &uid))
-    {
-      if (!_dbus_unix_groups_from_uid (uid, groups, n_groups))
-        {
-          _dbus_verbose ("Did not get any groups for UID %lu\n",
-                         uid);
-          return FALSE;
-        }
-      else
-        {
-          _dbus_verbose ("Got %d groups for UID %lu\n",
-                         *n_groups, uid);
-          return TRUE;
-        }
-    }
+    return connection_get_unix_groups_for_uid (d, uid, groups, n_groups);
   else
     return TRUE; /* successfully got 0 groups */
 }
@@ -867,29 +987,41 @@ dbus_bool_t
 bus_connection_is_in_unix_group (DBusConnection *connection,
                                  unsigned long   gid)
 {
-  int i;
-  unsigned long *group_ids;
+  const unsigned long *group_ids;
   int n_group_ids;
+  int lo, hi;
 
   if (!bus_connection_get_unix_groups (connection, &group_ids, &n_group_ids,
                                        NULL))
     return FALSE;
 
-  i = 0;
-  while (i < n_group_ids)
+  lo = 0;
+  hi = n_group_ids;
+  while (lo < hi)
     {
-      if (group_ids[i] == gid)
-        {
-          dbus_free (group_ids);
-          return TRUE;
-        }
-      ++i;
+      int mid = lo + (hi - lo) / 2;
+
+      if (group_ids[mid] == gid)
+        return TRUE;
+      else if (group_ids[mid] < gid)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
 
-  dbus_free (group_ids);
   return FALSE;
 }
 
+/**
+ * Makes every connection look up its groups again the next time they
+ * are needed, because the user database cache has been flushed.
+ */
+void
+bus_connections_invalidate_unix_groups (BusConnections *connections)
+{
+  connections->unix_groups_generation += 1;
+}
+
 const char *
 bus_connection_get_loginfo (DBusConnection        *connection)
 {
@@ -1357,6 +1489,7 @@ bus_connection_complete (DBusConnection   *connection,
                          DBusError        *error)
 {
   BusConnectionData *d;
+  BusWorkers *workers;
   unsigned long uid;
   
   d = BUS_CONNECTION_DATA (connection);
@@ -1408,6 +1541,22 @@ bus_connection_complete (DBusConnection   *connection,
   if (!cache_peer_loginfo_string (d, connection))
     goto fail;
 
+  /* Give its I/O to a worker thread if we have them; this can't be
+   * undone, so it has to be the last thing that can fail.
+   */
+  workers = bus_context_get_workers (d->connections->context);
+  if (workers != NULL &&
+      !bus_workers_adopt_connection (workers, connection))
+    {
+      dbus_free (d->cached_loginfo_string);
+      d->cached_loginfo_string = NULL;
+
+      if (dbus_connection_get_unix_user (connection, &uid))
+        adjust_connections_for_uid (d->connections, uid, -1);
+
+      goto fail;
+    }
+
   /* Now the connection is active, move it between lists */
   _dbus_list_unlink (&d->connections->incomplete,
                      d->link_in_connection_list);
@@ -1489,9 +1638,160 @@ bus_pending_reply_free (BusPendingReply *pending)
                  pending->will_get_reply,
                  pending->reply_serial);
 
+  _dbus_assert (!pending->indexed);
+
   dbus_free (pending);
 }
 
+/* Adds @pending to the receiver's pending_replies and the replier's
+ * replies_owed, so it can be found without walking every pending reply
+ * on the bus.
+ */
+static dbus_bool_t
+bus_pending_reply_index (BusPendingReply *pending)
+{
+  BusConnectionData *receiver;
+  BusConnectionData *replier;
+  BusPendingReply *head;
+
+  receiver = BUS_CONNECTION_DATA (pending->will_get_reply);
+  replier = BUS_CONNECTION_DATA (pending->will_send_reply);
+  _dbus_assert (receiver != NULL);
+  _dbus_assert (replier != NULL);
+  _dbus_assert (!pending->indexed);
+
+  if (receiver->pending_replies == NULL)
+    {
+      receiver->pending_replies = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                        NULL, NULL);
+      if (receiver->pending_replies == NULL)
+        return FALSE;
+    }
+
+  pending->link_in_replier = _dbus_list_alloc_link (pending);
+  if (pending->link_in_replier == NULL)
+    return FALSE;
+
+  head = _dbus_hash_table_lookup_uintptr (receiver->pending_replies,
+                                          pending->reply_serial);
+  if (head != NULL)
+    {
+      pending->next_with_serial = head->next_with_serial;
+      head->next_with_serial = pending;
+    }
+  else if (!_dbus_hash_table_insert_uintptr (receiver->pending_replies,
+                                             pending->reply_serial,
+                                             pending))
+    {
+      _dbus_list_free_link (pending->link_in_replier);
+      pending->link_in_replier = NULL;
+      return FALSE;
+    }
+
+  _dbus_list_append_link (&replier->replies_owed, pending->link_in_replier);
+  receiver->n_pending_replies += 1;
+  pending->indexed = TRUE;
+
+  return TRUE;
+}
+
+static void
+bus_pending_reply_unlink_replier (BusPendingReply *pending)
+{
+  BusConnectionData *replier;
+
+  if (pending->link_in_replier == NULL)
+    return;
+
+  replier = BUS_CONNECTION_DATA (pending->will_send_reply);
+  _dbus_assert (replier != NULL);
+
+  _dbus_list_remove_link (&replier->replies_owed, pending->link_in_replier);
+  pending->link_in_replier = NULL;
+}
+
+/* Undoes bus_pending_reply_index(); a no-op if that was already done */
+static void
+bus_pending_reply_unindex (BusPendingReply *pending)
+{
+  BusConnectionData *receiver;
+  BusPendingReply *head;
+  DBusHashIter iter;
+
+  if (!pending->indexed)
+    return;
+
+  receiver = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_assert (receiver != NULL);
+
+  if (!_dbus_hash_iter_lookup (receiver->pending_replies,
+                               (void *) (uintptr_t) pending->reply_serial,
+                               FALSE, &iter))
+    _dbus_assert_not_reached ("indexed pending reply was not in the table");
+
+  head = _dbus_hash_iter_get_value (&iter);
+
+  if (head == pending)
+    {
+      if (pending->next_with_serial != NULL)
+        _dbus_hash_iter_set_value (&iter, pending->next_with_serial);
+      else
+        _dbus_hash_iter_remove_entry (&iter);
+    }
+  else
+    {
+      while (head->next_with_serial != pending)
+        {
+          head = head->next_with_serial;
+          _dbus_assert (head != NULL);
+        }
+
+      head->next_with_serial = pending->next_with_serial;
+    }
+
+  pending->next_with_serial = NULL;
+
+  if (!pending->replying)
+    receiver->n_pending_replies -= 1;
+  _dbus_assert (receiver->n_pending_replies >= 0);
+
+  bus_pending_reply_unlink_replier (pending);
+
+  pending->indexed = FALSE;
+}
+
+/* Finds the reply that @receiver is waiting for from @replier, ignoring
+ * any that are already being answered in a pending transaction.
+ */
+static BusPendingReply *
+bus_pending_reply_lookup (DBusConnection *receiver,
+                          DBusConnection *replier,
+                          dbus_uint32_t   reply_serial)
+{
+  BusConnectionData *d;
+  BusPendingReply *pending;
+
+  d = BUS_CONNECTION_DATA (receiver);
+  _dbus_assert (d != NULL);
+
+  if (d->pending_replies == NULL)
+    return NULL;
+
+  pending = _dbus_hash_table_lookup_uintptr (d->pending_replies, reply_serial);
+  while (pending != NULL)
+    {
+      _dbus_assert (pending->reply_serial == reply_serial);
+      _dbus_assert (pending->will_get_reply == receiver);
+
+      if (pending->will_send_reply == replier && !pending->replying)
+        return pending;
+
+      pending = pending->next_with_serial;
+    }
+
+  return NULL;
+}
+
 static dbus_bool_t
 bus_pending_reply_send_no_reply (BusConnections  *connections,
                                  BusTransaction  *transaction,
@@ -1566,8 +1866,11 @@ bus_pending_reply_expired (BusExpireList *list,
       return FALSE;
     }
 
+  _dbus_assert (link == pending->expire_link);
   bus_expire_list_remove_link (connections->pending_replies, link);
+  pending->expire_link = NULL;
 
+  bus_pending_reply_unindex (pending);
   bus_pending_reply_free (pending);
   bus_transaction_execute_and_free (transaction);
 
@@ -1579,56 +1882,89 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
                                      DBusConnection  *connection)
 {
   /* The DBusConnection is almost 100% finalized here, so you can't
-   * do anything with it except check for pointer equality
+   * do anything with it except check for pointer equality and look
+   * at its BusConnectionData
    */
+  BusConnectionData *d;
+  BusPendingReply *pending;
   DBusList *link;
 
   _dbus_verbose ("Dropping pending replies that involve connection %p\n",
                  connection);
-  
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
-    {
-      DBusList *next;
-      BusPendingReply *pending;
 
-      next = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      pending = link->data;
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
 
-      if (pending->will_get_reply == connection)
-        {
-          /* We don't need to track this pending reply anymore */
+  if (d->pending_replies != NULL)
+    {
+      DBusHashIter iter;
 
-          _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
-          bus_expire_list_remove_link (connections->pending_replies,
-                                       link);
-          bus_pending_reply_free (pending);
-        }
-      else if (pending->will_send_reply == connection)
+      _dbus_hash_iter_init (d->pending_replies, &iter);
+      while (_dbus_hash_iter_next (&iter))
         {
-          /* The reply isn't going to be sent, so set things
-           * up so it will be expired right away
-           */
-          _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
-          pending->will_send_reply = NULL;
-          pending->expire_item.added_tv_sec = 0;
-          pending->expire_item.added_tv_usec = 0;
+          BusPendingReply *next;
+
+          pending = _dbus_hash_iter_get_value (&iter);
+          _dbus_hash_iter_remove_entry (&iter);
 
-          bus_expire_list_recheck_immediately (connections->pending_replies);
+          while (pending != NULL)
+            {
+              _dbus_assert (pending->will_get_reply == connection);
+
+              next = pending->next_with_serial;
+              pending->next_with_serial = NULL;
+              pending->indexed = FALSE;
+              bus_pending_reply_unlink_replier (pending);
+
+              /* A reply that is already in a transaction is freed when
+               * that transaction is finished, as before
+               */
+              if (!pending->replying)
+                {
+                  /* We don't need to track this pending reply anymore */
+
+                  _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
+                                 pending,
+                                 pending->will_send_reply,
+                                 pending->will_get_reply,
+                                 pending->reply_serial);
+
+                  bus_expire_list_remove_link (connections->pending_replies,
+                                               pending->expire_link);
+                  pending->expire_link = NULL;
+                  bus_pending_reply_free (pending);
+                }
+
+              pending = next;
+            }
         }
-      
-      link = next;
+
+      d->n_pending_replies = 0;
+    }
+
+  while ((link = _dbus_list_get_first_link (&d->replies_owed)))
+    {
+      pending = link->data;
+
+      _dbus_assert (pending->will_send_reply == connection);
+
+      /* The reply isn't going to be sent, so set things
+       * up so it will be expired right away
+       */
+      _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
+                     pending,
+                     pending->will_send_reply,
+                     pending->will_get_reply,
+                     pending->reply_serial);
+
+      _dbus_list_remove_link (&d->replies_owed, link);
+      pending->link_in_replier = NULL;
+
+      pending->will_send_reply = NULL;
+      pending->expire_item.added_tv_sec = 0;
+      pending->expire_item.added_tv_usec = 0;
+
+      bus_expire_list_recheck_immediately (connections->pending_replies);
     }
 }
 
@@ -1646,10 +1982,11 @@ cancel_pending_reply (void *data)
 
   _dbus_verbose ("d = %p\n", d);
   
-  if (!bus_expire_list_remove (d->connections->pending_replies,
-                               &d->pending->expire_item))
-    _dbus_assert_not_reached ("pending reply did not exist to be cancelled");
+  bus_expire_list_remove_link (d->connections->pending_replies,
+                               d->pending->expire_link);
+  d->pending->expire_link = NULL;
 
+  bus_pending_reply_unindex (d->pending);
   bus_pending_reply_free (d->pending); /* since it's been cancelled */
 }
 
@@ -1680,10 +2017,9 @@ bus_connections_expect_reply (BusConnections  *connections,
                               DBusError       *error)
 {
   BusPendingReply *pending;
+  BusConnectionData *d;
   dbus_uint32_t reply_serial;
-  DBusList *link;
   CancelPendingReplyData *cprd;
-  int count;
 
   _dbus_assert (will_get_reply != NULL);
   _dbus_assert (will_send_reply != NULL);
@@ -1694,28 +2030,18 @@ bus_connections_expect_reply (BusConnections  *connections,
   
   reply_serial = dbus_message_get_serial (reply_to_this);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  count = 0;
-  while (link != NULL)
+  if (bus_pending_reply_lookup (will_get_reply, will_send_reply,
+                                reply_serial) != NULL)
     {
-      pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == will_get_reply &&
-          pending->will_send_reply == will_send_reply)
-        {
-          dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                          "Message has the same reply serial as a currently-outstanding existing method call");
-          return FALSE;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      if (pending->will_get_reply == will_get_reply)
-        ++count;
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Message has the same reply serial as a currently-outstanding existing method call");
+      return FALSE;
     }
-  
-  if (count >=
+
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->n_pending_replies >=
       bus_context_get_max_replies_per_connection (connections->context))
     {
       dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
@@ -1747,11 +2073,20 @@ bus_connections_expect_reply (BusConnections  *connections,
       bus_pending_reply_free (pending);
       return FALSE;
     }
-  
-  if (!bus_expire_list_add (connections->pending_replies,
-                            &pending->expire_item))
+
+  pending->expire_link = _dbus_list_alloc_link (&pending->expire_item);
+  if (pending->expire_link == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free (cprd);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+
+  if (!bus_pending_reply_index (pending))
     {
       BUS_SET_OOM (error);
+      _dbus_list_free_link (pending->expire_link);
       dbus_free (cprd);
       bus_pending_reply_free (pending);
       return FALSE;
@@ -1763,11 +2098,15 @@ bus_connections_expect_reply (BusConnections  *connections,
                                         cancel_pending_reply_data_free))
     {
       BUS_SET_OOM (error);
-      bus_expire_list_remove (connections->pending_replies, &pending->expire_item);
+      bus_pending_reply_unindex (pending);
+      _dbus_list_free_link (pending->expire_link);
       dbus_free (cprd);
       bus_pending_reply_free (pending);
       return FALSE;
     }
+
+  bus_expire_list_add_link (connections->pending_replies,
+                            pending->expire_link);
                                         
   cprd->pending = pending;
   cprd->connections = connections;
@@ -1795,11 +2134,25 @@ cancel_check_pending_reply (void *data)
 {
   CheckPendingReplyData *d = data;
 
+  BusPendingReply *pending = d->link->data;
+
   _dbus_verbose ("d = %p\n",d);
 
   bus_expire_list_add_link (d->connections->pending_replies,
                             d->link);
   d->link = NULL;
+
+  _dbus_assert (pending->replying);
+  pending->replying = FALSE;
+
+  /* unless the receiver has gone away meanwhile */
+  if (pending->indexed)
+    {
+      BusConnectionData *receiver_data;
+
+      receiver_data = BUS_CONNECTION_DATA (pending->will_get_reply);
+      receiver_data->n_pending_replies += 1;
+    }
 }
 
 static void
@@ -1815,7 +2168,9 @@ check_pending_reply_data_free (void *data)
       
       _dbus_assert (!bus_expire_list_contains_item (d->connections->pending_replies,
                                                     &pending->expire_item));
+      _dbus_assert (pending->expire_link == d->link);
       
+      bus_pending_reply_unindex (pending);
       bus_pending_reply_free (pending);
       _dbus_list_free_link (d->link);
     }
@@ -1836,6 +2191,8 @@ bus_connections_check_reply (BusConnections *connections,
                              DBusError      *error)
 {
   CheckPendingReplyData *cprd;
+  BusPendingReply *pending;
+  BusConnectionData *d;
   DBusList *link;
   dbus_uint32_t reply_serial;
   
@@ -1844,30 +2201,20 @@ bus_connections_check_reply (BusConnections *connections,
 
   reply_serial = dbus_message_get_reply_serial (reply);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
-    {
-      BusPendingReply *pending = link->data;
+  pending = bus_pending_reply_lookup (receiving_reply, sending_reply,
+                                      reply_serial);
 
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == receiving_reply &&
-          pending->will_send_reply == sending_reply)
-        {
-          _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
-          break;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-    }
-
-  if (link == NULL)
+  if (pending == NULL)
     {
       _dbus_verbose ("No pending reply expected\n");
 
       return FALSE;
     }
 
+  _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
+
+  link = pending->expire_link;
+
   cprd = dbus_new0 (CheckPendingReplyData, 1);
   if (cprd == NULL)
     {
@@ -1893,6 +2240,10 @@ bus_connections_check_reply (BusConnections *connections,
   
   _dbus_assert (!bus_expire_list_contains_item (connections->pending_replies, link->data));
 
+  pending->replying = TRUE;
+  d = BUS_CONNECTION_DATA (receiving_reply);
+  d->n_pending_replies -= 1;
+
   return TRUE;
 }
 
@@ -1903,13 +2254,6 @@ bus_connections_check_reply (BusConnections *connections,
  * one transaction across any main loop iterations.
  */
 
-typedef struct
-{
-  BusTransaction *transaction;
-  DBusMessage    *message;
-  DBusPreallocatedSend *preallocated;
-} MessageToSend;
-
 typedef struct
 {
   BusTransactionCancelFunction cancel_function;
@@ -1928,13 +2272,18 @@ static void
 message_to_send_free (DBusConnection *connection,
                       MessageToSend  *to_send)
 {
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
   if (to_send->message)
     dbus_message_unref (to_send->message);
 
   if (to_send->preallocated)
     dbus_connection_free_preallocated_send (connection, to_send->preallocated);
 
-  dbus_free (to_send);
+  _dbus_mem_pool_dealloc (d->connections->messages_to_send, to_send);
 }
 
 static void
@@ -2067,7 +2416,7 @@ bus_transaction_send (BusTransaction *transaction,
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
   
-  to_send = dbus_new (MessageToSend, 1);
+  to_send = _dbus_mem_pool_alloc (d->connections->messages_to_send);
   if (to_send == NULL)
     {
       return FALSE;
@@ -2076,7 +2425,7 @@ bus_transaction_send (BusTransaction *transaction,
   to_send->preallocated = dbus_connection_preallocate_send (connection);
   if (to_send->preallocated == NULL)
     {
-      dbus_free (to_send);
+      _dbus_mem_pool_dealloc (d->connections->messages_to_send, to_send);
       return FALSE;
     }  
   
@@ -2084,23 +2433,13 @@ bus_transaction_send (BusTransaction *transaction,
   to_send->message = message;
   to_send->transaction = transaction;
 
-  _dbus_verbose ("about to prepend message\n");
-  
-  if (!_dbus_list_prepend (&d->transaction_messages, to_send))
-    {
-      message_to_send_free (connection, to_send);
-      return FALSE;
-    }
-
-  _dbus_verbose ("prepended message\n");
-  
   /* See if we already had this connection in the list
    * for this transaction. If we have a pending message,
-   * then we should already be in transaction->connections
+   * then we should already be in transaction->connections.
+   * The most recent message is usually from this transaction
+   * if any are, so this normally stops at the first link.
    */
   link = _dbus_list_get_first_link (&d->transaction_messages);
-  _dbus_assert (link->data == to_send);
-  link = _dbus_list_get_next_link (&d->transaction_messages, link);
   while (link != NULL)
     {
       MessageToSend *m = link->data;
@@ -2112,14 +2451,18 @@ bus_transaction_send (BusTransaction *transaction,
       link = next;
     }
 
+  /* Nothing can fail from here on */
+  to_send->link_in_connection.data = to_send;
+  _dbus_list_prepend_link (&d->transaction_messages,
+                           &to_send->link_in_connection);
+
+  _dbus_verbose ("prepended message\n");
+
   if (link == NULL)
     {
-      if (!_dbus_list_prepend (&transaction->connections, connection))
-        {
-          _dbus_list_remove (&d->transaction_messages, to_send);
-          message_to_send_free (connection, to_send);
-          return FALSE;
-        }
+      to_send->link_in_transaction.data = connection;
+      _dbus_list_prepend_link (&transaction->connections,
+                               &to_send->link_in_transaction);
     }
 
   return TRUE;
@@ -2143,8 +2486,8 @@ connection_cancel_transaction (DBusConnection *connection,
       
       if (m->transaction == transaction)
         {
-          _dbus_list_remove_link (&d->transaction_messages,
-                                  link);
+          _dbus_list_unlink (&d->transaction_messages,
+                             link);
           
           message_to_send_free (connection, m);
         }
@@ -2153,6 +2496,23 @@ connection_cancel_transaction (DBusConnection *connection,
     }
 }
 
+/* The links in transaction->connections belong to MessageToSend
+ * structs, so they are unlinked rather than freed.
+ */
+static DBusConnection *
+transaction_pop_connection (BusTransaction *transaction)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&transaction->connections);
+  if (link == NULL)
+    return NULL;
+
+  _dbus_list_unlink (&transaction->connections, link);
+
+  return link->data;
+}
+
 void
 bus_transaction_cancel_and_free (BusTransaction *transaction)
 {
@@ -2160,7 +2520,7 @@ bus_transaction_cancel_and_free (BusTransaction *transaction)
 
   _dbus_verbose ("TRANSACTION: cancelled\n");
   
-  while ((connection = _dbus_list_pop_first (&transaction->connections)))
+  while ((connection = transaction_pop_connection (transaction)))
     connection_cancel_transaction (connection, transaction);
 
   _dbus_assert (transaction->connections == NULL);
@@ -2192,8 +2552,8 @@ connection_execute_transaction (DBusConnection *connection,
       
       if (m->transaction == transaction)
         {
-          _dbus_list_remove_link (&d->transaction_messages,
-                                  link);
+          _dbus_list_unlink (&d->transaction_messages,
+                             link);
 
           _dbus_assert (dbus_message_get_sender (m->message) != NULL);
           
@@ -2221,7 +2581,7 @@ bus_transaction_execute_and_free (BusTransaction *transaction)
 
   _dbus_verbose ("TRANSACTION: executing\n");
   
-  while ((connection = _dbus_list_pop_first (&transaction->connections)))
+  while ((connection = transaction_pop_connection (transaction)))
     connection_execute_transaction (connection, transaction);
 
   _dbus_assert (transaction->connections == NULL);
@@ -2236,17 +2596,28 @@ bus_connection_remove_transactions (DBusConnection *connection)
 {
   MessageToSend *to_send;
   BusConnectionData *d;
+  DBusList *link;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
   
-  while ((to_send = _dbus_list_get_first (&d->transaction_messages)))
+  while ((link = _dbus_list_get_first_link (&d->transaction_messages)))
     {
-      /* only has an effect for the first MessageToSend listing this transaction */
-      _dbus_list_remove (&to_send->transaction->connections,
-                         connection);
+      DBusList *in_transaction;
+
+      to_send = link->data;
+
+      /* only has an effect for the first MessageToSend listing this
+       * transaction; the link unlinked there belongs to one of this
+       * connection's messages, which are all freed below
+       */
+      in_transaction = _dbus_list_find_last (&to_send->transaction->connections,
+                                             connection);
+      if (in_transaction != NULL)
+        _dbus_list_unlink (&to_send->transaction->connections,
+                           in_transaction);
 
-      _dbus_list_remove (&d->transaction_messages, to_send);
+      _dbus_list_unlink (&d->transaction_messages, link);
       message_to_send_free (connection, to_send);
     }
 }
@@ -109,9 +109,10 @@ void        bus_connection_disconnected (DBusConnection *connection);
 dbus_bool_t      bus_connection_is_in_unix_group (DBusConnection       *connection,
                                                   unsigned long         gid);
 dbus_bool_t      bus_connection_get_unix_groups  (DBusConnection       *connection,
-                                                  unsigned long       **groups,
+                                                  const unsigned long **groups,
                                                   int                  *n_groups,
                                                   DBusError            *error);
+void             bus_connections_invalidate_unix_groups (BusConnections *connections);
 BusClientPolicy* bus_connection_get_policy  (DBusConnection       *connection);
 
 /* transaction API so we can send or not send a block of messages as a whole */
@@ -33,3 +33,14 @@ void
 bus_set_watched_dirs (BusContext *context, DBusList **directories)
 {
 }
+
+dbus_bool_t
+bus_dir_is_watched (const char *dir)
+{
+  return FALSE;
+}
+
+void
+bus_drain_watched_dirs (void)
+{
+}
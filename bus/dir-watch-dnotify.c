@@ -91,3 +91,14 @@ bus_drop_all_directory_watches (void)
   
   num_fds = 0;
 }
+
+dbus_bool_t
+bus_dir_is_watched (const char *dir)
+{
+  return FALSE;
+}
+
+void
+bus_drain_watched_dirs (void)
+{
+}
@@ -28,13 +28,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
-#include <signal.h>
 #include <errno.h>
 
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-timeout.h>
 #include <dbus/dbus-watch.h>
+#include "activation.h"
 #include "dir-watch.h"
 
 #define MAX_DIRS_TO_WATCH 128
@@ -48,6 +50,168 @@ static int num_wds = 0;
 static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
 static DBusLoop *loop = NULL;
+static BusContext *watch_context = NULL;
+
+/* Files tend to change in bursts, e.g. when a package is installed, so
+ * wait until things have been quiet for a moment before reloading, but
+ * don't put it off forever.
+ */
+#define RELOAD_DELAY_MS 250
+#define RELOAD_MAX_DELAY_MS 2000
+
+typedef enum
+{
+  RELOAD_NONE,
+  RELOAD_POLICY, /* a configuration file changed */
+  RELOAD_FULL    /* we might have missed changes to service files */
+} ReloadKind;
+
+static DBusTimeout *reload_timeout = NULL;
+static dbus_bool_t reload_timeout_added = FALSE;
+static ReloadKind pending_reload = RELOAD_NONE;
+static long pending_reload_since = 0;
+
+static void
+_reload_now (void)
+{
+  DBusError error;
+  ReloadKind kind;
+  dbus_bool_t ok;
+
+  kind = pending_reload;
+  pending_reload = RELOAD_NONE;
+
+  if (reload_timeout_added)
+    {
+      _dbus_loop_remove_timeout (loop, reload_timeout);
+      reload_timeout_added = FALSE;
+    }
+
+  if (kind == RELOAD_NONE || watch_context == NULL)
+    return;
+
+  _dbus_verbose ("Reloading %s after inotify events\n",
+                 kind == RELOAD_FULL ? "configuration" : "policy");
+
+  /* this can only fail if we don't understand the config file
+   * or OOM.  Either way we should just stick with the currently
+   * loaded config.
+   */
+  dbus_error_init (&error);
+
+  if (kind == RELOAD_FULL)
+    ok = bus_context_reload_config (watch_context, &error);
+  else
+    ok = bus_context_reload_policy (watch_context, &error);
+
+  if (!ok)
+    {
+      _dbus_warn ("Unable to reload configuration: %s\n", error.message);
+      dbus_error_free (&error);
+    }
+}
+
+static dbus_bool_t
+_handle_reload_timeout (void *data)
+{
+  _reload_now ();
+
+  return TRUE;
+}
+
+static void
+_queue_reload (ReloadKind kind)
+{
+  long tv_sec, tv_usec, now;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  now = tv_sec * 1000 + tv_usec / 1000;
+
+  if (pending_reload == RELOAD_NONE)
+    pending_reload_since = now;
+  if (kind > pending_reload)
+    pending_reload = kind;
+
+  if (reload_timeout_added)
+    {
+      if (now - pending_reload_since >= RELOAD_MAX_DELAY_MS)
+        return;
+
+      /* Start waiting again */
+      _dbus_loop_remove_timeout (loop, reload_timeout);
+      reload_timeout_added = FALSE;
+    }
+
+  if (reload_timeout != NULL && _dbus_loop_add_timeout (loop, reload_timeout))
+    reload_timeout_added = TRUE;
+  else
+    _reload_now ();
+}
+
+static int
+_find_watched_dir (int wd)
+{
+  int i;
+
+  for (i = 0; i < num_wds; i++)
+    {
+      if (wds[i] == wd && dirs[i] != NULL)
+        return i;
+    }
+
+  return -1;
+}
+
+static ReloadKind
+_handle_inotify_event (struct inotify_event *ev)
+{
+  BusActivation *activation;
+  DBusError error;
+  int i;
+
+  if (ev->mask & IN_Q_OVERFLOW)
+    return RELOAD_FULL;
+
+  i = _find_watched_dir (ev->wd);
+
+  /* Left over from a directory we've stopped watching */
+  if (i < 0)
+    return RELOAD_NONE;
+
+  if (ev->mask & IN_IGNORED)
+    {
+      /* The kernel dropped the watch, e.g. because the directory was
+       * deleted */
+      _dbus_verbose ("Lost inotify watch on '%s'\n", dirs[i]);
+      dbus_free (dirs[i]);
+      dirs[i] = NULL;
+      wds[i] = -1;
+      return RELOAD_FULL;
+    }
+
+  if (ev->len == 0 || watch_context == NULL)
+    return RELOAD_FULL;
+
+  activation = bus_context_get_activation (watch_context);
+  if (activation == NULL)
+    return RELOAD_FULL;
+
+  dbus_error_init (&error);
+  if (bus_activation_service_file_changed (activation, dirs[i], ev->name,
+                                           &error))
+    return RELOAD_NONE;
+
+  if (dbus_error_is_set (&error))
+    {
+      _dbus_verbose ("Could not update activation entries: %s\n",
+                     error.message);
+      dbus_error_free (&error);
+      return RELOAD_FULL;
+    }
+
+  /* not a service directory, so it's one of the configuration ones */
+  return RELOAD_POLICY;
+}
 
 static dbus_bool_t
 _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
@@ -55,8 +219,7 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   char buffer[INOTIFY_BUF_LEN];
   ssize_t ret = 0;
   int i = 0;
-  pid_t pid;
-  dbus_bool_t have_change = FALSE;
+  ReloadKind reload = RELOAD_NONE;
 
   ret = read (inotify_fd, buffer, INOTIFY_BUF_LEN);
   if (ret < 0)
@@ -67,7 +230,7 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   while (i < ret)
     {
       struct inotify_event *ev;
-      pid = _dbus_getpid ();
+      ReloadKind kind;
 
       ev = (struct inotify_event *) &buffer[i];
       i += INOTIFY_EVENT_SIZE + ev->len;
@@ -76,11 +239,12 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
 #endif
-      _dbus_verbose ("Sending SIGHUP signal on reception of a inotify event\n");
-      have_change = TRUE;
+      kind = _handle_inotify_event (ev);
+      if (kind > reload)
+        reload = kind;
     }
-  if (have_change)
-    (void) kill (pid, SIGHUP);
+  if (reload != RELOAD_NONE)
+    _queue_reload (reload);
 
   return TRUE;
 }
@@ -198,6 +362,16 @@ _shutdown_inotify (void *data)
 
   _set_watched_dirs_internal (&empty);
 
+  if (reload_timeout != NULL)
+    {
+      if (reload_timeout_added)
+        _dbus_loop_remove_timeout (loop, reload_timeout);
+      _dbus_timeout_unref (reload_timeout);
+    }
+  reload_timeout = NULL;
+  reload_timeout_added = FALSE;
+  pending_reload = RELOAD_NONE;
+
   if (watch != NULL)
     {
       _dbus_loop_remove_watch (loop, watch);
@@ -207,6 +381,7 @@ _shutdown_inotify (void *data)
     }
   watch = NULL;
   loop = NULL;
+  watch_context = NULL;
 
   close (inotify_fd);
   inotify_fd = -1;
@@ -254,6 +429,11 @@ _init_inotify (BusContext *context)
           goto out;
         }
 
+      /* if this fails, we just reload without waiting */
+      reload_timeout = _dbus_timeout_new (RELOAD_DELAY_MS,
+                                          _handle_reload_timeout,
+                                          NULL, NULL);
+
       if (!_dbus_register_shutdown_func (_shutdown_inotify, NULL))
       {
           _dbus_warn ("Unable to register shutdown func");
@@ -275,5 +455,32 @@ bus_set_watched_dirs (BusContext *context, DBusList **directories)
   if (!_init_inotify (context))
     return;
 
+  watch_context = context;
   _set_watched_dirs_internal (directories);
 }
+
+dbus_bool_t
+bus_dir_is_watched (const char *dir)
+{
+  int i;
+
+  for (i = 0; i < num_wds; i++)
+    {
+      if (dirs[i] != NULL && strcmp (dirs[i], dir) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+void
+bus_drain_watched_dirs (void)
+{
+  int pending;
+
+  if (inotify_fd < 0)
+    return;
+
+  if (ioctl (inotify_fd, FIONREAD, &pending) == 0 && pending > 0)
+    _handle_inotify_watch (watch, DBUS_WATCH_READABLE, NULL);
+}
@@ -248,3 +248,17 @@ bus_set_watched_dirs (BusContext *context, DBusList **directories)
  out:
   ;
 }
+
+/* kqueue only tells us that a directory changed, which triggers a full
+ * reload; it cannot keep the activation index current by itself.
+ */
+dbus_bool_t
+bus_dir_is_watched (const char *dir)
+{
+  return FALSE;
+}
+
+void
+bus_drain_watched_dirs (void)
+{
+}
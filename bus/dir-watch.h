@@ -37,4 +37,22 @@
  */
 void bus_set_watched_dirs (BusContext *context, DBusList **dirs);
 
+/**
+ * Whether changes to the .service files in a directory are reported
+ * to the activation code as they happen (see
+ * bus_activation_service_file_changed()).  Implementations which can
+ * only tell that "something changed" must return #FALSE.
+ *
+ * @param dir a directory path
+ * @returns #TRUE if per-file changes in dir are being reported
+ */
+dbus_bool_t bus_dir_is_watched (const char *dir);
+
+/**
+ * Process change notifications which are already queued, so that the
+ * caller sees the current contents of the watched directories without
+ * waiting for the main loop.
+ */
+void bus_drain_watched_dirs (void);
+
 #endif /* DIR_WATCH_H */
@@ -31,6 +31,7 @@
 #include "activation.h"
 #include "utils.h"
 #include "bus.h"
+#include "policy.h"
 #include "signals.h"
 #include "test.h"
 #include <dbus/dbus-internals.h>
@@ -4056,6 +4057,8 @@ static dbus_bool_t
 check_get_services (BusContext     *context,
 		    DBusConnection *connection,
 		    const char     *method,
+		    const char     *prefix,
+		    dbus_uint32_t   flags,
 		    char         ***services,
 		    int            *len)
 {
@@ -4078,6 +4081,16 @@ check_get_services (BusContext     *context,
   if (message == NULL)
     return TRUE;
 
+  if (prefix != NULL &&
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &prefix,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
   if (!dbus_connection_send (connection, message, &serial))
     {
       dbus_message_unref (message);
@@ -4201,7 +4214,7 @@ check_list_services (BusContext     *context,
 
   _dbus_verbose ("check_list_services for %p\n", connection);
 
-  if (!check_get_services (context, connection, "ListActivatableNames", &services, &len))
+  if (!check_get_services (context, connection, "ListActivatableNames", NULL, 0, &services, &len))
     {
       return TRUE;
     }
@@ -4366,7 +4379,7 @@ check_list_services (BusContext     *context,
 	}
     }
 
-  if (!check_get_services (context, connection, "ListNames", &services, &len))
+  if (!check_get_services (context, connection, "ListNames", NULL, 0, &services, &len))
     {
       return TRUE;
     }
@@ -4379,6 +4392,27 @@ check_list_services (BusContext     *context,
 
   dbus_free_string_array (services);
 
+  /* The running test service is also activatable, but must only be
+   * listed once; unique names and names outside the prefix are left out.
+   */
+  if (!check_get_services (context, connection, "ListNamesMatching",
+                           existent,
+                           DBUS_LIST_NAMES_WELL_KNOWN |
+                           DBUS_LIST_NAMES_ACTIVATABLE,
+                           &services, &len))
+    {
+      return TRUE;
+    }
+
+  if (len != 1 || strcmp (services[0], existent) != 0)
+    {
+      _dbus_warn ("Did not get only %s from ListNamesMatching\n", existent);
+      dbus_free_string_array (services);
+      goto out;
+    }
+
+  dbus_free_string_array (services);
+
   if (!check_send_exit_to_service (context, connection,
 				   EXISTENT_SERVICE_NAME, base_service))
     goto out;
@@ -4757,6 +4791,434 @@ bus_dispatch_sha1_test (const DBusString *test_data_dir)
   return TRUE;
 }
 
+#define GUARDED_NAME "org.freedesktop.DBus.TestSuite.Guarded"
+#define SECRET_INTERFACE "org.freedesktop.DBus.TestSuite.Secret"
+#define OPEN_INTERFACE "org.freedesktop.DBus.TestSuite.Open"
+
+/* The bus's end of a client connection that has said Hello */
+static DBusConnection *
+get_bus_side_connection (BusContext     *context,
+                         DBusConnection *client)
+{
+  BusService *service;
+  DBusString name;
+
+  _dbus_string_init_const (&name, dbus_bus_get_unique_name (client));
+  service = bus_registry_lookup (bus_context_get_registry (context), &name);
+  _dbus_assert (service != NULL);
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+/* Checks whether a send is allowed, first with nothing remembered for
+ * it, then from the remembered verdict, then by walking all the rules,
+ * and returns the answer after checking that all three agree.
+ */
+static dbus_bool_t
+check_policy_send (BusClientPolicy *policy,
+                   BusRegistry     *registry,
+                   dbus_bool_t      requested_reply,
+                   DBusConnection  *receiver,
+                   DBusMessage     *message)
+{
+  dbus_bool_t allowed[3];
+  dbus_int32_t toggles[3];
+  dbus_bool_t log[3];
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      bus_client_policy_set_uncached (policy, i == 2);
+      log[i] = FALSE;
+      allowed[i] = bus_client_policy_check_can_send (policy, registry,
+                                                     requested_reply,
+                                                     receiver, message,
+                                                     &toggles[i], &log[i]);
+    }
+
+  bus_client_policy_set_uncached (policy, FALSE);
+
+  _dbus_assert (allowed[0] == allowed[1] && allowed[0] == allowed[2]);
+  _dbus_assert (toggles[0] == toggles[1] && toggles[0] == toggles[2]);
+  _dbus_assert (log[0] == log[1] && log[0] == log[2]);
+
+  return allowed[0];
+}
+
+/* As check_policy_send(), for receiving */
+static dbus_bool_t
+check_policy_receive (BusClientPolicy *policy,
+                      BusRegistry     *registry,
+                      dbus_bool_t      requested_reply,
+                      DBusConnection  *sender,
+                      DBusConnection  *addressed_recipient,
+                      DBusConnection  *proposed_recipient,
+                      DBusMessage     *message)
+{
+  dbus_bool_t allowed[3];
+  dbus_int32_t toggles[3];
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      bus_client_policy_set_uncached (policy, i == 2);
+      allowed[i] = bus_client_policy_check_can_receive (policy, registry,
+                                                        requested_reply,
+                                                        sender,
+                                                        addressed_recipient,
+                                                        proposed_recipient,
+                                                        message,
+                                                        &toggles[i]);
+    }
+
+  bus_client_policy_set_uncached (policy, FALSE);
+
+  _dbus_assert (allowed[0] == allowed[1] && allowed[0] == allowed[2]);
+  _dbus_assert (toggles[0] == toggles[1] && toggles[0] == toggles[2]);
+
+  return allowed[0];
+}
+
+static void
+set_guarded_name_owned (BusContext     *context,
+                        DBusConnection *connection,
+                        dbus_bool_t     owned)
+{
+  BusTransaction *transaction;
+  DBusString name;
+  dbus_uint32_t result;
+  DBusError error;
+
+  dbus_error_init (&error);
+  _dbus_string_init_const (&name, GUARDED_NAME);
+
+  transaction = bus_transaction_new (context);
+  if (transaction == NULL)
+    _dbus_assert_not_reached ("no memory for transaction");
+
+  if (owned)
+    {
+      if (!bus_registry_acquire_service (bus_context_get_registry (context),
+                                         connection, &name, 0, &result,
+                                         transaction, &error))
+        _dbus_assert_not_reached ("could not acquire name");
+
+      _dbus_assert (result == DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER);
+    }
+  else
+    {
+      if (!bus_registry_release_service (bus_context_get_registry (context),
+                                         connection, &name, &result,
+                                         transaction, &error))
+        _dbus_assert_not_reached ("could not release name");
+
+      _dbus_assert (result == DBUS_RELEASE_NAME_REPLY_RELEASED);
+    }
+
+  bus_transaction_execute_and_free (transaction);
+}
+
+static DBusConnection *
+open_policy_test_client (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match_all (context, connection))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  return connection;
+}
+
+/* Checks the send and receive rules as they are used for routing,
+ * i.e. compiled per message type and with their verdicts remembered,
+ * against walking every rule each time
+ */
+dbus_bool_t
+bus_dispatch_policy_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusRegistry *registry;
+  BusClientPolicy *policy;
+  DBusConnection *foo, *bar;
+  DBusConnection *bus_foo, *bus_bar;
+  DBusMessage *secret, *open, *reply, *to_driver, *signal, *m;
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-check-policy.conf");
+  if (context == NULL)
+    return FALSE;
+
+  registry = bus_context_get_registry (context);
+
+  foo = open_policy_test_client (context);
+  bar = open_policy_test_client (context);
+
+  bus_foo = get_bus_side_connection (context, foo);
+  bus_bar = get_bus_side_connection (context, bar);
+  policy = bus_connection_get_policy (bus_foo);
+
+  secret = dbus_message_new_method_call (GUARDED_NAME, "/",
+                                         SECRET_INTERFACE, "Get");
+  open = dbus_message_new_method_call (GUARDED_NAME, "/",
+                                       OPEN_INTERFACE, "Get");
+  to_driver = dbus_message_new_method_call (DBUS_SERVICE_DBUS, "/",
+                                            SECRET_INTERFACE, "Get");
+  signal = dbus_message_new_signal ("/", OPEN_INTERFACE, "Changed");
+  if (secret == NULL || open == NULL || to_driver == NULL || signal == NULL)
+    _dbus_assert_not_reached ("no memory for messages");
+
+  dbus_message_set_serial (secret, 42);
+  reply = dbus_message_new_method_return (secret);
+  if (reply == NULL ||
+      !dbus_message_set_destination (signal, dbus_bus_get_unique_name (foo)))
+    _dbus_assert_not_reached ("no memory for messages");
+
+  /* Rules naming a destination or sender only apply while bar owns the
+   * name, so remembered verdicts must go when it changes hands */
+  _dbus_assert (check_policy_send (policy, registry, FALSE, bus_bar, secret));
+  _dbus_assert (check_policy_receive (policy, registry, FALSE, bus_bar,
+                                      bus_foo, bus_foo, secret));
+
+  set_guarded_name_owned (context, bus_bar, TRUE);
+
+  _dbus_assert (!check_policy_send (policy, registry, FALSE, bus_bar, secret));
+  _dbus_assert (check_policy_send (policy, registry, FALSE, bus_bar, open));
+  _dbus_assert (!check_policy_receive (policy, registry, FALSE, bus_bar,
+                                       bus_foo, bus_foo, secret));
+
+  set_guarded_name_owned (context, bus_bar, FALSE);
+
+  _dbus_assert (check_policy_send (policy, registry, FALSE, bus_bar, secret));
+  _dbus_assert (check_policy_receive (policy, registry, FALSE, bus_bar,
+                                      bus_foo, bus_foo, secret));
+
+  /* Without a receiving connection the rules look at the destination
+   * in the message, so it must tell verdicts apart */
+  _dbus_assert (!check_policy_send (policy, registry, FALSE, NULL, secret));
+  _dbus_assert (check_policy_send (policy, registry, FALSE, NULL, to_driver));
+
+  /* Only requested replies are allowed */
+  _dbus_assert (check_policy_send (policy, registry, TRUE, bus_bar, reply));
+  _dbus_assert (!check_policy_send (policy, registry, FALSE, bus_bar, reply));
+
+  /* Receiving is only allowed when not eavesdropping */
+  _dbus_assert (check_policy_receive (policy, registry, FALSE, bus_bar,
+                                      bus_foo, bus_foo, signal));
+  _dbus_assert (!check_policy_receive (policy, registry, FALSE, bus_bar,
+                                       bus_bar, bus_foo, signal));
+
+  /* Only a bounded number of verdicts is remembered */
+  for (i = 0; i < 40; i++)
+    {
+      char member[16];
+
+      snprintf (member, sizeof (member), "Get%d", i);
+      if (!dbus_message_set_member (open, member))
+        _dbus_assert_not_reached ("no memory for message");
+
+      _dbus_assert (check_policy_send (policy, registry, FALSE, bus_bar, open));
+      _dbus_assert (bus_client_policy_get_n_verdicts (policy) > 0);
+      _dbus_assert (bus_client_policy_get_n_verdicts (policy) <= 32);
+    }
+
+  dbus_message_unref (secret);
+  dbus_message_unref (open);
+  dbus_message_unref (reply);
+  dbus_message_unref (to_driver);
+  dbus_message_unref (signal);
+
+  /* Throw away the signals about the name changing hands */
+  bus_test_run_everything (context);
+  while ((m = dbus_connection_pop_message (foo)) != NULL)
+    dbus_message_unref (m);
+  while ((m = dbus_connection_pop_message (bar)) != NULL)
+    dbus_message_unref (m);
+
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#define WORKER_TEST_INTERFACE "org.freedesktop.DBus.TestSuite.Worker"
+#define WORKER_TEST_N_CALLS 100
+
+/* Like block_connection_until_message_from_bus(), but without
+ * blocking in either loop: with worker threads, what we are waiting
+ * for can happen in another thread while we would be blocked.
+ */
+static void
+spin_connection_until_message_from_bus (BusContext     *context,
+                                        DBusConnection *connection)
+{
+  while (dbus_connection_get_dispatch_status (connection) ==
+         DBUS_DISPATCH_COMPLETE &&
+         dbus_connection_get_is_connected (connection))
+    {
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
+    }
+}
+
+static DBusConnection *
+open_worker_threads_test_client (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  DBusError error;
+  dbus_uint32_t serial;
+  const char *name;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
+  if (message == NULL ||
+      !dbus_connection_send (connection, message, &serial))
+    _dbus_assert_not_reached ("could not send Hello");
+
+  dbus_message_unref (message);
+
+  spin_connection_until_message_from_bus (context, connection);
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (message) != serial)
+    _dbus_assert_not_reached ("did not get Hello reply");
+
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("bad Hello reply");
+
+  while (!dbus_bus_set_unique_name (connection, name))
+    _dbus_wait_for_memory ();
+
+  dbus_message_unref (message);
+
+  /* The bus's end of the connection now belongs to a worker, which
+   * writes NameAcquired after the reply
+   */
+  spin_connection_until_message_from_bus (context, connection);
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL ||
+      !dbus_message_is_signal (message, DBUS_INTERFACE_DBUS, "NameAcquired"))
+    _dbus_assert_not_reached ("did not get NameAcquired");
+
+  dbus_message_unref (message);
+
+  return connection;
+}
+
+/* Checks that messages between connections serviced by different
+ * worker threads are routed, and arrive in the order they were sent
+ */
+dbus_bool_t
+bus_dispatch_worker_threads_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo, *bar;
+  DBusMessage *m, *reply;
+  dbus_uint32_t i, n;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-worker-threads.conf");
+  if (context == NULL)
+    return FALSE;
+
+  _dbus_assert (bus_context_get_workers (context) != NULL);
+
+  foo = open_worker_threads_test_client (context);
+  bar = open_worker_threads_test_client (context);
+
+  for (i = 0; i < WORKER_TEST_N_CALLS; i++)
+    {
+      m = dbus_message_new_method_call (dbus_bus_get_unique_name (bar), "/",
+                                        WORKER_TEST_INTERFACE, "Count");
+      if (m == NULL ||
+          !dbus_message_append_args (m, DBUS_TYPE_UINT32, &i,
+                                     DBUS_TYPE_INVALID) ||
+          !dbus_connection_send (foo, m, NULL))
+        _dbus_assert_not_reached ("could not send call");
+
+      dbus_message_unref (m);
+    }
+
+  for (i = 0; i < WORKER_TEST_N_CALLS; i++)
+    {
+      spin_connection_until_message_from_bus (context, bar);
+      m = pop_message_waiting_for_memory (bar);
+      if (m == NULL ||
+          !dbus_message_is_method_call (m, WORKER_TEST_INTERFACE, "Count") ||
+          !dbus_message_get_args (m, NULL, DBUS_TYPE_UINT32, &n,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("did not get call");
+
+      _dbus_assert (n == i);
+
+      reply = dbus_message_new_method_return (m);
+      if (reply == NULL ||
+          !dbus_message_append_args (reply, DBUS_TYPE_UINT32, &n,
+                                     DBUS_TYPE_INVALID) ||
+          !dbus_connection_send (bar, reply, NULL))
+        _dbus_assert_not_reached ("could not send reply");
+
+      dbus_message_unref (reply);
+      dbus_message_unref (m);
+    }
+
+  for (i = 0; i < WORKER_TEST_N_CALLS; i++)
+    {
+      spin_connection_until_message_from_bus (context, foo);
+      m = pop_message_waiting_for_memory (foo);
+      if (m == NULL ||
+          dbus_message_get_type (m) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+          !dbus_message_get_args (m, NULL, DBUS_TYPE_UINT32, &n,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("did not get reply");
+
+      _dbus_assert (n == i);
+
+      dbus_message_unref (m);
+    }
+
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
 #ifdef HAVE_UNIX_FD_PASSING
 
 dbus_bool_t
@@ -33,8 +33,10 @@
 #include "stats.h"
 #include "utils.h"
 #include <dbus/dbus-string.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-message.h>
+#include <dbus/dbus-message-internal.h>
 #include <dbus/dbus-marshal-recursive.h>
 #include <string.h>
 
@@ -368,97 +370,92 @@ bus_driver_send_welcome_message (DBusConnection *connection,
     }
 }
 
+/* Sends the names selected by flags (DBUS_LIST_NAMES_*) which start
+ * with prefix, marshalling them straight from the registry and the
+ * activation entries.
+ */
 static dbus_bool_t
-bus_driver_handle_list_services (DBusConnection *connection,
-                                 BusTransaction *transaction,
-                                 DBusMessage    *message,
-                                 DBusError      *error)
+send_name_list (DBusConnection *connection,
+                BusTransaction *transaction,
+                DBusMessage    *message,
+                const char     *prefix,
+                dbus_uint32_t   flags,
+                DBusError      *error)
 {
   DBusMessage *reply;
-  int len;
-  char **services;
   BusRegistry *registry;
-  int i;
   DBusMessageIter iter;
   DBusMessageIter sub;
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  dbus_bool_t unique, well_known, activatable;
 
   registry = bus_connection_get_registry (connection);
 
+  unique = (flags & DBUS_LIST_NAMES_UNIQUE) != 0;
+  well_known = (flags & DBUS_LIST_NAMES_WELL_KNOWN) != 0;
+  activatable = (flags & DBUS_LIST_NAMES_ACTIVATABLE) != 0;
+
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!bus_registry_list_services (registry, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+    goto oom;
 
   dbus_message_iter_init_append (reply, &iter);
 
   if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
                                          DBUS_TYPE_STRING_AS_STRING,
                                          &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                         &v_STRING))
-      {
-        dbus_free_string_array (services);
-        dbus_message_unref (reply);
-        BUS_SET_OOM (error);
-        return FALSE;
-      }
-  }
+    goto oom;
 
-  i = 0;
-  while (i < len)
+  /* Include the bus driver in the list */
+  if ((well_known || activatable) &&
+      strncmp (DBUS_SERVICE_DBUS, prefix, strlen (prefix)) == 0)
     {
+      const char *v_STRING = DBUS_SERVICE_DBUS;
+
       if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                           &services[i]))
-        {
-          dbus_free_string_array (services);
-          dbus_message_unref (reply);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      ++i;
+                                           &v_STRING))
+        goto oom;
     }
 
-  dbus_free_string_array (services);
+  if ((unique || well_known) &&
+      !bus_registry_append_names (registry, &sub, prefix,
+                                  unique, well_known))
+    goto oom;
+
+  /* A name that is both owned and activatable is only listed once */
+  if (activatable &&
+      !bus_activation_append_names (bus_connection_get_activation (connection),
+                                    &sub, prefix,
+                                    well_known ? registry : NULL))
+    goto oom;
 
   if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+    goto oom;
 
   if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_list_services (DBusConnection *connection,
+                                 BusTransaction *transaction,
+                                 DBusMessage    *message,
+                                 DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  return send_name_list (connection, transaction, message, "",
+                         DBUS_LIST_NAMES_UNIQUE | DBUS_LIST_NAMES_WELL_KNOWN,
+                         error);
 }
 
 static dbus_bool_t
@@ -467,91 +464,36 @@ bus_driver_handle_list_activatable_services (DBusConnection *connection,
 					     DBusMessage    *message,
 					     DBusError      *error)
 {
-  DBusMessage *reply;
-  int len;
-  char **services;
-  BusActivation *activation;
-  int i;
-  DBusMessageIter iter;
-  DBusMessageIter sub;
-
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  activation = bus_connection_get_activation (connection);
-
-  reply = dbus_message_new_method_return (message);
-  if (reply == NULL)
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!bus_activation_list_services (activation, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  dbus_message_iter_init_append (reply, &iter);
-
-  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
-					 DBUS_TYPE_STRING_AS_STRING,
-					 &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  return send_name_list (connection, transaction, message, "",
+                         DBUS_LIST_NAMES_ACTIVATABLE, error);
+}
 
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					 &v_STRING))
-      {
-	dbus_free_string_array (services);
-	dbus_message_unref (reply);
-	BUS_SET_OOM (error);
-	return FALSE;
-      }
-  }
+static dbus_bool_t
+bus_driver_handle_list_names_matching (DBusConnection *connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  const char *prefix;
+  dbus_uint32_t flags;
 
-  i = 0;
-  while (i < len)
-    {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					   &services[i]))
-	{
-	  dbus_free_string_array (services);
-	  dbus_message_unref (reply);
-	  BUS_SET_OOM (error);
-	  return FALSE;
-	}
-      ++i;
-    }
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  dbus_free_string_array (services);
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &prefix,
+                              DBUS_TYPE_UINT32, &flags,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
 
-  if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  /* No flags means the same names as ListNames */
+  if ((flags & (DBUS_LIST_NAMES_UNIQUE | DBUS_LIST_NAMES_WELL_KNOWN |
+                DBUS_LIST_NAMES_ACTIVATABLE)) == 0)
+    flags = DBUS_LIST_NAMES_UNIQUE | DBUS_LIST_NAMES_WELL_KNOWN;
 
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+  return send_name_list (connection, transaction, message, prefix, flags,
+                         error);
 }
 
 static dbus_bool_t
@@ -1659,10 +1601,6 @@ typedef struct
                            DBusError      *error);
 } MessageHandler;
 
-/* For speed it might be useful to sort this in order of
- * frequency of use (but doesn't matter with only a few items
- * anyhow)
- */
 static const MessageHandler dbus_message_handlers[] = {
   { "Hello",
     "",
@@ -1696,6 +1634,10 @@ static const MessageHandler dbus_message_handlers[] = {
     "",
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_list_activatable_services },
+  { "ListNamesMatching",
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_list_names_matching },
   { "AddMatch",
     DBUS_TYPE_STRING_AS_STRING,
     "",
@@ -1761,8 +1703,6 @@ typedef struct {
   const char *extra_introspection;
 } InterfaceHandler;
 
-/* These should ideally be sorted by frequency of use, although it
- * probably doesn't matter with this few items */
 static InterfaceHandler interface_handlers[] = {
   { DBUS_INTERFACE_DBUS, dbus_message_handlers,
     "    <signal name=\"NameOwnerChanged\">\n"
@@ -1783,6 +1723,97 @@ static InterfaceHandler interface_handlers[] = {
   { NULL, NULL, NULL }
 };
 
+/* All the methods above, keyed on the hash of their name, so that
+ * dispatching a call is a single probe using the hash the message
+ * header has already computed for its member field. The lengths are
+ * kept so that names and signatures can be compared with memcmp().
+ */
+typedef struct
+{
+  const InterfaceHandler *interface;
+  const MessageHandler *method;
+  unsigned int name_hash;
+  int name_len;
+  int in_args_len;
+} DriverMethod;
+
+/* A power of two, and at least twice the number of methods so that
+ * collisions are rare and every probe sequence ends at an empty slot */
+#define N_DRIVER_METHOD_SLOTS 64
+
+static DriverMethod driver_methods[N_DRIVER_METHOD_SLOTS];
+static dbus_bool_t driver_methods_initialized = FALSE;
+
+static void
+init_driver_methods (void)
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+  int n_methods;
+
+  n_methods = 0;
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+        {
+          int name_len;
+          unsigned int name_hash;
+          unsigned int i;
+
+          name_len = strlen (mh->name);
+          name_hash = _dbus_hash_string_len (mh->name, name_len);
+
+          /* Earlier interfaces come first in each probe sequence, so
+           * calls without an interface still find the same method as
+           * when we searched the interfaces in order */
+          i = name_hash;
+          while (driver_methods[i % N_DRIVER_METHOD_SLOTS].method != NULL)
+            i++;
+
+          _dbus_assert (i - name_hash < N_DRIVER_METHOD_SLOTS);
+
+          driver_methods[i % N_DRIVER_METHOD_SLOTS].interface = ih;
+          driver_methods[i % N_DRIVER_METHOD_SLOTS].method = mh;
+          driver_methods[i % N_DRIVER_METHOD_SLOTS].name_hash = name_hash;
+          driver_methods[i % N_DRIVER_METHOD_SLOTS].name_len = name_len;
+          driver_methods[i % N_DRIVER_METHOD_SLOTS].in_args_len = strlen (mh->in_args);
+
+          n_methods++;
+          _dbus_assert (n_methods <= N_DRIVER_METHOD_SLOTS / 2);
+        }
+    }
+
+  driver_methods_initialized = TRUE;
+}
+
+static const DriverMethod *
+find_driver_method (const char   *interface,
+                    const char   *name,
+                    int           name_len,
+                    unsigned int  name_hash)
+{
+  unsigned int i;
+
+  if (!driver_methods_initialized)
+    init_driver_methods ();
+
+  for (i = name_hash; i - name_hash < N_DRIVER_METHOD_SLOTS; i++)
+    {
+      const DriverMethod *dm = &driver_methods[i % N_DRIVER_METHOD_SLOTS];
+
+      if (dm->method == NULL)
+        return NULL;
+
+      if (dm->name_hash == name_hash &&
+          dm->name_len == name_len &&
+          memcmp (dm->method->name, name, name_len) == 0 &&
+          (interface == NULL || strcmp (interface, dm->interface->name) == 0))
+        return dm;
+    }
+
+  return NULL;
+}
+
 static dbus_bool_t
 write_args_for_direction (DBusString *xml,
 			  const char *signature,
@@ -1933,10 +1964,12 @@ bus_driver_handle_message (DBusConnection *connection,
 			   DBusMessage    *message,
                            DBusError      *error)
 {
-  const char *name, *interface;
+  const char *name, *interface, *signature;
+  int name_len, signature_len;
+  unsigned int name_hash;
+  const DriverMethod *dm;
   const InterfaceHandler *ih;
-  const MessageHandler *mh;
-  dbus_bool_t found_interface = FALSE;
+  dbus_bool_t found_interface;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -1957,9 +1990,9 @@ bus_driver_handle_message (DBusConnection *connection,
   /* may be NULL, which means "any interface will do" */
   interface = dbus_message_get_interface (message);
 
-  _dbus_assert (dbus_message_get_member (message) != NULL);
-
-  name = dbus_message_get_member (message);
+  if (!_dbus_message_get_header_string (message, DBUS_HEADER_FIELD_MEMBER,
+                                        &name, &name_len, &name_hash))
+    _dbus_assert_not_reached ("method call without a member");
 
   _dbus_verbose ("Driver got a method call: %s\n", name);
 
@@ -1972,53 +2005,55 @@ bus_driver_handle_message (DBusConnection *connection,
     }
 #endif
 
-  for (ih = interface_handlers; ih->name != NULL; ih++)
-    {
-      if (interface != NULL && strcmp (interface, ih->name) != 0)
-        continue;
+  dm = find_driver_method (interface, name, name_len, name_hash);
 
-      found_interface = TRUE;
+  if (dm != NULL)
+    {
+      _dbus_verbose ("Found driver handler for %s\n", name);
 
-      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+      /* a missing signature field means no arguments */
+      if (!_dbus_message_get_header_string (message, DBUS_HEADER_FIELD_SIGNATURE,
+                                            &signature, &signature_len, NULL))
         {
-          if (strcmp (mh->name, name) != 0)
-            continue;
+          signature = "";
+          signature_len = 0;
+        }
 
-          _dbus_verbose ("Found driver handler for %s\n", name);
+      if (signature_len != dm->in_args_len ||
+          memcmp (signature, dm->method->in_args, signature_len) != 0)
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
+                         name, signature, dm->method->in_args);
 
-          if (!dbus_message_has_signature (message, mh->in_args))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
-                             name, dbus_message_get_signature (message),
-                             mh->in_args);
-
-              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-                              "Call to %s has wrong args (%s, expected %s)\n",
-                              name, dbus_message_get_signature (message),
-                              mh->in_args);
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              return FALSE;
-            }
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Call to %s has wrong args (%s, expected %s)\n",
+                          name, signature, dm->method->in_args);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return FALSE;
+        }
 
-          if ((* mh->handler) (connection, transaction, message, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Driver handler succeeded\n");
-              return TRUE;
-            }
-          else
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_verbose ("Driver handler returned failure\n");
-              return FALSE;
-            }
+      if ((* dm->method->handler) (connection, transaction, message, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Driver handler succeeded\n");
+          return TRUE;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          _dbus_verbose ("Driver handler returned failure\n");
+          return FALSE;
         }
     }
 
   _dbus_verbose ("No driver handler for message \"%s\"\n",
                  name);
 
+  found_interface = (interface == NULL);
+  for (ih = interface_handlers; ih->name != NULL && !found_interface; ih++)
+    found_interface = (strcmp (interface, ih->name) == 0);
+
   dbus_set_error (error, found_interface ? DBUS_ERROR_UNKNOWN_METHOD : DBUS_ERROR_UNKNOWN_INTERFACE,
                   "%s does not understand message %s",
                   DBUS_SERVICE_DBUS, name);
@@ -23,9 +23,11 @@
 
 #include <config.h>
 #include "policy.h"
+#include "connection.h"
 #include "services.h"
 #include "test.h"
 #include "utils.h"
+#include "atoms.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
@@ -96,21 +98,21 @@ bus_policy_rule_unref (BusPolicyRule *rule)
       switch (rule->type)
         {
         case BUS_POLICY_RULE_SEND:
-          dbus_free (rule->d.send.path);
-          dbus_free (rule->d.send.interface);
-          dbus_free (rule->d.send.member);
-          dbus_free (rule->d.send.error);
-          dbus_free (rule->d.send.destination);
+          bus_atom_unref (rule->d.send.path);
+          bus_atom_unref (rule->d.send.interface);
+          bus_atom_unref (rule->d.send.member);
+          bus_atom_unref (rule->d.send.error);
+          bus_atom_unref (rule->d.send.destination);
           break;
         case BUS_POLICY_RULE_RECEIVE:
-          dbus_free (rule->d.receive.path);
-          dbus_free (rule->d.receive.interface);
-          dbus_free (rule->d.receive.member);
-          dbus_free (rule->d.receive.error);
-          dbus_free (rule->d.receive.origin);
+          bus_atom_unref (rule->d.receive.path);
+          bus_atom_unref (rule->d.receive.interface);
+          bus_atom_unref (rule->d.receive.member);
+          bus_atom_unref (rule->d.receive.error);
+          bus_atom_unref (rule->d.receive.origin);
           break;
         case BUS_POLICY_RULE_OWN:
-          dbus_free (rule->d.own.service_name);
+          bus_atom_unref (rule->d.own.service_name);
           break;
         case BUS_POLICY_RULE_USER:
           break;
@@ -292,7 +294,7 @@ bus_policy_create_client_policy (BusPolicy      *policy,
    */
   if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
     {
-      unsigned long *groups;
+      const unsigned long *groups;
       int n_groups;
       int i;
       
@@ -310,16 +312,11 @@ bus_policy_create_client_policy (BusPolicy      *policy,
           if (list != NULL)
             {
               if (!add_list_to_client (list, client))
-                {
-                  dbus_free (groups);
-                  goto nomem;
-                }
+                goto nomem;
             }
           
           ++i;
         }
-
-      dbus_free (groups);
     }
   
   if (dbus_connection_get_unix_user (connection, &uid))
@@ -434,20 +431,12 @@ list_allows_user (dbus_bool_t           def,
 }
 
 dbus_bool_t
-bus_policy_allow_unix_user (BusPolicy        *policy,
-                            unsigned long     uid)
+bus_policy_allow_unix_user (BusPolicy           *policy,
+                            unsigned long        uid,
+                            const unsigned long *group_ids,
+                            int                  n_group_ids)
 {
   dbus_bool_t allowed;
-  unsigned long *group_ids;
-  int n_group_ids;
-
-  /* On OOM or error we always reject the user */
-  if (!_dbus_unix_groups_from_uid (uid, &group_ids, &n_group_ids))
-    {
-      _dbus_verbose ("Did not get any groups for UID %lu\n",
-                     uid);
-      return FALSE;
-    }
 
   /* Default to "user owning bus" can connect */
   allowed = _dbus_unix_user_is_process_owner (uid);
@@ -462,8 +451,6 @@ bus_policy_allow_unix_user (BusPolicy        *policy,
                               uid,
                               group_ids, n_group_ids);
 
-  dbus_free (group_ids);
-
   _dbus_verbose ("UID %lu allowed = %d\n", uid, allowed);
   
   return allowed;
@@ -688,11 +675,42 @@ bus_policy_merge (BusPolicy *policy,
   return TRUE;
 }
 
+/** Most verdicts a client policy remembers before starting over */
+#define MAX_POLICY_VERDICTS 32
+
+/**
+ * Rules of one kind that can apply to one message type, in the order
+ * they appeared in the config file.
+ */
+typedef struct
+{
+  BusPolicyRule **rules; /**< the rules */
+  int n_rules;           /**< number of rules */
+} BusPolicyRuleArray;
+
 struct BusClientPolicy
 {
   int refcount;
 
   DBusList *rules;
+
+  /* Compiled from rules on first use, so each check only looks at
+   * rules of the right kind for the message type
+   */
+  BusPolicyRuleArray send_rules[DBUS_NUM_MESSAGE_TYPES];
+  BusPolicyRuleArray receive_rules[DBUS_NUM_MESSAGE_TYPES];
+  unsigned int compiled : 1;
+
+  /** Key describing a message and its peer => packed verdict, valid
+   * while the registry's owners serial is verdicts_serial
+   */
+  DBusHashTable *verdicts;
+  dbus_uint32_t verdicts_serial;
+  DBusString verdict_key;
+
+  /* Set by tests to check the compiled rules and remembered verdicts
+   * against a plain walk of rules */
+  unsigned int uncached : 1;
 };
 
 BusClientPolicy*
@@ -704,11 +722,126 @@ bus_client_policy_new (void)
   if (policy == NULL)
     return NULL;
 
+  if (!_dbus_string_init (&policy->verdict_key))
+    {
+      dbus_free (policy);
+      return NULL;
+    }
+
   policy->refcount = 1;
 
   return policy;
 }
 
+static void
+bus_client_policy_uncompile (BusClientPolicy *policy)
+{
+  int i;
+
+  for (i = 0; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      dbus_free (policy->send_rules[i].rules);
+      policy->send_rules[i].rules = NULL;
+      policy->send_rules[i].n_rules = 0;
+
+      dbus_free (policy->receive_rules[i].rules);
+      policy->receive_rules[i].rules = NULL;
+      policy->receive_rules[i].n_rules = 0;
+    }
+
+  policy->compiled = FALSE;
+
+  if (policy->verdicts != NULL)
+    _dbus_hash_table_remove_all (policy->verdicts);
+}
+
+static dbus_bool_t
+rule_applies_to_message_type (BusPolicyRule     *rule,
+                              BusPolicyRuleType  type,
+                              int                message_type)
+{
+  int rule_message_type;
+
+  if (rule->type != type)
+    return FALSE;
+
+  if (type == BUS_POLICY_RULE_SEND)
+    rule_message_type = rule->d.send.message_type;
+  else
+    rule_message_type = rule->d.receive.message_type;
+
+  return rule_message_type == DBUS_MESSAGE_TYPE_INVALID ||
+    rule_message_type == message_type;
+}
+
+static dbus_bool_t
+rule_array_compile (BusPolicyRuleArray *array,
+                    DBusList          **rules,
+                    BusPolicyRuleType   type,
+                    int                 message_type)
+{
+  DBusList *link;
+  int n;
+
+  n = 0;
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      if (rule_applies_to_message_type (link->data, type, message_type))
+        n++;
+    }
+
+  if (n == 0)
+    return TRUE;
+
+  array->rules = dbus_new (BusPolicyRule *, n);
+  if (array->rules == NULL)
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      if (rule_applies_to_message_type (link->data, type, message_type))
+        array->rules[array->n_rules++] = link->data;
+    }
+
+  _dbus_assert (array->n_rules == n);
+
+  return TRUE;
+}
+
+/* Returns FALSE on OOM, in which case the checks fall back to
+ * walking the whole list of rules
+ */
+static dbus_bool_t
+bus_client_policy_compile (BusClientPolicy *policy)
+{
+  int i;
+
+  if (policy->compiled)
+    return TRUE;
+
+  for (i = 0; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      if (i == DBUS_MESSAGE_TYPE_INVALID)
+        continue;
+
+      if (!rule_array_compile (&policy->send_rules[i], &policy->rules,
+                               BUS_POLICY_RULE_SEND, i) ||
+          !rule_array_compile (&policy->receive_rules[i], &policy->rules,
+                               BUS_POLICY_RULE_RECEIVE, i))
+        {
+          bus_client_policy_uncompile (policy);
+          return FALSE;
+        }
+    }
+
+  policy->compiled = TRUE;
+  return TRUE;
+}
+
 BusClientPolicy *
 bus_client_policy_ref (BusClientPolicy *policy)
 {
@@ -743,6 +876,13 @@ bus_client_policy_unref (BusClientPolicy *policy)
 
       _dbus_list_clear (&policy->rules);
 
+      bus_client_policy_uncompile (policy);
+
+      if (policy->verdicts != NULL)
+        _dbus_hash_table_unref (policy->verdicts);
+
+      _dbus_string_free (&policy->verdict_key);
+
       dbus_free (policy);
     }
 }
@@ -791,6 +931,8 @@ bus_client_policy_optimize (BusClientPolicy *policy)
 
   _dbus_verbose ("Optimizing policy with %d rules\n",
                  _dbus_list_get_length (&policy->rules));
+
+  bus_client_policy_uncompile (policy);
   
   link = _dbus_list_get_first_link (&policy->rules);
   while (link != NULL)
@@ -858,10 +1000,335 @@ bus_client_policy_append_rule (BusClientPolicy *policy,
     return FALSE;
 
   bus_policy_rule_ref (rule);
+  bus_client_policy_uncompile (policy);
+
+  return TRUE;
+}
+
+/* Fills in the verdict key for a message and the connection at the
+ * other end of it, or returns FALSE if the verdict for it shouldn't be
+ * remembered. The key has everything that a send or receive rule can
+ * look at, apart from name ownership, which the registry's owners
+ * serial stands in for.
+ */
+static dbus_bool_t
+build_verdict_key (BusClientPolicy *policy,
+                   char             kind,
+                   dbus_bool_t      requested_reply,
+                   dbus_bool_t      eavesdropping,
+                   DBusConnection  *peer,
+                   const char      *peer_name,
+                   DBusMessage     *message)
+{
+  DBusString *key = &policy->verdict_key;
+  const char *fields[5];
+  char flags[6];
+  int i;
+
+  /* the other end is the bus driver, so the rule compares names */
+  if (peer == NULL)
+    {
+      flags[5] = 'b';
+    }
+  else
+    {
+      flags[5] = 'c';
+      peer_name = bus_connection_get_name (peer);
+      if (peer_name == NULL)
+        return FALSE;
+    }
+
+  flags[0] = kind;
+  flags[1] = '0' + dbus_message_get_type (message);
+  flags[2] = dbus_message_get_reply_serial (message) != 0 ? 'r' : '-';
+  flags[3] = requested_reply ? 'R' : '-';
+  flags[4] = eavesdropping ? 'e' : '-';
+
+  fields[0] = peer_name;
+  fields[1] = dbus_message_get_path (message);
+  fields[2] = dbus_message_get_interface (message);
+  fields[3] = dbus_message_get_member (message);
+  fields[4] = dbus_message_get_error_name (message);
+
+  _dbus_string_set_length (key, 0);
+
+  if (!_dbus_string_append_len (key, flags, sizeof (flags)))
+    return FALSE;
+
+  /* None of these can contain a space, and none can be empty, so a
+   * missing field can't be confused with a present one */
+  for (i = 0; i < _DBUS_N_ELEMENTS (fields); i++)
+    {
+      if (!_dbus_string_append_byte (key, ' '))
+        return FALSE;
+
+      if (fields[i] != NULL &&
+          !_dbus_string_append (key, fields[i]))
+        return FALSE;
+    }
 
   return TRUE;
 }
 
+/* Verdicts are packed into a pointer; bit 0 is always set so a
+ * remembered verdict is never NULL
+ */
+#define VERDICT_ALLOWED (1 << 1)
+#define VERDICT_LOG     (1 << 2)
+#define VERDICT_TOGGLES_SHIFT 3
+
+static dbus_bool_t
+lookup_verdict (BusClientPolicy *policy,
+                BusRegistry     *registry,
+                dbus_bool_t     *allowed,
+                dbus_int32_t    *toggles,
+                dbus_bool_t     *log)
+{
+  uintptr_t verdict;
+
+  if (policy->verdicts == NULL)
+    return FALSE;
+
+  if (policy->verdicts_serial != bus_registry_get_owners_serial (registry))
+    {
+      _dbus_hash_table_remove_all (policy->verdicts);
+      policy->verdicts_serial = bus_registry_get_owners_serial (registry);
+      return FALSE;
+    }
+
+  verdict = (uintptr_t) _dbus_hash_table_lookup_string (policy->verdicts,
+                                                        _dbus_string_get_const_data (&policy->verdict_key));
+  if (verdict == 0)
+    return FALSE;
+
+  *allowed = (verdict & VERDICT_ALLOWED) != 0;
+  *toggles = verdict >> VERDICT_TOGGLES_SHIFT;
+
+  /* like the rules themselves, only touch *log if a rule was used */
+  if (log != NULL && *toggles > 0)
+    *log = (verdict & VERDICT_LOG) != 0;
+
+  _dbus_verbose ("  (policy) using remembered verdict, allow = %d\n",
+                 *allowed);
+
+  return TRUE;
+}
+
+/* Failing to remember a verdict (on OOM) is harmless */
+static void
+remember_verdict (BusClientPolicy *policy,
+                  BusRegistry     *registry,
+                  dbus_bool_t      allowed,
+                  dbus_int32_t     toggles,
+                  dbus_bool_t      log)
+{
+  uintptr_t verdict;
+  char *key;
+
+  if (policy->verdicts == NULL)
+    {
+      policy->verdicts = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                               dbus_free, NULL);
+      if (policy->verdicts == NULL)
+        return;
+
+      policy->verdicts_serial = bus_registry_get_owners_serial (registry);
+    }
+
+  _dbus_assert (policy->verdicts_serial == bus_registry_get_owners_serial (registry));
+
+  if (_dbus_hash_table_get_n_entries (policy->verdicts) >= MAX_POLICY_VERDICTS)
+    _dbus_hash_table_remove_all (policy->verdicts);
+
+  if (!_dbus_string_copy_data (&policy->verdict_key, &key))
+    return;
+
+  verdict = 1 | ((uintptr_t) toggles << VERDICT_TOGGLES_SHIFT);
+  if (allowed)
+    verdict |= VERDICT_ALLOWED;
+  if (log)
+    verdict |= VERDICT_LOG;
+
+  if (!_dbus_hash_table_insert_string (policy->verdicts, key, (void *) verdict))
+    dbus_free (key);
+}
+
+/* Gets the compiled rules of one kind for a message type, or returns
+ * FALSE if the policy couldn't be compiled
+ */
+static dbus_bool_t
+bus_client_policy_get_rules (BusClientPolicy     *policy,
+                             BusPolicyRuleType    type,
+                             int                  message_type,
+                             BusPolicyRuleArray **array)
+{
+  if (message_type <= DBUS_MESSAGE_TYPE_INVALID ||
+      message_type >= DBUS_NUM_MESSAGE_TYPES)
+    return FALSE;
+
+  if (!bus_client_policy_compile (policy))
+    return FALSE;
+
+  if (type == BUS_POLICY_RULE_SEND)
+    *array = &policy->send_rules[message_type];
+  else
+    *array = &policy->receive_rules[message_type];
+
+  return TRUE;
+}
+
+/* Whether a send rule of the right message type applies to a message */
+static dbus_bool_t
+send_rule_applies (BusPolicyRule  *rule,
+                   BusRegistry    *registry,
+                   dbus_bool_t     requested_reply,
+                   DBusConnection *receiver,
+                   DBusMessage    *message)
+{
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
+       */
+      if (!requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
+        {
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
+        }
+
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
+       */
+      if (requested_reply && !rule->allow && !rule->d.send.requested_reply)
+        {
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.send.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.send.path) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.send.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
+
+      no_interface = dbus_message_get_interface (message) == NULL;
+      
+      if ((no_interface && rule->allow) ||
+          (!no_interface && 
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.send.interface) != 0))
+        {
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.send.member) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.send.error) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.send.destination != NULL)
+    {
+      /* receiver can be NULL for messages that are sent to the
+       * message bus itself, we check the strings in that case as
+       * built-in services don't have a DBusConnection but messages
+       * to them have a destination service name.
+       */
+      if (receiver == NULL)
+        {
+          if (!dbus_message_has_destination (message,
+                                             rule->d.send.destination))
+            {
+              _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
+                             rule->d.send.destination);
+              return FALSE;
+            }
+        }
+      else
+        {
+          DBusString str;
+          BusService *service;
+          
+          _dbus_string_init_const (&str, rule->d.send.destination);
+          
+          service = bus_registry_lookup (registry, &str);
+          if (service == NULL)
+            {
+              _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
+                             rule->d.send.destination);
+              return FALSE;
+            }
+
+          if (!bus_service_has_owner (service, receiver))
+            {
+              _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
+                             rule->d.send.destination);
+              return FALSE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+check_send_rule (BusPolicyRule  *rule,
+                 BusRegistry    *registry,
+                 dbus_bool_t     requested_reply,
+                 DBusConnection *receiver,
+                 DBusMessage    *message,
+                 dbus_bool_t    *allowed,
+                 dbus_int32_t   *toggles,
+                 dbus_bool_t    *log)
+{
+  if (!send_rule_applies (rule, registry, requested_reply, receiver, message))
+    return;
+
+  /* Use this rule */
+  *allowed = rule->allow;
+  *log = rule->d.send.log;
+  (*toggles)++;
+
+  _dbus_verbose ("  (policy) used rule, allow now = %d\n",
+                 *allowed);
+}
+
 dbus_bool_t
 bus_client_policy_check_can_send (BusClientPolicy *policy,
                                   BusRegistry     *registry,
@@ -871,8 +1338,10 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
                                   dbus_int32_t    *toggles,
                                   dbus_bool_t     *log)
 {
-  DBusList *link;
+  BusPolicyRuleArray *array;
   dbus_bool_t allowed;
+  dbus_bool_t have_key;
+  int type;
   
   /* policy->rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
@@ -880,164 +1349,229 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
 
   _dbus_verbose ("  (policy) checking send rules\n");
   *toggles = 0;
-  
+
+  have_key = !policy->uncached &&
+    build_verdict_key (policy, 's', requested_reply, FALSE,
+                       receiver,
+                       dbus_message_get_destination (message),
+                       message);
+
+  if (have_key &&
+      lookup_verdict (policy, registry, &allowed, toggles, log))
+    return allowed;
+
   allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+  type = dbus_message_get_type (message);
+
+  if (!policy->uncached &&
+      bus_client_policy_get_rules (policy, BUS_POLICY_RULE_SEND, type, &array))
     {
-      BusPolicyRule *rule = link->data;
+      int i;
 
-      link = _dbus_list_get_next_link (&policy->rules, link);
-      
-      /* Rule is skipped if it specifies a different
-       * message name from the message, or a different
-       * destination from the message
-       */
-      
-      if (rule->type != BUS_POLICY_RULE_SEND)
-        {
-          _dbus_verbose ("  (policy) skipping non-send rule\n");
-          continue;
-        }
+      for (i = 0; i < array->n_rules; i++)
+        check_send_rule (array->rules[i], registry, requested_reply,
+                         receiver, message, &allowed, toggles, log);
+    }
+  else
+    {
+      DBusList *link;
 
-      if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
+      for (link = _dbus_list_get_first_link (&policy->rules);
+           link != NULL;
+           link = _dbus_list_get_next_link (&policy->rules, link))
         {
-          if (dbus_message_get_type (message) != rule->d.send.message_type)
+          BusPolicyRule *rule = link->data;
+
+          /* Rule is skipped if it isn't a send rule for this type of
+           * message
+           */
+          if (!rule_applies_to_message_type (rule, BUS_POLICY_RULE_SEND, type))
             {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
+              _dbus_verbose ("  (policy) skipping rule for different message type or non-send rule\n");
               continue;
             }
+
+          check_send_rule (rule, registry, requested_reply,
+                           receiver, message, &allowed, toggles, log);
         }
+    }
 
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
+  if (have_key)
+    remember_verdict (policy, registry, allowed, *toggles, *log);
+
+  return allowed;
+}
+
+/* Whether a receive rule of the right message type applies to a message */
+static dbus_bool_t
+receive_rule_applies (BusPolicyRule  *rule,
+                      BusRegistry    *registry,
+                      dbus_bool_t     requested_reply,
+                      dbus_bool_t     eavesdropping,
+                      DBusConnection *sender,
+                      DBusMessage    *message)
+{
+  /* for allow, eavesdrop=false means the rule doesn't apply when
+   * eavesdropping. eavesdrop=true means always allow.
+   */
+  if (eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
+      return FALSE;
+    }
+
+  /* for deny, eavesdrop=true means the rule applies only when
+   * eavesdropping; eavesdrop=false means always deny.
+   */
+  if (!eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
+      return FALSE;
+    }
+
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
+       */
+      if (!requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
         {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
-            {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
+        }
 
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.send.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
+       */
+      if (requested_reply && !rule->allow && !rule->d.receive.requested_reply)
+        {
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
         }
-      
-      if (rule->d.send.path != NULL)
+    }
+  
+  if (rule->d.receive.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.receive.path) != 0)
         {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.send.path) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
         }
+    }
+  
+  if (rule->d.receive.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
+
+      no_interface = dbus_message_get_interface (message) == NULL;
       
-      if (rule->d.send.interface != NULL)
+      if ((no_interface && rule->allow) ||
+          (!no_interface &&
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.receive.interface) != 0))
         {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
-
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface && 
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.send.interface) != 0))
-            {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
         }
+    }      
 
-      if (rule->d.send.member != NULL)
+  if (rule->d.receive.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.receive.member) != 0)
         {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.send.member) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
         }
+    }
 
-      if (rule->d.send.error != NULL)
+  if (rule->d.receive.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.receive.error) != 0)
         {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.send.error) != 0)
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.receive.origin != NULL)
+    {          
+      /* sender can be NULL for messages that originate from the
+       * message bus itself, we check the strings in that case as
+       * built-in services don't have a DBusConnection but will
+       * still set the sender on their messages.
+       */
+      if (sender == NULL)
+        {
+          if (!dbus_message_has_sender (message,
+                                        rule->d.receive.origin))
             {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
-              continue;
+              _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
         }
-      
-      if (rule->d.send.destination != NULL)
+      else
         {
-          /* receiver can be NULL for messages that are sent to the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but messages
-           * to them have a destination service name.
-           */
-          if (receiver == NULL)
+          BusService *service;
+          DBusString str;
+
+          _dbus_string_init_const (&str, rule->d.receive.origin);
+          
+          service = bus_registry_lookup (registry, &str);
+          
+          if (service == NULL)
             {
-              if (!dbus_message_has_destination (message,
-                                                 rule->d.send.destination))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
+              _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
-          else
-            {
-              DBusString str;
-              BusService *service;
-              
-              _dbus_string_init_const (&str, rule->d.send.destination);
-              
-              service = bus_registry_lookup (registry, &str);
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
 
-              if (!bus_service_has_owner (service, receiver))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
+          if (!bus_service_has_owner (service, sender))
+            {
+              _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
         }
+    }
 
-      /* Use this rule */
-      allowed = rule->allow;
-      *log = rule->d.send.log;
-      (*toggles)++;
+  return TRUE;
+}
 
-      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
-                     allowed);
-    }
+static void
+check_receive_rule (BusPolicyRule  *rule,
+                    BusRegistry    *registry,
+                    dbus_bool_t     requested_reply,
+                    dbus_bool_t     eavesdropping,
+                    DBusConnection *sender,
+                    DBusMessage    *message,
+                    dbus_bool_t    *allowed,
+                    dbus_int32_t   *toggles)
+{
+  if (!receive_rule_applies (rule, registry, requested_reply, eavesdropping,
+                             sender, message))
+    return;
 
-  return allowed;
+  /* Use this rule */
+  *allowed = rule->allow;
+  (*toggles)++;
+
+  _dbus_verbose ("  (policy) used rule, allow now = %d\n",
+                 *allowed);
 }
 
 /* See docs on what the args mean on bus_context_check_security_policy()
@@ -1053,9 +1587,11 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
                                      DBusMessage     *message,
                                      dbus_int32_t    *toggles)
 {
-  DBusList *link;
+  BusPolicyRuleArray *array;
   dbus_bool_t allowed;
   dbus_bool_t eavesdropping;
+  dbus_bool_t have_key;
+  int type;
 
   eavesdropping =
     addressed_recipient != proposed_recipient &&
@@ -1067,176 +1603,55 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
 
   _dbus_verbose ("  (policy) checking receive rules, eavesdropping = %d\n", eavesdropping);
   *toggles = 0;
-  
-  allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
-    {
-      BusPolicyRule *rule = link->data;
-
-      link = _dbus_list_get_next_link (&policy->rules, link);      
-      
-      if (rule->type != BUS_POLICY_RULE_RECEIVE)
-        {
-          _dbus_verbose ("  (policy) skipping non-receive rule\n");
-          continue;
-        }
 
-      if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
-        {
-          if (dbus_message_get_type (message) != rule->d.receive.message_type)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
-              continue;
-            }
-        }
-
-      /* for allow, eavesdrop=false means the rule doesn't apply when
-       * eavesdropping. eavesdrop=true means always allow.
-       */
-      if (eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
-        {
-          _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
-          continue;
-        }
-
-      /* for deny, eavesdrop=true means the rule applies only when
-       * eavesdropping; eavesdrop=false means always deny.
-       */
-      if (!eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
-        {
-          _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
-          continue;
-        }
+  have_key = !policy->uncached &&
+    build_verdict_key (policy, 'r', requested_reply, eavesdropping,
+                       sender,
+                       dbus_message_get_sender (message),
+                       message);
 
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
-        {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
-            {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
+  if (have_key &&
+      lookup_verdict (policy, registry, &allowed, toggles, NULL))
+    return allowed;
+  
+  allowed = FALSE;
+  type = dbus_message_get_type (message);
 
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.receive.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.path != NULL)
-        {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.receive.path) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.interface != NULL)
-        {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
+  if (!policy->uncached &&
+      bus_client_policy_get_rules (policy, BUS_POLICY_RULE_RECEIVE, type, &array))
+    {
+      int i;
 
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface &&
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.receive.interface) != 0))
-            {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
-            }
-        }      
+      for (i = 0; i < array->n_rules; i++)
+        check_receive_rule (array->rules[i], registry, requested_reply,
+                            eavesdropping, sender, message,
+                            &allowed, toggles);
+    }
+  else
+    {
+      DBusList *link;
 
-      if (rule->d.receive.member != NULL)
+      for (link = _dbus_list_get_first_link (&policy->rules);
+           link != NULL;
+           link = _dbus_list_get_next_link (&policy->rules, link))
         {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.receive.member) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
-            }
-        }
+          BusPolicyRule *rule = link->data;
 
-      if (rule->d.receive.error != NULL)
-        {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.receive.error) != 0)
+          if (!rule_applies_to_message_type (rule, BUS_POLICY_RULE_RECEIVE, type))
             {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
+              _dbus_verbose ("  (policy) skipping rule for different message type or non-receive rule\n");
               continue;
             }
-        }
-      
-      if (rule->d.receive.origin != NULL)
-        {          
-          /* sender can be NULL for messages that originate from the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but will
-           * still set the sender on their messages.
-           */
-          if (sender == NULL)
-            {
-              if (!dbus_message_has_sender (message,
-                                            rule->d.receive.origin))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-            }
-          else
-            {
-              BusService *service;
-              DBusString str;
 
-              _dbus_string_init_const (&str, rule->d.receive.origin);
-              
-              service = bus_registry_lookup (registry, &str);
-              
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-
-              if (!bus_service_has_owner (service, sender))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-            }
+          check_receive_rule (rule, registry, requested_reply,
+                              eavesdropping, sender, message,
+                              &allowed, toggles);
         }
-      
-      /* Use this rule */
-      allowed = rule->allow;
-      (*toggles)++;
-
-      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
-                     allowed);
     }
 
+  if (have_key)
+    remember_verdict (policy, registry, allowed, *toggles, FALSE);
+
   return allowed;
 }
 
@@ -1309,5 +1724,24 @@ bus_policy_check_can_own (BusPolicy  *policy,
 {
   return bus_rules_check_can_own (policy->default_rules, service_name);
 }
+
+/* Makes send and receive checks walk the whole list of rules without
+ * remembering verdicts, as they do when the rules can't be compiled
+ */
+void
+bus_client_policy_set_uncached (BusClientPolicy *policy,
+                                dbus_bool_t      uncached)
+{
+  policy->uncached = uncached != FALSE;
+}
+
+int
+bus_client_policy_get_n_verdicts (BusClientPolicy *policy)
+{
+  if (policy->verdicts == NULL)
+    return 0;
+
+  return _dbus_hash_table_get_n_entries (policy->verdicts);
+}
 #endif /* DBUS_BUILD_TESTS */
 
@@ -57,12 +57,12 @@ struct BusPolicyRule
     {
       /* message type can be DBUS_MESSAGE_TYPE_INVALID meaning "any" */
       int   message_type;
-      /* any of these can be NULL meaning "any" */
-      char *path;
-      char *interface;
-      char *member;
-      char *error;
-      char *destination;
+      /* atoms; any of these can be NULL meaning "any" */
+      const char *path;
+      const char *interface;
+      const char *member;
+      const char *error;
+      const char *destination;
       unsigned int eavesdrop : 1;
       unsigned int requested_reply : 1;
       unsigned int log : 1;
@@ -72,12 +72,12 @@ struct BusPolicyRule
     {
       /* message type can be DBUS_MESSAGE_TYPE_INVALID meaning "any" */
       int   message_type;
-      /* any of these can be NULL meaning "any" */
-      char *path;
-      char *interface;
-      char *member;
-      char *error;
-      char *origin;
+      /* atoms; any of these can be NULL meaning "any" */
+      const char *path;
+      const char *interface;
+      const char *member;
+      const char *error;
+      const char *origin;
       unsigned int eavesdrop : 1;
       unsigned int requested_reply : 1;
     } receive;
@@ -85,7 +85,7 @@ struct BusPolicyRule
     struct
     {
       /* can be NULL meaning "any" */
-      char *service_name;
+      const char *service_name;
       /* if prefix is set, any name starting with service_name can be owned */
       unsigned int prefix : 1;
     } own;
@@ -117,7 +117,9 @@ BusClientPolicy* bus_policy_create_client_policy  (BusPolicy        *policy,
                                                    DBusConnection   *connection,
                                                    DBusError        *error);
 dbus_bool_t      bus_policy_allow_unix_user       (BusPolicy        *policy,
-                                                   unsigned long     uid);
+                                                   unsigned long     uid,
+                                                   const unsigned long *group_ids,
+                                                   int               n_group_ids);
 dbus_bool_t      bus_policy_allow_windows_user    (BusPolicy        *policy,
                                                    const char       *windows_sid);
 dbus_bool_t      bus_policy_append_default_rule   (BusPolicy        *policy,
@@ -164,6 +166,9 @@ void             bus_client_policy_optimize          (BusClientPolicy  *policy);
 #ifdef DBUS_BUILD_TESTS
 dbus_bool_t      bus_policy_check_can_own     (BusPolicy  *policy,
                                                const DBusString *service_name);
+void             bus_client_policy_set_uncached   (BusClientPolicy *policy,
+                                                   dbus_bool_t      uncached);
+int              bus_client_policy_get_n_verdicts (BusClientPolicy *policy);
 #endif
 
 #endif /* BUS_POLICY_H */
@@ -36,13 +36,14 @@
 #include "policy.h"
 #include "bus.h"
 #include "selinux.h"
+#include "atoms.h"
 
 struct BusService
 {
   int refcount;
 
   BusRegistry *registry;
-  char *name;
+  const char *name; /**< An atom, shared with match rules and policies */
   DBusList *owners;
 };
 
@@ -68,8 +69,30 @@ struct BusRegistry
   DBusMemPool   *owner_pool;
 
   DBusHashTable *service_sid_table;
+
+  dbus_uint32_t owners_serial; /**< bumped whenever any name gains or loses an owner */
 };
 
+static void
+bus_registry_owners_changed (BusRegistry *registry)
+{
+  registry->owners_serial += 1;
+}
+
+/**
+ * Gets a number that changes whenever a connection is added to or
+ * removed from any name's queue of owners, so callers can tell when
+ * anything they worked out from bus_service_has_owner() is stale.
+ *
+ * @param registry the registry
+ * @returns the current serial
+ */
+dbus_uint32_t
+bus_registry_get_owners_serial (BusRegistry *registry)
+{
+  return registry->owners_serial;
+}
+
 BusRegistry*
 bus_registry_new (BusContext *context)
 {
@@ -267,17 +290,13 @@ bus_registry_ensure (BusRegistry               *registry,
   service->registry = registry;  
   service->refcount = 1;
 
-  _dbus_verbose ("copying string %p '%s' to service->name\n",
-                 service_name, _dbus_string_get_const_data (service_name));
-  if (!_dbus_string_copy_data (service_name, &service->name))
+  service->name = bus_atom_intern (_dbus_string_get_const_data (service_name));
+  if (service->name == NULL)
     {
       _dbus_mem_pool_dealloc (registry->service_pool, service);
       BUS_SET_OOM (error);
       return NULL;
     }
-  _dbus_verbose ("copied string %p '%s' to '%s'\n",
-                 service_name, _dbus_string_get_const_data (service_name),
-                 service->name);
 
   if (!bus_driver_send_service_owner_changed (service->name, 
 					      NULL,
@@ -303,7 +322,7 @@ bus_registry_ensure (BusRegistry               *registry,
     }
   
   if (!_dbus_hash_table_insert_string (registry->service_hash,
-                                       service->name,
+                                       (char *) service->name,
                                        service))
     {
       /* The add_owner gets reverted on transaction cancel */
@@ -330,48 +349,47 @@ bus_registry_foreach (BusRegistry               *registry,
     }
 }
 
+/**
+ * Appends the names owned on the bus to an array of strings that is
+ * being built in a message, straight from the registry without
+ * copying them first.
+ *
+ * @param registry the registry
+ * @param array iterator for an open array of strings
+ * @param prefix only names starting with this are appended
+ * @param unique whether to append unique names
+ * @param well_known whether to append well-known names
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_registry_list_services (BusRegistry *registry,
-                            char      ***listp,
-                            int         *array_len)
+bus_registry_append_names (BusRegistry     *registry,
+                           DBusMessageIter *array,
+                           const char      *prefix,
+                           dbus_bool_t      unique,
+                           dbus_bool_t      well_known)
 {
-  int i, j, len;
-  char **retval;
   DBusHashIter iter;
-   
-  len = _dbus_hash_table_get_n_entries (registry->service_hash);
-  retval = dbus_new (char *, len + 1);
+  size_t prefix_len;
 
-  if (retval == NULL)
-    return FALSE;
+  prefix_len = strlen (prefix);
 
   _dbus_hash_iter_init (registry->service_hash, &iter);
-  i = 0;
   while (_dbus_hash_iter_next (&iter))
     {
       BusService *service = _dbus_hash_iter_get_value (&iter);
 
-      retval[i] = _dbus_strdup (service->name);
-      if (retval[i] == NULL)
-	goto error;
+      if (service->name[0] == ':' ? !unique : !well_known)
+        continue;
 
-      i++;
+      if (strncmp (service->name, prefix, prefix_len) != 0)
+        continue;
+
+      if (!dbus_message_iter_append_basic (array, DBUS_TYPE_STRING,
+                                           &service->name))
+        return FALSE;
     }
 
-  retval[i] = NULL;
-  
-  if (array_len)
-    *array_len = len;
-  
-  *listp = retval;
   return TRUE;
-  
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
 }
 
 dbus_bool_t
@@ -537,6 +555,7 @@ bus_registry_acquire_service (BusRegistry      *registry,
           temp_owner = (BusOwner *)link->data;
           bus_owner_unref (temp_owner); 
           _dbus_list_free_link (link);
+          bus_registry_owners_changed (registry);
         }
       
       *result = DBUS_REQUEST_NAME_REPLY_EXISTS;
@@ -707,6 +726,7 @@ bus_service_unlink_owner (BusService      *service,
 {
   _dbus_list_remove_last (&service->owners, owner);
   bus_owner_unref (owner);
+  bus_registry_owners_changed (service->registry);
 }
 
 static void
@@ -733,7 +753,7 @@ bus_service_relink (BusService           *service,
 
   _dbus_hash_table_insert_string_preallocated (service->registry->service_hash,
                                                preallocated,
-                                               service->name,
+                                               (char *) service->name,
                                                service);
   
   bus_service_ref (service);
@@ -859,6 +879,8 @@ bus_service_add_owner (BusService     *service,
               return FALSE;
             }
         }      
+
+      bus_registry_owners_changed (service->registry);
     } 
   else 
     {
@@ -936,6 +958,7 @@ restore_ownership (void *data)
     }
   
   _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  bus_registry_owners_changed (d->service->registry);
 
   /* Note that removing then restoring this changes the order in which
    * ServiceDeleted messages are sent on destruction of the
@@ -1133,6 +1156,7 @@ bus_service_remove_owner (BusService     *service,
       temp_owner = (BusOwner *)link->data;
       bus_owner_unref (temp_owner); 
       _dbus_list_free_link (link);
+      bus_registry_owners_changed (service->registry);
 
       return TRUE; 
     }
@@ -1211,7 +1235,7 @@ bus_service_unref (BusService *service)
     {
       _dbus_assert (service->owners == NULL);
       
-      dbus_free (service->name);
+      bus_atom_unref (service->name);
       _dbus_mem_pool_dealloc (service->registry->service_pool, service);
     }
 }
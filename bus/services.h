@@ -47,9 +47,11 @@ BusService*  bus_registry_ensure          (BusRegistry                 *registry
 void         bus_registry_foreach         (BusRegistry                 *registry,
                                            BusServiceForeachFunction    function,
                                            void                        *data);
-dbus_bool_t  bus_registry_list_services   (BusRegistry                 *registry,
-                                           char                      ***listp,
-                                           int                         *array_len);
+dbus_bool_t  bus_registry_append_names    (BusRegistry                 *registry,
+                                           DBusMessageIter             *array,
+                                           const char                  *prefix,
+                                           dbus_bool_t                  unique,
+                                           dbus_bool_t                  well_known);
 dbus_bool_t  bus_registry_acquire_service (BusRegistry                 *registry,
                                            DBusConnection              *connection,
                                            const DBusString            *service_name,
@@ -65,6 +67,7 @@ dbus_bool_t  bus_registry_release_service (BusRegistry                 *registry
                                            DBusError                   *error);
 dbus_bool_t  bus_registry_set_service_context_table (BusRegistry           *registry,
 						     DBusHashTable         *table);
+dbus_uint32_t bus_registry_get_owners_serial (BusRegistry                *registry);
 
 BusService*     bus_service_ref                       (BusService     *service);
 void            bus_service_unref                     (BusService     *service);
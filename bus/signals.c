@@ -25,7 +25,9 @@
 #include "signals.h"
 #include "services.h"
 #include "utils.h"
+#include "atoms.h"
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
 
 struct BusMatchRule
 {
@@ -36,11 +38,14 @@ struct BusMatchRule
   unsigned int flags; /**< BusMatchFlags */
 
   int   message_type;
-  char *interface;
-  char *member;
-  char *sender;
-  char *destination;
-  char *path;
+
+  /* These are atoms, so rules share them and can compare them by
+   * address */
+  const char *interface;
+  const char *member;
+  const char *sender;
+  const char *destination;
+  const char *path;
 
   unsigned int *arg_lens;
   char **args;
@@ -89,11 +94,11 @@ bus_match_rule_unref (BusMatchRule *rule)
   rule->refcount -= 1;
   if (rule->refcount == 0)
     {
-      dbus_free (rule->interface);
-      dbus_free (rule->member);
-      dbus_free (rule->sender);
-      dbus_free (rule->destination);
-      dbus_free (rule->path);
+      bus_atom_unref (rule->interface);
+      bus_atom_unref (rule->member);
+      bus_atom_unref (rule->sender);
+      bus_atom_unref (rule->destination);
+      bus_atom_unref (rule->path);
       dbus_free (rule->arg_lens);
 
       /* can't use dbus_free_string_array() since there
@@ -296,16 +301,16 @@ dbus_bool_t
 bus_match_rule_set_interface (BusMatchRule *rule,
                               const char   *interface)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (interface != NULL);
 
-  new = _dbus_strdup (interface);
+  new = bus_atom_intern (interface);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_INTERFACE;
-  dbus_free (rule->interface);
+  bus_atom_unref (rule->interface);
   rule->interface = new;
 
   return TRUE;
@@ -315,16 +320,16 @@ dbus_bool_t
 bus_match_rule_set_member (BusMatchRule *rule,
                            const char   *member)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (member != NULL);
 
-  new = _dbus_strdup (member);
+  new = bus_atom_intern (member);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_MEMBER;
-  dbus_free (rule->member);
+  bus_atom_unref (rule->member);
   rule->member = new;
 
   return TRUE;
@@ -334,16 +339,16 @@ dbus_bool_t
 bus_match_rule_set_sender (BusMatchRule *rule,
                            const char   *sender)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (sender != NULL);
 
-  new = _dbus_strdup (sender);
+  new = bus_atom_intern (sender);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_SENDER;
-  dbus_free (rule->sender);
+  bus_atom_unref (rule->sender);
   rule->sender = new;
 
   return TRUE;
@@ -353,16 +358,16 @@ dbus_bool_t
 bus_match_rule_set_destination (BusMatchRule *rule,
                                 const char   *destination)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (destination != NULL);
 
-  new = _dbus_strdup (destination);
+  new = bus_atom_intern (destination);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_DESTINATION;
-  dbus_free (rule->destination);
+  bus_atom_unref (rule->destination);
   rule->destination = new;
 
   return TRUE;
@@ -383,11 +388,11 @@ bus_match_rule_set_path (BusMatchRule *rule,
                          const char   *path,
                          dbus_bool_t   is_namespace)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (path != NULL);
 
-  new = _dbus_strdup (path);
+  new = bus_atom_intern (path);
   if (new == NULL)
     return FALSE;
 
@@ -398,7 +403,7 @@ bus_match_rule_set_path (BusMatchRule *rule,
   else
     rule->flags |= BUS_MATCH_PATH;
 
-  dbus_free (rule->path);
+  bus_atom_unref (rule->path);
   rule->path = new;
 
   return TRUE;
@@ -1120,14 +1125,49 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
   return rule;
 }
 
+/* Match rules are indexed by those of their features that can be looked
+ * up by exact value: interface, member, path, sender (only when it is a
+ * unique name or the bus driver, since their ownership never changes) and
+ * a literal string arg0. Rules that use the same set of such features
+ * share a RuleIndex, in which they are hashed by those values joined into
+ * a single string. Dispatching a message then costs one hash lookup per
+ * distinct set of features in use, plus one match_rule_matches() for each
+ * rule in the buckets that were hit, rather than a match_rule_matches()
+ * for every rule on the bus.
+ */
+#define BUS_MATCH_INDEX_KEYS (BUS_MATCH_INTERFACE | \
+                              BUS_MATCH_MEMBER | \
+                              BUS_MATCH_SENDER | \
+                              BUS_MATCH_PATH | \
+                              BUS_MATCH_ARGS)
+
+typedef struct
+{
+  /* Atoms; for a message, NULL if it has no such field or if no atom
+   * (so no rule) has the field's value */
+  const char *interface;
+  const char *member;
+  const char *path;
+
+  const char *sender;
+  const char *arg0;
+} MatchKeyValues;
+
+typedef struct RuleIndex RuleIndex;
+struct RuleIndex
+{
+  /* Subset of BUS_MATCH_INDEX_KEYS; BUS_MATCH_ARGS stands for arg0 only */
+  BusMatchFlags keys;
+
+  /* Maps keys built by append_index_key() to non-NULL (DBusList **)s */
+  DBusHashTable *rules_by_key;
+};
+
 typedef struct RulePool RulePool;
 struct RulePool
 {
-  /* Maps non-NULL interface names to non-NULL (DBusList **)s */
-  DBusHashTable *rules_by_iface;
-
-  /* List of BusMatchRules which don't specify an interface */
-  DBusList *rules_without_iface;
+  /* List of RuleIndex, one for each distinct set of keys in use */
+  DBusList *indexes;
 };
 
 struct BusMatchmaker
@@ -1139,8 +1179,145 @@ struct BusMatchmaker
    * type.
    */
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Scratch space for the key most recently built by
+   * bus_matchmaker_get_rules() or bus_matchmaker_get_recipients()
+   */
+  DBusString key;
 };
 
+static BusMatchFlags
+match_rule_get_index_keys (BusMatchRule *rule)
+{
+  BusMatchFlags keys;
+
+  keys = rule->flags & (BUS_MATCH_INTERFACE | BUS_MATCH_MEMBER |
+                        BUS_MATCH_PATH);
+
+  if ((rule->flags & BUS_MATCH_SENDER) &&
+      (*rule->sender == ':' || strcmp (rule->sender, DBUS_SERVICE_DBUS) == 0))
+    keys |= BUS_MATCH_SENDER;
+
+  if ((rule->flags & BUS_MATCH_ARGS) &&
+      rule->args_len > 0 &&
+      rule->args[0] != NULL &&
+      (rule->arg_lens[0] & BUS_MATCH_ARG_FLAGS) == 0)
+    keys |= BUS_MATCH_ARGS;
+
+  return keys;
+}
+
+static void
+match_key_values_init_from_rule (MatchKeyValues *values,
+                                 BusMatchRule   *rule,
+                                 BusMatchFlags   keys)
+{
+  values->interface = (keys & BUS_MATCH_INTERFACE) ? rule->interface : NULL;
+  values->member = (keys & BUS_MATCH_MEMBER) ? rule->member : NULL;
+  values->sender = (keys & BUS_MATCH_SENDER) ? rule->sender : NULL;
+  values->path = (keys & BUS_MATCH_PATH) ? rule->path : NULL;
+  values->arg0 = (keys & BUS_MATCH_ARGS) ? rule->args[0] : NULL;
+}
+
+static const char *
+message_field_atom (DBusMessage *message,
+                    int          field)
+{
+  const char *value;
+  unsigned int hash;
+
+  if (!_dbus_message_get_header_string (message, field, &value, NULL, &hash))
+    return NULL;
+
+  return bus_atom_lookup_hashed (value, hash);
+}
+
+static void
+match_key_values_init_from_message (MatchKeyValues *values,
+                                    DBusConnection *sender,
+                                    DBusMessage    *message)
+{
+  DBusMessageIter iter;
+
+  values->interface = message_field_atom (message, DBUS_HEADER_FIELD_INTERFACE);
+  values->member = message_field_atom (message, DBUS_HEADER_FIELD_MEMBER);
+  values->path = message_field_atom (message, DBUS_HEADER_FIELD_PATH);
+
+  /* Only the name that match_rule_matches() would compare a unique-name
+   * or bus-driver sender rule against; NULL if the sender has no unique
+   * name yet, in which case no such rule can match.
+   */
+  if (sender == NULL)
+    values->sender = DBUS_SERVICE_DBUS;
+  else
+    values->sender = bus_connection_get_name (sender);
+
+  values->arg0 = NULL;
+  dbus_message_iter_init (message, &iter);
+  if (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING)
+    dbus_message_iter_get_basic (&iter, &values->arg0);
+}
+
+static dbus_bool_t
+match_key_values_have_keys (const MatchKeyValues *values,
+                            BusMatchFlags         keys)
+{
+  if ((keys & BUS_MATCH_INTERFACE) && values->interface == NULL)
+    return FALSE;
+
+  if ((keys & BUS_MATCH_MEMBER) && values->member == NULL)
+    return FALSE;
+
+  if ((keys & BUS_MATCH_SENDER) && values->sender == NULL)
+    return FALSE;
+
+  if ((keys & BUS_MATCH_PATH) && values->path == NULL)
+    return FALSE;
+
+  if ((keys & BUS_MATCH_ARGS) && values->arg0 == NULL)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Interface, member, bus names and paths can't contain a space, and arg0
+ * goes last, so joining the values with spaces can't be ambiguous within
+ * one RuleIndex.
+ */
+static dbus_bool_t
+append_index_key (DBusString           *key,
+                  BusMatchFlags         keys,
+                  const MatchKeyValues *values)
+{
+  _dbus_assert (match_key_values_have_keys (values, keys));
+
+  if ((keys & BUS_MATCH_INTERFACE) &&
+      !(_dbus_string_append (key, values->interface) &&
+        _dbus_string_append_byte (key, ' ')))
+    return FALSE;
+
+  if ((keys & BUS_MATCH_MEMBER) &&
+      !(_dbus_string_append (key, values->member) &&
+        _dbus_string_append_byte (key, ' ')))
+    return FALSE;
+
+  if ((keys & BUS_MATCH_SENDER) &&
+      !(_dbus_string_append (key, values->sender) &&
+        _dbus_string_append_byte (key, ' ')))
+    return FALSE;
+
+  if ((keys & BUS_MATCH_PATH) &&
+      !(_dbus_string_append (key, values->path) &&
+        _dbus_string_append_byte (key, ' ')))
+    return FALSE;
+
+  if ((keys & BUS_MATCH_ARGS) &&
+      !_dbus_string_append (key, values->arg0))
+    return FALSE;
+
+  return TRUE;
+}
+
 static void
 rule_list_free (DBusList **rules)
 {
@@ -1167,127 +1344,210 @@ rule_list_ptr_free (DBusList **list)
     }
 }
 
+static void
+rule_index_free (RuleIndex *index)
+{
+  _dbus_hash_table_unref (index->rules_by_key);
+  dbus_free (index);
+}
+
+static void
+rule_pool_free (RulePool *p)
+{
+  RuleIndex *index;
+
+  while ((index = _dbus_list_pop_first (&p->indexes)))
+    rule_index_free (index);
+}
+
 BusMatchmaker*
 bus_matchmaker_new (void)
 {
   BusMatchmaker *matchmaker;
-  int i;
 
   matchmaker = dbus_new0 (BusMatchmaker, 1);
   if (matchmaker == NULL)
     return NULL;
 
+  if (!_dbus_string_init (&matchmaker->key))
+    {
+      dbus_free (matchmaker);
+      return NULL;
+    }
+
   matchmaker->refcount = 1;
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  return matchmaker;
+}
+
+static RuleIndex *
+rule_pool_get_index (RulePool      *p,
+                     BusMatchFlags  keys,
+                     dbus_bool_t    create)
+{
+  DBusList *link;
+  RuleIndex *index;
+
+  link = _dbus_list_get_first_link (&p->indexes);
+  while (link != NULL)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
+      index = link->data;
 
-      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
-          dbus_free, (DBusFreeFunction) rule_list_ptr_free);
+      if (index->keys == keys)
+        return index;
 
-      if (p->rules_by_iface == NULL)
-        goto nomem;
+      link = _dbus_list_get_next_link (&p->indexes, link);
     }
 
-  return matchmaker;
+  if (!create)
+    return NULL;
 
- nomem:
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  index = dbus_new0 (RuleIndex, 1);
+  if (index == NULL)
+    return NULL;
+
+  index->keys = keys;
+  index->rules_by_key = _dbus_hash_table_new (DBUS_HASH_STRING,
+      dbus_free, (DBusFreeFunction) rule_list_ptr_free);
+
+  if (index->rules_by_key == NULL)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
+      dbus_free (index);
+      return NULL;
+    }
 
-      if (p->rules_by_iface == NULL)
-        break;
-      else
-        _dbus_hash_table_unref (p->rules_by_iface);
+  if (!_dbus_list_append (&p->indexes, index))
+    {
+      rule_index_free (index);
+      return NULL;
     }
-  dbus_free (matchmaker);
 
-  return NULL;
+  return index;
 }
 
-static DBusList **
+/* Finds the list that @rule belongs in, creating it if @create is set,
+ * and leaves its key in matchmaker->key for bus_matchmaker_gc_rules().
+ * Returns FALSE if out of memory; otherwise *rules_p is NULL if there
+ * is no such list and @create isn't set.
+ */
+static dbus_bool_t
 bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
-                          int            message_type,
-                          const char    *interface,
-                          dbus_bool_t    create)
+                          BusMatchRule  *rule,
+                          dbus_bool_t    create,
+                          DBusList    ***rules_p,
+                          RuleIndex    **index_p)
 {
   RulePool *p;
+  RuleIndex *index;
+  MatchKeyValues values;
+  BusMatchFlags keys;
+  DBusList **list;
+  const char *key;
+  dbus_bool_t retval;
+
+  _dbus_assert (rule->message_type >= 0);
+  _dbus_assert (rule->message_type < DBUS_NUM_MESSAGE_TYPES);
 
-  _dbus_assert (message_type >= 0);
-  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+  p = matchmaker->rules_by_type + rule->message_type;
+  keys = match_rule_get_index_keys (rule);
 
-  _dbus_verbose ("Looking up rules for message_type %d, interface %s\n",
-                 message_type,
-                 interface != NULL ? interface : "<null>");
+  _dbus_verbose ("Looking up rules for message_type %d, keys 0x%x\n",
+                 rule->message_type, keys);
+
+  *rules_p = NULL;
+  *index_p = NULL;
+
+  index = rule_pool_get_index (p, keys, create);
+  if (index == NULL)
+    return !create;
+
+  *index_p = index;
+  retval = FALSE;
 
-  p = matchmaker->rules_by_type + message_type;
+  match_key_values_init_from_rule (&values, rule, keys);
+  _dbus_string_set_length (&matchmaker->key, 0);
 
-  if (interface == NULL)
+  if (!append_index_key (&matchmaker->key, keys, &values))
     {
-      return &p->rules_without_iface;
+      list = NULL;
+      goto out;
     }
-  else
-    {
-      DBusList **list;
 
-      list = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
+  key = _dbus_string_get_const_data (&matchmaker->key);
+  list = _dbus_hash_table_lookup_string (index->rules_by_key, key);
 
-      if (list == NULL && create)
-        {
-          char *dupped_interface;
+  if (list == NULL && create)
+    {
+      char *dupped_key;
 
-          list = dbus_new0 (DBusList *, 1);
-          if (list == NULL)
-            return NULL;
+      list = dbus_new0 (DBusList *, 1);
+      if (list == NULL)
+        goto out;
 
-          dupped_interface = _dbus_strdup (interface);
-          if (dupped_interface == NULL)
-            {
-              dbus_free (list);
-              return NULL;
-            }
+      dupped_key = _dbus_strdup (key);
+      if (dupped_key == NULL)
+        {
+          dbus_free (list);
+          list = NULL;
+          goto out;
+        }
 
-          _dbus_verbose ("Adding list for type %d, iface %s\n", message_type,
-                         interface);
+      _dbus_verbose ("Adding list for type %d, key \"%s\"\n",
+                     rule->message_type, key);
 
-          if (!_dbus_hash_table_insert_string (p->rules_by_iface,
-                                               dupped_interface, list))
-            {
-              dbus_free (list);
-              dbus_free (dupped_interface);
-              return NULL;
-            }
+      if (!_dbus_hash_table_insert_string (index->rules_by_key,
+                                           dupped_key, list))
+        {
+          dbus_free (list);
+          dbus_free (dupped_key);
+          list = NULL;
+          goto out;
         }
+    }
 
-      return list;
+  retval = TRUE;
+  *rules_p = list;
+
+ out:
+  /* don't leave an index we just created with nothing in it */
+  if (list == NULL && _dbus_hash_table_get_n_entries (index->rules_by_key) == 0)
+    {
+      _dbus_list_remove (&p->indexes, index);
+      rule_index_free (index);
+      *index_p = NULL;
     }
+
+  return retval;
 }
 
 static void
 bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
                          int            message_type,
-                         const char    *interface,
+                         RuleIndex     *index,
                          DBusList     **rules)
 {
   RulePool *p;
-
-  if (interface == NULL)
-    return;
+  const char *key;
 
   if (*rules != NULL)
     return;
 
-  _dbus_verbose ("GCing HT entry for message_type %u, interface %s\n",
-                 message_type, interface);
+  key = _dbus_string_get_const_data (&matchmaker->key);
 
-  p = matchmaker->rules_by_type + message_type;
+  _dbus_verbose ("GCing HT entry for message_type %u, key \"%s\"\n",
+                 message_type, key);
 
-  _dbus_assert (_dbus_hash_table_lookup_string (p->rules_by_iface, interface)
+  _dbus_assert (_dbus_hash_table_lookup_string (index->rules_by_key, key)
       == rules);
 
-  _dbus_hash_table_remove_string (p->rules_by_iface, interface);
+  _dbus_hash_table_remove_string (index->rules_by_key, key);
+
+  if (_dbus_hash_table_get_n_entries (index->rules_by_key) == 0)
+    {
+      p = matchmaker->rules_by_type + message_type;
+      _dbus_list_remove (&p->indexes, index);
+      rule_index_free (index);
+    }
 }
 
 BusMatchmaker *
@@ -1311,13 +1571,9 @@ bus_matchmaker_unref (BusMatchmaker *matchmaker)
       int i;
 
       for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
-        {
-          RulePool *p = matchmaker->rules_by_type + i;
-
-          _dbus_hash_table_unref (p->rules_by_iface);
-          rule_list_free (&p->rules_without_iface);
-        }
+        rule_pool_free (matchmaker->rules_by_type + i);
 
+      _dbus_string_free (&matchmaker->key);
       dbus_free (matchmaker);
     }
 }
@@ -1328,6 +1584,7 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
                          BusMatchRule    *rule)
 {
   DBusList **rules;
+  RuleIndex *index;
 
   _dbus_assert (bus_connection_is_active (rule->matches_go_to));
 
@@ -1335,20 +1592,21 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, TRUE);
-
-  if (rules == NULL)
+  if (!bus_matchmaker_get_rules (matchmaker, rule, TRUE, &rules, &index))
     return FALSE;
 
+  _dbus_assert (rules != NULL);
+
   if (!_dbus_list_append (rules, rule))
-    return FALSE;
+    {
+      bus_matchmaker_gc_rules (matchmaker, rule->message_type, index, rules);
+      return FALSE;
+    }
 
   if (!bus_connection_add_match_rule (rule->matches_go_to, rule))
     {
       _dbus_list_remove_last (rules, rule);
-      bus_matchmaker_gc_rules (matchmaker, rule->message_type,
-                               rule->interface, rules);
+      bus_matchmaker_gc_rules (matchmaker, rule->message_type, index, rules);
       return FALSE;
     }
 
@@ -1382,23 +1640,23 @@ match_rule_equal (BusMatchRule *a,
     return FALSE;
 
   if ((a->flags & BUS_MATCH_MEMBER) &&
-      strcmp (a->member, b->member) != 0)
+      a->member != b->member)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_PATH) &&
-      strcmp (a->path, b->path) != 0)
+      a->path != b->path)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_INTERFACE) &&
-      strcmp (a->interface, b->interface) != 0)
+      a->interface != b->interface)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_SENDER) &&
-      strcmp (a->sender, b->sender) != 0)
+      a->sender != b->sender)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_DESTINATION) &&
-      strcmp (a->destination, b->destination) != 0)
+      a->destination != b->destination)
     return FALSE;
 
   /* we already compared the value of flags, and
@@ -1465,6 +1723,7 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                             BusMatchRule    *rule)
 {
   DBusList **rules;
+  RuleIndex *index;
 
   _dbus_verbose ("Removing rule with message_type %d, interface %s\n",
                  rule->message_type,
@@ -1472,17 +1731,19 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
 
   bus_connection_remove_match_rule (rule->matches_go_to, rule);
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, FALSE);
-
   /* We should only be asked to remove a rule by identity right after it was
-   * added, so there should be a list for it.
+   * added, so there should be a list for it. The key was already built when
+   * the rule was added, so building it again can't run out of memory.
    */
-  _dbus_assert (rules != NULL);
+  if (!bus_matchmaker_get_rules (matchmaker, rule, FALSE, &rules, &index) ||
+      rules == NULL)
+    {
+      _dbus_assert_not_reached ("no list for a rule that was added");
+      return;
+    }
 
   _dbus_list_remove (rules, rule);
-  bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
-      rules);
+  bus_matchmaker_gc_rules (matchmaker, rule->message_type, index, rules);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1505,13 +1766,17 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
 {
   DBusList **rules;
   DBusList *link = NULL;
+  RuleIndex *index;
 
   _dbus_verbose ("Removing rule by value with message_type %d, interface %s\n",
                  value->message_type,
                  value->interface != NULL ? value->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, value->message_type,
-      value->interface, FALSE);
+  if (!bus_matchmaker_get_rules (matchmaker, value, FALSE, &rules, &index))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
 
   if (rules != NULL)
     {
@@ -1544,8 +1809,7 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
       return FALSE;
     }
 
-  bus_matchmaker_gc_rules (matchmaker, value->message_type, value->interface,
-      rules);
+  bus_matchmaker_gc_rules (matchmaker, value->message_type, index, rules);
 
   return TRUE;
 }
@@ -1615,19 +1879,33 @@ bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
   for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
       RulePool *p = matchmaker->rules_by_type + i;
-      DBusHashIter iter;
+      DBusList *link;
 
-      rule_list_remove_by_connection (&p->rules_without_iface, connection);
-
-      _dbus_hash_iter_init (p->rules_by_iface, &iter);
-      while (_dbus_hash_iter_next (&iter))
+      link = _dbus_list_get_first_link (&p->indexes);
+      while (link != NULL)
         {
-          DBusList **items = _dbus_hash_iter_get_value (&iter);
+          RuleIndex *index = link->data;
+          DBusList *next = _dbus_list_get_next_link (&p->indexes, link);
+          DBusHashIter iter;
+
+          _dbus_hash_iter_init (index->rules_by_key, &iter);
+          while (_dbus_hash_iter_next (&iter))
+            {
+              DBusList **items = _dbus_hash_iter_get_value (&iter);
+
+              rule_list_remove_by_connection (items, connection);
+
+              if (*items == NULL)
+                _dbus_hash_iter_remove_entry (&iter);
+            }
 
-          rule_list_remove_by_connection (items, connection);
+          if (_dbus_hash_table_get_n_entries (index->rules_by_key) == 0)
+            {
+              _dbus_list_remove_link (&p->indexes, link);
+              rule_index_free (index);
+            }
 
-          if (*items == NULL)
-            _dbus_hash_iter_remove_entry (&iter);
+          link = next;
         }
     }
 }
@@ -1664,12 +1942,14 @@ str_has_prefix (const char *str, const char *prefix)
     return FALSE;
 }
 
+/* values must have come from match_key_values_init_from_message() */
 static dbus_bool_t
-match_rule_matches (BusMatchRule    *rule,
-                    DBusConnection  *sender,
-                    DBusConnection  *addressed_recipient,
-                    DBusMessage     *message,
-                    BusMatchFlags    already_matched)
+match_rule_matches (BusMatchRule         *rule,
+                    const MatchKeyValues *values,
+                    DBusConnection       *sender,
+                    DBusConnection       *addressed_recipient,
+                    DBusMessage          *message,
+                    BusMatchFlags         already_matched)
 {
   dbus_bool_t wants_to_eavesdrop = FALSE;
   int flags;
@@ -1699,29 +1979,17 @@ match_rule_matches (BusMatchRule    *rule,
 
   if (flags & BUS_MATCH_INTERFACE)
     {
-      const char *iface;
-
       _dbus_assert (rule->interface != NULL);
 
-      iface = dbus_message_get_interface (message);
-      if (iface == NULL)
-        return FALSE;
-
-      if (strcmp (iface, rule->interface) != 0)
+      if (values->interface != rule->interface)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_MEMBER)
     {
-      const char *member;
-
       _dbus_assert (rule->member != NULL);
 
-      member = dbus_message_get_member (message);
-      if (member == NULL)
-        return FALSE;
-
-      if (strcmp (member, rule->member) != 0)
+      if (values->member != rule->member)
         return FALSE;
     }
 
@@ -1804,15 +2072,9 @@ match_rule_matches (BusMatchRule    *rule,
 
   if (flags & BUS_MATCH_PATH)
     {
-      const char *path;
-
       _dbus_assert (rule->path != NULL);
 
-      path = dbus_message_get_path (message);
-      if (path == NULL)
-        return FALSE;
-
-      if (strcmp (path, rule->path) != 0)
+      if (values->path != rule->path)
         return FALSE;
     }
 
@@ -1940,11 +2202,13 @@ match_rule_matches (BusMatchRule    *rule,
 }
 
 static dbus_bool_t
-get_recipients_from_list (DBusList       **rules,
-                          DBusConnection  *sender,
-                          DBusConnection  *addressed_recipient,
-                          DBusMessage     *message,
-                          DBusList       **recipients_p)
+get_recipients_from_list (DBusList            **rules,
+                          const MatchKeyValues *values,
+                          DBusConnection       *sender,
+                          DBusConnection       *addressed_recipient,
+                          DBusMessage          *message,
+                          BusMatchFlags         already_matched,
+                          DBusList            **recipients_p)
 {
   DBusList *link;
 
@@ -1968,9 +2232,9 @@ get_recipients_from_list (DBusList       **rules,
       }
 #endif
 
-      if (match_rule_matches (rule,
+      if (match_rule_matches (rule, values,
                               sender, addressed_recipient, message,
-                              BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE))
+                              already_matched))
         {
           _dbus_verbose ("Rule matched\n");
 
@@ -1994,6 +2258,50 @@ get_recipients_from_list (DBusList       **rules,
   return TRUE;
 }
 
+static dbus_bool_t
+get_recipients_from_pool (BusMatchmaker        *matchmaker,
+                          RulePool             *p,
+                          const MatchKeyValues *values,
+                          DBusConnection       *sender,
+                          DBusConnection       *addressed_recipient,
+                          DBusMessage          *message,
+                          DBusList            **recipients_p)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&p->indexes);
+  while (link != NULL)
+    {
+      RuleIndex *index = link->data;
+
+      /* If the message lacks one of the keys, no rule in here can match */
+      if (match_key_values_have_keys (values, index->keys))
+        {
+          DBusList **rules;
+
+          _dbus_string_set_length (&matchmaker->key, 0);
+          if (!append_index_key (&matchmaker->key, index->keys, values))
+            return FALSE;
+
+          rules = _dbus_hash_table_lookup_string (index->rules_by_key,
+              _dbus_string_get_const_data (&matchmaker->key));
+
+          /* arg0 is only one of the args the rule might check */
+          if (!get_recipients_from_list (rules, values,
+                                         sender, addressed_recipient,
+                                         message,
+                                         BUS_MATCH_MESSAGE_TYPE |
+                                         (index->keys & ~BUS_MATCH_ARGS),
+                                         recipients_p))
+            return FALSE;
+        }
+
+      link = _dbus_list_get_next_link (&p->indexes, link);
+    }
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
                                BusConnections  *connections,
@@ -2003,8 +2311,7 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
                                DBusList       **recipients_p)
 {
   int type;
-  const char *interface;
-  DBusList **neither, **just_type, **just_iface, **both;
+  MatchKeyValues values;
 
   _dbus_assert (*recipients_p == NULL);
 
@@ -2022,38 +2329,27 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
     bus_connection_mark_stamp (addressed_recipient);
 
   type = dbus_message_get_type (message);
-  interface = dbus_message_get_interface (message);
-
-  neither = bus_matchmaker_get_rules (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
-      NULL, FALSE);
-  just_type = just_iface = both = NULL;
+  match_key_values_init_from_message (&values, sender, message);
 
-  if (interface != NULL)
-    just_iface = bus_matchmaker_get_rules (matchmaker,
-        DBUS_MESSAGE_TYPE_INVALID, interface, FALSE);
-
-  if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES)
-    {
-      just_type = bus_matchmaker_get_rules (matchmaker, type, NULL, FALSE);
-
-      if (interface != NULL)
-        both = bus_matchmaker_get_rules (matchmaker, type, interface, FALSE);
-    }
+  if (!get_recipients_from_pool (matchmaker,
+                                 matchmaker->rules_by_type +
+                                 DBUS_MESSAGE_TYPE_INVALID,
+                                 &values, sender, addressed_recipient,
+                                 message, recipients_p))
+    goto nomem;
 
-  if (!(get_recipients_from_list (neither, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_iface, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_type, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (both, sender, addressed_recipient,
-                                  message, recipients_p)))
-    {
-      _dbus_list_clear (recipients_p);
-      return FALSE;
-    }
+  if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES &&
+      !get_recipients_from_pool (matchmaker,
+                                 matchmaker->rules_by_type + type,
+                                 &values, sender, addressed_recipient,
+                                 message, recipients_p))
+    goto nomem;
 
   return TRUE;
+
+ nomem:
+  _dbus_list_clear (recipients_p);
+  return FALSE;
 }
 
 #ifdef DBUS_BUILD_TESTS
@@ -2542,13 +2838,15 @@ check_matches (dbus_bool_t  expected_to_match,
                const char  *rule_text)
 {
   BusMatchRule *rule;
+  MatchKeyValues values;
   dbus_bool_t matched;
 
   rule = check_parse (TRUE, rule_text);
   _dbus_assert (rule != NULL);
 
   /* We can't test sender/destination rules since we pass NULL here */
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  match_key_values_init_from_message (&values, NULL, message);
+  matched = match_rule_matches (rule, &values, NULL, NULL, message, 0);
 
   if (matched != expected_to_match)
     {
@@ -2558,6 +2856,41 @@ check_matches (dbus_bool_t  expected_to_match,
       exit (1);
     }
 
+  /* Any rule that matches must be in the bucket the matchmaker would look
+   * up for the message, i.e. their index keys must agree.
+   */
+  if (matched)
+    {
+      MatchKeyValues rule_values, message_values;
+      DBusString rule_key, message_key;
+      BusMatchFlags keys;
+
+      keys = match_rule_get_index_keys (rule);
+      match_key_values_init_from_rule (&rule_values, rule, keys);
+      match_key_values_init_from_message (&message_values, NULL, message);
+
+      _dbus_assert (match_key_values_have_keys (&message_values, keys));
+
+      if (!_dbus_string_init (&rule_key) ||
+          !_dbus_string_init (&message_key) ||
+          !append_index_key (&rule_key, keys, &rule_values) ||
+          !append_index_key (&message_key, keys, &message_values))
+        _dbus_assert_not_reached ("oom");
+
+      if (!_dbus_string_equal (&rule_key, &message_key))
+        {
+          _dbus_warn ("Rule %s matches message %d but its index key "
+                      "\"%s\" differs from the message's \"%s\"\n",
+                      rule_text, number,
+                      _dbus_string_get_const_data (&rule_key),
+                      _dbus_string_get_const_data (&message_key));
+          exit (1);
+        }
+
+      _dbus_string_free (&rule_key);
+      _dbus_string_free (&message_key);
+    }
+
   bus_match_rule_unref (rule);
 }
 
@@ -2665,6 +2998,7 @@ test_path_match (int type,
                  dbus_bool_t   should_match)
 {
   DBusMessage *message = dbus_message_new (DBUS_MESSAGE_TYPE_SIGNAL);
+  MatchKeyValues values;
   dbus_bool_t matched;
 
   _dbus_assert (message != NULL);
@@ -2676,7 +3010,8 @@ test_path_match (int type,
                                  NULL))
     _dbus_assert_not_reached ("oom");
 
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  match_key_values_init_from_message (&values, NULL, message);
+  matched = match_rule_matches (rule, &values, NULL, NULL, message, 0);
 
   if (matched != should_match)
     {
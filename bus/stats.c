@@ -23,6 +23,8 @@
 
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-message-internal.h>
 
 #include "connection.h"
 #include "services.h"
@@ -188,6 +190,9 @@ bus_stats_handle_get_stats (DBusConnection *connection,
   DBusMessageIter iter, arr_iter;
   static dbus_uint32_t stats_serial = 0;
   dbus_uint32_t in_use, in_free_list, allocated;
+  dbus_uint32_t cache_hits, cache_misses, cached_messages;
+  dbus_uint32_t polls, events, watch_changes, watch_change_calls;
+  int n_reloads, last_reload_usec, peak_reload_usec;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -211,6 +216,36 @@ bus_stats_handle_get_stats (DBusConnection *connection,
                        allocated))
     goto oom;
 
+  _dbus_message_get_cache_stats (&cache_hits, &cache_misses,
+                                 &cached_messages);
+  if (!asv_add_uint32 (&iter, &arr_iter, "MessageCacheHits", cache_hits) ||
+      !asv_add_uint32 (&iter, &arr_iter, "MessageCacheMisses",
+                       cache_misses) ||
+      !asv_add_uint32 (&iter, &arr_iter, "MessageCacheSize",
+                       cached_messages))
+    goto oom;
+
+  _dbus_loop_get_stats (bus_context_get_loop (
+                          bus_transaction_get_context (transaction)),
+                        &polls, &events, &watch_changes, &watch_change_calls);
+  if (!asv_add_uint32 (&iter, &arr_iter, "MainLoopPolls", polls) ||
+      !asv_add_uint32 (&iter, &arr_iter, "MainLoopEvents", events) ||
+      !asv_add_uint32 (&iter, &arr_iter, "MainLoopWatchChanges",
+                       watch_changes) ||
+      !asv_add_uint32 (&iter, &arr_iter, "MainLoopWatchChangeCalls",
+                       watch_change_calls))
+    goto oom;
+
+  bus_context_get_reload_stats (bus_transaction_get_context (transaction),
+                                &n_reloads, &last_reload_usec,
+                                &peak_reload_usec);
+  if (!asv_add_uint32 (&iter, &arr_iter, "ConfigReloads", n_reloads) ||
+      !asv_add_uint32 (&iter, &arr_iter, "LastConfigReloadMicroseconds",
+                       last_reload_usec) ||
+      !asv_add_uint32 (&iter, &arr_iter, "PeakConfigReloadMicroseconds",
+                       peak_reload_usec))
+    goto oom;
+
   /* Connections */
 
   if (!asv_add_uint32 (&iter, &arr_iter, "ActiveConnections",
@@ -148,6 +148,24 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "dispatch-policy") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running policy check test\n", argv[0]);
+      if (!bus_dispatch_policy_test (&test_data_dir))
+        die ("policy");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "dispatch-worker-threads") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running worker threads test\n", argv[0]);
+      if (!bus_dispatch_worker_threads_test (&test_data_dir))
+        die ("worker threads");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "dispatch") == 0)
     {
       test_pre_hook ();
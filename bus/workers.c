@@ -0,0 +1,342 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* workers.c  Threads that do I/O for active connections
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "workers.h"
+#include "utils.h"
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-threads-internal.h>
+
+typedef struct
+{
+  DBusLoop *loop;       /**< Only iterated by the worker's own thread */
+  DBusThread *thread;   /**< #NULL if the thread is not running */
+  DBusCMutex *mutex;    /**< Protects queue, n_queued and quit */
+  DBusList *queue;      /**< BusWorkerConnection for the thread to look at */
+  int n_queued;         /**< Length of queue */
+  dbus_bool_t quit;     /**< #TRUE when the thread should return */
+} BusWorker;
+
+struct BusWorkers
+{
+  BusWorker *workers;   /**< Array of n_workers workers */
+  int n_workers;        /**< Number of workers, running or not */
+  int next_worker;      /**< Worker that gets the next connection */
+};
+
+/* This is the data for the connection's deferred write function, so
+ * the connection owns it and frees it when it is finalized. It can't
+ * be finalized while it is queued, because the queue holds a reference.
+ */
+typedef struct
+{
+  BusWorker *worker;
+  DBusConnection *connection; /**< Not a reference */
+  DBusList link;              /**< Link in the worker's queue */
+  dbus_bool_t queued;         /**< Protected by the worker's mutex */
+  dbus_bool_t adopted;        /**< Only used by the worker's thread */
+} BusWorkerConnection;
+
+static dbus_bool_t
+add_worker_watch (DBusWatch *watch,
+                  void      *data)
+{
+  BusWorker *worker = data;
+
+  return _dbus_loop_add_watch (worker->loop, watch);
+}
+
+static void
+remove_worker_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusWorker *worker = data;
+
+  _dbus_loop_remove_watch (worker->loop, watch);
+}
+
+static void
+toggle_worker_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusWorker *worker = data;
+
+  _dbus_loop_toggle_watch (worker->loop, watch);
+}
+
+/* Asks the worker's thread to adopt the connection if it has not yet,
+ * and to write out its outgoing messages. This is called with the
+ * connection lock held, from whichever thread queued a message.
+ */
+static void
+worker_connection_queue (BusWorkerConnection *wc)
+{
+  BusWorker *worker = wc->worker;
+  dbus_bool_t appended;
+
+  _dbus_cmutex_lock (worker->mutex);
+
+  appended = !wc->queued;
+  if (appended)
+    {
+      dbus_connection_ref (wc->connection);
+      wc->queued = TRUE;
+      wc->link.data = wc;
+      _dbus_list_append_link (&worker->queue, &wc->link);
+      worker->n_queued += 1;
+    }
+
+  _dbus_cmutex_unlock (worker->mutex);
+
+  if (appended)
+    _dbus_loop_wakeup (worker->loop);
+}
+
+static void
+worker_connection_write (void *data)
+{
+  worker_connection_queue (data);
+}
+
+static void
+worker_process_connection (BusWorker           *worker,
+                           BusWorkerConnection *wc)
+{
+  DBusConnection *connection = wc->connection;
+
+  if (!wc->adopted)
+    {
+      while (!dbus_connection_set_watch_functions (connection,
+                                                   add_worker_watch,
+                                                   remove_worker_watch,
+                                                   toggle_worker_watch,
+                                                   worker, NULL))
+        _dbus_wait_for_memory ();
+
+      wc->adopted = TRUE;
+    }
+
+  _dbus_connection_write_deferred (connection);
+
+  /* drop the reference from worker_connection_queue(); this may
+   * free wc */
+  dbus_connection_unref (connection);
+}
+
+static void
+worker_main (void *data)
+{
+  BusWorker *worker = data;
+
+  while (TRUE)
+    {
+      int n;
+
+      _dbus_cmutex_lock (worker->mutex);
+      n = worker->quit ? -1 : worker->n_queued;
+      _dbus_cmutex_unlock (worker->mutex);
+
+      if (n < 0)
+        break;
+
+      /* Only look at the connections that were queued already, so a
+       * busy sender can't keep us from ever polling the others.
+       */
+      while (n > 0)
+        {
+          BusWorkerConnection *wc;
+          DBusList *link;
+
+          _dbus_cmutex_lock (worker->mutex);
+          link = _dbus_list_pop_first_link (&worker->queue);
+          worker->n_queued -= 1;
+          wc = link->data;
+          wc->queued = FALSE;
+          _dbus_cmutex_unlock (worker->mutex);
+
+          worker_process_connection (worker, wc);
+          n -= 1;
+        }
+
+      _dbus_loop_iterate (worker->loop, TRUE);
+    }
+}
+
+BusWorkers *
+bus_workers_new (int        n_threads,
+                 DBusError *error)
+{
+  BusWorkers *workers;
+  int i;
+
+  _dbus_assert (n_threads > 0);
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  workers = dbus_new0 (BusWorkers, 1);
+  if (workers == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  workers->workers = dbus_new0 (BusWorker, n_threads);
+  if (workers->workers == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free (workers);
+      return NULL;
+    }
+
+  for (i = 0; i < n_threads; i++)
+    {
+      BusWorker *worker = &workers->workers[i];
+
+      /* count it now, so that bus_workers_free() cleans it up */
+      workers->n_workers += 1;
+
+      worker->loop = _dbus_loop_new ();
+      if (worker->loop == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      if (!_dbus_loop_enable_threads (worker->loop, error))
+        goto failed;
+
+      _dbus_cmutex_new_at_location (&worker->mutex);
+      if (worker->mutex == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      worker->thread = _dbus_platform_thread_start (worker_main, worker);
+      if (worker->thread == NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "Could not start worker thread");
+          goto failed;
+        }
+    }
+
+  return workers;
+
+ failed:
+  bus_workers_stop (workers);
+  bus_workers_free (workers);
+  return NULL;
+}
+
+/* Waits for all the threads to return. Their connections stay in
+ * their loops, with nobody polling them, until they are closed; and
+ * writes queued after this are left for bus_workers_free().
+ */
+void
+bus_workers_stop (BusWorkers *workers)
+{
+  int i;
+
+  for (i = 0; i < workers->n_workers; i++)
+    {
+      BusWorker *worker = &workers->workers[i];
+
+      if (worker->thread == NULL)
+        continue;
+
+      _dbus_cmutex_lock (worker->mutex);
+      worker->quit = TRUE;
+      _dbus_cmutex_unlock (worker->mutex);
+
+      _dbus_loop_wakeup (worker->loop);
+      _dbus_platform_thread_join (worker->thread);
+      worker->thread = NULL;
+    }
+}
+
+/* Must be called after all the adopted connections have been closed,
+ * because their deferred write functions point at the workers.
+ */
+void
+bus_workers_free (BusWorkers *workers)
+{
+  int i;
+
+  for (i = 0; i < workers->n_workers; i++)
+    {
+      BusWorker *worker = &workers->workers[i];
+      DBusList *link;
+
+      _dbus_assert (worker->thread == NULL);
+
+      while ((link = _dbus_list_pop_first_link (&worker->queue)) != NULL)
+        {
+          BusWorkerConnection *wc = link->data;
+
+          wc->queued = FALSE;
+          worker->n_queued -= 1;
+          dbus_connection_unref (wc->connection);
+        }
+
+      if (worker->mutex != NULL)
+        _dbus_cmutex_free_at_location (&worker->mutex);
+
+      if (worker->loop != NULL)
+        _dbus_loop_unref (worker->loop);
+    }
+
+  dbus_free (workers->workers);
+  dbus_free (workers);
+}
+
+dbus_bool_t
+bus_workers_adopt_connection (BusWorkers     *workers,
+                              DBusConnection *connection)
+{
+  BusWorkerConnection *wc;
+
+  wc = dbus_new0 (BusWorkerConnection, 1);
+  if (wc == NULL)
+    return FALSE;
+
+  wc->worker = &workers->workers[workers->next_worker];
+  wc->connection = connection;
+  workers->next_worker = (workers->next_worker + 1) % workers->n_workers;
+
+  /* Stop watching its socket here; the worker watches it from now on.
+   * Its timeouts stay in the main loop.
+   */
+  if (!dbus_connection_set_watch_functions (connection,
+                                            NULL, NULL, NULL,
+                                            NULL, NULL))
+    _dbus_assert_not_reached ("setting NULL watch functions failed");
+
+  _dbus_connection_set_deferred_write_function (connection,
+                                                worker_connection_write,
+                                                wc, dbus_free);
+
+  worker_connection_queue (wc);
+
+  return TRUE;
+}
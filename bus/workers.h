@@ -0,0 +1,40 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* workers.h  Threads that do I/O for active connections
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_WORKERS_H
+#define BUS_WORKERS_H
+
+#include <dbus/dbus.h>
+#include "bus.h"
+
+/* Each worker thread has its own main loop, and reads, parses and
+ * writes messages for the connections it has been given. Everything
+ * else, including dispatching the messages it reads, stays in the main
+ * loop; the workers only watch the connections' sockets.
+ */
+BusWorkers  *bus_workers_new              (int             n_threads,
+                                           DBusError      *error);
+void         bus_workers_stop             (BusWorkers     *workers);
+void         bus_workers_free             (BusWorkers     *workers);
+dbus_bool_t  bus_workers_adopt_connection (BusWorkers     *workers,
+                                           DBusConnection *connection);
+
+#endif /* BUS_WORKERS_H */
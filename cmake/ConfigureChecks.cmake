@@ -37,6 +37,7 @@ check_symbol_exists(setlocale    "locale.h"         HAVE_SETLOCALE)          #
 check_symbol_exists(localeconv   "locale.h"         HAVE_LOCALECONV)         #  dbus-sysdeps.c
 check_symbol_exists(strtoll      "stdlib.h"         HAVE_STRTOLL)            #  dbus-send.c
 check_symbol_exists(strtoull     "stdlib.h"         HAVE_STRTOULL)           #  dbus-send.c
+check_symbol_exists(epoll_create1 "sys/epoll.h"     DBUS_HAVE_LINUX_EPOLL)   #  dbus-socket-set-epoll.c
 
 check_struct_member(cmsgcred cmcred_pid "sys/types.h sys/socket.h" HAVE_CMSGCRED)   #  dbus-sysdeps.c
 
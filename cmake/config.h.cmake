@@ -108,6 +108,9 @@
 /* Define to 1 if you have sys/poll.h */
 #cmakedefine    HAVE_POLL 1
 
+/* Define to use epoll(4) on Linux */
+#cmakedefine    DBUS_HAVE_LINUX_EPOLL 1
+
 /* Define to 1 if you have sys/time.h */
 #cmakedefine    HAVE_SYS_TIME 1
 
@@ -52,6 +52,9 @@ void              _dbus_connection_queue_received_message_link (DBusConnection
                                                                 DBusList           *link);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
 DBusMessage*      _dbus_connection_get_message_to_send         (DBusConnection     *connection);
+int               _dbus_connection_get_messages_to_send        (DBusConnection     *connection,
+                                                                DBusMessage       **messages,
+                                                                int                 max_messages);
 void              _dbus_connection_message_sent_unlocked       (DBusConnection     *connection,
                                                                 DBusMessage        *message);
 dbus_bool_t       _dbus_connection_add_watch_unlocked          (DBusConnection     *connection,
@@ -76,6 +79,11 @@ void              _dbus_connection_do_iteration_unlocked       (DBusConnection
                                                                 DBusPendingCall    *pending,
                                                                 unsigned int        flags,
                                                                 int                 timeout_milliseconds);
+void              _dbus_connection_set_deferred_write_function (DBusConnection     *connection,
+                                                                DBusWakeupMainFunction function,
+                                                                void               *data,
+                                                                DBusFreeFunction    free_data_function);
+void              _dbus_connection_write_deferred              (DBusConnection     *connection);
 void              _dbus_connection_close_possibly_shared       (DBusConnection     *connection);
 void              _dbus_connection_close_if_only_one_ref       (DBusConnection     *connection);
 
@@ -294,6 +294,10 @@ struct DBusConnection
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
   DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall. */  
+  DBusHashTable *incoming_replies; /**< Hash of reply serials to the first link in incoming_messages with that reply serial. */
+  int n_unindexed_replies;         /**< Number of replies in incoming_messages missing from incoming_replies,
+                                    *   because an earlier one has the same reply serial or we ran out of memory
+                                    */
   
   dbus_uint32_t client_serial;       /**< Client serial. Increments each time a message is sent  */
   DBusList *disconnect_message_link; /**< Preallocated list node for queueing the disconnection message */
@@ -302,6 +306,10 @@ struct DBusConnection
   void *wakeup_main_data; /**< Application data for wakeup_main_function */
   DBusFreeFunction free_wakeup_main_data; /**< free wakeup_main_data */
 
+  DBusWakeupMainFunction deferred_write_function; /**< If set, called instead of writing when a message is queued */
+  void *deferred_write_data; /**< Application data for deferred_write_function */
+  DBusFreeFunction free_deferred_write_data; /**< free deferred_write_data */
+
   DBusDispatchStatusFunction dispatch_status_function; /**< Function on dispatch status changes  */
   void *dispatch_status_data; /**< Application data for dispatch_status_function */
   DBusFreeFunction free_dispatch_status_data; /**< free dispatch_status_data */
@@ -475,6 +483,133 @@ _dbus_connection_test_get_locks (DBusConnection *connection,
 }
 #endif
 
+/*
+ * Index of the incoming queue by reply serial, so that a blocking call
+ * can find its reply without walking past every signal that arrived
+ * while it waited. Each serial maps to the first link that has it; any
+ * later duplicates, and replies we couldn't index for lack of memory,
+ * are counted in n_unindexed_replies, and are found by walking the queue
+ * as before. These must be called while @link is in the queue.
+ */
+static void
+incoming_reply_index_add (DBusConnection *connection,
+                          DBusList       *link)
+{
+  dbus_uint32_t reply_serial;
+  DBusList *indexed;
+
+  reply_serial = dbus_message_get_reply_serial (link->data);
+
+  if (reply_serial == 0)
+    return;
+
+  indexed = _dbus_hash_table_lookup_int (connection->incoming_replies,
+                                         reply_serial);
+
+  /* Links are only ever added at the ends of the queue, so the indexed
+   * one is earlier unless this one is at the head */
+  if (indexed != NULL && link != connection->incoming_messages)
+    {
+      connection->n_unindexed_replies += 1;
+      return;
+    }
+
+  /* An earlier reply with this serial may have missed the index for
+   * lack of memory, and has to stay the one that is found first */
+  if (indexed == NULL && connection->n_unindexed_replies > 0)
+    {
+      DBusList *earlier;
+
+      for (earlier = connection->incoming_messages;
+           earlier != link;
+           earlier = _dbus_list_get_next_link (&connection->incoming_messages,
+                                               earlier))
+        {
+          if (dbus_message_get_reply_serial (earlier->data) == reply_serial)
+            {
+              connection->n_unindexed_replies += 1;
+              return;
+            }
+        }
+    }
+
+  if (!_dbus_hash_table_insert_int (connection->incoming_replies,
+                                    reply_serial, link))
+    {
+      connection->n_unindexed_replies += 1;
+      return;
+    }
+
+  /* The previously indexed link, if any, is now a later duplicate */
+  if (indexed != NULL)
+    connection->n_unindexed_replies += 1;
+}
+
+static void
+incoming_reply_index_remove (DBusConnection *connection,
+                             DBusList       *link)
+{
+  dbus_uint32_t reply_serial;
+  DBusList *next;
+
+  reply_serial = dbus_message_get_reply_serial (link->data);
+
+  if (reply_serial == 0)
+    return;
+
+  if (_dbus_hash_table_lookup_int (connection->incoming_replies,
+                                   reply_serial) != link)
+    {
+      _dbus_assert (connection->n_unindexed_replies > 0);
+      connection->n_unindexed_replies -= 1;
+      return;
+    }
+
+  _dbus_hash_table_remove_int (connection->incoming_replies, reply_serial);
+
+  if (connection->n_unindexed_replies == 0)
+    return;
+
+  /* Promote the next reply with the same serial, if there is one */
+  for (next = _dbus_list_get_next_link (&connection->incoming_messages, link);
+       next != NULL;
+       next = _dbus_list_get_next_link (&connection->incoming_messages, next))
+    {
+      if (dbus_message_get_reply_serial (next->data) == reply_serial)
+        {
+          if (_dbus_hash_table_insert_int (connection->incoming_replies,
+                                           reply_serial, next))
+            connection->n_unindexed_replies -= 1;
+
+          break;
+        }
+    }
+}
+
+/* Returns the first link in the incoming queue replying to @reply_serial */
+static DBusList *
+incoming_reply_index_lookup (DBusConnection *connection,
+                             dbus_uint32_t   reply_serial)
+{
+  DBusList *link;
+
+  link = _dbus_hash_table_lookup_int (connection->incoming_replies,
+                                      reply_serial);
+
+  if (link != NULL || connection->n_unindexed_replies == 0)
+    return link;
+
+  for (link = _dbus_list_get_first_link (&connection->incoming_messages);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connection->incoming_messages, link))
+    {
+      if (dbus_message_get_reply_serial (link->data) == reply_serial)
+        return link;
+    }
+
+  return NULL;
+}
+
 /**
  * Adds a message-containing list link to the incoming message queue,
  * taking ownership of the link and the message's current refcount.
@@ -495,6 +630,7 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
   
   _dbus_list_append_link (&connection->incoming_messages,
                           link);
+  incoming_reply_index_add (connection, link);
   message = link->data;
 
   /* If this is a reply we're waiting on, remove timeout for it */
@@ -555,6 +691,7 @@ _dbus_connection_queue_synthesized_message_link (DBusConnection *connection,
   HAVE_LOCK_CHECK (connection);
   
   _dbus_list_append_link (&connection->incoming_messages, link);
+  incoming_reply_index_add (connection, link);
 
   connection->n_incoming += 1;
 
@@ -620,6 +757,40 @@ _dbus_connection_get_message_to_send (DBusConnection *connection)
   return _dbus_list_get_last (&connection->outgoing_messages);
 }
 
+/**
+ * Gets up to @p max_messages outgoing messages, in the order they
+ * will be sent, so that a transport can write several in one go. The
+ * messages remain in the queue, and the caller does not own
+ * references to them; each must still be passed to
+ * _dbus_connection_message_sent_unlocked() once written.
+ *
+ * @param connection the connection.
+ * @param messages return location for the messages
+ * @param max_messages the size of @p messages
+ * @returns the number of messages stored in @p messages
+ */
+int
+_dbus_connection_get_messages_to_send (DBusConnection  *connection,
+                                       DBusMessage    **messages,
+                                       int              max_messages)
+{
+  DBusList *link;
+  int n;
+
+  HAVE_LOCK_CHECK (connection);
+
+  n = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  while (link != NULL && n < max_messages)
+    {
+      messages[n] = link->data;
+      n++;
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return n;
+}
+
 /**
  * Notifies the connection that a message has been sent, so the
  * message can be removed from the outgoing queue.
@@ -1243,6 +1414,74 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
   _dbus_verbose ("end\n");
 }
 
+/**
+ * Sets a function to be called instead of writing out messages as
+ * they are sent. Once it is set, sending a message only queues it;
+ * when the outgoing queue stops being empty, the function is called
+ * (with the connection lock held, so it must not call back into the
+ * connection), and whoever it notifies must then call
+ * _dbus_connection_write_deferred(). Messages that can't be written
+ * straight away are left to the write watch as usual.
+ *
+ * This lets one thread hand off a connection's I/O to another thread,
+ * which does all the writing on its own main loop.
+ *
+ * @param connection the connection
+ * @param function function to call, or #NULL to write messages
+ *  out immediately again
+ * @param data data to pass to the function
+ * @param free_data_function function to free the data
+ */
+void
+_dbus_connection_set_deferred_write_function (DBusConnection         *connection,
+                                              DBusWakeupMainFunction  function,
+                                              void                   *data,
+                                              DBusFreeFunction        free_data_function)
+{
+  void *old_data;
+  DBusFreeFunction old_free_data;
+
+  CONNECTION_LOCK (connection);
+  old_data = connection->deferred_write_data;
+  old_free_data = connection->free_deferred_write_data;
+
+  connection->deferred_write_function = function;
+  connection->deferred_write_data = data;
+  connection->free_deferred_write_data = free_data_function;
+
+  CONNECTION_UNLOCK (connection);
+
+  /* Callback outside the lock */
+  if (old_free_data)
+    (*old_free_data) (old_data);
+}
+
+/**
+ * Writes out as many queued messages as can be written without
+ * blocking, after the function from
+ * _dbus_connection_set_deferred_write_function() has been called.
+ *
+ * @param connection the connection
+ */
+void
+_dbus_connection_write_deferred (DBusConnection *connection)
+{
+  DBusDispatchStatus status;
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_connection_do_iteration_unlocked (connection,
+                                          NULL,
+                                          DBUS_ITERATION_DO_WRITING,
+                                          -1);
+
+  /* writing can notice that we've been disconnected */
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
 /**
  * Creates a new connection for the given transport.  A transport
  * represents a message stream that uses some concrete mechanism, such
@@ -1259,6 +1498,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   DBusWatchList *watch_list;
   DBusTimeoutList *timeout_list;
   DBusHashTable *pending_replies;
+  DBusHashTable *incoming_replies;
   DBusList *disconnect_link;
   DBusMessage *disconnect_message;
   DBusCounter *outgoing_counter;
@@ -1267,6 +1507,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   watch_list = NULL;
   connection = NULL;
   pending_replies = NULL;
+  incoming_replies = NULL;
   timeout_list = NULL;
   disconnect_link = NULL;
   disconnect_message = NULL;
@@ -1287,6 +1528,10 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
                           (DBusFreeFunction)free_pending_call_on_hash_removal);
   if (pending_replies == NULL)
     goto error;
+
+  incoming_replies = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (incoming_replies == NULL)
+    goto error;
   
   connection = dbus_new0 (DBusConnection, 1);
   if (connection == NULL)
@@ -1344,6 +1589,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   connection->watches = watch_list;
   connection->timeouts = timeout_list;
   connection->pending_replies = pending_replies;
+  connection->incoming_replies = incoming_replies;
   connection->outgoing_counter = outgoing_counter;
   connection->filter_list = NULL;
   connection->last_dispatch_status = DBUS_DISPATCH_COMPLETE; /* so we're notified first time there's data */
@@ -1399,6 +1645,9 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
     }
   if (pending_replies)
     _dbus_hash_table_unref (pending_replies);
+
+  if (incoming_replies)
+    _dbus_hash_table_unref (incoming_replies);
   
   if (watch_list)
     _dbus_watch_list_free (watch_list);
@@ -2034,6 +2283,16 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
   
   dbus_message_lock (message);
 
+  if (connection->deferred_write_function != NULL)
+    {
+      /* If the queue wasn't empty, a write is already on its way,
+       * either from an earlier call or from the write watch */
+      if (connection->n_outgoing == 1)
+        (* connection->deferred_write_function) (connection->deferred_write_data);
+
+      return;
+    }
+
   /* Now we need to run an iteration to hopefully just write the messages
    * out immediately, and otherwise get them queued up
    */
@@ -2218,21 +2477,12 @@ static dbus_bool_t
 _dbus_connection_peek_for_reply_unlocked (DBusConnection *connection,
                                           dbus_uint32_t   client_serial)
 {
-  DBusList *link;
   HAVE_LOCK_CHECK (connection);
 
-  link = _dbus_list_get_first_link (&connection->incoming_messages);
-
-  while (link != NULL)
+  if (incoming_reply_index_lookup (connection, client_serial) != NULL)
     {
-      DBusMessage *reply = link->data;
-
-      if (dbus_message_get_reply_serial (reply) == client_serial)
-        {
-          _dbus_verbose ("%s reply to %d found in queue\n", _DBUS_FUNCTION_NAME, client_serial);
-          return TRUE;
-        }
-      link = _dbus_list_get_next_link (&connection->incoming_messages, link);
+      _dbus_verbose ("%s reply to %d found in queue\n", _DBUS_FUNCTION_NAME, client_serial);
+      return TRUE;
     }
 
   return FALSE;
@@ -2246,25 +2496,20 @@ check_for_reply_unlocked (DBusConnection *connection,
                           dbus_uint32_t   client_serial)
 {
   DBusList *link;
+  DBusMessage *reply;
 
   HAVE_LOCK_CHECK (connection);
   
-  link = _dbus_list_get_first_link (&connection->incoming_messages);
+  link = incoming_reply_index_lookup (connection, client_serial);
 
-  while (link != NULL)
-    {
-      DBusMessage *reply = link->data;
-
-      if (dbus_message_get_reply_serial (reply) == client_serial)
-	{
-	  _dbus_list_remove_link (&connection->incoming_messages, link);
-	  connection->n_incoming  -= 1;
-	  return reply;
-	}
-      link = _dbus_list_get_next_link (&connection->incoming_messages, link);
-    }
+  if (link == NULL)
+    return NULL;
 
-  return NULL;
+  reply = link->data;
+  incoming_reply_index_remove (connection, link);
+  _dbus_list_remove_link (&connection->incoming_messages, link);
+  connection->n_incoming  -= 1;
+  return reply;
 }
 
 static void
@@ -2682,6 +2927,7 @@ _dbus_connection_last_unref (DBusConnection *connection)
   
   dbus_connection_set_dispatch_status_function (connection, NULL, NULL, NULL);
   dbus_connection_set_wakeup_main_function (connection, NULL, NULL, NULL);
+  _dbus_connection_set_deferred_write_function (connection, NULL, NULL, NULL);
   dbus_connection_set_unix_user_function (connection, NULL, NULL, NULL);
   
   _dbus_watch_list_free (connection->watches);
@@ -2724,6 +2970,8 @@ _dbus_connection_last_unref (DBusConnection *connection)
 		      (DBusForeachFunction) dbus_message_unref,
 		      NULL);
   _dbus_list_clear (&connection->incoming_messages);
+  _dbus_hash_table_unref (connection->incoming_replies);
+  connection->incoming_replies = NULL;
 
   _dbus_counter_unref (connection->outgoing_counter);
 
@@ -3902,6 +4150,7 @@ dbus_connection_steal_borrowed_message (DBusConnection *connection,
  
   _dbus_assert (message == connection->message_borrowed);
 
+  incoming_reply_index_remove (connection, connection->incoming_messages);
   pop_message = _dbus_list_pop_first (&connection->incoming_messages);
   _dbus_assert (message == pop_message);
   (void) pop_message; /* unused unless asserting */
@@ -3935,6 +4184,7 @@ _dbus_connection_pop_message_link_unlocked (DBusConnection *connection)
     {
       DBusList *link;
 
+      incoming_reply_index_remove (connection, connection->incoming_messages);
       link = _dbus_list_pop_first_link (&connection->incoming_messages);
       connection->n_incoming -= 1;
 
@@ -4004,6 +4254,7 @@ _dbus_connection_putback_message_link_unlocked (DBusConnection *connection,
 
   _dbus_list_prepend_link (&connection->incoming_messages,
                            message_link);
+  incoming_reply_index_add (connection, message_link);
   connection->n_incoming += 1;
 
   _dbus_verbose ("Message %p (%s %s %s '%s') put back into queue %p, %d incoming\n",
@@ -4138,6 +4389,7 @@ _dbus_connection_failed_pop (DBusConnection *connection,
 {
   _dbus_list_prepend_link (&connection->incoming_messages,
 			   message_link);
+  incoming_reply_index_add (connection, message_link);
   connection->n_incoming += 1;
 }
 
@@ -5411,6 +5663,40 @@ dbus_connection_set_allow_anonymous (DBusConnection             *connection,
   CONNECTION_UNLOCK (connection);
 }
 
+/**
+ * Normally every message received on a connection is fully validated
+ * before the application sees it, since a malformed message could
+ * otherwise crash the application. When the other end can only ever
+ * send well-formed messages that work is wasted: a message bus daemon
+ * validates everything it routes before passing it on, and peers in a
+ * private connection may be other processes of the same application.
+ *
+ * If set to #TRUE (the default is #FALSE), the headers and bodies of
+ * incoming messages are no longer validated, provided that the
+ * connection has authenticated and the process at the other end is
+ * running as root or as the same user as this one. On the server side
+ * that is the identity the client authenticated as; on the client side
+ * it is found out from the socket, where the platform allows that.
+ * Otherwise the setting has no effect, and messages are validated
+ * as usual.
+ *
+ * This may be called at any time; it applies to messages received
+ * from then on.
+ *
+ * @param connection the connection
+ * @param value whether to trust data from a trusted peer
+ */
+void
+dbus_connection_set_trust_incoming_data (DBusConnection             *connection,
+                                         dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_trust_incoming_data (connection->transport, value);
+  CONNECTION_UNLOCK (connection);
+}
+
 /**
  *
  * Normally #DBusConnection automatically handles all messages to the
@@ -6272,4 +6558,257 @@ _dbus_connection_get_address (DBusConnection *connection)
 }
 #endif
 
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-test.h"
+#include "dbus-transport-socket.h"
+
+/* Checks that each reply serial in the incoming queue is indexed to
+ * the first link that has it, or not at all, and that every other
+ * reply is counted as unindexed */
+static void
+check_incoming_reply_index (DBusConnection *connection)
+{
+  DBusList *link;
+  int n_replies;
+  int n_unindexed;
+
+  n_replies = 0;
+  n_unindexed = 0;
+
+  for (link = _dbus_list_get_first_link (&connection->incoming_messages);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connection->incoming_messages, link))
+    {
+      dbus_uint32_t reply_serial;
+      DBusList *first;
+      DBusList *indexed;
+
+      reply_serial = dbus_message_get_reply_serial (link->data);
+      if (reply_serial == 0)
+        continue;
+
+      n_replies += 1;
+
+      for (first = _dbus_list_get_first_link (&connection->incoming_messages);
+           dbus_message_get_reply_serial (first->data) != reply_serial;
+           first = _dbus_list_get_next_link (&connection->incoming_messages,
+                                             first))
+        ;
+
+      indexed = _dbus_hash_table_lookup_int (connection->incoming_replies,
+                                             reply_serial);
+      _dbus_assert (indexed == NULL || indexed == first);
+      _dbus_assert (incoming_reply_index_lookup (connection,
+                                                 reply_serial) == first);
+
+      if (indexed != link)
+        n_unindexed += 1;
+    }
+
+  _dbus_assert (n_unindexed == connection->n_unindexed_replies);
+  _dbus_assert (_dbus_hash_table_get_n_entries (connection->incoming_replies) ==
+                n_replies - n_unindexed);
+}
+
+typedef struct
+{
+  DBusConnection *connection;
+  DBusMessage *signal;      /* not a reply */
+  DBusMessage *replies[3];  /* the first two have the same reply serial */
+  dbus_bool_t have_memory;  /* TRUE if no allocation will fail */
+} ReplyIndexTest;
+
+#define TEST_REPLY_SERIAL 5
+#define TEST_OTHER_REPLY_SERIAL 7
+
+static dbus_bool_t
+queue_test_reply (DBusConnection *connection,
+                  DBusMessage    *message)
+{
+  DBusList *link;
+
+  link = _dbus_list_alloc_link (message);
+  if (link == NULL)
+    return FALSE;
+
+  dbus_message_ref (message);
+  _dbus_connection_queue_synthesized_message_link (connection, link);
+  check_incoming_reply_index (connection);
+  return TRUE;
+}
+
+static void
+free_test_link (DBusList *link)
+{
+  dbus_message_unref (link->data);
+  _dbus_list_free_link (link);
+}
+
+/* Moves messages in and out of the incoming queue in every way that
+ * updates the reply index, checking it after each step. Indexing can
+ * run out of memory at any point without changing what is found. */
+static dbus_bool_t
+reply_index_test_iteration (void *data)
+{
+  ReplyIndexTest *test = data;
+  DBusConnection *connection = test->connection;
+  DBusList *link;
+  DBusList *signal_link;
+  DBusMessage *message;
+  int i;
+
+  CONNECTION_LOCK (connection);
+  _dbus_connection_acquire_dispatch (connection);
+
+  if (!queue_test_reply (connection, test->signal))
+    goto out;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (test->replies); i++)
+    {
+      if (!queue_test_reply (connection, test->replies[i]))
+        goto out;
+    }
+
+  /* pop and put back a message that is not a reply */
+  signal_link = _dbus_connection_pop_message_link_unlocked (connection);
+  _dbus_assert (signal_link->data == test->signal);
+  check_incoming_reply_index (connection);
+  _dbus_connection_putback_message_link_unlocked (connection, signal_link);
+  check_incoming_reply_index (connection);
+
+  signal_link = _dbus_connection_pop_message_link_unlocked (connection);
+  _dbus_assert (signal_link->data == test->signal);
+  check_incoming_reply_index (connection);
+
+  /* popping the first reply leaves the second one to be found */
+  link = _dbus_connection_pop_message_link_unlocked (connection);
+  _dbus_assert (link->data == test->replies[0]);
+  check_incoming_reply_index (connection);
+  _dbus_assert (_dbus_connection_peek_for_reply_unlocked (connection,
+                                                          TEST_REPLY_SERIAL));
+
+  if (test->have_memory)
+    {
+      DBusList *indexed;
+
+      /* the second reply was promoted, rather than left to be found by
+       * walking the queue */
+      indexed = _dbus_hash_table_lookup_int (connection->incoming_replies,
+                                             TEST_REPLY_SERIAL);
+      _dbus_assert (indexed != NULL && indexed->data == test->replies[1]);
+      _dbus_assert (connection->n_unindexed_replies == 0);
+    }
+
+  /* putting it back makes it the first again */
+  _dbus_connection_putback_message_link_unlocked (connection, link);
+  check_incoming_reply_index (connection);
+
+  message = check_for_reply_unlocked (connection, TEST_REPLY_SERIAL);
+  _dbus_assert (message == test->replies[0]);
+  dbus_message_unref (message);
+  check_incoming_reply_index (connection);
+
+  message = check_for_reply_unlocked (connection, TEST_REPLY_SERIAL);
+  _dbus_assert (message == test->replies[1]);
+  dbus_message_unref (message);
+  check_incoming_reply_index (connection);
+
+  _dbus_assert (!_dbus_connection_peek_for_reply_unlocked (connection,
+                                                           TEST_REPLY_SERIAL));
+  _dbus_assert (check_for_reply_unlocked (connection,
+                                          TEST_REPLY_SERIAL) == NULL);
+
+  /* a reply put back behind a signal is still found */
+  _dbus_connection_putback_message_link_unlocked (connection, signal_link);
+  check_incoming_reply_index (connection);
+
+  message = check_for_reply_unlocked (connection, TEST_OTHER_REPLY_SERIAL);
+  _dbus_assert (message == test->replies[2]);
+  dbus_message_unref (message);
+  check_incoming_reply_index (connection);
+
+ out:
+  while ((link = _dbus_connection_pop_message_link_unlocked (connection)))
+    {
+      free_test_link (link);
+      check_incoming_reply_index (connection);
+    }
+
+  _dbus_assert (connection->n_unindexed_replies == 0);
+  _dbus_assert (_dbus_hash_table_get_n_entries (connection->incoming_replies) == 0);
+
+  _dbus_connection_release_dispatch (connection);
+  CONNECTION_UNLOCK (connection);
+
+  return TRUE;
+}
+
+static DBusMessage *
+new_test_reply (dbus_uint32_t reply_serial)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (message == NULL ||
+      !dbus_message_set_reply_serial (message, reply_serial))
+    _dbus_assert_not_reached ("no memory for reply");
+
+  return message;
+}
+
+/**
+ * Unit test for DBusConnection's index of incoming replies.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_connection_test (void)
+{
+  ReplyIndexTest test;
+  DBusTransport *transport;
+  DBusString address;
+  int fd1, fd2;
+  int i;
+
+  if (!_dbus_full_duplex_pipe (&fd1, &fd2, FALSE, NULL))
+    _dbus_assert_not_reached ("could not create socket pair");
+
+  _dbus_string_init_const (&address, "test-reply-index:");
+  transport = _dbus_transport_new_for_socket (fd1, NULL, &address);
+  if (transport == NULL)
+    _dbus_assert_not_reached ("no memory for transport");
+
+  test.connection = _dbus_connection_new_for_transport (transport);
+  if (test.connection == NULL)
+    _dbus_assert_not_reached ("no memory for connection");
+  _dbus_transport_unref (transport);
+
+  test.signal = dbus_message_new_signal ("/a/b", "a.b", "C");
+  if (test.signal == NULL)
+    _dbus_assert_not_reached ("no memory for signal");
+
+  test.replies[0] = new_test_reply (TEST_REPLY_SERIAL);
+  test.replies[1] = new_test_reply (TEST_REPLY_SERIAL);
+  test.replies[2] = new_test_reply (TEST_OTHER_REPLY_SERIAL);
+
+  test.have_memory = TRUE;
+  reply_index_test_iteration (&test);
+
+  test.have_memory = FALSE;
+  if (!_dbus_test_oom_handling ("reply index", reply_index_test_iteration,
+                                &test))
+    _dbus_assert_not_reached ("reply index got confused by OOM");
+
+  dbus_message_unref (test.signal);
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (test.replies); i++)
+    dbus_message_unref (test.replies[i]);
+
+  dbus_connection_close (test.connection);
+  dbus_connection_unref (test.connection);
+  _dbus_close_socket (fd2, NULL);
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
+
 /** @} */
@@ -287,6 +287,9 @@ void               dbus_connection_set_allow_anonymous          (DBusConnection
 DBUS_EXPORT
 void               dbus_connection_set_route_peer_messages      (DBusConnection             *connection,
                                                                  dbus_bool_t                 value);
+DBUS_EXPORT
+void               dbus_connection_set_trust_incoming_data      (DBusConnection             *connection,
+                                                                 dbus_bool_t                 value);
 
 
 /* Filters */
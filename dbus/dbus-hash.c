@@ -840,6 +840,34 @@ string_hash (const char *str)
   return h;
 }
 
+/**
+ * Hashes the first @p len bytes of a string, giving the same value
+ * as for the key of a #DBUS_HASH_STRING table if there are no nul
+ * bytes among them. Useful for comparing strings whose hashes can be
+ * worked out in advance, such as header fields and match rules.
+ *
+ * @param str the string
+ * @param len its length
+ * @returns the hash
+ */
+unsigned int
+_dbus_hash_string_len (const char *str,
+                       int         len)
+{
+  unsigned int h;
+  int i;
+
+  if (len <= 0)
+    return 0;
+
+  h = str[0];
+
+  for (i = 1; i < len; i++)
+    h = (h << 5) - h + str[i];
+
+  return h;
+}
+
 /** Key comparison function */
 typedef int (* KeyCompareFunc) (const void *key_a, const void *key_b);
 
@@ -1061,6 +1089,34 @@ _dbus_hash_table_lookup_string (DBusHashTable *table,
     return NULL;
 }
 
+/**
+ * Like _dbus_hash_table_lookup_string(), but for a key whose hash has
+ * already been worked out with _dbus_hash_string_len().
+ *
+ * @param table the hash table.
+ * @param key the string to look up.
+ * @param hash the hash of the string.
+ * @returns the value of the hash entry.
+ */
+void*
+_dbus_hash_table_lookup_string_hashed (DBusHashTable *table,
+                                       const char    *key,
+                                       unsigned int   hash)
+{
+  DBusHashEntry *entry;
+
+  _dbus_assert (table->key_type == DBUS_HASH_STRING);
+  _dbus_assert (hash == string_hash (key));
+
+  entry = find_generic_function (table, (char*) key, hash & table->mask,
+                                 (KeyCompareFunc) strcmp, FALSE, NULL, NULL);
+
+  if (entry)
+    return entry->value;
+  else
+    return NULL;
+}
+
 /**
  * Looks up the value for a given integer in a hash table
  * of type #DBUS_HASH_INT. Returns %NULL if the value
@@ -1462,6 +1518,8 @@ _dbus_hash_test (void)
 
       len = sprintf (keys[i], "Hash key %d", i);
       _dbus_assert (*(keys[i] + len) == '\0');
+      _dbus_assert (_dbus_hash_string_len (keys[i], len) ==
+                    string_hash (keys[i]));
       ++i;
     }
   printf ("... done.\n");
@@ -1524,6 +1582,8 @@ _dbus_hash_test (void)
       value = _dbus_hash_table_lookup_string (table1, keys[i]);
       _dbus_assert (value != NULL);
       _dbus_assert (strcmp (value, "Value!") == 0);
+      _dbus_assert (_dbus_hash_table_lookup_string_hashed (table1, keys[i],
+          _dbus_hash_string_len (keys[i], strlen (keys[i]))) == value);
 
       value = _dbus_hash_table_lookup_int (table2, i);
       _dbus_assert (value != NULL);
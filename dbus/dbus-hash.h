@@ -93,6 +93,9 @@ dbus_bool_t    _dbus_hash_iter_lookup              (DBusHashTable    *table,
                                                     DBusHashIter     *iter);
 void*          _dbus_hash_table_lookup_string      (DBusHashTable    *table,
                                                     const char       *key);
+void*          _dbus_hash_table_lookup_string_hashed (DBusHashTable  *table,
+                                                    const char       *key,
+                                                    unsigned int      hash);
 void*          _dbus_hash_table_lookup_int         (DBusHashTable    *table,
                                                     int               key);
 void*          _dbus_hash_table_lookup_uintptr     (DBusHashTable    *table,
@@ -114,6 +117,9 @@ dbus_bool_t    _dbus_hash_table_insert_uintptr     (DBusHashTable    *table,
                                                     void             *value);
 int            _dbus_hash_table_get_n_entries      (DBusHashTable    *table);
 
+unsigned int   _dbus_hash_string_len               (const char       *str,
+                                                    int               len);
+
 /* Preallocation */
 
 /** A preallocated hash entry */
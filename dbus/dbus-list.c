@@ -48,32 +48,50 @@ _DBUS_DEFINE_GLOBAL_LOCK (list);
  * @{
  */
 
-/* the mem pool is probably a speed hit, with the thread
- * lock, though it does still save memory - unknown.
+/* Links are cached per thread in "magazines", so that the list lock
+ * is only taken once per LINK_MAGAZINE_BATCH allocations or frees:
+ * an empty magazine is refilled from list_pool in one go, and a full
+ * one gives half its links back. This is only done once threads have
+ * been initialized, since before that the lock costs nothing.
  */
+#define LINK_MAGAZINE_SIZE 64
+#define LINK_MAGAZINE_BATCH (LINK_MAGAZINE_SIZE / 2)
+
+typedef struct LinkMagazine LinkMagazine;
+
+/**
+ * One thread's cache of free links.
+ */
+struct LinkMagazine
+{
+  LinkMagazine *prev;   /**< previous magazine, protected by list lock */
+  LinkMagazine *next;   /**< next magazine, protected by list lock */
+  DBusList *free_links; /**< free links, chained through their next */
+  int n_free_links;     /**< length of free_links */
+};
+
+static DBusThreadLocal *link_magazine_local = NULL;
+/* every thread's magazine, so they can be emptied by dbus_shutdown() */
+static LinkMagazine *link_magazines = NULL;
+
+/* Must be called with the list lock held */
 static DBusList*
-alloc_link (void *data)
+pool_alloc_link (void)
 {
   DBusList *link;
 
-  _DBUS_LOCK (list);
-
   if (list_pool == NULL)
     {      
       list_pool = _dbus_mem_pool_new (sizeof (DBusList), TRUE);
 
       if (list_pool == NULL)
-        {
-          _DBUS_UNLOCK (list);
-          return NULL;
-        }
+        return NULL;
 
       link = _dbus_mem_pool_alloc (list_pool);
       if (link == NULL)
         {
           _dbus_mem_pool_free (list_pool);
           list_pool = NULL;
-          _DBUS_UNLOCK (list);
           return NULL;
         }
     }
@@ -82,24 +100,227 @@ alloc_link (void *data)
       link = _dbus_mem_pool_alloc (list_pool);
     }
 
-  if (link)
-    link->data = data;
-  
+  return link;
+}
+
+/* Must be called with the list lock held */
+static void
+pool_free_link (DBusList *link)
+{
+  if (_dbus_mem_pool_dealloc (list_pool, link))
+    {
+      _dbus_mem_pool_free (list_pool);
+      list_pool = NULL;
+    }
+}
+
+static void
+link_magazine_refill (LinkMagazine *magazine)
+{
+  _DBUS_LOCK (list);
+
+  while (magazine->n_free_links < LINK_MAGAZINE_BATCH)
+    {
+      DBusList *link;
+
+      link = pool_alloc_link ();
+      if (link == NULL)
+        break;
+
+      link->next = magazine->free_links;
+      magazine->free_links = link;
+      magazine->n_free_links += 1;
+    }
+
+  _DBUS_UNLOCK (list);
+}
+
+/* Must be called with the list lock held */
+static void
+link_magazine_spill (LinkMagazine *magazine,
+                     int           n_links)
+{
+  while (n_links > 0 && magazine->free_links != NULL)
+    {
+      DBusList *link;
+
+      link = magazine->free_links;
+      magazine->free_links = link->next;
+      magazine->n_free_links -= 1;
+      n_links -= 1;
+
+      link->next = NULL;
+      pool_free_link (link);
+    }
+}
+
+/* Must be called with the list lock held; empties the magazine and
+ * forgets about it, but does not free it
+ */
+static void
+link_magazine_remove (LinkMagazine *magazine)
+{
+  link_magazine_spill (magazine, magazine->n_free_links);
+
+  if (magazine->prev != NULL)
+    magazine->prev->next = magazine->next;
+  else
+    link_magazines = magazine->next;
+
+  if (magazine->next != NULL)
+    magazine->next->prev = magazine->prev;
+}
+
+/* Called when a thread exits */
+static void
+link_magazine_free (void *data)
+{
+  LinkMagazine *magazine = data;
+
+  _DBUS_LOCK (list);
+  link_magazine_remove (magazine);
+  _DBUS_UNLOCK (list);
+
+  dbus_free (magazine);
+}
+
+/* Returns the calling thread's magazine, or #NULL if we are not
+ * using them or there is no memory for one.
+ */
+static LinkMagazine*
+get_link_magazine (void)
+{
+  LinkMagazine *magazine;
+
+  if (link_magazine_local == NULL)
+    return NULL;
+
+  magazine = _dbus_platform_thread_local_get (link_magazine_local);
+  if (magazine != NULL)
+    return magazine;
+
+  magazine = dbus_new0 (LinkMagazine, 1);
+  if (magazine == NULL)
+    return NULL;
+
+  if (!_dbus_platform_thread_local_set (link_magazine_local, magazine))
+    {
+      dbus_free (magazine);
+      return NULL;
+    }
+
+  _DBUS_LOCK (list);
+  magazine->next = link_magazines;
+  if (link_magazines != NULL)
+    link_magazines->prev = magazine;
+  link_magazines = magazine;
   _DBUS_UNLOCK (list);
 
+  return magazine;
+}
+
+static void
+shutdown_link_magazines (void *data)
+{
+  _DBUS_LOCK (list);
+
+  while (link_magazines != NULL)
+    {
+      LinkMagazine *magazine = link_magazines;
+
+      link_magazine_remove (magazine);
+      dbus_free (magazine);
+    }
+
+  _dbus_platform_thread_local_free (link_magazine_local);
+  link_magazine_local = NULL;
+
+  _DBUS_UNLOCK (list);
+}
+
+/**
+ * Starts caching free links per thread. Called by dbus_threads_init(),
+ * before there is more than one thread; if it fails, links are
+ * allocated with the list lock held, as they are without threads.
+ */
+void
+_dbus_list_init_thread_caches (void)
+{
+  _dbus_assert (link_magazine_local == NULL);
+
+  link_magazine_local = _dbus_platform_thread_local_new (link_magazine_free);
+  if (link_magazine_local == NULL)
+    return;
+
+  if (!_dbus_register_shutdown_func (shutdown_link_magazines, NULL))
+    {
+      _dbus_platform_thread_local_free (link_magazine_local);
+      link_magazine_local = NULL;
+    }
+}
+
+static DBusList*
+alloc_link (void *data)
+{
+  LinkMagazine *magazine;
+  DBusList *link;
+
+  magazine = get_link_magazine ();
+
+  if (magazine != NULL)
+    {
+      if (magazine->free_links == NULL)
+        link_magazine_refill (magazine);
+
+      link = magazine->free_links;
+      if (link == NULL)
+        return NULL;
+
+      magazine->free_links = link->next;
+      magazine->n_free_links -= 1;
+      link->next = NULL;
+    }
+  else
+    {
+      _DBUS_LOCK (list);
+      link = pool_alloc_link ();
+      _DBUS_UNLOCK (list);
+
+      if (link == NULL)
+        return NULL;
+    }
+
+  link->data = data;
+
   return link;
 }
 
 static void
 free_link (DBusList *link)
 {  
-  _DBUS_LOCK (list);
-  if (_dbus_mem_pool_dealloc (list_pool, link))
+  LinkMagazine *magazine;
+
+  magazine = get_link_magazine ();
+
+  if (magazine != NULL)
     {
-      _dbus_mem_pool_free (list_pool);
-      list_pool = NULL;
+      if (magazine->n_free_links >= LINK_MAGAZINE_SIZE)
+        {
+          _DBUS_LOCK (list);
+          link_magazine_spill (magazine, LINK_MAGAZINE_BATCH);
+          _DBUS_UNLOCK (list);
+        }
+
+      link->data = NULL;
+      link->prev = NULL;
+      link->next = magazine->free_links;
+      magazine->free_links = link;
+      magazine->n_free_links += 1;
+      return;
     }
-  
+
+  _DBUS_LOCK (list);
+  pool_free_link (link);
   _DBUS_UNLOCK (list);
 }
 
@@ -152,9 +373,22 @@ _dbus_list_get_stats     (dbus_uint32_t *in_use_p,
                           dbus_uint32_t *in_free_list_p,
                           dbus_uint32_t *allocated_p)
 {
+  LinkMagazine *magazine;
+  dbus_uint32_t in_magazines = 0;
+
   _DBUS_LOCK (list);
   _dbus_mem_pool_get_stats (list_pool, in_use_p, in_free_list_p, allocated_p);
+
+  /* Links cached by threads are free as far as the caller is
+   * concerned; other threads may be changing these counts.
+   */
+  for (magazine = link_magazines; magazine != NULL; magazine = magazine->next)
+    in_magazines += magazine->n_free_links * sizeof (DBusList);
+
   _DBUS_UNLOCK (list);
+
+  *in_use_p -= in_magazines;
+  *in_free_list_p += in_magazines;
 }
 #endif
 
@@ -1336,4 +1570,46 @@ _dbus_list_test (void)
   return TRUE;
 }
 
+/**
+ * @ingroup DBusListInternals
+ * Unit test for the per-thread link cache. This initializes threads,
+ * which can't be undone, so it has to run after every other test.
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_list_magazine_test (void)
+{
+  DBusList *list1;
+  int i;
+
+  list1 = NULL;
+
+  /* Go through the per-thread link cache's refill and spill paths; the
+   * memleak check after this test makes sure dbus_shutdown() gives all
+   * the cached links back
+   */
+  if (!dbus_threads_init_default ())
+    _dbus_assert_not_reached ("could not initialize threads");
+
+  _dbus_assert (link_magazine_local != NULL);
+
+  i = 0;
+  while (i < LINK_MAGAZINE_SIZE * 3)
+    {
+      if (!_dbus_list_append (&list1, _DBUS_INT_TO_POINTER (i)))
+        _dbus_assert_not_reached ("could not allocate for append");
+      ++i;
+    }
+
+  verify_list (&list1);
+  _dbus_assert (is_ascending_sequence (&list1));
+  _dbus_assert (get_link_magazine ()->n_free_links < LINK_MAGAZINE_BATCH);
+
+  _dbus_list_clear (&list1);
+  _dbus_assert (get_link_magazine ()->n_free_links <= LINK_MAGAZINE_SIZE);
+  _dbus_assert (get_link_magazine ()->n_free_links > LINK_MAGAZINE_BATCH);
+  
+  return TRUE;
+}
+
 #endif
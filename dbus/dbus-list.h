@@ -90,6 +90,8 @@ void _dbus_list_foreach (DBusList            **list,
 #define _dbus_list_get_next_link(list, link) ((link)->next == *(list) ? NULL : (link)->next)
 #define _dbus_list_get_prev_link(list, link) ((link) == *(list) ? NULL : (link)->prev)
 
+void        _dbus_list_init_thread_caches (void);
+
 /* if DBUS_ENABLE_STATS */
 void        _dbus_list_get_stats          (dbus_uint32_t *in_use_p,
                                            dbus_uint32_t *in_free_list_p,
@@ -30,6 +30,8 @@
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-socket-set.h>
+#include <dbus/dbus-threads-internal.h>
+#include <dbus/dbus-timeout.h>
 #include <dbus/dbus-watch.h>
 
 #define MAINLOOP_SPEW 0
@@ -55,34 +57,70 @@ watch_flags_to_string (int flags)
 #endif /* DBUS_ENABLE_VERBOSE_MODE */
 #endif /* MAINLOOP_SPEW */
 
+/* How many toggled fds a threaded loop remembers before it gives up
+ * and refreshes all of them */
+#define N_TOGGLED_FDS 16
+
+typedef struct
+{
+  DBusLoop *loop;
+  DBusTimeout *timeout;
+  unsigned long last_tv_sec;
+  unsigned long last_tv_usec;
+  unsigned long expiration_tv_sec;  /**< last_tv_sec plus the interval */
+  unsigned long expiration_tv_usec; /**< last_tv_usec plus the interval */
+  int heap_index; /**< position in the loop's timeout heap, or -1 if disabled */
+} TimeoutCallback;
+
 struct DBusLoop
 {
   int refcount;
   /** fd => dbus_malloc'd DBusList ** of references to DBusWatch */
   DBusHashTable *watches;
   DBusSocketSet *socket_set;
-  DBusList *timeouts;
+  /** Enabled timeouts, as a binary min-heap ordered by expiration time.
+   * Disabled timeouts are only reachable via their DBusTimeout.
+   * Has room for timeout_count entries so enabling one can't fail. */
+  TimeoutCallback **timeout_heap;
+  int timeout_heap_size;
+  int timeout_heap_allocated;
   int callback_list_serial;
   int watch_count;
   int timeout_count;
   int depth; /**< number of recursive runs */
-  DBusList *need_dispatch;
+  DBusList *need_dispatch; /**< protected by mutex, if there is one */
+  /** Buffer for poll results, grown to one entry per watched fd so that
+   * a busy loop doesn't need several wakeups to see everything that
+   * happened. Not used by a nested iteration while an outer one is still
+   * working through it. */
+  DBusSocketEvent *ready_fds;
+  int ready_fds_allocated;
   /** TRUE if we will skip a watch next time because it was OOM; becomes
    * FALSE between polling, and dealing with the results of the poll */
   unsigned oom_watch_pending : 1;
+  unsigned ready_fds_in_use : 1;
+
+  /** Set by _dbus_loop_enable_threads(), and protects the fields below
+   * it; #NULL if the loop is only used by one thread */
+  DBusCMutex *mutex;
+  int wakeup_read_fd;  /**< readable when another thread wakes us up */
+  int wakeup_write_fd; /**< the other end of wakeup_read_fd */
+  DBusString wakeup_buffer; /**< for draining wakeup_read_fd */
+  /** fds whose watches were toggled since we last polled */
+  int toggled_fds[N_TOGGLED_FDS];
+  int n_toggled_fds;
+  /** TRUE if toggled_fds ran out of space, so every fd must be refreshed */
+  dbus_bool_t toggled_fds_overflowed;
+  dbus_bool_t polling;          /**< TRUE while the owning thread polls */
+  dbus_bool_t wakeup_written;   /**< TRUE if wakeup_read_fd is readable */
+  dbus_bool_t wakeup_requested; /**< TRUE if the next poll mustn't block */
 };
 
-typedef struct
-{
-  DBusTimeout *timeout;
-  unsigned long last_tv_sec;
-  unsigned long last_tv_usec;
-} TimeoutCallback;
-
 #define TIMEOUT_CALLBACK(callback) ((TimeoutCallback*)callback)
 
 static TimeoutCallback*
-timeout_callback_new (DBusTimeout         *timeout)
+timeout_callback_new (DBusLoop            *loop,
+                      DBusTimeout         *timeout)
 {
   TimeoutCallback *cb;
 
@@ -90,9 +128,11 @@ timeout_callback_new (DBusTimeout         *timeout)
   if (cb == NULL)
     return NULL;
 
+  cb->loop = loop;
   cb->timeout = timeout;
   _dbus_get_monotonic_time (&cb->last_tv_sec,
                             &cb->last_tv_usec);
+  cb->heap_index = -1;
   return cb;
 }
 
@@ -151,10 +191,99 @@ _dbus_loop_new (void)
     }
 
   loop->refcount = 1;
+  loop->wakeup_read_fd = -1;
+  loop->wakeup_write_fd = -1;
 
   return loop;
 }
 
+/* Lets other threads call _dbus_loop_toggle_watch(),
+ * _dbus_loop_queue_dispatch() and _dbus_loop_wakeup() while the thread
+ * that owns the loop is iterating it. Everything else, including adding
+ * and removing watches and timeouts, must still only be done by the
+ * owning thread.
+ */
+dbus_bool_t
+_dbus_loop_enable_threads (DBusLoop  *loop,
+                           DBusError *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (loop->mutex == NULL);
+
+  if (!_dbus_string_init (&loop->wakeup_buffer))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_full_duplex_pipe (&loop->wakeup_read_fd, &loop->wakeup_write_fd,
+                               FALSE, error))
+    goto failed_string;
+
+  if (!_dbus_socket_set_add (loop->socket_set, loop->wakeup_read_fd,
+                             DBUS_WATCH_READABLE, TRUE))
+    {
+      _DBUS_SET_OOM (error);
+      goto failed_pipe;
+    }
+
+  _dbus_cmutex_new_at_location (&loop->mutex);
+
+  if (loop->mutex == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      _dbus_socket_set_remove (loop->socket_set, loop->wakeup_read_fd);
+      goto failed_pipe;
+    }
+
+  return TRUE;
+
+ failed_pipe:
+  _dbus_close_socket (loop->wakeup_read_fd, NULL);
+  _dbus_close_socket (loop->wakeup_write_fd, NULL);
+  loop->wakeup_read_fd = -1;
+  loop->wakeup_write_fd = -1;
+ failed_string:
+  _dbus_string_free (&loop->wakeup_buffer);
+  return FALSE;
+}
+
+/* Makes the owning thread's poll return, if it's polling. Called with
+ * the mutex held. */
+static dbus_bool_t
+wakeup_if_polling (DBusLoop *loop)
+{
+  if (!loop->polling)
+    return FALSE;
+
+  if (!loop->wakeup_written)
+    {
+      DBusString byte;
+
+      _dbus_string_init_const (&byte, "x");
+
+      if (_dbus_write_socket (loop->wakeup_write_fd, &byte, 0, 1) == 1)
+        loop->wakeup_written = TRUE;
+    }
+
+  return TRUE;
+}
+
+/* Makes the owning thread's current or next iteration return without
+ * waiting for anything else to happen */
+void
+_dbus_loop_wakeup (DBusLoop *loop)
+{
+  _dbus_assert (loop->mutex != NULL);
+
+  _dbus_cmutex_lock (loop->mutex);
+
+  if (!wakeup_if_polling (loop))
+    loop->wakeup_requested = TRUE;
+
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
 DBusLoop *
 _dbus_loop_ref (DBusLoop *loop)
 {
@@ -182,8 +311,19 @@ _dbus_loop_unref (DBusLoop *loop)
           dbus_connection_unref (connection);
         }
 
+      if (loop->mutex != NULL)
+        {
+          _dbus_socket_set_remove (loop->socket_set, loop->wakeup_read_fd);
+          _dbus_close_socket (loop->wakeup_read_fd, NULL);
+          _dbus_close_socket (loop->wakeup_write_fd, NULL);
+          _dbus_string_free (&loop->wakeup_buffer);
+          _dbus_cmutex_free_at_location (&loop->mutex);
+        }
+
       _dbus_hash_table_unref (loop->watches);
       _dbus_socket_set_free (loop->socket_set);
+      dbus_free (loop->ready_fds);
+      dbus_free (loop->timeout_heap);
       dbus_free (loop);
     }
 }
@@ -335,7 +475,72 @@ void
 _dbus_loop_toggle_watch (DBusLoop          *loop,
                          DBusWatch         *watch)
 {
-  refresh_watches_for_fd (loop, NULL, dbus_watch_get_socket (watch));
+  int fd;
+  int i;
+
+  fd = dbus_watch_get_socket (watch);
+
+  if (loop->mutex == NULL)
+    {
+      refresh_watches_for_fd (loop, NULL, fd);
+      return;
+    }
+
+  /* We might not be the owning thread, so leave it to the owning thread
+   * to look at the watch before it next polls */
+  _dbus_cmutex_lock (loop->mutex);
+
+  for (i = 0; i < loop->n_toggled_fds; i++)
+    {
+      if (loop->toggled_fds[i] == fd)
+        break;
+    }
+
+  if (i == loop->n_toggled_fds)
+    {
+      if (loop->n_toggled_fds < N_TOGGLED_FDS)
+        loop->toggled_fds[loop->n_toggled_fds++] = fd;
+      else
+        loop->toggled_fds_overflowed = TRUE;
+    }
+
+  wakeup_if_polling (loop);
+
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+/* Called by the owning thread with the mutex held */
+static void
+refresh_toggled_watches (DBusLoop *loop)
+{
+  DBusList **watches;
+  int i;
+
+  if (loop->toggled_fds_overflowed)
+    {
+      DBusHashIter hash_iter;
+
+      _dbus_hash_iter_init (loop->watches, &hash_iter);
+
+      while (_dbus_hash_iter_next (&hash_iter))
+        refresh_watches_for_fd (loop, _dbus_hash_iter_get_value (&hash_iter),
+                                _dbus_hash_iter_get_int_key (&hash_iter));
+    }
+  else
+    {
+      for (i = 0; i < loop->n_toggled_fds; i++)
+        {
+          /* the watch might have been removed since it was toggled */
+          watches = _dbus_hash_table_lookup_int (loop->watches,
+                                                 loop->toggled_fds[i]);
+
+          if (watches != NULL)
+            refresh_watches_for_fd (loop, watches, loop->toggled_fds[i]);
+        }
+    }
+
+  loop->n_toggled_fds = 0;
+  loop->toggled_fds_overflowed = FALSE;
 }
 
 void
@@ -386,26 +591,184 @@ _dbus_loop_remove_watch (DBusLoop         *loop,
   _dbus_warn ("could not find watch %p to remove\n", watch);
 }
 
+/* TRUE if @a should fire before @b; ties go to the one that fired
+ * longest ago, so a timeout that has just fired sorts after any
+ * other expired timeout with the same expiration time.
+ */
+static dbus_bool_t
+timeout_callback_expires_before (TimeoutCallback *a,
+                                 TimeoutCallback *b)
+{
+  if (a->expiration_tv_sec != b->expiration_tv_sec)
+    return a->expiration_tv_sec < b->expiration_tv_sec;
+
+  if (a->expiration_tv_usec != b->expiration_tv_usec)
+    return a->expiration_tv_usec < b->expiration_tv_usec;
+
+  if (a->last_tv_sec != b->last_tv_sec)
+    return a->last_tv_sec < b->last_tv_sec;
+
+  return a->last_tv_usec < b->last_tv_usec;
+}
+
+static void
+timeout_heap_set (DBusLoop        *loop,
+                  int              i,
+                  TimeoutCallback *tcb)
+{
+  loop->timeout_heap[i] = tcb;
+  tcb->heap_index = i;
+}
+
+static void
+timeout_heap_sift_up (DBusLoop        *loop,
+                      TimeoutCallback *tcb)
+{
+  int i = tcb->heap_index;
+
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+
+      if (!timeout_callback_expires_before (tcb, loop->timeout_heap[parent]))
+        break;
+
+      timeout_heap_set (loop, i, loop->timeout_heap[parent]);
+      i = parent;
+    }
+
+  timeout_heap_set (loop, i, tcb);
+}
+
+static void
+timeout_heap_sift_down (DBusLoop        *loop,
+                        TimeoutCallback *tcb)
+{
+  int i = tcb->heap_index;
+
+  while (TRUE)
+    {
+      int child = 2 * i + 1;
+
+      if (child >= loop->timeout_heap_size)
+        break;
+
+      if (child + 1 < loop->timeout_heap_size &&
+          timeout_callback_expires_before (loop->timeout_heap[child + 1],
+                                           loop->timeout_heap[child]))
+        child += 1;
+
+      if (!timeout_callback_expires_before (loop->timeout_heap[child], tcb))
+        break;
+
+      timeout_heap_set (loop, i, loop->timeout_heap[child]);
+      i = child;
+    }
+
+  timeout_heap_set (loop, i, tcb);
+}
+
+static void
+timeout_heap_remove (DBusLoop        *loop,
+                     TimeoutCallback *tcb)
+{
+  TimeoutCallback *last;
+
+  _dbus_assert (tcb->heap_index >= 0);
+  _dbus_assert (loop->timeout_heap[tcb->heap_index] == tcb);
+
+  loop->timeout_heap_size -= 1;
+  last = loop->timeout_heap[loop->timeout_heap_size];
+
+  if (last != tcb)
+    {
+      timeout_heap_set (loop, tcb->heap_index, last);
+      timeout_heap_sift_up (loop, last);
+      timeout_heap_sift_down (loop, last);
+    }
+
+  tcb->heap_index = -1;
+}
+
+/* Recomputes the expiration time from the last time the timeout fired
+ * and its current interval, and moves it to the right place in the heap
+ * (or out of it, if it's disabled). Can't fail.
+ */
+static void
+timeout_callback_reschedule (DBusLoop        *loop,
+                             TimeoutCallback *tcb)
+{
+  int interval;
+
+  interval = dbus_timeout_get_interval (tcb->timeout);
+
+  tcb->expiration_tv_sec = tcb->last_tv_sec + interval / 1000L;
+  tcb->expiration_tv_usec = tcb->last_tv_usec + (interval % 1000L) * 1000;
+  if (tcb->expiration_tv_usec >= 1000000)
+    {
+      tcb->expiration_tv_usec -= 1000000;
+      tcb->expiration_tv_sec += 1;
+    }
+
+  if (!dbus_timeout_get_enabled (tcb->timeout))
+    {
+      if (tcb->heap_index >= 0)
+        timeout_heap_remove (loop, tcb);
+    }
+  else if (tcb->heap_index < 0)
+    {
+      _dbus_assert (loop->timeout_heap_size < loop->timeout_heap_allocated);
+
+      timeout_heap_set (loop, loop->timeout_heap_size, tcb);
+      loop->timeout_heap_size += 1;
+      timeout_heap_sift_up (loop, tcb);
+    }
+  else
+    {
+      timeout_heap_sift_up (loop, tcb);
+      timeout_heap_sift_down (loop, tcb);
+    }
+}
+
+static void
+timeout_changed (DBusTimeout *timeout,
+                 void        *data)
+{
+  TimeoutCallback *tcb = data;
+
+  timeout_callback_reschedule (tcb->loop, tcb);
+}
+
 dbus_bool_t
 _dbus_loop_add_timeout (DBusLoop           *loop,
                         DBusTimeout        *timeout)
 {
   TimeoutCallback *tcb;
 
-  tcb = timeout_callback_new (timeout);
+  if (loop->timeout_count == loop->timeout_heap_allocated)
+    {
+      TimeoutCallback **heap;
+      int allocated;
+
+      allocated = MAX (loop->timeout_heap_allocated * 2, 8);
+      heap = dbus_realloc (loop->timeout_heap,
+                           allocated * sizeof (TimeoutCallback *));
+      if (heap == NULL)
+        return FALSE;
+
+      loop->timeout_heap = heap;
+      loop->timeout_heap_allocated = allocated;
+    }
+
+  tcb = timeout_callback_new (loop, timeout);
   if (tcb == NULL)
     return FALSE;
 
-  if (_dbus_list_append (&loop->timeouts, tcb))
-    {
-      loop->callback_list_serial += 1;
-      loop->timeout_count += 1;
-    }
-  else
-    {
-      timeout_callback_free (tcb);
-      return FALSE;
-    }
+  _dbus_timeout_set_changed_function (timeout, timeout_changed, tcb);
+  loop->callback_list_serial += 1;
+  loop->timeout_count += 1;
+
+  timeout_callback_reschedule (loop, tcb);
   
   return TRUE;
 }
@@ -414,78 +777,57 @@ void
 _dbus_loop_remove_timeout (DBusLoop           *loop,
                            DBusTimeout        *timeout)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&loop->timeouts);
-  while (link != NULL)
-    {
-      DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-      TimeoutCallback *this = link->data;
+  TimeoutCallback *tcb;
 
-      if (this->timeout == timeout)
-        {
-          _dbus_list_remove_link (&loop->timeouts, link);
-          loop->callback_list_serial += 1;
-          loop->timeout_count -= 1;
-          timeout_callback_free (this);
+  tcb = _dbus_timeout_get_changed_data (timeout);
 
-          return;
-        }
-      
-      link = next;
+  if (tcb == NULL || tcb->loop != loop)
+    {
+      _dbus_warn ("could not find timeout %p to remove\n", timeout);
+      return;
     }
 
-  _dbus_warn ("could not find timeout %p to remove\n", timeout);
+  _dbus_assert (tcb->timeout == timeout);
+
+  if (tcb->heap_index >= 0)
+    timeout_heap_remove (loop, tcb);
+
+  _dbus_timeout_set_changed_function (timeout, NULL, NULL);
+  loop->callback_list_serial += 1;
+  loop->timeout_count -= 1;
+  timeout_callback_free (tcb);
 }
 
 /* Convolutions from GLib, there really must be a better way
  * to do this.
  */
 static dbus_bool_t
-check_timeout (unsigned long    tv_sec,
+check_timeout (DBusLoop        *loop,
+               unsigned long    tv_sec,
                unsigned long    tv_usec,
                TimeoutCallback *tcb,
                int             *timeout)
 {
   long sec_remaining;
   long msec_remaining;
-  unsigned long expiration_tv_sec;
-  unsigned long expiration_tv_usec;
-  long interval_seconds;
-  long interval_milliseconds;
   int interval;
 
-  /* I'm pretty sure this function could suck (a lot) less */
-  
   interval = dbus_timeout_get_interval (tcb->timeout);
   
-  interval_seconds = interval / 1000L;
-  interval_milliseconds = interval % 1000L;
-  
-  expiration_tv_sec = tcb->last_tv_sec + interval_seconds;
-  expiration_tv_usec = tcb->last_tv_usec + interval_milliseconds * 1000;
-  if (expiration_tv_usec >= 1000000)
-    {
-      expiration_tv_usec -= 1000000;
-      expiration_tv_sec += 1;
-    }
-  
-  sec_remaining = expiration_tv_sec - tv_sec;
+  sec_remaining = tcb->expiration_tv_sec - tv_sec;
   /* need to force this to be signed, as it is intended to sometimes
    * produce a negative result
    */
-  msec_remaining = ((long) expiration_tv_usec - (long) tv_usec) / 1000L;
+  msec_remaining = ((long) tcb->expiration_tv_usec - (long) tv_usec) / 1000L;
 
 #if MAINLOOP_SPEW
-  _dbus_verbose ("Interval is %ld seconds %ld msecs\n",
-                 interval_seconds,
-                 interval_milliseconds);
+  _dbus_verbose ("Interval is %d msecs\n", interval);
   _dbus_verbose ("Now is  %lu seconds %lu usecs\n",
                  tv_sec, tv_usec);
   _dbus_verbose ("Last is %lu seconds %lu usecs\n",
                  tcb->last_tv_sec, tcb->last_tv_usec);
   _dbus_verbose ("Exp is  %lu seconds %lu usecs\n",
-                 expiration_tv_sec, expiration_tv_usec);
+                 tcb->expiration_tv_sec, tcb->expiration_tv_usec);
   _dbus_verbose ("Pre-correction, sec_remaining %ld msec_remaining %ld\n",
                  sec_remaining, msec_remaining);
 #endif
@@ -520,6 +862,7 @@ check_timeout (unsigned long    tv_sec,
       
       tcb->last_tv_sec = tv_sec;
       tcb->last_tv_usec = tv_usec;
+      timeout_callback_reschedule (loop, tcb);
 
       *timeout = interval;
     }
@@ -531,22 +874,35 @@ check_timeout (unsigned long    tv_sec,
   return *timeout == 0;
 }
 
+static DBusConnection *
+pop_need_dispatch (DBusLoop *loop)
+{
+  DBusConnection *connection;
+
+  if (loop->mutex != NULL)
+    _dbus_cmutex_lock (loop->mutex);
+
+  connection = _dbus_list_pop_first (&loop->need_dispatch);
+
+  if (loop->mutex != NULL)
+    _dbus_cmutex_unlock (loop->mutex);
+
+  return connection;
+}
+
 dbus_bool_t
 _dbus_loop_dispatch (DBusLoop *loop)
 {
+  DBusConnection *connection;
 
-#if MAINLOOP_SPEW
-  _dbus_verbose ("  %d connections to dispatch\n", _dbus_list_get_length (&loop->need_dispatch));
-#endif
-  
-  if (loop->need_dispatch == NULL)
+  connection = pop_need_dispatch (loop);
+
+  if (connection == NULL)
     return FALSE;
   
  next:
-  while (loop->need_dispatch != NULL)
+  while (connection != NULL)
     {
-      DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
-      
       while (TRUE)
         {
           DBusDispatchStatus status;
@@ -556,6 +912,7 @@ _dbus_loop_dispatch (DBusLoop *loop)
           if (status == DBUS_DISPATCH_COMPLETE)
             {
               dbus_connection_unref (connection);
+              connection = pop_need_dispatch (loop);
               goto next;
             }
           else
@@ -573,13 +930,69 @@ dbus_bool_t
 _dbus_loop_queue_dispatch (DBusLoop       *loop,
                            DBusConnection *connection)
 {
-  if (_dbus_list_append (&loop->need_dispatch, connection))
+  dbus_bool_t retval;
+
+  if (loop->mutex != NULL)
+    _dbus_cmutex_lock (loop->mutex);
+
+  retval = _dbus_list_append (&loop->need_dispatch, connection);
+
+  if (retval)
     {
       dbus_connection_ref (connection);
-      return TRUE;
+
+      if (loop->mutex != NULL)
+        wakeup_if_polling (loop);
     }
-  else
-    return FALSE;
+
+  if (loop->mutex != NULL)
+    _dbus_cmutex_unlock (loop->mutex);
+
+  return retval;
+}
+
+/* Rounds the loop's poll buffer up to a multiple of this many entries */
+#define READY_FDS_INCREMENT 64
+
+/* Returns the loop's poll buffer, big enough for every watched fd if
+ * possible, or NULL if it's already in use or can't be allocated. */
+static DBusSocketEvent *
+get_ready_fds (DBusLoop *loop,
+               int      *n_ready_fds)
+{
+  int n_fds;
+
+  if (loop->ready_fds_in_use)
+    return NULL;
+
+  n_fds = _dbus_hash_table_get_n_entries (loop->watches);
+
+  if (loop->mutex != NULL)
+    n_fds += 1; /* wakeup_read_fd */
+
+  if (n_fds > loop->ready_fds_allocated)
+    {
+      DBusSocketEvent *bigger;
+      int allocated;
+
+      allocated = (n_fds + READY_FDS_INCREMENT - 1) / READY_FDS_INCREMENT *
+        READY_FDS_INCREMENT;
+      bigger = dbus_realloc (loop->ready_fds,
+                             allocated * sizeof (DBusSocketEvent));
+
+      if (bigger != NULL)
+        {
+          loop->ready_fds = bigger;
+          loop->ready_fds_allocated = allocated;
+        }
+    }
+
+  if (loop->ready_fds == NULL)
+    return NULL;
+
+  loop->ready_fds_in_use = TRUE;
+  *n_ready_fds = loop->ready_fds_allocated;
+  return loop->ready_fds;
 }
 
 /* Returns TRUE if we invoked any timeouts or have ready file
@@ -592,7 +1005,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
 {  
 #define N_STACK_DESCRIPTORS 64
   dbus_bool_t retval;
-  DBusSocketEvent ready_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent stack_ready_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent *ready_fds;
+  int n_ready_fds;
   int i;
   DBusList *link;
   int n_ready;
@@ -601,6 +1016,7 @@ _dbus_loop_iterate (DBusLoop     *loop,
   int orig_depth;
 
   retval = FALSE;      
+  ready_fds = NULL;
 
   orig_depth = loop->depth;
   
@@ -609,58 +1025,43 @@ _dbus_loop_iterate (DBusLoop     *loop,
                  block, loop->depth, loop->timeout_count, loop->watch_count);
 #endif
 
-  if (_dbus_hash_table_get_n_entries (loop->watches) == 0 &&
-      loop->timeouts == NULL)
+  /* A threaded loop can always be woken up by another thread */
+  if (loop->mutex == NULL &&
+      _dbus_hash_table_get_n_entries (loop->watches) == 0 &&
+      loop->timeout_count == 0)
     goto next_iteration;
 
   timeout = -1;
-  if (loop->timeout_count > 0)
+  if (loop->timeout_heap_size > 0)
     {
       unsigned long tv_sec;
       unsigned long tv_usec;
+      TimeoutCallback *tcb;
+      int msecs_remaining;
       
       _dbus_get_monotonic_time (&tv_sec, &tv_usec);
 
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
+      /* The top of the heap expires first, unless checking it finds
+       * the clock went backwards and moves it further down */
+      do
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
-
-          if (dbus_timeout_get_enabled (tcb->timeout))
-            {
-              int msecs_remaining;
-
-              check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
+          tcb = loop->timeout_heap[0];
+          check_timeout (loop, tv_sec, tv_usec, tcb, &msecs_remaining);
+        }
+      while (tcb != loop->timeout_heap[0]);
 
-              if (timeout < 0)
-                timeout = msecs_remaining;
-              else
-                timeout = MIN (msecs_remaining, timeout);
+      timeout = msecs_remaining;
+      _dbus_assert (timeout >= 0);
 
 #if MAINLOOP_SPEW
-              _dbus_verbose ("  timeout added, %d remaining, aggregate timeout %ld\n",
-                             msecs_remaining, timeout);
-#endif
-              
-              _dbus_assert (timeout >= 0);
-                  
-              if (timeout == 0)
-                break; /* it's not going to get shorter... */
-            }
-#if MAINLOOP_SPEW
-          else
-            {
-              _dbus_verbose ("  skipping disabled timeout\n");
-            }
+      _dbus_verbose ("  %d enabled timeouts, aggregate timeout %ld\n",
+                     loop->timeout_heap_size, timeout);
 #endif
-          
-          link = next;
-        }
     }
 
-  /* Never block if we have stuff to dispatch */
-  if (!block || loop->need_dispatch != NULL)
+  /* Never block if we have stuff to dispatch (for a threaded loop, we
+   * check that with the mutex held, just before polling) */
+  if (!block || (loop->mutex == NULL && loop->need_dispatch != NULL))
     {
       timeout = 0;
 #if MAINLOOP_SPEW
@@ -678,8 +1079,48 @@ _dbus_loop_iterate (DBusLoop     *loop,
   _dbus_verbose ("  polling on %d descriptors timeout %ld\n", n_fds, timeout);
 #endif
 
+  ready_fds = get_ready_fds (loop, &n_ready_fds);
+
+  if (ready_fds == NULL)
+    {
+      ready_fds = stack_ready_fds;
+      n_ready_fds = _DBUS_N_ELEMENTS (stack_ready_fds);
+    }
+
+  if (loop->mutex != NULL)
+    {
+      _dbus_cmutex_lock (loop->mutex);
+
+      refresh_toggled_watches (loop);
+
+      if (loop->need_dispatch != NULL || loop->wakeup_requested)
+        timeout = 0;
+
+      loop->wakeup_requested = FALSE;
+      loop->polling = TRUE;
+
+      _dbus_cmutex_unlock (loop->mutex);
+    }
+
   n_ready = _dbus_socket_set_poll (loop->socket_set, ready_fds,
-                                   _DBUS_N_ELEMENTS (ready_fds), timeout);
+                                   n_ready_fds, timeout);
+
+  if (loop->mutex != NULL)
+    {
+      _dbus_cmutex_lock (loop->mutex);
+
+      loop->polling = FALSE;
+
+      if (loop->wakeup_written)
+        {
+          /* only one byte is written each time we poll */
+          _dbus_read_socket (loop->wakeup_read_fd, &loop->wakeup_buffer, 1);
+          _dbus_string_set_length (&loop->wakeup_buffer, 0);
+          loop->wakeup_written = FALSE;
+        }
+
+      _dbus_cmutex_unlock (loop->mutex);
+    }
 
   /* re-enable any watches we skipped this time */
   if (loop->oom_watch_pending)
@@ -723,19 +1164,19 @@ _dbus_loop_iterate (DBusLoop     *loop,
 
   initial_serial = loop->callback_list_serial;
 
-  if (loop->timeout_count > 0)
+  if (loop->timeout_heap_size > 0)
     {
       unsigned long tv_sec;
       unsigned long tv_usec;
 
       _dbus_get_monotonic_time (&tv_sec, &tv_usec);
 
-      /* It'd be nice to avoid this O(n) thingy here */
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
+      /* Fire timeouts from the top of the heap until we reach one that
+       * hasn't expired; only the expired ones are visited */
+      while (loop->timeout_heap_size > 0)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
+          TimeoutCallback *tcb = loop->timeout_heap[0];
+          int msecs_remaining;
 
           if (initial_serial != loop->callback_list_serial)
             goto next_iteration;
@@ -743,43 +1184,42 @@ _dbus_loop_iterate (DBusLoop     *loop,
           if (loop->depth != orig_depth)
             goto next_iteration;
 
-          if (dbus_timeout_get_enabled (tcb->timeout))
-            {
-              int msecs_remaining;
-              
-              if (check_timeout (tv_sec, tv_usec,
-                                 tcb, &msecs_remaining))
-                {
-                  /* Save last callback time and fire this timeout */
-                  tcb->last_tv_sec = tv_sec;
-                  tcb->last_tv_usec = tv_usec;
-
-#if MAINLOOP_SPEW
-                  _dbus_verbose ("  invoking timeout\n");
-#endif
-
-                  /* can theoretically return FALSE on OOM, but we just
-                   * let it fire again later - in practice that's what
-                   * every wrapper callback in dbus-daemon used to do */
-                  dbus_timeout_handle (tcb->timeout);
+          /* Already fired on this iteration (it has an interval of 0),
+           * and so has everything else that has expired */
+          if (tcb->last_tv_sec == tv_sec &&
+              tcb->last_tv_usec == tv_usec)
+            break;
 
-                  retval = TRUE;
-                }
-              else
+          if (!check_timeout (loop, tv_sec, tv_usec,
+                              tcb, &msecs_remaining))
+            {
+              if (tcb == loop->timeout_heap[0])
                 {
 #if MAINLOOP_SPEW
-                  _dbus_verbose ("  timeout has not expired\n");
+                  _dbus_verbose ("  no more timeouts have expired\n");
 #endif
+                  break;
                 }
+
+              /* the clock went backwards, so it was rescheduled */
+              continue;
             }
+
+          /* Save last callback time and fire this timeout */
+          tcb->last_tv_sec = tv_sec;
+          tcb->last_tv_usec = tv_usec;
+          timeout_callback_reschedule (loop, tcb);
+
 #if MAINLOOP_SPEW
-          else
-            {
-              _dbus_verbose ("  skipping invocation of disabled timeout\n");
-            }
+          _dbus_verbose ("  invoking timeout\n");
 #endif
 
-          link = next;
+          /* can theoretically return FALSE on OOM, but we just
+           * let it fire again later - in practice that's what
+           * every wrapper callback in dbus-daemon used to do */
+          dbus_timeout_handle (tcb->timeout);
+
+          retval = TRUE;
         }
     }
 
@@ -802,6 +1242,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
           if (loop->depth != orig_depth)
             goto next_iteration;
 
+          if (ready_fds[i].fd == loop->wakeup_read_fd)
+            continue;
+
           _dbus_assert (ready_fds[i].flags != 0);
 
           if (_DBUS_UNLIKELY (ready_fds[i].flags & _DBUS_WATCH_NVAL))
@@ -877,6 +1320,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
   _dbus_verbose ("  moving to next iteration\n");
 #endif
 
+  if (ready_fds != NULL && ready_fds == loop->ready_fds)
+    loop->ready_fds_in_use = FALSE;
+
   if (_dbus_loop_dispatch (loop))
     retval = TRUE;
   
@@ -919,6 +1365,21 @@ _dbus_loop_quit (DBusLoop *loop)
                  loop->depth + 1, loop->depth);
 }
 
+#ifdef DBUS_ENABLE_STATS
+void
+_dbus_loop_get_stats (DBusLoop      *loop,
+                      dbus_uint32_t *polls_p,
+                      dbus_uint32_t *events_p,
+                      dbus_uint32_t *watch_changes_p,
+                      dbus_uint32_t *watch_change_calls_p)
+{
+  *polls_p = loop->socket_set->n_polls;
+  *events_p = loop->socket_set->n_events;
+  *watch_changes_p = loop->socket_set->n_changes;
+  *watch_change_calls_p = loop->socket_set->n_change_calls;
+}
+#endif
+
 int
 _dbus_get_oom_wait (void)
 {
@@ -937,4 +1398,450 @@ _dbus_wait_for_memory (void)
   _dbus_sleep_milliseconds (_dbus_get_oom_wait ());
 }
 
+#ifdef DBUS_BUILD_TESTS
+#include <dbus/dbus-test.h>
+
+typedef struct
+{
+  DBusLoop *loop;
+  DBusTimeout *timeout;
+  int n_fired;
+  int *order;          /**< where to record the firing order, or NULL */
+  int *n_order;
+  int id;
+  dbus_bool_t one_shot;
+  DBusTimeout *remove; /**< timeout to remove when fired, or NULL */
+  dbus_bool_t remove_self;
+} TestTimeout;
+
+/* Checks that the heap is ordered and every entry knows where it is */
+static void
+check_timeout_heap (DBusLoop *loop)
+{
+  int i;
+
+  _dbus_assert (loop->timeout_heap_size >= 0);
+  _dbus_assert (loop->timeout_heap_size <= loop->timeout_count);
+  _dbus_assert (loop->timeout_count <= loop->timeout_heap_allocated);
+
+  for (i = 0; i < loop->timeout_heap_size; i++)
+    {
+      TimeoutCallback *tcb = loop->timeout_heap[i];
+
+      _dbus_assert (tcb->heap_index == i);
+      _dbus_assert (dbus_timeout_get_enabled (tcb->timeout));
+
+      if (i > 0)
+        _dbus_assert (!timeout_callback_expires_before (tcb,
+            loop->timeout_heap[(i - 1) / 2]));
+    }
+}
+
+static TimeoutCallback *
+get_timeout_callback (DBusTimeout *timeout)
+{
+  return _dbus_timeout_get_changed_data (timeout);
+}
+
+static dbus_bool_t
+test_timeout_handler (void *data)
+{
+  TestTimeout *tt = data;
+
+  tt->n_fired += 1;
+
+  if (tt->order != NULL)
+    {
+      tt->order[*tt->n_order] = tt->id;
+      *tt->n_order += 1;
+    }
+
+  if (tt->one_shot)
+    _dbus_timeout_set_enabled (tt->timeout, FALSE);
+
+  if (tt->remove != NULL && _dbus_timeout_get_changed_data (tt->remove))
+    _dbus_loop_remove_timeout (tt->loop, tt->remove);
+
+  if (tt->remove_self && _dbus_timeout_get_changed_data (tt->timeout))
+    _dbus_loop_remove_timeout (tt->loop, tt->timeout);
+
+  check_timeout_heap (tt->loop);
+
+  return TRUE;
+}
+
+static void
+test_timeout_init (TestTimeout *tt,
+                   DBusLoop    *loop,
+                   int          id,
+                   int          interval)
+{
+  _DBUS_ZERO (*tt);
+  tt->loop = loop;
+  tt->id = id;
+  tt->timeout = _dbus_timeout_new (interval, test_timeout_handler, tt, NULL);
+  if (tt->timeout == NULL ||
+      !_dbus_loop_add_timeout (loop, tt->timeout))
+    _dbus_assert_not_reached ("no memory for timeout");
+
+  check_timeout_heap (loop);
+}
+
+static void
+test_timeout_clear (TestTimeout *tt)
+{
+  if (_dbus_timeout_get_changed_data (tt->timeout) != NULL)
+    _dbus_loop_remove_timeout (tt->loop, tt->timeout);
+
+  check_timeout_heap (tt->loop);
+  _dbus_timeout_unref (tt->timeout);
+  tt->timeout = NULL;
+}
+
+/* Timeouts fire in order of expiry, whatever order they were added in */
+static void
+check_timeout_order (void)
+{
+  static const int intervals[] = { 80, 20, 60, 40, 100, 0 };
+  TestTimeout tts[_DBUS_N_ELEMENTS (intervals)];
+  int order[_DBUS_N_ELEMENTS (intervals)];
+  int n_order;
+  DBusLoop *loop;
+  int i;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    _dbus_assert_not_reached ("no memory for loop");
+
+  n_order = 0;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (intervals); i++)
+    {
+      test_timeout_init (&tts[i], loop, i, intervals[i]);
+      tts[i].one_shot = TRUE;
+      tts[i].order = order;
+      tts[i].n_order = &n_order;
+    }
+
+  _dbus_assert (get_timeout_callback (loop->timeout_heap[0]->timeout) ==
+                get_timeout_callback (tts[5].timeout));
+
+  while (n_order < (int) _DBUS_N_ELEMENTS (intervals))
+    _dbus_loop_iterate (loop, TRUE);
+
+  _dbus_assert (order[0] == 5);
+  _dbus_assert (order[1] == 1);
+  _dbus_assert (order[2] == 3);
+  _dbus_assert (order[3] == 2);
+  _dbus_assert (order[4] == 0);
+  _dbus_assert (order[5] == 4);
+
+  _dbus_assert (loop->timeout_heap_size == 0);
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (intervals); i++)
+    {
+      _dbus_assert (tts[i].n_fired == 1);
+      test_timeout_clear (&tts[i]);
+    }
+
+  _dbus_assert (loop->timeout_count == 0);
+  _dbus_loop_unref (loop);
+}
+
+/* Changing a timeout's interval or enabling or disabling it moves it
+ * within the heap */
+static void
+check_timeout_changes (void)
+{
+  TestTimeout a, b, c;
+  DBusLoop *loop;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    _dbus_assert_not_reached ("no memory for loop");
+
+  test_timeout_init (&a, loop, 0, 1000);
+  test_timeout_init (&b, loop, 1, 2000);
+  test_timeout_init (&c, loop, 2, 3000);
+  _dbus_assert (loop->timeout_heap[0] == get_timeout_callback (a.timeout));
+
+  _dbus_timeout_set_interval (a.timeout, 10000);
+  check_timeout_heap (loop);
+  _dbus_assert (loop->timeout_heap[0] == get_timeout_callback (b.timeout));
+
+  _dbus_timeout_set_enabled (b.timeout, FALSE);
+  check_timeout_heap (loop);
+  _dbus_assert (loop->timeout_heap_size == 2);
+  _dbus_assert (get_timeout_callback (b.timeout)->heap_index == -1);
+  _dbus_assert (loop->timeout_heap[0] == get_timeout_callback (c.timeout));
+
+  /* a disabled timeout's interval can change too */
+  _dbus_timeout_set_interval (b.timeout, 500);
+  check_timeout_heap (loop);
+  _dbus_assert (loop->timeout_heap_size == 2);
+
+  _dbus_timeout_set_enabled (b.timeout, TRUE);
+  check_timeout_heap (loop);
+  _dbus_assert (loop->timeout_heap_size == 3);
+  _dbus_assert (loop->timeout_heap[0] == get_timeout_callback (b.timeout));
+
+  _dbus_timeout_set_interval (c.timeout, 0);
+  check_timeout_heap (loop);
+  _dbus_assert (loop->timeout_heap[0] == get_timeout_callback (c.timeout));
+
+  _dbus_timeout_set_interval (c.timeout, 20000);
+  check_timeout_heap (loop);
+  _dbus_assert (loop->timeout_heap[0] == get_timeout_callback (b.timeout));
+  _dbus_assert (loop->timeout_heap[1] == get_timeout_callback (a.timeout) ||
+                loop->timeout_heap[2] == get_timeout_callback (a.timeout));
+
+  _dbus_timeout_set_enabled (a.timeout, FALSE);
+  _dbus_timeout_set_enabled (b.timeout, FALSE);
+  _dbus_timeout_set_enabled (c.timeout, FALSE);
+  check_timeout_heap (loop);
+  _dbus_assert (loop->timeout_heap_size == 0);
+
+  /* nothing fires once everything is disabled */
+  _dbus_loop_iterate (loop, FALSE);
+  _dbus_assert (a.n_fired == 0 && b.n_fired == 0 && c.n_fired == 0);
+
+  test_timeout_clear (&a);
+  test_timeout_clear (&b);
+  test_timeout_clear (&c);
+  _dbus_loop_unref (loop);
+}
+
+/* A timeout can remove itself or another timeout while it runs */
+static void
+check_timeout_removal (void)
+{
+  TestTimeout a, b, c, d;
+  DBusLoop *loop;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    _dbus_assert_not_reached ("no memory for loop");
+
+  /* a and b expire together, and whichever goes first removes both */
+  test_timeout_init (&a, loop, 0, 0);
+  test_timeout_init (&b, loop, 1, 0);
+  a.remove_self = TRUE;
+  a.remove = b.timeout;
+  b.remove_self = TRUE;
+  b.remove = a.timeout;
+
+  /* c removes d, which has not expired */
+  test_timeout_init (&c, loop, 2, 0);
+  test_timeout_init (&d, loop, 3, 60000);
+  c.remove = d.timeout;
+
+  while (a.n_fired + b.n_fired == 0 || c.n_fired == 0)
+    _dbus_loop_iterate (loop, FALSE);
+
+  _dbus_assert (a.n_fired + b.n_fired == 1);
+  _dbus_assert (_dbus_timeout_get_changed_data (a.timeout) == NULL);
+  _dbus_assert (_dbus_timeout_get_changed_data (b.timeout) == NULL);
+  _dbus_assert (_dbus_timeout_get_changed_data (d.timeout) == NULL);
+  _dbus_assert (d.n_fired == 0);
+  _dbus_assert (loop->timeout_count == 1);
+  _dbus_assert (loop->timeout_heap_size == 1);
+  _dbus_assert (loop->timeout_heap[0] == get_timeout_callback (c.timeout));
+
+  /* c still fires after the removals */
+  c.n_fired = 0;
+  while (c.n_fired == 0)
+    _dbus_loop_iterate (loop, FALSE);
+
+  test_timeout_clear (&a);
+  test_timeout_clear (&b);
+  test_timeout_clear (&c);
+  test_timeout_clear (&d);
+  _dbus_assert (loop->timeout_count == 0);
+  _dbus_loop_unref (loop);
+}
+
+/* A timeout with an interval of 0 fires at most once per iteration */
+static void
+check_zero_interval_timeouts (void)
+{
+  TestTimeout a, b;
+  DBusLoop *loop;
+  int i;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    _dbus_assert_not_reached ("no memory for loop");
+
+  test_timeout_init (&a, loop, 0, 0);
+  test_timeout_init (&b, loop, 1, 0);
+
+  for (i = 1; i <= 5; i++)
+    {
+      /* make sure the clock has moved on since the last iteration */
+      _dbus_sleep_milliseconds (1);
+
+      _dbus_loop_iterate (loop, FALSE);
+      _dbus_assert (a.n_fired == i);
+      _dbus_assert (b.n_fired == i);
+      check_timeout_heap (loop);
+    }
+
+  test_timeout_clear (&a);
+  test_timeout_clear (&b);
+  _dbus_loop_unref (loop);
+}
+
+typedef struct
+{
+  DBusLoop *loop;
+  DBusWatchList *watches;
+  DBusWatch *watch; /**< watch to enable, or NULL to just wake the loop */
+} TestWaker;
+
+static dbus_bool_t
+test_add_watch (DBusWatch *watch,
+                void      *data)
+{
+  return _dbus_loop_add_watch (data, watch);
+}
+
+static void
+test_remove_watch (DBusWatch *watch,
+                   void      *data)
+{
+  _dbus_loop_remove_watch (data, watch);
+}
+
+static void
+test_toggle_watch (DBusWatch *watch,
+                   void      *data)
+{
+  _dbus_loop_toggle_watch (data, watch);
+}
+
+static void
+test_waker_main (void *data)
+{
+  TestWaker *waker = data;
+
+  /* give the loop a chance to start polling */
+  _dbus_sleep_milliseconds (50);
+
+  if (waker->watch != NULL)
+    _dbus_watch_list_toggle_watch (waker->watches, waker->watch, TRUE);
+  else
+    _dbus_loop_wakeup (waker->loop);
+}
+
+static DBusThread *
+test_waker_start (TestWaker *waker)
+{
+  DBusThread *thread;
+
+  thread = _dbus_platform_thread_start (test_waker_main, waker);
+  if (thread == NULL)
+    _dbus_assert_not_reached ("no memory for thread");
+
+  return thread;
+}
+
+static dbus_bool_t
+test_watch_handler (DBusWatch    *watch,
+                    unsigned int  condition,
+                    void         *data)
+{
+  int *n_handled = data;
+
+  *n_handled += 1;
+  return TRUE;
+}
+
+/* Other threads can wake up a threaded loop, and enable its watches */
+static void
+check_threaded_wakeup (void)
+{
+  TestTimeout watchdog;
+  TestWaker waker;
+  DBusThread *thread;
+  DBusWatch *watch;
+  DBusString byte;
+  DBusLoop *loop;
+  int fds[2];
+  int n_handled;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL || !_dbus_loop_enable_threads (loop, NULL))
+    _dbus_assert_not_reached ("no memory for loop");
+
+  /* a wakeup before we poll makes the next iteration return at once,
+   * even though there is nothing to wait for */
+  _dbus_loop_wakeup (loop);
+  _dbus_loop_iterate (loop, TRUE);
+
+  /* so does one from another thread, whether or not we're polling yet */
+  waker.loop = loop;
+  waker.watch = NULL;
+  thread = test_waker_start (&waker);
+  _dbus_loop_iterate (loop, TRUE);
+  _dbus_platform_thread_join (thread);
+
+  /* a watch that another thread enables is polled straight away */
+  if (!_dbus_full_duplex_pipe (&fds[0], &fds[1], FALSE, NULL))
+    _dbus_assert_not_reached ("no socket pair");
+
+  _dbus_string_init_const (&byte, "x");
+  if (_dbus_write_socket (fds[1], &byte, 0, 1) != 1)
+    _dbus_assert_not_reached ("couldn't write to socket pair");
+
+  waker.watches = _dbus_watch_list_new ();
+  if (waker.watches == NULL ||
+      !_dbus_watch_list_set_functions (waker.watches, test_add_watch,
+                                       test_remove_watch, test_toggle_watch,
+                                       loop, NULL))
+    _dbus_assert_not_reached ("no memory for watch list");
+
+  n_handled = 0;
+  watch = _dbus_watch_new (fds[0], DBUS_WATCH_READABLE, FALSE,
+                           test_watch_handler, &n_handled, NULL);
+  if (watch == NULL || !_dbus_watch_list_add_watch (waker.watches, watch))
+    _dbus_assert_not_reached ("no memory for watch");
+
+  /* if the loop didn't notice, we'd only wake up for this */
+  test_timeout_init (&watchdog, loop, 0, 10000);
+
+  waker.watch = watch;
+  thread = test_waker_start (&waker);
+
+  while (n_handled == 0 && watchdog.n_fired == 0)
+    _dbus_loop_iterate (loop, TRUE);
+
+  _dbus_platform_thread_join (thread);
+
+  _dbus_assert (n_handled > 0);
+  _dbus_assert (watchdog.n_fired == 0);
+
+  _dbus_watch_list_remove_watch (waker.watches, watch);
+  _dbus_watch_invalidate (watch);
+  _dbus_watch_unref (watch);
+  _dbus_watch_list_free (waker.watches);
+  test_timeout_clear (&watchdog);
+  _dbus_close_socket (fds[0], NULL);
+  _dbus_close_socket (fds[1], NULL);
+  _dbus_loop_unref (loop);
+}
+
+/* Unit test for the main loop's timeout scheduling and threaded mode */
+dbus_bool_t
+_dbus_mainloop_test (void)
+{
+  check_timeout_order ();
+  check_timeout_changes ();
+  check_timeout_removal ();
+  check_zero_interval_timeouts ();
+  check_threaded_wakeup ();
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
+
 #endif /* !DOXYGEN_SHOULD_SKIP_THIS */
@@ -37,6 +37,9 @@ typedef dbus_bool_t (* DBusWatchFunction)   (DBusWatch     *watch,
 DBusLoop*   _dbus_loop_new            (void);
 DBusLoop*   _dbus_loop_ref            (DBusLoop            *loop);
 void        _dbus_loop_unref          (DBusLoop            *loop);
+dbus_bool_t _dbus_loop_enable_threads (DBusLoop            *loop,
+                                       DBusError           *error);
+void        _dbus_loop_wakeup         (DBusLoop            *loop);
 dbus_bool_t _dbus_loop_add_watch      (DBusLoop            *loop,
                                        DBusWatch           *watch);
 void        _dbus_loop_remove_watch   (DBusLoop            *loop,
@@ -57,6 +60,13 @@ dbus_bool_t _dbus_loop_iterate        (DBusLoop            *loop,
                                        dbus_bool_t          block);
 dbus_bool_t _dbus_loop_dispatch       (DBusLoop            *loop);
 
+/* if DBUS_ENABLE_STATS */
+void        _dbus_loop_get_stats      (DBusLoop            *loop,
+                                       dbus_uint32_t       *polls_p,
+                                       dbus_uint32_t       *events_p,
+                                       dbus_uint32_t       *watch_changes_p,
+                                       dbus_uint32_t       *watch_change_calls_p);
+
 int  _dbus_get_oom_wait    (void);
 void _dbus_wait_for_memory (void);
 
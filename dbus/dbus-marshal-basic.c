@@ -960,7 +960,41 @@ _dbus_swap_array (unsigned char *data,
    */
   d = data;
   end = d + (n_elements * alignment);
-  
+
+#ifdef DBUS_HAVE_INT64
+  /* 2- and 8-byte elements each take one instruction (or vectorize) as
+   * they are, but 4-byte ones don't vectorize without instructions
+   * beyond the baseline, so swap them in pairs: a 64-bit swap, and a
+   * rotation to put the pair back in order */
+  if (alignment == 4)
+    {
+      unsigned char *words;
+
+      words = _DBUS_ALIGN_ADDRESS (d, 8);
+
+      if (end - words >= 8)
+        {
+          unsigned char *words_end;
+
+          words_end = words + ((end - words) & ~7);
+
+          if (d != words)
+            {
+              *((dbus_uint32_t*)d) = DBUS_UINT32_SWAP_LE_BE (*((dbus_uint32_t*)d));
+              d += 4;
+            }
+
+          for (; d != words_end; d += 8)
+            {
+              dbus_uint64_t w;
+
+              w = DBUS_UINT64_SWAP_LE_BE (*((dbus_uint64_t*)d));
+              *((dbus_uint64_t*)d) = (w << 32) | (w >> 32);
+            }
+        }
+    }
+#endif
+
   if (alignment == 8)
     {
       while (d != end)
@@ -1986,6 +2020,45 @@ _dbus_marshal_test (void)
         break;
     }
 
+  /* Swapping in words has to agree with swapping each element, whatever
+   * the array's alignment within a word and however long it is */
+  {
+    union { double align; unsigned char bytes[64]; } swapped, expected;
+    int alignment;
+
+    for (alignment = 2; alignment <= 8; alignment *= 2)
+      {
+        int start;
+
+        for (start = 0; start < 8; start += alignment)
+          {
+            int n_elements;
+
+            for (n_elements = 0;
+                 start + n_elements * alignment <= (int) sizeof (swapped.bytes);
+                 n_elements++)
+              {
+                int i;
+
+                for (i = 0; i < (int) sizeof (swapped.bytes); i++)
+                  swapped.bytes[i] = expected.bytes[i] = i;
+
+                for (i = start; i < start + n_elements * alignment; i += alignment)
+                  {
+                    int j;
+
+                    for (j = 0; j < alignment; j++)
+                      expected.bytes[i + j] = i + alignment - 1 - j;
+                  }
+
+                _dbus_swap_array (swapped.bytes + start, n_elements, alignment);
+                _dbus_assert (memcmp (swapped.bytes, expected.bytes,
+                                      sizeof (swapped.bytes)) == 0);
+              }
+          }
+      }
+  }
+
   /* Clean up */
   _dbus_string_free (&str);
 
@@ -26,6 +26,7 @@
 #include "dbus-marshal-header.h"
 #include "dbus-marshal-recursive.h"
 #include "dbus-marshal-byteswap.h"
+#include "dbus-hash.h"
 
 /**
  * @addtogroup DBusMarshal
@@ -139,6 +140,8 @@ _dbus_header_cache_invalidate_all (DBusHeader *header)
   while (i <= DBUS_HEADER_FIELD_LAST)
     {
       header->fields[i].value_pos = _DBUS_HEADER_FIELD_VALUE_UNKNOWN;
+      header->fields[i].str_len = -1;
+      header->fields[i].str_hashed = FALSE;
       ++i;
     }
 }
@@ -157,6 +160,8 @@ _dbus_header_cache_one (DBusHeader     *header,
 {
   header->fields[field_code].value_pos =
     _dbus_type_reader_get_value_pos (variant_reader);
+  header->fields[field_code].str_len = -1;
+  header->fields[field_code].str_hashed = FALSE;
 
 #if 0
   _dbus_verbose ("cached value_pos %d for field %d\n",
@@ -194,6 +199,8 @@ _dbus_header_cache_revalidate (DBusHeader *header)
   while (i <= DBUS_HEADER_FIELD_LAST)
     {
       header->fields[i].value_pos = _DBUS_HEADER_FIELD_VALUE_NONEXISTENT;
+      header->fields[i].str_len = -1;
+      header->fields[i].str_hashed = FALSE;
       ++i;
     }
 
@@ -650,6 +657,22 @@ _dbus_header_create (DBusHeader  *header,
   return FALSE;
 }
 
+/* Like _dbus_marshal_read_uint32(), but for a value that is only
+ * aligned relative to the start of its message, which need not itself
+ * be aligned within @str.
+ */
+static dbus_uint32_t
+read_uint32_unaligned (const DBusString *str,
+                       int               pos,
+                       int               byte_order)
+{
+  dbus_uint32_t v;
+
+  memcpy (&v, _dbus_string_get_const_data_len (str, pos, 4), 4);
+
+  return _dbus_unpack_uint32 (byte_order, (const unsigned char *) &v);
+}
+
 /**
  * Given data long enough to contain the length of the message body
  * and the fields array, check whether the data is long enough to
@@ -663,7 +686,7 @@ _dbus_header_create (DBusHeader  *header,
  * @param header_len return location for claimed header length
  * @param body_len return location for claimed body length
  * @param str the data
- * @param start start of data, 8-aligned
+ * @param start start of data; need not be aligned
  * @param len length of data
  * @returns #TRUE if the data is long enough for the claimed length, and the lengths were valid
  */
@@ -687,8 +710,6 @@ _dbus_header_have_message_untrusted (int                max_message_length,
   _dbus_assert (start < _DBUS_INT32_MAX / 2);
   _dbus_assert (len >= 0);
 
-  _dbus_assert (start == (int) _DBUS_ALIGN_VALUE (start, 8));
-
   *byte_order = _dbus_string_get_byte (str, start + BYTE_ORDER_OFFSET);
 
   if (*byte_order != DBUS_LITTLE_ENDIAN && *byte_order != DBUS_BIG_ENDIAN)
@@ -698,8 +719,8 @@ _dbus_header_have_message_untrusted (int                max_message_length,
     }
 
   _dbus_assert (FIELDS_ARRAY_LENGTH_OFFSET + 4 <= len);
-  fields_array_len_unsigned = _dbus_marshal_read_uint32 (str, start + FIELDS_ARRAY_LENGTH_OFFSET,
-                                                         *byte_order, NULL);
+  fields_array_len_unsigned = read_uint32_unaligned (str, start + FIELDS_ARRAY_LENGTH_OFFSET,
+                                                     *byte_order);
 
   if (fields_array_len_unsigned > (unsigned) max_message_length)
     {
@@ -708,8 +729,8 @@ _dbus_header_have_message_untrusted (int                max_message_length,
     }
 
   _dbus_assert (BODY_LENGTH_OFFSET + 4 < len);
-  body_len_unsigned = _dbus_marshal_read_uint32 (str, start + BODY_LENGTH_OFFSET,
-                                                 *byte_order, NULL);
+  body_len_unsigned = read_uint32_unaligned (str, start + BODY_LENGTH_OFFSET,
+                                             *byte_order);
 
   if (body_len_unsigned > (unsigned) max_message_length)
     {
@@ -960,7 +981,8 @@ load_and_validate_field (DBusHeader     *header,
  * @param body_len claimed length of body
  * @param header_len claimed length of header
  * @param str a string
- * @param start start of header, 8-aligned
+ * @param start start of header; need not be aligned, since the header
+ *   is validated after being copied out of @p str
  * @param len length of string to look at
  * @returns #FALSE if no memory or data was invalid, #TRUE otherwise
  */
@@ -987,7 +1009,6 @@ _dbus_header_load (DBusHeader        *header,
   int padding_len;
   int i;
 
-  _dbus_assert (start == (int) _DBUS_ALIGN_VALUE (start, 8));
   _dbus_assert (header_len <= len);
   _dbus_assert (_dbus_string_get_length (&header->data) == 0);
 
@@ -1000,14 +1021,14 @@ _dbus_header_load (DBusHeader        *header,
 
   if (mode == DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
-      leftover = len - header_len - body_len - start;
+      leftover = len - header_len - body_len;
     }
   else
     {
       v = _dbus_validate_body_with_reason (&_dbus_header_signature_str, 0,
                                            byte_order,
                                            &leftover,
-                                           str, start, len);
+                                           &header->data, 0, header_len);
       
       if (v != DBUS_VALID)
         {
@@ -1019,13 +1040,13 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_assert (leftover < len);
 
   padding_len = header_len - (FIRST_FIELD_OFFSET + fields_array_len);
-  padding_start = start + FIRST_FIELD_OFFSET + fields_array_len;
-  _dbus_assert (start + header_len == (int) _DBUS_ALIGN_VALUE (padding_start, 8));
-  _dbus_assert (start + header_len == padding_start + padding_len);
+  padding_start = FIRST_FIELD_OFFSET + fields_array_len;
+  _dbus_assert (header_len == (int) _DBUS_ALIGN_VALUE (padding_start, 8));
+  _dbus_assert (header_len == padding_start + padding_len);
 
   if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
-      if (!_dbus_string_validate_nul (str, padding_start, padding_len))
+      if (!_dbus_string_validate_nul (&header->data, padding_start, padding_len))
         {
           *validity = DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
           goto invalid;
@@ -1047,7 +1068,7 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_type_reader_init (&reader,
                           byte_order,
                           &_dbus_header_signature_str, 0,
-                          str, start);
+                          &header->data, 0);
 
   /* BYTE ORDER */
   _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
@@ -1256,6 +1277,106 @@ find_field_for_modification (DBusHeader     *header,
   return retval;
 }
 
+/**
+ * Appends a string or object path field by writing its marshaled bytes
+ * straight after the current last field. Fields always start 8-aligned
+ * and the header is already padded to 8, so the new field goes where
+ * the padding ends, and the old padding becomes padding inside the
+ * array. No other field moves, so the rest of the cache stays valid.
+ *
+ * @param header the header
+ * @param field the field to append, which must not already exist
+ * @param type #DBUS_TYPE_STRING or #DBUS_TYPE_OBJECT_PATH
+ * @param value the value
+ * @returns #FALSE if no memory
+ */
+static dbus_bool_t
+append_string_field (DBusHeader *header,
+                     int         field,
+                     int         type,
+                     const char *value)
+{
+  unsigned char *p;
+  char byte_order;
+  int value_len;
+  int field_start;
+  int field_len;
+  int padding;
+
+  _dbus_assert (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH);
+  _dbus_assert (_dbus_header_cache_known_nonexistent (header, field));
+
+  byte_order = _dbus_header_get_byte_order (header);
+  value_len = strlen (value);
+
+  field_start = _dbus_string_get_length (&header->data);
+  _dbus_assert (_DBUS_ALIGN_VALUE (field_start, 8) == (unsigned) field_start);
+
+  /* byte code, signature "s" or "o", uint32 length, value, nul */
+  field_len = 4 + 4 + value_len + 1;
+  padding = _DBUS_ALIGN_VALUE (field_len, 8) - field_len;
+
+  if (!_dbus_string_lengthen (&header->data, field_len + padding))
+    return FALSE;
+
+  p = (unsigned char *) _dbus_string_get_data_len (&header->data, field_start,
+                                                   field_len + padding);
+  p[0] = field;
+  p[1] = 1;
+  p[2] = type;
+  p[3] = '\0';
+  _dbus_pack_uint32 (value_len, byte_order, p + 4);
+  memcpy (p + 8, value, value_len + 1);
+  memset (p + field_len, '\0', padding);
+
+  _dbus_marshal_set_uint32 (&header->data,
+                            FIELDS_ARRAY_LENGTH_OFFSET,
+                            field_start + field_len - FIRST_FIELD_OFFSET,
+                            byte_order);
+
+  header->padding = padding;
+  header->fields[field].value_pos = field_start + 4;
+  header->fields[field].str_len = -1;
+  header->fields[field].str_hashed = FALSE;
+
+  return TRUE;
+}
+
+/**
+ * Overwrites an existing string or object path field in place, if
+ * the new value has the same length as the old one.
+ *
+ * @param header the header
+ * @param field the field to set, which must exist
+ * @param value the new value
+ * @returns #TRUE if the field was overwritten
+ */
+static dbus_bool_t
+overwrite_string_field (DBusHeader *header,
+                        int         field,
+                        const char *value)
+{
+  int value_pos;
+  int value_len;
+
+  value_pos = header->fields[field].value_pos;
+  _dbus_assert (value_pos >= 0);
+
+  value_len = strlen (value);
+
+  if (_dbus_marshal_read_uint32 (&header->data, value_pos,
+                                 _dbus_header_get_byte_order (header),
+                                 NULL) != (dbus_uint32_t) value_len)
+    return FALSE;
+
+  memcpy (_dbus_string_get_data_len (&header->data, value_pos + 4, value_len),
+          value, value_len);
+  header->fields[field].str_len = -1;
+  header->fields[field].str_hashed = FALSE;
+
+  return TRUE;
+}
+
 /**
  * Sets the value of a field with basic type. If the value is a string
  * value, it isn't allowed to be #NULL. If the field doesn't exist,
@@ -1275,6 +1396,20 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 {
   _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
 
+  /* Strings are the common case (the bus sets the sender on every
+   * message it routes), and can mostly be done without re-marshaling
+   * anything
+   */
+  if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH)
+    {
+      const char *v_STRING = *(const char **) value;
+
+      if (!_dbus_header_cache_check (header, field))
+        return append_string_field (header, field, type, v_STRING);
+      else if (overwrite_string_field (header, field, v_STRING))
+        return TRUE;
+    }
+
   if (!reserve_header_padding (header))
     return FALSE;
 
@@ -1373,6 +1508,79 @@ _dbus_header_get_field_basic (DBusHeader    *header,
   return TRUE;
 }
 
+/**
+ * Gets the value of a string, object path or signature field, with its
+ * length and hash (see _dbus_hash_string_len()). These are worked out the
+ * first time they're asked for and kept until the field is next
+ * modified, so code that compares a field against many strings, like
+ * match rules, can cheaply rule out most of them without a strcmp().
+ * The hash is only worked out if hash is not #NULL.
+ *
+ * @param header the header
+ * @param field the field to get
+ * @param value return location for the string, or #NULL
+ * @param len return location for its length, or #NULL
+ * @param hash return location for its hash, or #NULL
+ * @returns #FALSE if the field doesn't exist
+ */
+dbus_bool_t
+_dbus_header_get_field_string (DBusHeader    *header,
+                               int            field,
+                               const char   **value,
+                               int           *len,
+                               unsigned int  *hash)
+{
+  DBusHeaderField *f;
+  const char *str;
+
+  _dbus_assert (field != DBUS_HEADER_FIELD_INVALID);
+  _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
+  _dbus_assert (EXPECTED_TYPE_OF_FIELD (field) == DBUS_TYPE_STRING ||
+                EXPECTED_TYPE_OF_FIELD (field) == DBUS_TYPE_OBJECT_PATH ||
+                EXPECTED_TYPE_OF_FIELD (field) == DBUS_TYPE_SIGNATURE);
+
+  if (!_dbus_header_cache_check (header, field))
+    return FALSE;
+
+  f = &header->fields[field];
+  _dbus_assert (f->value_pos >= 0);
+
+  /* The value is a uint32 length (a byte for signatures), then the
+   * string */
+  if (EXPECTED_TYPE_OF_FIELD (field) == DBUS_TYPE_SIGNATURE)
+    str = _dbus_string_get_const_data_len (&header->data, f->value_pos + 1, 0);
+  else
+    str = _dbus_string_get_const_data_len (&header->data, f->value_pos + 4, 0);
+
+  if (f->str_len < 0)
+    {
+      if (EXPECTED_TYPE_OF_FIELD (field) == DBUS_TYPE_SIGNATURE)
+        f->str_len = (unsigned char) str[-1];
+      else
+        f->str_len = _dbus_unpack_uint32 (_dbus_header_get_byte_order (header),
+                                          (const unsigned char *) str - 4);
+    }
+
+  /* Only the bus compares fields by hash, so don't make every caller
+   * pay for it */
+  if (hash != NULL && !f->str_hashed)
+    {
+      f->str_hash = _dbus_hash_string_len (str, f->str_len);
+      f->str_hashed = TRUE;
+    }
+
+  if (value != NULL)
+    *value = str;
+
+  if (len != NULL)
+    *len = f->str_len;
+
+  if (hash != NULL)
+    *hash = f->str_hash;
+
+  return TRUE;
+}
+
 /**
  * Gets the raw marshaled data for a field. If the field doesn't
  * exist, returns #FALSE, otherwise returns #TRUE.  Returns the start
@@ -39,6 +39,9 @@ typedef struct DBusHeaderField DBusHeaderField;
 struct DBusHeaderField
 {
   int            value_pos; /**< Position of field value, or -1/-2 */
+  int            str_len;   /**< Length of a string value, or -1 if not decoded yet */
+  unsigned int   str_hash;  /**< Hash of a string value, valid if str_hashed */
+  dbus_bool_t    str_hashed; /**< #TRUE if str_hash has been worked out */
 };
 
 /**
@@ -86,6 +89,11 @@ dbus_bool_t   _dbus_header_get_field_basic        (DBusHeader        *header,
                                                    int                field,
                                                    int                type,
                                                    void              *value);
+dbus_bool_t   _dbus_header_get_field_string       (DBusHeader        *header,
+                                                   int                field,
+                                                   const char       **value,
+                                                   int               *len,
+                                                   unsigned int      *hash);
 dbus_bool_t   _dbus_header_get_field_raw          (DBusHeader        *header,
                                                    int                field,
                                                    const DBusString **str,
@@ -29,6 +29,7 @@
 #include "dbus-internals.h"
 #include "dbus-marshal-validate.h"
 #include "dbus-marshal-recursive.h"
+#include "dbus-marshal-basic.h"
 
 #include "dbus-test.h"
 #include <stdio.h>
@@ -579,6 +580,60 @@ _dbus_marshal_validate_test (void)
     _dbus_string_free (&signature);
     _dbus_string_free (&body);
   }
+
+  /* Boolean arrays are checked all at once, so make sure a bad element
+   * is caught wherever it is, in either byte order.
+   */
+  {
+    DBusString signature;
+    DBusString body;
+    int byte_order;
+    int n_elements;
+    int bad;
+
+    _dbus_string_init_const (&signature, "ab");
+
+    if (!_dbus_string_init (&body))
+      _dbus_assert_not_reached ("oom");
+
+    for (byte_order = 0; byte_order < 2; byte_order++)
+      {
+        int order = byte_order ? DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+
+        for (n_elements = 0; n_elements < 12; n_elements++)
+          {
+            for (bad = -1; bad < n_elements; bad++)
+              {
+                DBusValidity validity;
+                int i;
+
+                if (!_dbus_string_set_length (&body, 4 * (n_elements + 1)))
+                  _dbus_assert_not_reached ("oom");
+
+                _dbus_marshal_set_uint32 (&body, 0, 4 * n_elements, order);
+                for (i = 0; i < n_elements; i++)
+                  _dbus_marshal_set_uint32 (&body, 4 * (i + 1), i % 2, order);
+
+                if (bad >= 0)
+                  _dbus_marshal_set_uint32 (&body, 4 * (bad + 1),
+                                            bad % 2 ? 0x100 : 2, order);
+
+                validity = _dbus_validate_body_with_reason (&signature, 0,
+                                                            order, NULL,
+                                                            &body, 0,
+                                                            _dbus_string_get_length (&body));
+                if (validity != (bad >= 0 ? DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE : DBUS_VALID))
+                  {
+                    _dbus_warn ("boolean array of %d with bad element %d: validity %d\n",
+                                n_elements, bad, validity);
+                    _dbus_assert_not_reached ("test failed");
+                  }
+              }
+          }
+      }
+
+    _dbus_string_free (&body);
+  }
   
   return TRUE;
 }
@@ -61,16 +61,16 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   DBusValidity result;
 
   int element_count;
-  DBusList *element_count_stack;
+  /* One count for the top level, then one per open struct or dict
+   * entry; both kinds of nesting are limited, so this never overflows
+   * and validating a signature never has to allocate.
+   */
+  int element_count_stack[DBUS_MAXIMUM_TYPE_RECURSION_DEPTH * 2 + 1];
+  int element_count_depth;
 
   result = DBUS_VALID;
-  element_count_stack = NULL;
-
-  if (!_dbus_list_append (&element_count_stack, _DBUS_INT_TO_POINTER (0)))
-    {
-      result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-      goto out;
-    }
+  element_count_depth = 0;
+  element_count_stack[0] = 0;
 
   _dbus_assert (type_str != NULL);
   _dbus_assert (type_pos < _DBUS_INT32_MAX - len);
@@ -129,12 +129,10 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
           
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
+          element_count_depth += 1;
+          _dbus_assert (element_count_depth <
+                        (int) _DBUS_N_ELEMENTS (element_count_stack));
+          element_count_stack[element_count_depth] = 0;
 
           break;
 
@@ -151,7 +149,7 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          _dbus_list_pop_last (&element_count_stack);
+          element_count_depth -= 1;
 
           struct_depth -= 1;
           break;
@@ -171,12 +169,10 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
+          element_count_depth += 1;
+          _dbus_assert (element_count_depth <
+                        (int) _DBUS_N_ELEMENTS (element_count_stack));
+          element_count_stack[element_count_depth] = 0;
 
           break;
 
@@ -189,8 +185,8 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
             
           dict_entry_depth -= 1;
 
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
+          element_count = element_count_stack[element_count_depth];
+          element_count_depth -= 1;
 
           if (element_count != 2)
             {
@@ -216,17 +212,7 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
           *p != DBUS_DICT_ENTRY_BEGIN_CHAR && 
 	  *p != DBUS_STRUCT_BEGIN_CHAR) 
         {
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
-
-          ++element_count;
-
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (element_count)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
+          element_count_stack[element_count_depth] += 1;
         }
       
       if (array_depth > 0)
@@ -287,7 +273,6 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   result = DBUS_VALID;
 
 out:
-  _dbus_list_clear (&element_count_stack);
   return result;
 }
 
@@ -467,18 +452,23 @@ validate_body_helper (DBusTypeReader       *reader,
                      */
                     if (array_elem_type == DBUS_TYPE_BOOLEAN)
                       {
-                        dbus_uint32_t v;
-                        alignment = _dbus_type_get_alignment (array_elem_type);
-
-                        while (p < array_end)
+                        dbus_uint32_t bits;
+
+                        /* Every element is 0 or 1 exactly when the OR of
+                         * all of them is; OR-ing is independent of byte
+                         * order, so only the result needs unpacking. This
+                         * has no branch per element and vectorizes well.
+                         */
+                        bits = 0;
+                        while (p + 4 <= array_end)
                           {
-                            v = _dbus_unpack_uint32 (byte_order, p);
-
-                            if (!(v == 0 || v == 1))
-                              return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
-
-                            p += alignment;
+                            bits |= *(const dbus_uint32_t *) p;
+                            p += 4;
                           }
+
+                        if (_dbus_unpack_uint32 (byte_order,
+                                                 (const unsigned char *) &bits) > 1)
+                          return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
                       }
 
                     else
@@ -746,24 +736,48 @@ _dbus_validate_body_with_reason (const DBusString *expected_signature,
     }
 }
 
+/* Character classes for names, indexed by byte; one table lookup is
+ * cheaper than the chain of range comparisons it replaces, and the
+ * validators below run on every name in every message header.
+ */
+#define NAME_CLASS_INITIAL      0x1  /* [A-Za-z_] */
+#define NAME_CLASS_LATER        0x2  /* [A-Za-z_0-9] */
+#define NAME_CLASS_BUS_INITIAL  0x4  /* [A-Za-z_-] */
+#define NAME_CLASS_BUS_LATER    0x8  /* [A-Za-z_0-9-] */
+
+static const unsigned char name_character_classes[256] = {
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0xc, 0x0, 0x0,
+  0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+  0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0x0, 0x0, 0x0, 0x0, 0xf,
+  0x0, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+  0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0
+};
+
+#define NAME_CHARACTER_IS(c, class) \
+  ((name_character_classes[(unsigned char) (c)] & (class)) != 0)
+
 /**
  * Determine wether the given character is valid as the first character
  * in a name.
  */
-#define VALID_INITIAL_NAME_CHARACTER(c)         \
-  ( ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') )
+#define VALID_INITIAL_NAME_CHARACTER(c) NAME_CHARACTER_IS (c, NAME_CLASS_INITIAL)
 
 /**
  * Determine wether the given character is valid as a second or later
  * character in a name
  */
-#define VALID_NAME_CHARACTER(c)                 \
-  ( ((c) >= '0' && (c) <= '9') ||               \
-    ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') )
+#define VALID_NAME_CHARACTER(c) NAME_CHARACTER_IS (c, NAME_CLASS_LATER)
 
 /**
  * Checks that the given range of the string is a valid object path
@@ -1067,20 +1081,14 @@ _dbus_validate_error_name (const DBusString  *str,
  * Determine wether the given character is valid as the first character
  * in a bus name.
  */
-#define VALID_INITIAL_BUS_NAME_CHARACTER(c)         \
-  ( ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') || ((c) == '-'))
+#define VALID_INITIAL_BUS_NAME_CHARACTER(c) \
+  NAME_CHARACTER_IS (c, NAME_CLASS_BUS_INITIAL)
 
 /**
  * Determine wether the given character is valid as a second or later
  * character in a bus name
  */
-#define VALID_BUS_NAME_CHARACTER(c)                 \
-  ( ((c) >= '0' && (c) <= '9') ||               \
-    ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') || ((c) == '-'))
+#define VALID_BUS_NAME_CHARACTER(c) NAME_CHARACTER_IS (c, NAME_CLASS_BUS_LATER)
 
 static dbus_bool_t
 _dbus_validate_bus_name_full (const DBusString  *str,
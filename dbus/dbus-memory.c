@@ -108,6 +108,7 @@ static dbus_bool_t disable_mem_pools = FALSE;
 static dbus_bool_t backtrace_on_fail_alloc = FALSE;
 static dbus_bool_t malloc_cannot_fail = FALSE;
 static DBusAtomic n_blocks_outstanding = {0};
+static DBusAtomic n_allocations = {0};
 
 /** value stored in guard padding for debugging buffer overrun */
 #define GUARD_VALUE 0xdeadbeef
@@ -306,6 +307,19 @@ _dbus_get_malloc_blocks_outstanding (void)
   return _dbus_atomic_get (&n_blocks_outstanding);
 }
 
+/**
+ * Get the number of successful calls to dbus_malloc(), dbus_malloc0()
+ * and dbus_realloc() so far, for counting allocations per operation
+ * in benchmarks. Only counted if tests are enabled.
+ *
+ * @returns number of allocations
+ */
+int
+_dbus_get_malloc_allocations (void)
+{
+  return _dbus_atomic_get (&n_allocations);
+}
+
 /**
  * Where the block came from.
  */
@@ -482,6 +496,7 @@ dbus_malloc (size_t bytes)
       if (block)
         {
           _dbus_atomic_inc (&n_blocks_outstanding);
+          _dbus_atomic_inc (&n_allocations);
         }
       else if (malloc_cannot_fail)
         {
@@ -502,6 +517,7 @@ dbus_malloc (size_t bytes)
       if (mem)
         {
           _dbus_atomic_inc (&n_blocks_outstanding);
+          _dbus_atomic_inc (&n_allocations);
         }
       else if (malloc_cannot_fail)
         {
@@ -554,6 +570,7 @@ dbus_malloc0 (size_t bytes)
       if (block)
         {
           _dbus_atomic_inc (&n_blocks_outstanding);
+          _dbus_atomic_inc (&n_allocations);
         }
       else if (malloc_cannot_fail)
         {
@@ -574,6 +591,7 @@ dbus_malloc0 (size_t bytes)
       if (mem)
         {
           _dbus_atomic_inc (&n_blocks_outstanding);
+          _dbus_atomic_inc (&n_allocations);
         }
       else if (malloc_cannot_fail)
         {
@@ -643,6 +661,8 @@ dbus_realloc (void  *memory,
               return NULL;
             }
 
+          _dbus_atomic_inc (&n_allocations);
+
           old_bytes = *(dbus_uint32_t*)block;
           if (bytes >= old_bytes)
             /* old guards shouldn't have moved */
@@ -659,6 +679,7 @@ dbus_realloc (void  *memory,
           if (block)
             {
               _dbus_atomic_inc (&n_blocks_outstanding);
+              _dbus_atomic_inc (&n_allocations);
             }
           else if (malloc_cannot_fail)
             {
@@ -685,6 +706,9 @@ dbus_realloc (void  *memory,
 
       if (memory == NULL && mem != NULL)
 	    _dbus_atomic_inc (&n_blocks_outstanding);
+
+      if (mem != NULL)
+        _dbus_atomic_inc (&n_allocations);
 #endif
       return mem;
     }
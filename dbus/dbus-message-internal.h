@@ -62,6 +62,11 @@ void        _dbus_message_add_counter_link      (DBusMessage  *message,
                                                  DBusList     *link);
 void        _dbus_message_remove_counter        (DBusMessage  *message,
                                                  DBusCounter  *counter);
+dbus_bool_t _dbus_message_get_header_string     (DBusMessage  *message,
+                                                 int           field,
+                                                 const char  **value,
+                                                 int          *len,
+                                                 unsigned int *hash);
 
 DBusMessageLoader* _dbus_message_loader_new                   (void);
 DBusMessageLoader* _dbus_message_loader_ref                   (DBusMessageLoader  *loader);
@@ -98,6 +103,24 @@ void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoad
                                                                  long                n);
 long               _dbus_message_loader_get_max_message_unix_fds(DBusMessageLoader  *loader);
 
+void               _dbus_message_loader_set_trusted           (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         trusted);
+
+void               _dbus_message_set_cache_limits             (int                 max_messages,
+                                                               int                 max_message_size);
+void               _dbus_message_init_thread_caches           (void);
+
+/* if DBUS_ENABLE_STATS */
+void               _dbus_message_get_cache_stats              (dbus_uint32_t      *hits_p,
+                                                               dbus_uint32_t      *misses_p,
+                                                               dbus_uint32_t      *cached_messages_p);
+
+/* if DBUS_BUILD_TESTS */
+void               _dbus_message_get_cache_limits             (int                *max_messages_p,
+                                                               int                *max_message_size_p);
+int                _dbus_message_cache_class_for_size         (int                 size);
+int                _dbus_message_get_n_cached                 (int                 size_class);
+
 typedef struct DBusInitialFDs DBusInitialFDs;
 DBusInitialFDs *_dbus_check_fdleaks_enter (void);
 void            _dbus_check_fdleaks_leave (DBusInitialFDs *fds);
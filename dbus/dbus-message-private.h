@@ -70,6 +70,8 @@ struct DBusMessageLoader
 
   DBusValidity corruption_reason; /**< why we were corrupted */
 
+  DBusValidationMode mode; /**< How much to check incoming messages */
+
   unsigned int corrupted : 1; /**< We got broken data, and are no longer working */
 
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
@@ -115,6 +117,8 @@ struct DBusMessage
 
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
+  DBusMessage *next_in_cache; /**< Next message in the same message cache free list */
+
 #ifndef DBUS_DISABLE_CHECKS
   int generation; /**< _dbus_current_generation when message was created */
 #endif
@@ -24,6 +24,7 @@
 
 #include <config.h>
 #include "dbus-internals.h"
+#include "dbus-hash.h"
 #include "dbus-test.h"
 #include "dbus-message-private.h"
 #include "dbus-marshal-recursive.h"
@@ -1003,6 +1004,131 @@ verify_test_message (DBusMessage *message)
     _dbus_assert_not_reached ("Didn't reach end of arguments");
 }
 
+static void
+check_header_string (DBusMessage *message,
+                     int          field,
+                     const char  *expected)
+{
+  const char *value;
+  int len;
+  unsigned int hash;
+
+  if (!_dbus_message_get_header_string (message, field, &value, &len, &hash))
+    _dbus_assert_not_reached ("header field missing");
+
+  _dbus_assert (strcmp (value, expected) == 0);
+  _dbus_assert (len == (int) strlen (expected));
+  _dbus_assert (hash == _dbus_hash_string_len (expected, len));
+}
+
+/* Makes a signal whose body is an array of @n_bytes bytes */
+static DBusMessage *
+new_message_with_body (int n_bytes)
+{
+  DBusMessage *message;
+  unsigned char *bytes;
+
+  bytes = dbus_malloc0 (n_bytes);
+  if (bytes == NULL)
+    _dbus_assert_not_reached ("no memory for message body");
+
+  message = dbus_message_new_signal ("/a/b", "a.b", "C");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &bytes, n_bytes,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for message");
+
+  dbus_free (bytes);
+
+  return message;
+}
+
+/* Frees @message, and checks that it was cached only if @expect_cached */
+static void
+check_message_cached (DBusMessage *message,
+                      dbus_bool_t  expect_cached)
+{
+  int size_class;
+  int n_in_class;
+  int n_cached;
+
+  size_class = _dbus_message_cache_class_for_size (
+      _dbus_string_get_allocated_size (&message->header.data) +
+      _dbus_string_get_allocated_size (&message->body));
+
+  n_cached = _dbus_message_get_n_cached (-1);
+  n_in_class = -1;
+  if (expect_cached)
+    n_in_class = _dbus_message_get_n_cached (size_class);
+
+  dbus_message_unref (message);
+
+  if (expect_cached)
+    {
+      _dbus_assert (_dbus_message_get_n_cached (-1) == n_cached + 1);
+      _dbus_assert (_dbus_message_get_n_cached (size_class) == n_in_class + 1);
+    }
+  else
+    {
+      _dbus_assert (_dbus_message_get_n_cached (-1) == n_cached);
+    }
+}
+
+static void
+check_message_cache (void)
+{
+  DBusMessage *messages[3];
+  int n_classes;
+  int old_max_messages;
+  int old_max_message_size;
+  int n_cached;
+  int i;
+
+  _dbus_message_get_cache_limits (&old_max_messages, &old_max_message_size);
+
+  /* classes go up to 512 bytes, then in steps up to 128 KiB */
+  n_classes = _dbus_message_cache_class_for_size (_DBUS_INT_MAX);
+  _dbus_assert (_dbus_message_cache_class_for_size (0) == 0);
+  _dbus_assert (_dbus_message_cache_class_for_size (512) == 0);
+  _dbus_assert (_dbus_message_cache_class_for_size (513) == 1);
+  _dbus_assert (_dbus_message_cache_class_for_size (128 * 1024) ==
+                n_classes - 1);
+  _dbus_assert (_dbus_message_cache_class_for_size (128 * 1024 + 1) ==
+                n_classes);
+
+  _dbus_message_set_cache_limits (_DBUS_INT_MAX, _DBUS_INT_MAX);
+
+  /* small and big messages go in their own classes */
+  check_message_cached (new_message_with_body (8), TRUE);
+  check_message_cached (new_message_with_body (100 * 1024), TRUE);
+
+  /* too big for any class */
+  check_message_cached (new_message_with_body (200 * 1024), FALSE);
+
+  /* too big for the limit */
+  _dbus_message_set_cache_limits (_DBUS_INT_MAX, 1024);
+  check_message_cached (new_message_with_body (4 * 1024), FALSE);
+
+  /* only as many messages as the limit allows */
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (messages); i++)
+    messages[i] = new_message_with_body (8);
+
+  n_cached = _dbus_message_get_n_cached (-1);
+  _dbus_message_set_cache_limits (n_cached + 2, _DBUS_INT_MAX);
+
+  check_message_cached (messages[0], TRUE);
+  check_message_cached (messages[1], TRUE);
+  check_message_cached (messages[2], FALSE);
+
+  /* 0 turns the cache off */
+  _dbus_message_set_cache_limits (0, _DBUS_INT_MAX);
+  check_message_cached (new_message_with_body (8), FALSE);
+
+  _dbus_message_set_cache_limits (old_max_messages, old_max_message_size);
+}
+
 /**
  * @ingroup DBusMessageInternals
  * Unit test for DBusMessage.
@@ -1062,6 +1188,7 @@ _dbus_message_test (const char *test_data_dir)
 #endif
   char **decomposed;
   DBusInitialFDs *initial_fds;
+  const char *senders[] = { ":1.1", ":1.22", ":1.333", ":1.4444", ":1.5" };
 
   initial_fds = _dbus_check_fdleaks_enter ();
 
@@ -1159,6 +1286,29 @@ _dbus_message_test (const char *test_data_dir)
   _dbus_assert (strcmp (dbus_message_get_member (message),
                         "Bar") == 0);
 
+  /* Cached lengths and hashes follow changes to any field */
+  check_header_string (message, DBUS_HEADER_FIELD_MEMBER, "Bar");
+  if (!dbus_message_set_member (message, "BarFoo"))
+    _dbus_assert_not_reached ("out of memory");
+  check_header_string (message, DBUS_HEADER_FIELD_MEMBER, "BarFoo");
+  if (!dbus_message_set_interface (message, "org.Foo.Bar"))
+    _dbus_assert_not_reached ("out of memory");
+  check_header_string (message, DBUS_HEADER_FIELD_MEMBER, "BarFoo");
+  check_header_string (message, DBUS_HEADER_FIELD_INTERFACE, "org.Foo.Bar");
+  _dbus_assert (!_dbus_message_get_header_string (message,
+                                                  DBUS_HEADER_FIELD_ERROR_NAME,
+                                                  NULL, NULL, NULL));
+
+  /* ... including ones overwritten in place with a value of the same
+   * length, and ones first read without asking for the hash */
+  if (!dbus_message_set_sender (message, ":1.1"))
+    _dbus_assert_not_reached ("out of memory");
+  check_header_string (message, DBUS_HEADER_FIELD_SENDER, ":1.1");
+  if (!dbus_message_set_sender (message, ":1.2"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_sender (message), ":1.2") == 0);
+  check_header_string (message, DBUS_HEADER_FIELD_SENDER, ":1.2");
+
   /* Path decomposing */
   dbus_message_set_path (message, NULL);
   dbus_message_get_path_decomposed (message, &decomposed);
@@ -1308,6 +1458,7 @@ _dbus_message_test (const char *test_data_dir)
 
   _dbus_assert (dbus_message_has_signature (message, sig));
   _dbus_assert (strcmp (s, sig) == 0);
+  check_header_string (message, DBUS_HEADER_FIELD_SIGNATURE, sig);
 
   verify_test_message (message);
 
@@ -1398,6 +1549,162 @@ _dbus_message_test (const char *test_data_dir)
     _dbus_assert_not_reached ("reply serial fields differ");
 
   dbus_message_unref (message);
+  _dbus_message_loader_unref (loader);
+
+  /* Several messages with unaligned body lengths in a single read; all of
+   * them except the first start at an unaligned offset in the buffer.
+   * They also have a sender appended, then overwritten with one that is
+   * sometimes the same length and sometimes not, as the bus might.
+   */
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory for loader");
+
+  for (i = 0; i < 5; i++)
+    {
+      DBusString *buffer;
+      const char *v_STRING = "abcde" + i;
+
+      message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                         "Foo.TestInterface",
+                                         "TestSignal");
+      if (message == NULL ||
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &v_STRING,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory for message");
+
+      if (!dbus_message_set_sender (message, ":1.0") ||
+          !dbus_message_set_sender (message, senders[i]))
+        _dbus_assert_not_reached ("no memory for sender");
+
+      _dbus_assert (dbus_message_has_path (message, "/org/freedesktop/TestPath"));
+      _dbus_assert (dbus_message_has_sender (message, senders[i]));
+
+      dbus_message_set_serial (message, i + 1);
+      dbus_message_lock (message);
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      if (!_dbus_string_copy (&message->header.data, 0, buffer,
+                              _dbus_string_get_length (buffer)) ||
+          !_dbus_string_copy (&message->body, 0, buffer,
+                              _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory for buffer");
+      _dbus_message_loader_return_buffer (loader, buffer, 1);
+
+      dbus_message_unref (message);
+    }
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  if (_dbus_message_loader_get_is_corrupted (loader))
+    _dbus_assert_not_reached ("message loader corrupted");
+
+  for (i = 0; i < 5; i++)
+    {
+      const char *v_STRING;
+
+      message = _dbus_message_loader_pop_message (loader);
+      if (message == NULL)
+        _dbus_assert_not_reached ("received a NULL message");
+
+      if (dbus_message_get_serial (message) != (dbus_uint32_t) i + 1)
+        _dbus_assert_not_reached ("messages out of order");
+
+      if (!dbus_message_has_sender (message, senders[i]) ||
+          !dbus_message_is_signal (message, "Foo.TestInterface", "TestSignal"))
+        _dbus_assert_not_reached ("wrong message header");
+
+      if (!dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_STRING, &v_STRING,
+                                  DBUS_TYPE_INVALID) ||
+          strcmp (v_STRING, "abcde" + i) != 0)
+        _dbus_assert_not_reached ("wrong message body");
+
+      dbus_message_unref (message);
+    }
+
+  if (_dbus_message_loader_pop_message (loader) != NULL)
+    _dbus_assert_not_reached ("too many messages");
+
+  /* A trusting loader takes the body as it is, so a string that is not
+   * UTF-8 gets through; the usual loader rejects it. Two messages in
+   * one read, so that the second starts partway through the buffer.
+   */
+  for (i = 0; i < 2; i++)
+    {
+      dbus_bool_t trusted = (i == 1);
+      DBusMessageLoader *other_loader;
+      DBusString *buffer;
+      int j;
+
+      other_loader = _dbus_message_loader_new ();
+      if (other_loader == NULL)
+        _dbus_assert_not_reached ("no memory for loader");
+
+      _dbus_message_loader_set_trusted (other_loader, trusted);
+
+      for (j = 0; j < 2; j++)
+        {
+          const char *v_STRING = "abc";
+          int body_start;
+
+          message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                             "Foo.TestInterface",
+                                             "TestSignal");
+          if (message == NULL ||
+              !dbus_message_append_args (message,
+                                         DBUS_TYPE_STRING, &v_STRING,
+                                         DBUS_TYPE_INVALID))
+            _dbus_assert_not_reached ("no memory for message");
+
+          dbus_message_set_serial (message, j + 1);
+          dbus_message_lock (message);
+
+          _dbus_message_loader_get_buffer (other_loader, &buffer);
+          if (!_dbus_string_copy (&message->header.data, 0, buffer,
+                                  _dbus_string_get_length (buffer)))
+            _dbus_assert_not_reached ("no memory for buffer");
+          body_start = _dbus_string_get_length (buffer);
+          if (!_dbus_string_copy (&message->body, 0, buffer, body_start))
+            _dbus_assert_not_reached ("no memory for buffer");
+
+          /* the first byte of the string, after its length */
+          _dbus_string_set_byte (buffer, body_start + 4, 0xff);
+          _dbus_message_loader_return_buffer (other_loader, buffer, 1);
+
+          dbus_message_unref (message);
+        }
+
+      if (!_dbus_message_loader_queue_messages (other_loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+
+      if (trusted)
+        {
+          for (j = 0; j < 2; j++)
+            {
+              message = _dbus_message_loader_pop_message (other_loader);
+              if (message == NULL)
+                _dbus_assert_not_reached ("trusted loader lost a message");
+
+              if (dbus_message_get_serial (message) != (dbus_uint32_t) j + 1 ||
+                  !dbus_message_is_signal (message, "Foo.TestInterface",
+                                           "TestSignal"))
+                _dbus_assert_not_reached ("wrong message header");
+
+              dbus_message_unref (message);
+            }
+        }
+      else
+        {
+          _dbus_assert (_dbus_message_loader_get_is_corrupted (other_loader));
+          _dbus_assert (_dbus_message_loader_get_corruption_reason (other_loader) ==
+                        DBUS_INVALID_BAD_UTF8_IN_STRING);
+        }
+
+      _dbus_message_loader_unref (other_loader);
+    }
 
   /* ovveride the serial, since it was reset by dbus_message_copy() */
   dbus_message_set_serial(message_without_unix_fds, 8901);
@@ -1522,6 +1829,28 @@ _dbus_message_test (const char *test_data_dir)
     print_validities_seen (TRUE);
   }
 
+  /* Building a message just like one that was freed should reuse it
+   * from the message cache, without allocating anything
+   */
+  data = _dbus_getenv ("DBUS_MESSAGE_CACHE");
+  if (data == NULL || *data != '0')
+    {
+      int allocations;
+
+      message = dbus_message_new_signal ("/a/b", "a.b", "C");
+      _dbus_assert (message != NULL);
+      dbus_message_unref (message);
+
+      allocations = _dbus_get_malloc_allocations ();
+      message = dbus_message_new_signal ("/a/b", "a.b", "C");
+      _dbus_assert (message != NULL);
+      _dbus_assert (_dbus_get_malloc_allocations () == allocations);
+      dbus_message_unref (message);
+    }
+
+  if (data == NULL || *data != '0')
+    check_message_cache ();
+
   check_memleaks ();
   _dbus_check_fdleaks_leave (initial_fds);
 
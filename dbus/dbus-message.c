@@ -285,6 +285,8 @@ _dbus_message_add_counter_link (DBusMessage  *message,
    * Do recompute it whenever there are no outstanding counters,
    * since it's basically free.
    */
+  _DBUS_LOCK (message_counters);
+
   if (message->counters == NULL)
     {
       message->size_counter_delta =
@@ -308,6 +310,8 @@ _dbus_message_add_counter_link (DBusMessage  *message,
 #ifdef HAVE_UNIX_FD_PASSING
   _dbus_counter_adjust_unix_fd (link->data, message->unix_fd_counter_delta);
 #endif
+
+  _DBUS_UNLOCK (message_counters);
 }
 
 /**
@@ -353,6 +357,8 @@ _dbus_message_remove_counter (DBusMessage  *message,
 {
   DBusList *link;
 
+  _DBUS_LOCK (message_counters);
+
   link = _dbus_list_find_last (&message->counters,
                                counter);
   _dbus_assert (link != NULL);
@@ -365,6 +371,8 @@ _dbus_message_remove_counter (DBusMessage  *message,
   _dbus_counter_adjust_unix_fd (counter, - message->unix_fd_counter_delta);
 #endif
 
+  _DBUS_UNLOCK (message_counters);
+
   _dbus_counter_notify (counter);
   _dbus_counter_unref (counter);
 }
@@ -456,135 +464,390 @@ _dbus_message_set_signature (DBusMessage *message,
 
 /* Message Cache
  *
- * We cache some DBusMessage to reduce the overhead of allocating
- * them.  In my profiling this consistently made about an 8%
- * difference.  It avoids the malloc for the message, the malloc for
- * the slot list, the malloc for the header string and body string,
- * and the associated free() calls. It does introduce another global
- * lock which could be a performance issue in certain cases.
- *
- * For the echo client/server the round trip time goes from around
- * .000077 to .000069 with the message cache on my laptop. The sysprof
- * change is as follows (numbers are cumulative percentage):
- *
- *  with message cache implemented as array as it is now (0.000069 per):
- *    new_empty_header           1.46
- *      mutex_lock               0.56    # i.e. _DBUS_LOCK(message_cache)
- *      mutex_unlock             0.25
- *      self                     0.41
- *    unref                      2.24
- *      self                     0.68
- *      list_clear               0.43
- *      mutex_lock               0.33    # i.e. _DBUS_LOCK(message_cache)
- *      mutex_unlock             0.25
- *
- *  with message cache implemented as list (0.000070 per roundtrip):
- *    new_empty_header           2.72
- *      list_pop_first           1.88
- *    unref                      3.3
- *      list_prepend             1.63
- *
- * without cache (0.000077 per roundtrip):
- *    new_empty_header           6.7
- *      string_init_preallocated 3.43
- *        dbus_malloc            2.43
- *      dbus_malloc0             2.59
- *
- *    unref                      4.02
- *      string_free              1.82
- *        dbus_free              1.63
- *      dbus_free                0.71
- *
- * If you implement the message_cache with a list, the primary reason
- * it's slower is that you add another thread lock (on the DBusList
- * mempool).
+ * We recycle DBusMessage to reduce the overhead of allocating them:
+ * a recycled message saves the malloc for the message, the malloc for
+ * the slot list, the mallocs for the header string and body string,
+ * and the associated free() calls, and it keeps the capacity of those
+ * strings. When this was first measured, the echo client/server round
+ * trip went from around .000077 to .000069 with a 5-message cache.
+ *
+ * Each thread has its own cache once threads have been initialized,
+ * so recycling a message never takes a lock; before that there is a
+ * single cache, and no locking is needed. Each cache has a free list
+ * per size class, by the allocated size of header plus body, so that
+ * the loader can ask for a message whose buffers already fit, and
+ * creating a small message doesn't use up a big cached one. The
+ * message_cache lock only protects the list of all caches, which is
+ * walked by dbus_shutdown() and when getting statistics.
  */
 
-/** Avoid caching huge messages */
-#define MAX_MESSAGE_SIZE_TO_CACHE 10 * _DBUS_ONE_KILOBYTE
+/** Upper bounds of the size classes, by header plus body capacity */
+static const int message_cache_class_sizes[] = {
+  512,
+  2 * _DBUS_ONE_KILOBYTE,
+  8 * _DBUS_ONE_KILOBYTE,
+  32 * _DBUS_ONE_KILOBYTE,
+  128 * _DBUS_ONE_KILOBYTE
+};
+
+#define N_MESSAGE_CACHE_CLASSES \
+  ((int) _DBUS_N_ELEMENTS (message_cache_class_sizes))
+
+/** Default for the largest header plus body capacity worth caching */
+#define DEFAULT_MAX_MESSAGE_SIZE_TO_CACHE (16 * _DBUS_ONE_KILOBYTE)
+
+/** Default for how many messages each cache can hold */
+#define DEFAULT_MAX_MESSAGE_CACHE_SIZE 16
 
-/** Avoid caching too many messages */
-#define MAX_MESSAGE_CACHE_SIZE    5
+typedef struct DBusMessageCache DBusMessageCache;
+
+/**
+ * A free list of messages for one thread, or for any thread holding
+ * the message_cache lock.
+ */
+struct DBusMessageCache
+{
+  DBusMessageCache *prev; /**< previous cache, protected by message_cache lock */
+  DBusMessageCache *next; /**< next cache, protected by message_cache lock */
+  DBusMessage *messages[N_MESSAGE_CACHE_CLASSES]; /**< free lists by class */
+  int n_messages; /**< number of messages in all the free lists */
+  dbus_uint32_t hits; /**< messages reused from this cache */
+  dbus_uint32_t misses; /**< times this cache had nothing to give */
+  unsigned int registered : 1; /**< TRUE if in message_caches */
+};
 
 _DBUS_DEFINE_GLOBAL_LOCK (message_cache);
-static DBusMessage *message_cache[MAX_MESSAGE_CACHE_SIZE];
-static int message_cache_count = 0;
+/* Protects DBusMessage.counters, which the connections a message is
+ * queued on can change from different threads */
+_DBUS_DEFINE_GLOBAL_LOCK (message_counters);
+static int max_message_size_to_cache = DEFAULT_MAX_MESSAGE_SIZE_TO_CACHE;
+static int max_message_cache_size = DEFAULT_MAX_MESSAGE_CACHE_SIZE;
+static DBusThreadLocal *message_cache_local = NULL;
+/* used without threads, or when there is no thread-local cache */
+static DBusMessageCache shared_message_cache;
+static DBusMessageCache *message_caches = NULL;
 static dbus_bool_t message_cache_shutdown_registered = FALSE;
+/* hits and misses of caches that have been freed */
+static dbus_uint32_t message_cache_old_hits = 0;
+static dbus_uint32_t message_cache_old_misses = 0;
+
+/**
+ * Sets how many messages each thread may keep for reuse, and the
+ * largest header plus body capacity that a reused message may have.
+ * Messages already cached are not affected.
+ *
+ * @param max_messages maximum messages per thread, or 0 to not cache
+ * @param max_message_size maximum bytes allocated for a cached message
+ */
+void
+_dbus_message_set_cache_limits (int max_messages,
+                                int max_message_size)
+{
+  _dbus_assert (max_messages >= 0);
+  _dbus_assert (max_message_size >= 0);
+
+  max_message_cache_size = max_messages;
+  max_message_size_to_cache = max_message_size;
+}
+
+static int
+message_cache_class_for_size (int size)
+{
+  int i;
+
+  for (i = 0; i < N_MESSAGE_CACHE_CLASSES; i++)
+    {
+      if (size <= message_cache_class_sizes[i])
+        break;
+    }
+
+  return i;
+}
 
+static int
+message_cache_class_of (DBusMessage *message)
+{
+  return message_cache_class_for_size (
+      _dbus_string_get_allocated_size (&message->header.data) +
+      _dbus_string_get_allocated_size (&message->body));
+}
+
+/* Finalizes every message in @cache */
 static void
-dbus_message_cache_shutdown (void *data)
+message_cache_empty (DBusMessageCache *cache)
+{
+  int i;
+
+  for (i = 0; i < N_MESSAGE_CACHE_CLASSES; i++)
+    {
+      while (cache->messages[i] != NULL)
+        {
+          DBusMessage *message = cache->messages[i];
+
+          cache->messages[i] = message->next_in_cache;
+          cache->n_messages -= 1;
+          dbus_message_finalize (message);
+        }
+    }
+
+  _dbus_assert (cache->n_messages == 0);
+}
+
+static DBusMessage*
+message_cache_pop (DBusMessageCache *cache,
+                   int               size_hint)
 {
+  DBusMessage *message;
+  int wanted;
   int i;
 
+  if (cache->n_messages == 0)
+    {
+      cache->misses += 1;
+      return NULL;
+    }
+
+  /* the smallest class that fits, then bigger ones, then smaller ones */
+  wanted = message_cache_class_for_size (size_hint);
+  if (wanted >= N_MESSAGE_CACHE_CLASSES)
+    wanted = N_MESSAGE_CACHE_CLASSES - 1;
+
+  message = NULL;
+
+  for (i = wanted; i < N_MESSAGE_CACHE_CLASSES && message == NULL; i++)
+    message = cache->messages[i];
+
+  for (i = wanted - 1; i >= 0 && message == NULL; i--)
+    message = cache->messages[i];
+
+  _dbus_assert (message != NULL);
+
+  i = message_cache_class_of (message);
+  _dbus_assert (cache->messages[i] == message);
+
+  cache->messages[i] = message->next_in_cache;
+  cache->n_messages -= 1;
+  cache->hits += 1;
+  message->next_in_cache = NULL;
+
+  _dbus_assert (cache->n_messages >= 0);
+
+  return message;
+}
+
+static dbus_bool_t
+message_cache_push (DBusMessageCache *cache,
+                    DBusMessage      *message,
+                    int               size_class)
+{
+  if (cache->n_messages >= max_message_cache_size)
+    return FALSE;
+
+  message->next_in_cache = cache->messages[size_class];
+  cache->messages[size_class] = message;
+  cache->n_messages += 1;
+
+  return TRUE;
+}
+
+static void
+dbus_message_cache_shutdown (void *data)
+{
+  DBusMessageCache *caches;
+  DBusMessageCache *cache;
+
   _DBUS_LOCK (message_cache);
 
-  i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
+  caches = message_caches;
+  message_caches = NULL;
+
+  for (cache = caches; cache != NULL; cache = cache->next)
+    cache->registered = FALSE;
+
+  message_cache_shutdown_registered = FALSE;
+  message_cache_old_hits = 0;
+  message_cache_old_misses = 0;
+
+  if (message_cache_local != NULL)
+    {
+      _dbus_platform_thread_local_free (message_cache_local);
+      message_cache_local = NULL;
+    }
+
+  _DBUS_UNLOCK (message_cache);
+
+  /* Nothing else can reach these caches any more, so finalize their
+   * messages without holding the lock
+   */
+  while (caches != NULL)
     {
-      if (message_cache[i])
-        dbus_message_finalize (message_cache[i]);
+      cache = caches;
+      caches = cache->next;
+
+      message_cache_empty (cache);
 
-      ++i;
+      if (cache == &shared_message_cache)
+        _DBUS_ZERO (shared_message_cache);
+      else
+        dbus_free (cache);
     }
+}
 
-  message_cache_count = 0;
-  message_cache_shutdown_registered = FALSE;
+/* Adds @cache to the caches that dbus_shutdown() empties. Must be
+ * called with the message_cache lock held.
+ */
+static dbus_bool_t
+message_cache_register_unlocked (DBusMessageCache *cache)
+{
+  if (!message_cache_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (dbus_message_cache_shutdown, NULL))
+        return FALSE;
+
+      message_cache_shutdown_registered = TRUE;
+    }
+
+  cache->prev = NULL;
+  cache->next = message_caches;
+  if (message_caches != NULL)
+    message_caches->prev = cache;
+  message_caches = cache;
+  cache->registered = TRUE;
+
+  return TRUE;
+}
+
+/* Called when a thread exits */
+static void
+message_cache_free (void *data)
+{
+  DBusMessageCache *cache = data;
+
+  _DBUS_LOCK (message_cache);
+
+  if (cache->registered)
+    {
+      if (cache->prev != NULL)
+        cache->prev->next = cache->next;
+      else
+        message_caches = cache->next;
+
+      if (cache->next != NULL)
+        cache->next->prev = cache->prev;
+
+      message_cache_old_hits += cache->hits;
+      message_cache_old_misses += cache->misses;
+    }
 
   _DBUS_UNLOCK (message_cache);
+
+  message_cache_empty (cache);
+  dbus_free (cache);
 }
 
 /**
- * Tries to get a message from the message cache.  The retrieved
- * message will have junk in it, so it still needs to be cleared out
- * in dbus_message_new_empty_header()
- *
- * @returns the message, or #NULL if none cached
+ * Starts keeping a message cache per thread. Called by
+ * dbus_threads_init(), before there is more than one thread; if it
+ * fails, all threads share one cache under a lock.
  */
-static DBusMessage*
-dbus_message_get_cached (void)
+void
+_dbus_message_init_thread_caches (void)
 {
-  DBusMessage *message;
-  int i;
+  _dbus_assert (message_cache_local == NULL);
 
-  message = NULL;
+  message_cache_local = _dbus_platform_thread_local_new (message_cache_free);
+  if (message_cache_local == NULL)
+    return;
+
+  /* Registered here, even if it already was, so that the thread-local
+   * slot is freed before the global locks are
+   */
+  if (!_dbus_register_shutdown_func (dbus_message_cache_shutdown, NULL))
+    {
+      _dbus_platform_thread_local_free (message_cache_local);
+      message_cache_local = NULL;
+      return;
+    }
 
   _DBUS_LOCK (message_cache);
+  message_cache_shutdown_registered = TRUE;
+  _DBUS_UNLOCK (message_cache);
+}
+
+/* Returns the calling thread's own cache, or #NULL if there are no
+ * per-thread caches or no memory for one; callers then use
+ * shared_message_cache with the lock held.
+ */
+static DBusMessageCache*
+get_thread_message_cache (void)
+{
+  DBusMessageCache *cache;
+  dbus_bool_t registered;
+
+  if (message_cache_local == NULL)
+    return NULL;
+
+  cache = _dbus_platform_thread_local_get (message_cache_local);
+  if (cache != NULL)
+    return cache;
 
-  _dbus_assert (message_cache_count >= 0);
+  cache = dbus_new0 (DBusMessageCache, 1);
+  if (cache == NULL)
+    return NULL;
 
-  if (message_cache_count == 0)
+  _DBUS_LOCK (message_cache);
+  registered = message_cache_register_unlocked (cache);
+  _DBUS_UNLOCK (message_cache);
+
+  if (!registered)
     {
-      _DBUS_UNLOCK (message_cache);
+      dbus_free (cache);
       return NULL;
     }
 
-  /* This is not necessarily true unless count > 0, and
-   * message_cache is uninitialized until the shutdown is
-   * registered
-   */
-  _dbus_assert (message_cache_shutdown_registered);
+  if (!_dbus_platform_thread_local_set (message_cache_local, cache))
+    {
+      message_cache_free (cache);
+      return NULL;
+    }
 
-  i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
+  return cache;
+}
+
+/**
+ * Tries to get a message from the message cache, preferring one whose
+ * header and body together have room for @size_hint bytes. The
+ * retrieved message will have junk in it, so it still needs to be
+ * cleared out in dbus_message_new_empty_header()
+ *
+ * @param size_hint expected size of header plus body, or 0
+ * @returns the message, or #NULL if none cached
+ */
+static DBusMessage*
+dbus_message_get_cached (int size_hint)
+{
+  DBusMessageCache *cache;
+  DBusMessage *message;
+
+  cache = get_thread_message_cache ();
+
+  if (cache != NULL)
     {
-      if (message_cache[i])
-        {
-          message = message_cache[i];
-          message_cache[i] = NULL;
-          message_cache_count -= 1;
-          break;
-        }
-      ++i;
+      message = message_cache_pop (cache, size_hint);
     }
-  _dbus_assert (message_cache_count >= 0);
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
-  _dbus_assert (message != NULL);
+  else
+    {
+      _DBUS_LOCK (message_cache);
+      message = message_cache_pop (&shared_message_cache, size_hint);
+      _DBUS_UNLOCK (message_cache);
+    }
+
+  if (message == NULL)
+    return NULL;
 
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
   _dbus_assert (message->counters == NULL);
-  
-  _DBUS_UNLOCK (message_cache);
 
   return message;
 }
@@ -640,8 +903,10 @@ free_counter (void *element,
 static void
 dbus_message_cache_or_finalize (DBusMessage *message)
 {
+  DBusMessageCache *cache;
   dbus_bool_t was_cached;
-  int i;
+  int size;
+  int size_class;
 
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
@@ -660,62 +925,153 @@ dbus_message_cache_or_finalize (DBusMessage *message)
 
   was_cached = FALSE;
 
-  _DBUS_LOCK (message_cache);
-
-  if (!message_cache_shutdown_registered)
-    {
-      _dbus_assert (message_cache_count == 0);
-
-      if (!_dbus_register_shutdown_func (dbus_message_cache_shutdown, NULL))
-        goto out;
-
-      i = 0;
-      while (i < MAX_MESSAGE_CACHE_SIZE)
-        {
-          message_cache[i] = NULL;
-          ++i;
-        }
-
-      message_cache_shutdown_registered = TRUE;
-    }
-
-  _dbus_assert (message_cache_count >= 0);
-
   if (!_dbus_enable_message_cache ())
     goto out;
 
-  if ((_dbus_string_get_length (&message->header.data) +
-       _dbus_string_get_length (&message->body)) >
-      MAX_MESSAGE_SIZE_TO_CACHE)
-    goto out;
+  size = _dbus_string_get_allocated_size (&message->header.data) +
+    _dbus_string_get_allocated_size (&message->body);
 
-  if (message_cache_count >= MAX_MESSAGE_CACHE_SIZE)
+  if (size > max_message_size_to_cache)
     goto out;
 
-  /* Find empty slot */
-  i = 0;
-  while (message_cache[i] != NULL)
-    ++i;
-
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
+  size_class = message_cache_class_for_size (size);
+  if (size_class >= N_MESSAGE_CACHE_CLASSES)
+    goto out;
 
-  _dbus_assert (message_cache[i] == NULL);
-  message_cache[i] = message;
-  message_cache_count += 1;
-  was_cached = TRUE;
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = TRUE;
 #endif
 
+  cache = get_thread_message_cache ();
+
+  if (cache != NULL)
+    {
+      was_cached = message_cache_push (cache, message, size_class);
+    }
+  else
+    {
+      _DBUS_LOCK (message_cache);
+
+      if (shared_message_cache.registered ||
+          message_cache_register_unlocked (&shared_message_cache))
+        was_cached = message_cache_push (&shared_message_cache, message,
+                                         size_class);
+
+      _DBUS_UNLOCK (message_cache);
+    }
+
  out:
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
-  _DBUS_UNLOCK (message_cache);
-  
   if (!was_cached)
     dbus_message_finalize (message);
 }
 
+#ifdef DBUS_ENABLE_STATS
+/**
+ * Gets statistics about message recycling, summed over all threads.
+ * Other threads may be changing the counts while this runs.
+ *
+ * @param hits_p returns how many messages were reused
+ * @param misses_p returns how many messages had to be allocated
+ * @param cached_messages_p returns how many messages are cached now
+ */
+void
+_dbus_message_get_cache_stats (dbus_uint32_t *hits_p,
+                               dbus_uint32_t *misses_p,
+                               dbus_uint32_t *cached_messages_p)
+{
+  DBusMessageCache *cache;
+
+  _DBUS_LOCK (message_cache);
+
+  *hits_p = message_cache_old_hits;
+  *misses_p = message_cache_old_misses;
+  *cached_messages_p = 0;
+
+  for (cache = message_caches; cache != NULL; cache = cache->next)
+    {
+      *hits_p += cache->hits;
+      *misses_p += cache->misses;
+      *cached_messages_p += cache->n_messages;
+    }
+
+  _DBUS_UNLOCK (message_cache);
+}
+#endif
+
+#ifdef DBUS_BUILD_TESTS
+/**
+ * Gets the limits set with _dbus_message_set_cache_limits().
+ *
+ * @param max_messages_p returns the maximum messages per thread
+ * @param max_message_size_p returns the largest size that is cached
+ */
+void
+_dbus_message_get_cache_limits (int *max_messages_p,
+                                int *max_message_size_p)
+{
+  *max_messages_p = max_message_cache_size;
+  *max_message_size_p = max_message_size_to_cache;
+}
+
+/**
+ * Gets the size class that a message whose header and body have
+ * @size bytes allocated would be cached in.
+ *
+ * @param size header plus body capacity
+ * @returns the class, or the number of classes if it is too big
+ */
+int
+_dbus_message_cache_class_for_size (int size)
+{
+  return message_cache_class_for_size (size);
+}
+
+/**
+ * Gets how many messages the calling thread could reuse from its
+ * cache, in one size class or in all of them.
+ *
+ * @param size_class the class, or -1 for all classes
+ * @returns the number of messages
+ */
+int
+_dbus_message_get_n_cached (int size_class)
+{
+  DBusMessageCache *cache;
+  DBusMessage *message;
+  int n;
+
+  cache = get_thread_message_cache ();
+
+  if (cache == NULL)
+    {
+      _DBUS_LOCK (message_cache);
+      cache = &shared_message_cache;
+    }
+
+  if (size_class < 0)
+    {
+      n = cache->n_messages;
+    }
+  else
+    {
+      _dbus_assert (size_class < N_MESSAGE_CACHE_CLASSES);
+
+      n = 0;
+      for (message = cache->messages[size_class];
+           message != NULL;
+           message = message->next_in_cache)
+        n++;
+    }
+
+  if (cache == &shared_message_cache)
+    _DBUS_UNLOCK (message_cache);
+
+  return n;
+}
+#endif /* DBUS_BUILD_TESTS */
+
 #ifndef DBUS_DISABLE_CHECKS
 static dbus_bool_t
 _dbus_message_iter_check (DBusMessageRealIter *iter)
@@ -1122,13 +1478,16 @@ dbus_message_finalize (DBusMessage *message)
   dbus_free (message);
 }
 
+/* @size_hint is how big the header and body are expected to be
+ * together, or 0 if unknown; it is only used to pick a cached message.
+ */
 static DBusMessage*
-dbus_message_new_empty_header (void)
+dbus_message_new_empty_header_sized (int size_hint)
 {
   DBusMessage *message;
   dbus_bool_t from_cache;
 
-  message = dbus_message_get_cached ();
+  message = dbus_message_get_cached (size_hint);
 
   if (message != NULL)
     {
@@ -1195,6 +1554,12 @@ dbus_message_new_empty_header (void)
   return message;
 }
 
+static DBusMessage*
+dbus_message_new_empty_header (void)
+{
+  return dbus_message_new_empty_header_sized (0);
+}
+
 /**
  * Constructs a new message of the given message type.
  * Types include #DBUS_MESSAGE_TYPE_METHOD_CALL,
@@ -3022,10 +3387,9 @@ dbus_message_get_path (DBusMessage   *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_PATH,
-                                DBUS_TYPE_OBJECT_PATH,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_PATH,
+                                 &v, NULL, NULL);
   return v;
 }
 
@@ -3153,10 +3517,9 @@ dbus_message_get_interface (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_INTERFACE,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_INTERFACE,
+                                 &v, NULL, NULL);
   return v;
 }
 
@@ -3239,10 +3602,9 @@ dbus_message_get_member (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_MEMBER,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_MEMBER,
+                                 &v, NULL, NULL);
   return v;
 }
 
@@ -3323,10 +3685,9 @@ dbus_message_get_error_name (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_ERROR_NAME,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_ERROR_NAME,
+                                 &v, NULL, NULL);
   return v;
 }
 
@@ -3376,10 +3737,9 @@ dbus_message_get_destination (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_DESTINATION,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_DESTINATION,
+                                 &v, NULL, NULL);
   return v;
 }
 
@@ -3436,10 +3796,9 @@ dbus_message_get_sender (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_SENDER,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_SENDER,
+                                 &v, NULL, NULL);
   return v;
 }
 
@@ -3474,6 +3833,31 @@ dbus_message_get_signature (DBusMessage *message)
   return _dbus_string_get_const_data_len (type_str, type_pos, 0);
 }
 
+/**
+ * Gets a string, object path or signature header field with its length
+ * and hash, as for _dbus_header_get_field_string(), so that it can be
+ * compared with many strings whose length and hash are known in advance.
+ *
+ * @param message the message
+ * @param field the header field, such as #DBUS_HEADER_FIELD_MEMBER
+ * @param value return location for the string, or #NULL
+ * @param len return location for its length, or #NULL
+ * @param hash return location for _dbus_hash_string_len() of it, or #NULL
+ * @returns #FALSE if the message doesn't have the field
+ */
+dbus_bool_t
+_dbus_message_get_header_string (DBusMessage  *message,
+                                 int           field,
+                                 const char  **value,
+                                 int          *len,
+                                 unsigned int *hash)
+{
+  _dbus_assert (message != NULL);
+
+  return _dbus_header_get_field_string (&message->header, field,
+                                        value, len, hash);
+}
+
 static dbus_bool_t
 _dbus_message_has_type_interface_member (DBusMessage *message,
                                          int          type,
@@ -3803,6 +4187,7 @@ _dbus_message_loader_new (void)
   number of unix fds we want to receive in advance. A
   try-and-reallocate loop is not possible. */
   loader->max_message_unix_fds = 1024;
+  loader->mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
 
   if (!_dbus_string_init (&loader->data))
     {
@@ -3989,10 +4374,7 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
 }
 
 /*
- * FIXME when we move the header out of the buffer, that memmoves all
- * buffered messages. Kind of crappy.
- *
- * Also we copy the header and body, which is kind of crappy.  To
+ * We copy the header and body, which is kind of crappy.  To
  * avoid this, we have to allow header and body to be in a single
  * memory block, which is good for messages we read and bad for
  * messages we are creating. But we could move_len() the buffer into
@@ -4008,15 +4390,17 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
  * memmoved. Though I suppose we also don't have a chance of reading a
  * bunch of small messages at once, so the optimization may be stupid.
  *
- * Another approach would be to keep a "start" index into
- * loader->data and only delete it occasionally, instead of after
- * each message is loaded.
+ * The message is loaded from offset @start in loader->data; the caller
+ * is responsible for deleting the consumed bytes, which
+ * _dbus_message_loader_queue_messages() does once per batch rather than
+ * once per message.
  *
  * load_message() returns FALSE if not enough memory OR the loader was corrupted
  */
 static dbus_bool_t
 load_message (DBusMessageLoader *loader,
               DBusMessage       *message,
+              int                start,
               int                byte_order,
               int                fields_array_len,
               int                header_len,
@@ -4029,17 +4413,18 @@ load_message (DBusMessageLoader *loader,
   DBusValidationMode mode;
   dbus_uint32_t n_unix_fds = 0;
 
-  mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
+  mode = loader->mode;
   
   oom = FALSE;
 
 #if 0
-  _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
+  _dbus_verbose_bytes_of_string (&loader->data, start, header_len /* + body_len */);
 #endif
 
   /* 1. VALIDATE AND COPY OVER HEADER */
   _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+  _dbus_assert ((start + header_len + body_len) <=
+                _dbus_string_get_length (&loader->data));
 
   if (!_dbus_header_load (&message->header,
                           mode,
@@ -4048,8 +4433,8 @@ load_message (DBusMessageLoader *loader,
                           fields_array_len,
                           header_len,
                           body_len,
-                          &loader->data, 0,
-                          _dbus_string_get_length (&loader->data)))
+                          &loader->data, start,
+                          _dbus_string_get_length (&loader->data) - start))
     {
       _dbus_verbose ("Failed to load header for new message code %d\n", validity);
 
@@ -4069,7 +4454,23 @@ load_message (DBusMessageLoader *loader,
 
   _dbus_assert (validity == DBUS_VALID);
 
-  /* 2. VALIDATE BODY */
+  /* 2. COPY OVER AND VALIDATE BODY */
+  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
+  _dbus_assert (_dbus_string_get_length (&loader->data) >=
+                (start + header_len + body_len));
+
+  /* The body is validated in its new home rather than in loader->data,
+   * because alignment is checked against actual addresses and @start is
+   * only guaranteed to be aligned relative to the previous message.
+   */
+  if (!_dbus_string_copy_len (&loader->data, start + header_len, body_len,
+                              &message->body, 0))
+    {
+      _dbus_verbose ("Failed to move body into new message\n");
+      oom = TRUE;
+      goto failed;
+    }
+
   if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
       get_const_signature (&message->header, &type_str, &type_pos);
@@ -4081,8 +4482,8 @@ load_message (DBusMessageLoader *loader,
                                                   type_pos,
                                                   byte_order,
                                                   NULL,
-                                                  &loader->data,
-                                                  header_len,
+                                                  &message->body,
+                                                  0,
                                                   body_len);
       if (validity != DBUS_VALID)
         {
@@ -4148,7 +4549,7 @@ load_message (DBusMessageLoader *loader,
 
 #endif
 
-  /* 3. COPY OVER BODY AND QUEUE MESSAGE */
+  /* 4. QUEUE MESSAGE */
 
   if (!_dbus_list_append (&loader->messages, message))
     {
@@ -4157,22 +4558,6 @@ load_message (DBusMessageLoader *loader,
       goto failed;
     }
 
-  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
-                (header_len + body_len));
-
-  if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
-    {
-      _dbus_verbose ("Failed to move body into new message\n");
-      oom = TRUE;
-      goto failed;
-    }
-
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
-
-  /* don't waste more than 2k of memory */
-  _dbus_string_compact (&loader->data, 2048);
-
   _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
   _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
 
@@ -4197,7 +4582,8 @@ load_message (DBusMessageLoader *loader,
   else
     _dbus_assert (loader->corrupted);
 
-  _dbus_verbose_bytes_of_string (&loader->data, 0, _dbus_string_get_length (&loader->data));
+  _dbus_verbose_bytes_of_string (&loader->data, start,
+                                 _dbus_string_get_length (&loader->data) - start);
 
   return FALSE;
 }
@@ -4213,14 +4599,25 @@ load_message (DBusMessageLoader *loader,
  * right here rather than passing it out to applications.  However
  * it's not an error to see messages of unknown type.
  *
+ * Messages are parsed in place from a moving start offset, and the
+ * consumed bytes are only deleted from the front of the buffer once
+ * at the end, so a read that brought in many small messages costs a
+ * single memmove of whatever partial message is left over.
+ *
  * @param loader the loader.
  * @returns #TRUE if we had enough memory to finish.
  */
 dbus_bool_t
 _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 {
+  dbus_bool_t retval;
+  int start;
+
+  retval = TRUE;
+  start = 0;
+
   while (!loader->corrupted &&
-         _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
+         _dbus_string_get_length (&loader->data) - start >= DBUS_MINIMUM_HEADER_SIZE)
     {
       DBusValidity validity;
       int byte_order, fields_array_len, header_len, body_len;
@@ -4231,18 +4628,22 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
                                                &fields_array_len,
                                                &header_len,
                                                &body_len,
-                                               &loader->data, 0,
-                                               _dbus_string_get_length (&loader->data)))
+                                               &loader->data, start,
+                                               _dbus_string_get_length (&loader->data) - start))
         {
           DBusMessage *message;
 
           _dbus_assert (validity == DBUS_VALID);
 
-          message = dbus_message_new_empty_header ();
+          message = dbus_message_new_empty_header_sized (header_len +
+                                                         body_len);
           if (message == NULL)
-            return FALSE;
+            {
+              retval = FALSE;
+              break;
+            }
 
-          if (!load_message (loader, message,
+          if (!load_message (loader, message, start,
                              byte_order, fields_array_len,
                              header_len, body_len))
             {
@@ -4250,11 +4651,14 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               /* load_message() returns false if corrupted or OOM; if
                * corrupted then return TRUE for not OOM
                */
-              return loader->corrupted;
+              retval = loader->corrupted;
+              break;
             }
 
           _dbus_assert (loader->messages != NULL);
           _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+
+          start += header_len + body_len;
 	}
       else
         {
@@ -4265,11 +4669,19 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
-          return TRUE;
+          break;
         }
     }
 
-  return TRUE;
+  if (start > 0)
+    {
+      _dbus_string_delete (&loader->data, 0, start);
+
+      /* don't waste more than 2k of memory */
+      _dbus_string_compact (&loader->data, 2048);
+    }
+
+  return retval;
 }
 
 /**
@@ -4423,6 +4835,25 @@ _dbus_message_loader_get_max_message_unix_fds (DBusMessageLoader  *loader)
   return loader->max_message_unix_fds;
 }
 
+/**
+ * Sets whether messages are assumed to be well-formed. If #TRUE,
+ * only the framing of each message is checked, and its header and
+ * body are used as they are; this is only safe if the sender is
+ * known to produce nothing but valid messages.
+ *
+ * @param loader the loader
+ * @param trusted #TRUE to skip validating message headers and bodies
+ */
+void
+_dbus_message_loader_set_trusted (DBusMessageLoader  *loader,
+                                  dbus_bool_t         trusted)
+{
+  if (trusted)
+    loader->mode = DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY;
+  else
+    loader->mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
+}
+
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (message_slots);
 
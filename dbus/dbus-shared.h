@@ -119,6 +119,11 @@ typedef enum
 #define DBUS_START_REPLY_SUCCESS         1 /**< Service was auto started */
 #define DBUS_START_REPLY_ALREADY_RUNNING 2 /**< Service was already running */
 
+/* Flags for listing names */
+#define DBUS_LIST_NAMES_UNIQUE      0x1 /**< Include unique connection names */
+#define DBUS_LIST_NAMES_WELL_KNOWN  0x2 /**< Include well-known names that have an owner */
+#define DBUS_LIST_NAMES_ACTIVATABLE 0x4 /**< Include names that can be activated */
+
 /** @} */
 
 #ifdef __cplusplus
@@ -25,7 +25,9 @@
 #include <config.h>
 #include "dbus-socket-set.h"
 
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps.h>
 
 #ifndef __linux__
@@ -39,9 +41,31 @@
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
+/* What we know about one fd. Enabling and disabling only record the
+ * events we want; the epoll_ctl() to make the kernel agree is made once,
+ * just before the next epoll_wait(), so a watch that is toggled several
+ * times between polls (as a connection's write watch is when it queues
+ * and flushes messages) costs at most one syscall.
+ */
+typedef struct {
+    int fd;
+    uint32_t applied;     /* events the kernel has for this fd */
+    uint32_t wanted;      /* events it should have at the next poll */
+    DBusList *dirty_link; /* allocated with the entry so that enabling
+                           * can't fail; in the dirty list iff queued */
+    unsigned int dirty : 1;
+} SocketSetEpollEntry;
+
 typedef struct {
     DBusSocketSet parent;
     int epfd;
+    /* fd => SocketSetEpollEntry */
+    DBusHashTable *entries;
+    /* entries whose wanted events may differ from the applied ones */
+    DBusList *dirty;
+    /* buffer for epoll_wait(), grown to what the caller can accept */
+    struct epoll_event *events;
+    int n_events_allocated;
 } DBusSocketSetEpoll;
 
 static inline DBusSocketSetEpoll *
@@ -63,9 +87,29 @@ socket_set_epoll_free (DBusSocketSet *set)
   if (self->epfd != -1)
     close (self->epfd);
 
+  /* every entry's dirty link is either in the list or owned by the entry */
+  while (self->dirty != NULL)
+    _dbus_list_unlink (&self->dirty, self->dirty);
+
+  if (self->entries != NULL)
+    _dbus_hash_table_unref (self->entries);
+
+  dbus_free (self->events);
   dbus_free (self);
 }
 
+static void
+socket_set_epoll_entry_free (void *data)
+{
+  SocketSetEpollEntry *entry = data;
+
+  if (entry == NULL)
+    return;
+
+  _dbus_list_free_link (entry->dirty_link);
+  dbus_free (entry);
+}
+
 DBusSocketSet *
 _dbus_socket_set_epoll_new (void)
 {
@@ -78,6 +122,16 @@ _dbus_socket_set_epoll_new (void)
 
   self->parent.cls = &_dbus_socket_set_epoll_class;
 
+  self->entries = _dbus_hash_table_new (DBUS_HASH_INT, NULL,
+                                        socket_set_epoll_entry_free);
+
+  if (self->entries == NULL)
+    {
+      self->epfd = -1;
+      socket_set_epoll_free ((DBusSocketSet *) self);
+      return NULL;
+    }
+
   self->epfd = epoll_create1 (EPOLL_CLOEXEC);
 
   if (self->epfd == -1)
@@ -141,10 +195,29 @@ socket_set_epoll_add (DBusSocketSet  *set,
                       dbus_bool_t     enabled)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  SocketSetEpollEntry *entry;
   struct epoll_event event;
   int err;
 
-  event.data.fd = fd;
+  if (_dbus_hash_table_lookup_int (self->entries, fd) != NULL)
+    {
+      _dbus_warn ("fd %d added and then added again\n", fd);
+      return FALSE;
+    }
+
+  entry = dbus_new0 (SocketSetEpollEntry, 1);
+
+  if (entry == NULL)
+    return FALSE;
+
+  entry->fd = fd;
+  entry->dirty_link = _dbus_list_alloc_link (entry);
+
+  if (entry->dirty_link == NULL)
+    {
+      dbus_free (entry);
+      return FALSE;
+    }
 
   if (enabled)
     {
@@ -157,6 +230,20 @@ socket_set_epoll_add (DBusSocketSet  *set,
       event.events = EPOLLET;
     }
 
+  entry->applied = event.events;
+  entry->wanted = event.events;
+
+  if (!_dbus_hash_table_insert_int (self->entries, fd, entry))
+    {
+      socket_set_epoll_entry_free (entry);
+      return FALSE;
+    }
+
+  /* Unlike changes to an fd we already have, this can fail, so it
+   * can't be put off until the next poll */
+  event.data.fd = fd;
+  self->parent.n_change_calls += 1;
+
   if (epoll_ctl (self->epfd, EPOLL_CTL_ADD, fd, &event) == 0)
     return TRUE;
 
@@ -184,56 +271,106 @@ socket_set_epoll_add (DBusSocketSet  *set,
         break;
     }
 
+  _dbus_hash_table_remove_int (self->entries, fd);
   return FALSE;
 }
 
+/* Records that @fd should have @events by the next poll. Can't fail. */
 static void
-socket_set_epoll_enable (DBusSocketSet  *set,
-                         int             fd,
-                         unsigned int    flags)
+socket_set_epoll_want (DBusSocketSetEpoll *self,
+                       int                 fd,
+                       uint32_t            events)
 {
-  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event event;
-  int err;
+  SocketSetEpollEntry *entry;
 
-  event.data.fd = fd;
-  event.events = watch_flags_to_epoll_events (flags);
+  self->parent.n_changes += 1;
 
-  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
-    return;
-
-  err = errno;
+  entry = _dbus_hash_table_lookup_int (self->entries, fd);
 
-  /* Enabling a file descriptor isn't allowed to fail, even for OOM, so we
-   * do our best to avoid all of these. */
-  switch (err)
+  if (entry == NULL)
     {
-      case EBADF:
-        _dbus_warn ("Bad fd %d\n", fd);
-        break;
+      _dbus_warn ("fd %d enabled or disabled before it was added\n", fd);
+      return;
+    }
 
-      case ENOENT:
-        _dbus_warn ("fd %d enabled before it was added\n", fd);
-        break;
+  entry->wanted = events;
 
-      case ENOMEM:
-        _dbus_warn ("Insufficient memory to change watch for fd %d\n", fd);
-        break;
+  if (!entry->dirty)
+    {
+      _dbus_list_append_link (&self->dirty, entry->dirty_link);
+      entry->dirty = TRUE;
+    }
+}
 
-      default:
-        _dbus_warn ("Misc error when trying to watch fd %d: %s\n", fd,
-                    strerror (err));
-        break;
+/* Makes the kernel agree with everything asked for since the last poll */
+static void
+socket_set_epoll_apply_changes (DBusSocketSetEpoll *self)
+{
+  while (self->dirty != NULL)
+    {
+      DBusList *link = self->dirty;
+      SocketSetEpollEntry *entry = link->data;
+      struct epoll_event event;
+      int err;
+
+      _dbus_list_unlink (&self->dirty, link);
+      entry->dirty = FALSE;
+
+      if (entry->wanted == entry->applied)
+        continue;
+
+      event.data.fd = entry->fd;
+      event.events = entry->wanted;
+      self->parent.n_change_calls += 1;
+
+      if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, entry->fd, &event) == 0)
+        {
+          entry->applied = entry->wanted;
+          continue;
+        }
+
+      err = errno;
+
+      /* Changing a file descriptor isn't allowed to fail, even for OOM,
+       * so we do our best to avoid all of these. */
+      switch (err)
+        {
+          case EBADF:
+            _dbus_warn ("Bad fd %d\n", entry->fd);
+            break;
+
+          case ENOENT:
+            _dbus_warn ("fd %d changed after it was closed\n", entry->fd);
+            break;
+
+          case ENOMEM:
+            _dbus_warn ("Insufficient memory to change watch for fd %d\n",
+                        entry->fd);
+            break;
+
+          default:
+            _dbus_warn ("Misc error when trying to watch fd %d: %s\n",
+                        entry->fd, strerror (err));
+            break;
+        }
     }
 }
 
+static void
+socket_set_epoll_enable (DBusSocketSet  *set,
+                         int             fd,
+                         unsigned int    flags)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+
+  socket_set_epoll_want (self, fd, watch_flags_to_epoll_events (flags));
+}
+
 static void
 socket_set_epoll_disable (DBusSocketSet  *set,
                           int             fd)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event event;
-  int err;
 
   /* The naive thing to do would be EPOLL_CTL_DEL, but that'll probably
    * free resources in the kernel. When we come to do socket_set_epoll_enable,
@@ -250,16 +387,12 @@ socket_set_epoll_disable (DBusSocketSet  *set,
    * we'll switch back to level-triggered and be notified again (verified to
    * work on 2.6.32). Compile this file with -DTEST_BEHAVIOUR_OF_EPOLLET for
    * test code.
+   *
+   * Enabled fds stay level-triggered: a watch reads or writes a bounded
+   * amount each time it is dispatched, so with edge-triggering whatever
+   * it left in the socket would never be reported again.
    */
-  event.data.fd = fd;
-  event.events = EPOLLET;
-
-  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
-    return;
-
-  err = errno;
-  _dbus_warn ("Error when trying to watch fd %d: %s\n", fd,
-              strerror (err));
+  socket_set_epoll_want (self, fd, EPOLLET);
 }
 
 static void
@@ -267,11 +400,26 @@ socket_set_epoll_remove (DBusSocketSet  *set,
                          int             fd)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  SocketSetEpollEntry *entry;
   int err;
   /* Kernels < 2.6.9 require a non-NULL struct pointer, even though its
    * contents are ignored */
   struct epoll_event dummy = { 0 };
 
+  /* The fd is probably about to be closed, so this has to happen now,
+   * and any change still queued for it is moot */
+  entry = _dbus_hash_table_lookup_int (self->entries, fd);
+
+  if (entry != NULL)
+    {
+      if (entry->dirty)
+        _dbus_list_unlink (&self->dirty, entry->dirty_link);
+
+      _dbus_hash_table_remove_int (self->entries, fd);
+    }
+
+  self->parent.n_change_calls += 1;
+
   if (epoll_ctl (self->epfd, EPOLL_CTL_DEL, fd, &dummy) == 0)
     return;
 
@@ -279,9 +427,7 @@ socket_set_epoll_remove (DBusSocketSet  *set,
   _dbus_warn ("Error when trying to remove fd %d: %s\n", fd, strerror (err));
 }
 
-/* Optimally, this should be the same as in DBusLoop: we use it to translate
- * between struct epoll_event and DBusSocketEvent without allocating heap
- * memory. */
+/* Used if we can't allocate a buffer as big as the caller's */
 #define N_STACK_DESCRIPTORS 64
 
 static int
@@ -291,19 +437,52 @@ socket_set_epoll_poll (DBusSocketSet   *set,
                        int              timeout_ms)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event events[N_STACK_DESCRIPTORS];
+  struct epoll_event stack_events[N_STACK_DESCRIPTORS];
+  struct epoll_event *events;
+  int n_events;
   int n_ready;
   int i;
 
   _dbus_assert (max_events > 0);
 
-  n_ready = epoll_wait (self->epfd, events,
-                        MIN (_DBUS_N_ELEMENTS (events), max_events),
-                        timeout_ms);
+  socket_set_epoll_apply_changes (self);
+
+  events = stack_events;
+  n_events = MIN ((int) _DBUS_N_ELEMENTS (stack_events), max_events);
+
+  /* Take as many events as the caller can, so that a burst of activity
+   * on many connections is picked up in one wakeup */
+  if (max_events > n_events)
+    {
+      if (max_events > self->n_events_allocated)
+        {
+          struct epoll_event *bigger;
+
+          bigger = dbus_realloc (self->events,
+                                 max_events * sizeof (struct epoll_event));
+
+          if (bigger != NULL)
+            {
+              self->events = bigger;
+              self->n_events_allocated = max_events;
+            }
+        }
+
+      if (self->n_events_allocated > n_events)
+        {
+          events = self->events;
+          n_events = MIN (self->n_events_allocated, max_events);
+        }
+    }
+
+  self->parent.n_polls += 1;
+  n_ready = epoll_wait (self->epfd, events, n_events, timeout_ms);
 
   if (n_ready <= 0)
     return n_ready;
 
+  self->parent.n_events += n_ready;
+
   for (i = 0; i < n_ready; i++)
     {
       revents[i].fd = events[i].data.fd;
@@ -25,6 +25,8 @@
 
 #include <config.h>
 #include <dbus/dbus-socket-set.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
 
 DBusSocketSet *
 _dbus_socket_set_new (int size_hint)
@@ -45,3 +47,119 @@ _dbus_socket_set_new (int size_hint)
 
   return NULL;
 }
+
+#ifdef DBUS_BUILD_TESTS
+#include <dbus/dbus-string.h>
+#include <dbus/dbus-test.h>
+
+/* Polls the set and returns the flags reported for fd */
+static unsigned int
+socket_set_ready_flags (DBusSocketSet *set,
+                        int            fd,
+                        int            timeout_ms)
+{
+  DBusSocketEvent events[8];
+  unsigned int flags;
+  int n, i;
+
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events),
+                             timeout_ms);
+  _dbus_assert (n >= 0);
+
+  flags = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (events[i].fd == fd)
+        flags |= events[i].flags;
+    }
+
+  return flags & (DBUS_WATCH_READABLE | DBUS_WATCH_WRITABLE);
+}
+
+static void
+check_socket_set (DBusSocketSet *set)
+{
+  DBusString byte;
+  int a, b;
+  int i;
+
+  _dbus_string_init_const (&byte, "x");
+
+  /* Twice, so that the second time round the fd numbers are reused
+   * and anything left over from the first pair must be ignored */
+  for (i = 0; i < 2; i++)
+    {
+      if (!_dbus_full_duplex_pipe (&a, &b, FALSE, NULL))
+        _dbus_assert_not_reached ("could not create socket pair");
+
+      if (!_dbus_socket_set_add (set, a, DBUS_WATCH_READABLE, TRUE))
+        _dbus_assert_not_reached ("no memory to add fd");
+
+      _dbus_assert (socket_set_ready_flags (set, a, 0) == 0);
+
+      if (_dbus_write_socket (b, &byte, 0, 1) != 1)
+        _dbus_assert_not_reached ("could not write to socket pair");
+
+      _dbus_assert (socket_set_ready_flags (set, a, 1000) == DBUS_WATCH_READABLE);
+      /* still readable, as nothing has been read */
+      _dbus_assert (socket_set_ready_flags (set, a, 1000) == DBUS_WATCH_READABLE);
+
+      _dbus_socket_set_disable (set, a);
+      _dbus_assert (socket_set_ready_flags (set, a, 0) == 0);
+
+      _dbus_socket_set_enable (set, a, DBUS_WATCH_READABLE | DBUS_WATCH_WRITABLE);
+      _dbus_assert (socket_set_ready_flags (set, a, 1000) ==
+                    (DBUS_WATCH_READABLE | DBUS_WATCH_WRITABLE));
+
+      _dbus_socket_set_enable (set, a, DBUS_WATCH_WRITABLE);
+      _dbus_assert (socket_set_ready_flags (set, a, 1000) == DBUS_WATCH_WRITABLE);
+
+      _dbus_socket_set_remove (set, a);
+      _dbus_assert (socket_set_ready_flags (set, a, 0) == 0);
+
+      /* added disabled, then enabled */
+      if (!_dbus_socket_set_add (set, a, DBUS_WATCH_READABLE, FALSE))
+        _dbus_assert_not_reached ("no memory to add fd");
+
+      _dbus_assert (socket_set_ready_flags (set, a, 0) == 0);
+
+      _dbus_socket_set_enable (set, a, DBUS_WATCH_READABLE);
+      _dbus_assert (socket_set_ready_flags (set, a, 1000) == DBUS_WATCH_READABLE);
+
+      _dbus_socket_set_remove (set, a);
+      _dbus_close_socket (a, NULL);
+      _dbus_close_socket (b, NULL);
+    }
+}
+
+/**
+ * Checks that each socket set implementation that was built reports
+ * readiness correctly as fds are added, enabled, disabled and removed.
+ *
+ * @returns #TRUE on success
+ */
+dbus_bool_t
+_dbus_socket_set_test (void)
+{
+  DBusSocketSet *set;
+
+  set = _dbus_socket_set_poll_new (8);
+  if (set == NULL)
+    _dbus_assert_not_reached ("no memory for poll socket set");
+
+  check_socket_set (set);
+  _dbus_socket_set_free (set);
+
+#ifdef DBUS_HAVE_LINUX_EPOLL
+  set = _dbus_socket_set_epoll_new ();
+
+  if (set != NULL)
+    {
+      check_socket_set (set);
+      _dbus_socket_set_free (set);
+    }
+#endif
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
@@ -59,6 +59,12 @@ struct DBusSocketSetClass {
 
 struct DBusSocketSet {
     DBusSocketSetClass *cls;
+    /* Counters for the bus daemon's Stats interface; each implementation
+     * updates whichever of them apply to it */
+    dbus_uint32_t n_polls;        /* calls to wait for events */
+    dbus_uint32_t n_events;       /* events those calls returned */
+    dbus_uint32_t n_changes;      /* enable/disable requests */
+    dbus_uint32_t n_change_calls; /* syscalls spent on the set of fds */
 };
 
 DBusSocketSet *_dbus_socket_set_new           (int               size_hint);
@@ -932,6 +932,59 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  /* The ASCII, UTF-8 and nul validators work a word at a time in the
+   * middle of the range, so put a bad byte at every offset, with every
+   * starting alignment, and make sure it is still noticed.
+   */
+  {
+    int start, bad;
+
+    if (!_dbus_string_init (&str))
+      _dbus_assert_not_reached ("no memory");
+
+    for (start = 0; start < 8; start++)
+      {
+        for (bad = start; bad < 40; bad++)
+          {
+            int len = 40 - start;
+
+            if (!_dbus_string_set_length (&str, 0) ||
+                !_dbus_string_append_len (&str, "0123456789abcdef0123456789abcdef01234567", 40))
+              _dbus_assert_not_reached ("no memory");
+
+            _dbus_assert (_dbus_string_validate_ascii (&str, start, len));
+            _dbus_assert (_dbus_string_validate_utf8 (&str, start, len));
+
+            _dbus_string_set_byte (&str, bad, 0x80);
+            _dbus_assert (!_dbus_string_validate_ascii (&str, start, len));
+            _dbus_assert (!_dbus_string_validate_utf8 (&str, start, len));
+
+            _dbus_string_set_byte (&str, bad, '\0');
+            _dbus_assert (!_dbus_string_validate_ascii (&str, start, len));
+            _dbus_assert (!_dbus_string_validate_utf8 (&str, start, len));
+
+            if (bad + 1 < 40)
+              {
+                /* a valid two-byte character in the middle of ASCII */
+                _dbus_string_set_byte (&str, bad, 0xc3);
+                _dbus_string_set_byte (&str, bad + 1, 0xa9);
+                _dbus_assert (!_dbus_string_validate_ascii (&str, start, len));
+                _dbus_assert (_dbus_string_validate_utf8 (&str, start, len));
+              }
+
+            if (!_dbus_string_set_length (&str, 0) ||
+                !_dbus_string_insert_bytes (&str, 0, 40, '\0'))
+              _dbus_assert_not_reached ("no memory");
+
+            _dbus_assert (_dbus_string_validate_nul (&str, start, len));
+            _dbus_string_set_byte (&str, bad, 1);
+            _dbus_assert (!_dbus_string_validate_nul (&str, start, len));
+          }
+      }
+
+    _dbus_string_free (&str);
+  }
+
   return TRUE;
 }
 
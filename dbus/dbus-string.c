@@ -722,6 +722,21 @@ _dbus_string_get_length (const DBusString  *str)
 }
 #endif /* !_dbus_string_get_length */
 
+/**
+ * Gets the number of bytes allocated for a string, which is how long
+ * it can become without being reallocated plus some padding.
+ *
+ * @param str the string
+ * @returns the allocated size
+ */
+int
+_dbus_string_get_allocated_size (const DBusString *str)
+{
+  DBUS_CONST_STRING_PREAMBLE (str);
+
+  return real->allocated;
+}
+
 /**
  * Makes a string longer by the given number of bytes.  Checks whether
  * adding additional_length to the current length would overflow an
@@ -2438,6 +2453,44 @@ _dbus_string_hex_decode (const DBusString *source,
   return retval;
 }
 
+/* The validators below look at a machine word at a time where they can,
+ * since they run over every string in every message from an untrusted
+ * peer. Subtracting 0x01 from each byte sets a byte's high bit if it was
+ * zero, so a word whose bytes are all in 1..127 has no high bits set in
+ * either the word or the word minus WORD_ONES.
+ */
+#define WORD_ONES ((size_t) -1 / 0xff)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+#define WORD_IS_NONNUL_ASCII(w) ((((w) | ((w) - WORD_ONES)) & WORD_HIGHS) == 0)
+
+/* Returns the first byte in [p, end) that is nul or not ASCII, or end */
+static const unsigned char *
+skip_nonnul_ascii (const unsigned char *p,
+                   const unsigned char *end)
+{
+  const unsigned char *aligned;
+
+  aligned = _DBUS_ALIGN_ADDRESS (p, sizeof (size_t));
+  if (aligned > end)
+    aligned = end;
+
+  while (p != aligned)
+    {
+      if (!_DBUS_ISASCII (*p))
+        return p;
+      ++p;
+    }
+
+  while ((size_t) (end - p) >= sizeof (size_t) &&
+         WORD_IS_NONNUL_ASCII (*(const size_t *) p))
+    p += sizeof (size_t);
+
+  while (p != end && _DBUS_ISASCII (*p))
+    ++p;
+
+  return p;
+}
+
 /**
  * Checks that the given range of the string is valid ASCII with no
  * nul bytes. If the given range is not entirely contained in the
@@ -2468,15 +2521,8 @@ _dbus_string_validate_ascii (const DBusString *str,
   
   s = real->str + start;
   end = s + len;
-  while (s != end)
-    {
-      if (_DBUS_UNLIKELY (!_DBUS_ISASCII (*s)))
-        return FALSE;
-        
-      ++s;
-    }
-  
-  return TRUE;
+
+  return skip_nonnul_ascii (s, end) == end;
 }
 
 /**
@@ -2595,11 +2641,12 @@ _dbus_string_validate_utf8  (const DBusString *str,
        * D-Bus profiles where we are typically validating
        * function names and such. We have to know that
        * all following checks will pass for ASCII though,
-       * comments follow ...
+       * comments follow ... Runs of ASCII are skipped a word
+       * at a time.
        */      
       if (*p < 128)
         {
-          ++p;
+          p = skip_nonnul_ascii (p, end);
           continue;
         }
       
@@ -2671,6 +2718,21 @@ _dbus_string_validate_nul (const DBusString *str,
   
   s = real->str + start;
   end = s + len;
+
+  while (s != end && (uintptr_t) s % sizeof (size_t) != 0)
+    {
+      if (_DBUS_UNLIKELY (*s != '\0'))
+        return FALSE;
+      ++s;
+    }
+
+  while ((size_t) (end - s) >= sizeof (size_t))
+    {
+      if (_DBUS_UNLIKELY (*(const size_t *) s != 0))
+        return FALSE;
+      s += sizeof (size_t);
+    }
+
   while (s != end)
     {
       if (_DBUS_UNLIKELY (*s != '\0'))
@@ -130,6 +130,7 @@ void          _dbus_string_copy_to_buffer_with_nul (const DBusString  *str,
 #ifndef _dbus_string_get_length
 int           _dbus_string_get_length            (const DBusString  *str);
 #endif /* !_dbus_string_get_length */
+int           _dbus_string_get_allocated_size    (const DBusString  *str);
 
 dbus_bool_t   _dbus_string_lengthen              (DBusString        *str,
                                                   int                additional_length);
@@ -28,6 +28,7 @@
 
 #include <sys/time.h>
 #include <pthread.h>
+#include <signal.h>
 #include <string.h>
 
 #ifdef HAVE_ERRNO_H
@@ -55,6 +56,16 @@ struct DBusCondVar {
   pthread_cond_t cond; /**< the condition */
 };
 
+struct DBusThreadLocal {
+  pthread_key_t key; /**< the key */
+};
+
+struct DBusThread {
+  pthread_t thread;            /**< the thread */
+  DBusThreadFunction function; /**< what it runs */
+  void *data;                  /**< argument to function */
+};
+
 #define DBUS_MUTEX(m)         ((DBusMutex*) m)
 #define DBUS_MUTEX_PTHREAD(m) ((DBusMutexPThread*) m)
 
@@ -262,6 +273,97 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   PTHREAD_CHECK ("pthread_cond_signal", pthread_cond_signal (&cond->cond));
 }
 
+DBusThreadLocal *
+_dbus_platform_thread_local_new (DBusThreadLocalDestructor destructor)
+{
+  DBusThreadLocal *local;
+
+  local = dbus_new (DBusThreadLocal, 1);
+  if (local == NULL)
+    return NULL;
+
+  if (pthread_key_create (&local->key, destructor) != 0)
+    {
+      dbus_free (local);
+      return NULL;
+    }
+
+  return local;
+}
+
+void
+_dbus_platform_thread_local_free (DBusThreadLocal *local)
+{
+  PTHREAD_CHECK ("pthread_key_delete", pthread_key_delete (local->key));
+  dbus_free (local);
+}
+
+void *
+_dbus_platform_thread_local_get (DBusThreadLocal *local)
+{
+  return pthread_getspecific (local->key);
+}
+
+dbus_bool_t
+_dbus_platform_thread_local_set (DBusThreadLocal *local,
+                                 void            *value)
+{
+  return pthread_setspecific (local->key, value) == 0;
+}
+
+static void *
+thread_main (void *data)
+{
+  DBusThread *thread = data;
+
+  (* thread->function) (thread->data);
+
+  return NULL;
+}
+
+/* The new thread blocks all signals, so they keep being delivered to
+ * the threads that were already handling them. */
+DBusThread *
+_dbus_platform_thread_start (DBusThreadFunction  function,
+                             void               *data)
+{
+  DBusThread *thread;
+  sigset_t all_signals;
+  sigset_t old_signals;
+  int result;
+
+  thread = dbus_new (DBusThread, 1);
+  if (thread == NULL)
+    return NULL;
+
+  thread->function = function;
+  thread->data = data;
+
+  sigfillset (&all_signals);
+  PTHREAD_CHECK ("pthread_sigmask",
+                 pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals));
+
+  result = pthread_create (&thread->thread, NULL, thread_main, thread);
+
+  PTHREAD_CHECK ("pthread_sigmask",
+                 pthread_sigmask (SIG_SETMASK, &old_signals, NULL));
+
+  if (result != 0)
+    {
+      dbus_free (thread);
+      return NULL;
+    }
+
+  return thread;
+}
+
+void
+_dbus_platform_thread_join (DBusThread *thread)
+{
+  PTHREAD_CHECK ("pthread_join", pthread_join (thread->thread, NULL));
+  dbus_free (thread);
+}
+
 static void
 check_monotonic_clock (void)
 {
@@ -256,6 +256,84 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   LeaveCriticalSection (&cond->lock);
 }
 
+/* TLS slots have no destructors here, and DllMain only sees threads
+ * exiting when we are built as a DLL, so there is no way to clean up
+ * after a thread; callers fall back to not using thread-local data.
+ */
+DBusThreadLocal *
+_dbus_platform_thread_local_new (DBusThreadLocalDestructor destructor)
+{
+  return NULL;
+}
+
+void
+_dbus_platform_thread_local_free (DBusThreadLocal *local)
+{
+  _dbus_assert_not_reached ("thread-local data is not supported");
+}
+
+void *
+_dbus_platform_thread_local_get (DBusThreadLocal *local)
+{
+  _dbus_assert_not_reached ("thread-local data is not supported");
+  return NULL;
+}
+
+dbus_bool_t
+_dbus_platform_thread_local_set (DBusThreadLocal *local,
+                                 void            *value)
+{
+  _dbus_assert_not_reached ("thread-local data is not supported");
+  return FALSE;
+}
+
+struct DBusThread {
+  HANDLE handle;               /**< the thread */
+  DBusThreadFunction function; /**< what it runs */
+  void *data;                  /**< argument to function */
+};
+
+static DWORD WINAPI
+thread_main (LPVOID data)
+{
+  DBusThread *thread = data;
+
+  (* thread->function) (thread->data);
+
+  return 0;
+}
+
+DBusThread *
+_dbus_platform_thread_start (DBusThreadFunction  function,
+                             void               *data)
+{
+  DBusThread *thread;
+
+  thread = dbus_new (DBusThread, 1);
+  if (thread == NULL)
+    return NULL;
+
+  thread->function = function;
+  thread->data = data;
+  thread->handle = CreateThread (NULL, 0, thread_main, thread, 0, NULL);
+
+  if (thread->handle == NULL)
+    {
+      dbus_free (thread);
+      return NULL;
+    }
+
+  return thread;
+}
+
+void
+_dbus_platform_thread_join (DBusThread *thread)
+{
+  WaitForSingleObject (thread->handle, INFINITE);
+  CloseHandle (thread->handle);
+  dbus_free (thread);
+}
+
 dbus_bool_t
 _dbus_threads_init_platform_specific (void)
 {
@@ -55,6 +55,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <grp.h>
+#include <limits.h>
 
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
@@ -484,6 +485,102 @@ _dbus_write_socket_with_unix_fds_two(int               fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_two() but writes any number of buffers, up
+ * to #_DBUS_MAX_SOCKET_WRITE_VECTORS, in a single system call. The
+ * file descriptors, if any, are sent along with the first byte
+ * written. May write fewer bytes than asked for, like any other
+ * socket write.
+ *
+ * @param fd the file descriptor
+ * @param vectors the buffers to write, in order
+ * @param n_vectors the number of buffers
+ * @param fds file descriptors to send, or #NULL
+ * @param n_fds the number of file descriptors
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_vectored (int                          fd,
+                             const DBusSocketWriteVector *vectors,
+                             int                          n_vectors,
+                             const int                   *fds,
+                             int                          n_fds)
+{
+  struct msghdr m;
+  struct iovec iov[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+  int n_iov;
+  int i;
+  int bytes_written;
+
+  _dbus_assert (n_vectors > 0);
+  _dbus_assert (n_vectors <= _DBUS_MAX_SOCKET_WRITE_VECTORS);
+  _dbus_assert (n_fds >= 0);
+
+#ifndef HAVE_UNIX_FD_PASSING
+  if (n_fds > 0)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+#endif
+
+  n_iov = 0;
+  for (i = 0; i < n_vectors; i++)
+    {
+      _dbus_assert (vectors[i].start >= 0);
+      _dbus_assert (vectors[i].len >= 0);
+
+      if (vectors[i].len == 0)
+        continue;
+
+      iov[n_iov].iov_base = (char*) _dbus_string_get_const_data_len (vectors[i].buffer,
+                                                                     vectors[i].start,
+                                                                     vectors[i].len);
+      iov[n_iov].iov_len = vectors[i].len;
+      n_iov++;
+    }
+
+#ifdef IOV_MAX
+  /* a short write is fine, the caller will be back for the rest */
+  if (n_iov > IOV_MAX)
+    n_iov = IOV_MAX;
+#endif
+
+  _DBUS_ZERO(m);
+  m.msg_iov = iov;
+  m.msg_iovlen = n_iov;
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (n_fds > 0)
+    {
+      struct cmsghdr *cm;
+
+      m.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+      m.msg_control = alloca(m.msg_controllen);
+      memset(m.msg_control, 0, m.msg_controllen);
+
+      cm = CMSG_FIRSTHDR(&m);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+      memcpy(CMSG_DATA(cm), fds, n_fds * sizeof(int));
+    }
+#endif
+
+ again:
+
+  bytes_written = sendmsg (fd, &m, 0
+#if HAVE_DECL_MSG_NOSIGNAL
+                           |MSG_NOSIGNAL
+#endif
+                           );
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 /**
  * Like _dbus_write_two() but only works on sockets and is thus
  * available on Windows.
@@ -1881,6 +1978,63 @@ _dbus_read_credentials_socket  (int              client_fd,
   return TRUE;
 }
 
+/**
+ * Adds the Unix user of the process at the other end of a connected
+ * socket to @p credentials, as reported by the kernel. Unlike
+ * _dbus_read_credentials_socket() this needs nothing from the peer, so
+ * a client can use it to find out who the server is.
+ *
+ * @param fd the socket
+ * @param credentials credentials to add to
+ * @returns #FALSE if the peer's user is not available, or no memory
+ */
+dbus_bool_t
+_dbus_read_peer_credentials_socket (int              fd,
+                                    DBusCredentials *credentials)
+{
+  dbus_uid_t uid_read;
+
+  uid_read = DBUS_UID_UNSET;
+
+  {
+#ifdef SO_PEERCRED
+#ifdef __OpenBSD__
+    struct sockpeercred cr;
+#else
+    struct ucred cr;
+#endif
+    socklen_t cr_len = sizeof (cr);
+
+    if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cr, &cr_len) == 0 &&
+        cr_len == sizeof (cr))
+      uid_read = cr.uid;
+#elif defined(HAVE_GETPEEREID)
+    uid_t euid;
+    gid_t egid;
+
+    if (getpeereid (fd, &euid, &egid) == 0)
+      uid_read = euid;
+#elif defined(HAVE_GETPEERUCRED)
+    ucred_t *ucred = NULL;
+
+    if (getpeerucred (fd, &ucred) == 0)
+      uid_read = ucred_geteuid (ucred);
+
+    if (ucred != NULL)
+      ucred_free (ucred);
+#endif
+  }
+
+  if (uid_read == DBUS_UID_UNSET)
+    {
+      _dbus_verbose ("Could not find out the peer's user: %s\n",
+                     _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return _dbus_credentials_add_unix_uid (credentials, uid_read);
+}
+
 /**
  * Sends a single nul byte with our UNIX credentials as ancillary
  * data.  Returns #TRUE if the data was successfully written.  On
@@ -449,6 +449,77 @@ _dbus_write_socket_two (int               fd,
   return bytes_written;
 }
 
+/**
+ * Like _dbus_write_socket_two() but writes any number of buffers, up
+ * to #_DBUS_MAX_SOCKET_WRITE_VECTORS, in a single system call. File
+ * descriptors can't be passed on Windows, so @p n_fds must be 0.
+ *
+ * @param fd the file descriptor
+ * @param vectors the buffers to write, in order
+ * @param n_vectors the number of buffers
+ * @param fds must be #NULL
+ * @param n_fds must be 0
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_vectored (int                          fd,
+                             const DBusSocketWriteVector *vectors,
+                             int                          n_vectors,
+                             const int                   *fds,
+                             int                          n_fds)
+{
+  WSABUF buffers[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+  int n_buffers;
+  int i;
+  int rc;
+  DWORD bytes_written;
+
+  _dbus_assert (n_vectors > 0);
+  _dbus_assert (n_vectors <= _DBUS_MAX_SOCKET_WRITE_VECTORS);
+  _dbus_assert (n_fds == 0);
+
+  n_buffers = 0;
+  for (i = 0; i < n_vectors; i++)
+    {
+      _dbus_assert (vectors[i].start >= 0);
+      _dbus_assert (vectors[i].len >= 0);
+
+      if (vectors[i].len == 0)
+        continue;
+
+      buffers[n_buffers].buf = (char*) _dbus_string_get_const_data_len (vectors[i].buffer,
+                                                                        vectors[i].start,
+                                                                        vectors[i].len);
+      buffers[n_buffers].len = vectors[i].len;
+      n_buffers++;
+    }
+
+ again:
+ 
+  _dbus_verbose ("WSASend: %d buffers fd=%d\n", n_buffers, fd);
+  rc = WSASend (fd, 
+                buffers,
+                n_buffers, 
+                &bytes_written,
+                0, 
+                NULL, 
+                NULL);
+                
+  if (rc == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSASend: failed: %s\n", _dbus_strerror_from_errno ());
+      bytes_written = -1;
+    }
+  else
+    _dbus_verbose ("WSASend: = %ld\n", bytes_written);
+    
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+      
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -1701,6 +1772,22 @@ _dbus_read_credentials_socket  (int              handle,
   return TRUE;
 }
 
+/**
+ * Would add the identity of the process at the other end of a
+ * connected socket to @p credentials, but Windows sockets don't
+ * tell us who the peer is.
+ *
+ * @param handle the socket
+ * @param credentials credentials to add to
+ * @returns #FALSE always
+ */
+dbus_bool_t
+_dbus_read_peer_credentials_socket (int              handle,
+                                    DBusCredentials *credentials)
+{
+  return FALSE;
+}
+
 /**
 * Checks to make sure the given directory is 
 * private to the user 
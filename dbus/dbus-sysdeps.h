@@ -142,6 +142,26 @@ int         _dbus_write_socket_two (int               fd,
                                     int               start2,
                                     int               len2);
 
+/** Most vectors _dbus_write_socket_vectored() can be given at once */
+#define _DBUS_MAX_SOCKET_WRITE_VECTORS 128
+
+/**
+ * A range of bytes in a DBusString, to be written by
+ * _dbus_write_socket_vectored().
+ */
+typedef struct
+{
+  const DBusString *buffer; /**< buffer to write from */
+  int start;                /**< first byte to write */
+  int len;                  /**< number of bytes to write */
+} DBusSocketWriteVector;
+
+int _dbus_write_socket_vectored (int                          fd,
+                                 const DBusSocketWriteVector *vectors,
+                                 int                          n_vectors,
+                                 const int                   *fds,
+                                 int                          n_fds);
+
 int _dbus_read_socket_with_unix_fds      (int               fd,
                                           DBusString       *buffer,
                                           int               count,
@@ -188,6 +208,8 @@ dbus_bool_t _dbus_read_credentials_socket (int               client_fd,
                                            DBusError        *error);
 dbus_bool_t _dbus_send_credentials_socket (int              server_fd,
                                            DBusError       *error);
+dbus_bool_t _dbus_read_peer_credentials_socket (int              fd,
+                                                DBusCredentials *credentials);
 
 dbus_bool_t _dbus_credentials_add_from_user            (DBusCredentials  *credentials,
                                                         const DBusString *username);
@@ -122,6 +122,8 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
 
   run_test ("server", specific_test, _dbus_server_test);
 
+  run_test ("connection", specific_test, _dbus_connection_test);
+
   run_test ("object-tree", specific_test, _dbus_object_tree_test);
 
   run_test ("signature", specific_test, _dbus_signature_test);
@@ -156,7 +158,13 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
   run_data_test ("userdb", specific_test, _dbus_userdb_test, test_data_dir);
 
   run_test ("transport-unix", specific_test, _dbus_transport_unix_test);
+
+  run_test ("transport-socket", specific_test, _dbus_transport_socket_test);
 #endif
+
+  run_test ("socket-set", specific_test, _dbus_socket_set_test);
+
+  run_test ("mainloop", specific_test, _dbus_mainloop_test);
   
   run_test ("keyring", specific_test, _dbus_keyring_test);
 
@@ -164,6 +172,9 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
   
   run_data_test ("auth", specific_test, _dbus_auth_test, test_data_dir);
 
+  /* initializes threads, so it must come last */
+  run_test ("list-magazine", specific_test, _dbus_list_magazine_test);
+
   printf ("%s: completed successfully\n", "dbus-test");
 #else
   printf ("Not compiled with unit tests, not running any\n");
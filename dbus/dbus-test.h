@@ -30,6 +30,7 @@
 
 dbus_bool_t _dbus_hash_test              (void);
 dbus_bool_t _dbus_list_test              (void);
+dbus_bool_t _dbus_list_magazine_test     (void);
 dbus_bool_t _dbus_marshal_test           (void);
 dbus_bool_t _dbus_marshal_recursive_test (void);
 dbus_bool_t _dbus_marshal_byteswap_test  (void);
@@ -40,6 +41,7 @@ dbus_bool_t _dbus_mem_pool_test          (void);
 dbus_bool_t _dbus_string_test            (void);
 dbus_bool_t _dbus_address_test           (void);
 dbus_bool_t _dbus_server_test            (void);
+dbus_bool_t _dbus_connection_test        (void);
 dbus_bool_t _dbus_message_test           (const char *test_data_dir);
 dbus_bool_t _dbus_auth_test              (const char *test_data_dir);
 dbus_bool_t _dbus_sha_test               (const char *test_data_dir);
@@ -49,9 +51,12 @@ dbus_bool_t _dbus_sysdeps_test           (void);
 dbus_bool_t _dbus_spawn_test             (const char *test_data_dir);
 dbus_bool_t _dbus_userdb_test            (const char *test_data_dir);
 dbus_bool_t _dbus_transport_unix_test    (void);
+dbus_bool_t _dbus_transport_socket_test  (void);
 dbus_bool_t _dbus_memory_test            (void);
 dbus_bool_t _dbus_object_tree_test       (void);
 dbus_bool_t _dbus_credentials_test       (const char *test_data_dir);
+dbus_bool_t _dbus_socket_set_test        (void);
+dbus_bool_t _dbus_mainloop_test          (void);
 
 void        dbus_internal_do_not_use_run_tests         (const char          *test_data_dir,
 							const char          *specific_test);
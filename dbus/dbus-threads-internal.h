@@ -44,6 +44,26 @@ typedef struct DBusRMutex DBusRMutex;
  */
 typedef struct DBusCMutex DBusCMutex;
 
+/**
+ * A slot holding a separate pointer for each thread.
+ */
+typedef struct DBusThreadLocal DBusThreadLocal;
+
+/**
+ * Called with a thread's non-#NULL value when that thread exits.
+ */
+typedef void (* DBusThreadLocalDestructor) (void *value);
+
+/**
+ * A thread started with _dbus_platform_thread_start().
+ */
+typedef struct DBusThread DBusThread;
+
+/**
+ * The function a #DBusThread runs.
+ */
+typedef void (* DBusThreadFunction) (void *data);
+
 /** @} */
 
 DBUS_BEGIN_DECLS
@@ -90,6 +110,16 @@ dbus_bool_t  _dbus_platform_condvar_wait_timeout (DBusCondVar   *cond,
                                               int                timeout_milliseconds);
 void         _dbus_platform_condvar_wake_one (DBusCondVar       *cond);
 
+DBusThreadLocal *_dbus_platform_thread_local_new  (DBusThreadLocalDestructor destructor);
+void             _dbus_platform_thread_local_free (DBusThreadLocal          *local);
+void            *_dbus_platform_thread_local_get  (DBusThreadLocal          *local);
+dbus_bool_t      _dbus_platform_thread_local_set  (DBusThreadLocal          *local,
+                                                   void                     *value);
+
+DBusThread      *_dbus_platform_thread_start      (DBusThreadFunction        function,
+                                                   void                     *data);
+void             _dbus_platform_thread_join       (DBusThread               *thread);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_THREADS_INTERNAL_H */
@@ -25,6 +25,7 @@
 #include "dbus-internals.h"
 #include "dbus-threads-internal.h"
 #include "dbus-list.h"
+#include "dbus-message-internal.h"
 
 static int thread_init_generation = 0;
  
@@ -505,7 +506,8 @@ init_locks (void)
     LOCK_ADDR (system_users),
     LOCK_ADDR (message_cache),
     LOCK_ADDR (shared_connections),
-    LOCK_ADDR (machine_uuid)
+    LOCK_ADDR (machine_uuid),
+    LOCK_ADDR (message_counters)
 #undef LOCK_ADDR
   };
 
@@ -590,6 +592,9 @@ dbus_threads_init (const DBusThreadFunctions *functions)
   if (!init_locks ())
     return FALSE;
 
+  _dbus_list_init_thread_caches ();
+  _dbus_message_init_thread_caches ();
+
   thread_init_generation = _dbus_current_generation;
   
   return TRUE;
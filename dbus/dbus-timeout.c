@@ -48,9 +48,20 @@ struct DBusTimeout
   
   void *data;		   	               /**< Application data. */
   DBusFreeFunction free_data_function;         /**< Free the application data. */
+
+  DBusTimeoutChangedFunction changed_function; /**< Internal main loop's change notification. */
+  void *changed_data;                          /**< Data for changed_function. */
+
   unsigned int enabled : 1;                    /**< True if timeout is active. */
 };
 
+static void
+timeout_changed (DBusTimeout *timeout)
+{
+  if (timeout->changed_function != NULL)
+    (* timeout->changed_function) (timeout, timeout->changed_data);
+}
+
 /**
  * Creates a new DBusTimeout, enabled by default.
  * @param interval the timeout interval in milliseconds.
@@ -135,8 +146,12 @@ _dbus_timeout_set_interval (DBusTimeout *timeout,
                             int          interval)
 {
   _dbus_assert (interval >= 0);
+
+  if (interval == timeout->interval)
+    return;
   
   timeout->interval = interval;
+  timeout_changed (timeout);
 }
 
 /**
@@ -153,7 +168,46 @@ void
 _dbus_timeout_set_enabled (DBusTimeout  *timeout,
                            dbus_bool_t   enabled)
 {
-  timeout->enabled = enabled != FALSE;
+  enabled = enabled != FALSE;
+
+  if (enabled == timeout->enabled)
+    return;
+
+  timeout->enabled = enabled;
+  timeout_changed (timeout);
+}
+
+/**
+ * Sets a function to be called whenever the timeout's interval or
+ * enabled-ness changes. This is for the internal DBusLoop, which keeps
+ * its timeouts ordered by expiry and needs to re-sort them; only one
+ * such function can be set at a time.
+ *
+ * @param timeout the timeout
+ * @param function the function, or #NULL to unset it
+ * @param data data to pass to the function
+ */
+void
+_dbus_timeout_set_changed_function (DBusTimeout                *timeout,
+                                    DBusTimeoutChangedFunction  function,
+                                    void                       *data)
+{
+  _dbus_assert (function == NULL || timeout->changed_function == NULL);
+
+  timeout->changed_function = function;
+  timeout->changed_data = data;
+}
+
+/**
+ * Gets the data set with _dbus_timeout_set_changed_function().
+ *
+ * @param timeout the timeout
+ * @returns the data, or #NULL if there is none
+ */
+void*
+_dbus_timeout_get_changed_data (DBusTimeout *timeout)
+{
+  return timeout->changed_data;
 }
 
 
@@ -369,6 +423,7 @@ _dbus_timeout_list_toggle_timeout (DBusTimeoutList           *timeout_list,
     return;
 
   timeout->enabled = enabled;
+  timeout_changed (timeout);
   
   if (timeout_list->timeout_toggled_function != NULL)
     (* timeout_list->timeout_toggled_function) (timeout,
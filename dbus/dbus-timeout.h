@@ -40,6 +40,10 @@ typedef struct DBusTimeoutList DBusTimeoutList;
 /** function to run when the timeout is handled */
 typedef dbus_bool_t (* DBusTimeoutHandler) (void *data);
 
+/** function to run when the timeout's interval or enabled-ness changes */
+typedef void (* DBusTimeoutChangedFunction) (DBusTimeout *timeout,
+                                             void        *data);
+
 DBusTimeout* _dbus_timeout_new          (int                 interval,
                                          DBusTimeoutHandler  handler,
                                          void               *data,
@@ -51,6 +55,11 @@ void         _dbus_timeout_set_interval (DBusTimeout        *timeout,
 void         _dbus_timeout_set_enabled  (DBusTimeout        *timeout,
                                          dbus_bool_t         enabled);
 
+void         _dbus_timeout_set_changed_function (DBusTimeout                *timeout,
+                                                 DBusTimeoutChangedFunction  function,
+                                                 void                       *data);
+void*        _dbus_timeout_get_changed_data     (DBusTimeout                *timeout);
+
 DBusTimeoutList *_dbus_timeout_list_new            (void);
 void             _dbus_timeout_list_free           (DBusTimeoutList           *timeout_list);
 dbus_bool_t      _dbus_timeout_list_set_functions  (DBusTimeoutList           *timeout_list,
@@ -117,6 +117,7 @@ struct DBusTransport
   unsigned int is_server : 1;                 /**< #TRUE if on the server side */
   unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
   unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
+  unsigned int trust_incoming_data : 1;       /**< #TRUE if messages from a trusted peer need not be validated */
 };
 
 dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
@@ -38,6 +38,19 @@
  * @{
  */
 
+/** Most messages do_writing() gathers into one system call */
+#define MAX_MESSAGES_PER_WRITE (_DBUS_MAX_SOCKET_WRITE_VECTORS / 2)
+
+#if defined (DBUS_BUILD_TESTS) && defined (DBUS_UNIX)
+/** If set, called instead of _dbus_write_socket_vectored(), so that
+ * tests can see every write and cut it short */
+static int (* write_socket_vectored_for_tests) (int                          fd,
+                                                const DBusSocketWriteVector *vectors,
+                                                int                          n_vectors,
+                                                const int                   *fds,
+                                                int                          n_fds) = NULL;
+#endif
+
 /**
  * Opaque object representing a socket file descriptor transport.
  */
@@ -489,6 +502,154 @@ do_authentication (DBusTransport *transport,
     return TRUE;
 }
 
+/* Writes as many of the queued messages as fit in one system call and
+ * the remaining per-iteration budget, carrying on from wherever the
+ * last write stopped in the first one. Returns the bytes written, or
+ * -1 with errno set. Only used when the auth mechanism doesn't need
+ * to encode data.
+ */
+static int
+write_messages_vectored (DBusTransport *transport,
+                         int            budget)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusMessage *messages[MAX_MESSAGES_PER_WRITE];
+  DBusSocketWriteVector vectors[MAX_MESSAGES_PER_WRITE * 2];
+  int message_lengths[MAX_MESSAGES_PER_WRITE];
+  const int *unix_fds;
+  unsigned n_unix_fds;
+  int n_messages;
+  int n_vectors;
+  int bytes_to_write;
+  int bytes_written;
+  int remaining;
+  int i;
+
+  n_messages = _dbus_connection_get_messages_to_send (transport->connection,
+                                                      messages,
+                                                      MAX_MESSAGES_PER_WRITE);
+  _dbus_assert (n_messages > 0);
+
+  unix_fds = NULL;
+  n_unix_fds = 0;
+  n_vectors = 0;
+  bytes_to_write = 0;
+
+  for (i = 0; i < n_messages; i++)
+    {
+      const DBusString *header;
+      const DBusString *body;
+      int header_len, body_len;
+      int skip;
+
+      dbus_message_lock (messages[i]);
+
+#ifdef HAVE_UNIX_FD_PASSING
+      if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD (transport))
+        {
+          const int *fds;
+          unsigned n;
+
+          _dbus_message_get_unix_fds (messages[i], &fds, &n);
+
+          /* The fds go with the first byte of the write, so only the
+           * first message in a write can have any; a message that is
+           * already partly written sent its fds with that part. */
+          if (i == 0)
+            {
+              if (socket_transport->message_bytes_written <= 0)
+                {
+                  unix_fds = fds;
+                  n_unix_fds = n;
+                }
+            }
+          else if (n > 0)
+            break;
+        }
+#endif
+
+      _dbus_message_get_network_data (messages[i], &header, &body);
+      header_len = _dbus_string_get_length (header);
+      body_len = _dbus_string_get_length (body);
+      message_lengths[i] = header_len + body_len;
+
+      /* Always write something of the first message, but stop before
+       * any whole message that would take us over the budget */
+      if (i > 0 && bytes_to_write + message_lengths[i] > budget)
+        break;
+
+      skip = i == 0 ? socket_transport->message_bytes_written : 0;
+
+      if (skip < header_len)
+        {
+          vectors[n_vectors].buffer = header;
+          vectors[n_vectors].start = skip;
+          vectors[n_vectors].len = header_len - skip;
+          n_vectors++;
+
+          vectors[n_vectors].buffer = body;
+          vectors[n_vectors].start = 0;
+          vectors[n_vectors].len = body_len;
+          n_vectors++;
+        }
+      else
+        {
+          vectors[n_vectors].buffer = body;
+          vectors[n_vectors].start = skip - header_len;
+          vectors[n_vectors].len = body_len - (skip - header_len);
+          n_vectors++;
+        }
+
+      bytes_to_write += message_lengths[i] - skip;
+    }
+
+  n_messages = i;
+
+#if defined (DBUS_BUILD_TESTS) && defined (DBUS_UNIX)
+  if (write_socket_vectored_for_tests != NULL)
+    bytes_written = (* write_socket_vectored_for_tests) (socket_transport->fd,
+                                                         vectors, n_vectors,
+                                                         unix_fds, n_unix_fds);
+  else
+#endif
+    bytes_written = _dbus_write_socket_vectored (socket_transport->fd,
+                                                 vectors, n_vectors,
+                                                 unix_fds, n_unix_fds);
+
+  if (bytes_written < 0)
+    return bytes_written;
+
+  if (n_unix_fds > 0)
+    _dbus_verbose ("Wrote %u unix fds\n", n_unix_fds);
+
+  _dbus_verbose (" wrote %d bytes of %d in %d messages\n", bytes_written,
+                 bytes_to_write, n_messages);
+
+  /* Retire every message that was completely written; the write can
+   * stop part-way through any of them */
+  remaining = bytes_written;
+  for (i = 0; i < n_messages; i++)
+    {
+      int left_in_message;
+
+      left_in_message = message_lengths[i] - socket_transport->message_bytes_written;
+
+      if (remaining < left_in_message)
+        {
+          socket_transport->message_bytes_written += remaining;
+          break;
+        }
+
+      remaining -= left_in_message;
+      socket_transport->message_bytes_written = 0;
+
+      _dbus_connection_message_sent_unlocked (transport->connection,
+                                              messages[i]);
+    }
+
+  return bytes_written;
+}
+
 /* returns false on oom */
 static dbus_bool_t
 do_writing (DBusTransport *transport)
@@ -526,7 +687,6 @@ do_writing (DBusTransport *transport)
       DBusMessage *message;
       const DBusString *header;
       const DBusString *body;
-      int header_len, body_len;
       int total_bytes_to_write;
       
       if (total > socket_transport->max_bytes_written_per_iteration)
@@ -535,7 +695,20 @@ do_writing (DBusTransport *transport)
                          total, socket_transport->max_bytes_written_per_iteration);
           goto out;
         }
-      
+
+      if (!_dbus_auth_needs_encoding (transport->auth))
+        {
+          bytes_written =
+            write_messages_vectored (transport,
+                                     socket_transport->max_bytes_written_per_iteration - total);
+
+          if (bytes_written < 0)
+            goto write_failed;
+
+          total += bytes_written;
+          continue;
+        }
+
       message = _dbus_connection_get_message_to_send (transport->connection);
       _dbus_assert (message != NULL);
       dbus_message_lock (message);
@@ -547,140 +720,77 @@ do_writing (DBusTransport *transport)
       _dbus_message_get_network_data (message,
                                       &header, &body);
 
-      header_len = _dbus_string_get_length (header);
-      body_len = _dbus_string_get_length (body);
+      /* Does fd passing even make sense with encoded data? */
+      _dbus_assert(!DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport));
 
-      if (_dbus_auth_needs_encoding (transport->auth))
+      if (_dbus_string_get_length (&socket_transport->encoded_outgoing) == 0)
         {
-          /* Does fd passing even make sense with encoded data? */
-          _dbus_assert(!DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport));
-
-          if (_dbus_string_get_length (&socket_transport->encoded_outgoing) == 0)
+          if (!_dbus_auth_encode_data (transport->auth,
+                                       header, &socket_transport->encoded_outgoing))
             {
-              if (!_dbus_auth_encode_data (transport->auth,
-                                           header, &socket_transport->encoded_outgoing))
-                {
-                  oom = TRUE;
-                  goto out;
-                }
-              
-              if (!_dbus_auth_encode_data (transport->auth,
-                                           body, &socket_transport->encoded_outgoing))
-                {
-                  _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
-                  oom = TRUE;
-                  goto out;
-                }
+              oom = TRUE;
+              goto out;
             }
           
-          total_bytes_to_write = _dbus_string_get_length (&socket_transport->encoded_outgoing);
-
-#if 0
-          _dbus_verbose ("encoded message is %d bytes\n",
-                         total_bytes_to_write);
-#endif
-          
-          bytes_written =
-            _dbus_write_socket (socket_transport->fd,
-                                &socket_transport->encoded_outgoing,
-                                socket_transport->message_bytes_written,
-                                total_bytes_to_write - socket_transport->message_bytes_written);
+          if (!_dbus_auth_encode_data (transport->auth,
+                                       body, &socket_transport->encoded_outgoing))
+            {
+              _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
+              oom = TRUE;
+              goto out;
+            }
         }
-      else
-        {
-          total_bytes_to_write = header_len + body_len;
+      
+      total_bytes_to_write = _dbus_string_get_length (&socket_transport->encoded_outgoing);
 
 #if 0
-          _dbus_verbose ("message is %d bytes\n",
-                         total_bytes_to_write);
+      _dbus_verbose ("encoded message is %d bytes\n",
+                     total_bytes_to_write);
 #endif
-
-#ifdef HAVE_UNIX_FD_PASSING
-          if (socket_transport->message_bytes_written <= 0 && DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
-            {
-              /* Send the fds along with the first byte of the message */
-              const int *unix_fds;
-              unsigned n;
-
-              _dbus_message_get_unix_fds(message, &unix_fds, &n);
-
-              bytes_written =
-                _dbus_write_socket_with_unix_fds_two (socket_transport->fd,
-                                                      header,
-                                                      socket_transport->message_bytes_written,
-                                                      header_len - socket_transport->message_bytes_written,
-                                                      body,
-                                                      0, body_len,
-                                                      unix_fds,
-                                                      n);
-
-              if (bytes_written > 0 && n > 0)
-                _dbus_verbose("Wrote %i unix fds\n", n);
-            }
-          else
-#endif
-            {
-              if (socket_transport->message_bytes_written < header_len)
-                {
-                  bytes_written =
-                    _dbus_write_socket_two (socket_transport->fd,
-                                            header,
-                                            socket_transport->message_bytes_written,
-                                            header_len - socket_transport->message_bytes_written,
-                                            body,
-                                            0, body_len);
-                }
-              else
-                {
-                  bytes_written =
-                    _dbus_write_socket (socket_transport->fd,
-                                        body,
-                                        (socket_transport->message_bytes_written - header_len),
-                                        body_len -
-                                        (socket_transport->message_bytes_written - header_len));
-                }
-            }
-        }
+      
+      bytes_written =
+        _dbus_write_socket (socket_transport->fd,
+                            &socket_transport->encoded_outgoing,
+                            socket_transport->message_bytes_written,
+                            total_bytes_to_write - socket_transport->message_bytes_written);
 
       if (bytes_written < 0)
+        goto write_failed;
+
+      _dbus_verbose (" wrote %d bytes of %d\n", bytes_written,
+                     total_bytes_to_write);
+      
+      total += bytes_written;
+      socket_transport->message_bytes_written += bytes_written;
+
+      _dbus_assert (socket_transport->message_bytes_written <=
+                    total_bytes_to_write);
+      
+      if (socket_transport->message_bytes_written == total_bytes_to_write)
         {
-          /* EINTR already handled for us */
-          
-          /* For some discussion of why we also ignore EPIPE here, see
-           * http://lists.freedesktop.org/archives/dbus/2008-March/009526.html
-           */
-          
-          if (_dbus_get_is_errno_eagain_or_ewouldblock () || _dbus_get_is_errno_epipe ())
-            goto out;
-          else
-            {
-              _dbus_verbose ("Error writing to remote app: %s\n",
-                             _dbus_strerror_from_errno ());
-              do_io_error (transport);
-              goto out;
-            }
+          socket_transport->message_bytes_written = 0;
+          _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
+          _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
+
+          _dbus_connection_message_sent_unlocked (transport->connection,
+                                                  message);
         }
-      else
-        {
-          _dbus_verbose (" wrote %d bytes of %d\n", bytes_written,
-                         total_bytes_to_write);
-          
-          total += bytes_written;
-          socket_transport->message_bytes_written += bytes_written;
+    }
 
-          _dbus_assert (socket_transport->message_bytes_written <=
-                        total_bytes_to_write);
-          
-          if (socket_transport->message_bytes_written == total_bytes_to_write)
-            {
-              socket_transport->message_bytes_written = 0;
-              _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
-              _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
+  goto out;
 
-              _dbus_connection_message_sent_unlocked (transport->connection,
-                                                      message);
-            }
-        }
+ write_failed:
+  /* EINTR already handled for us */
+  
+  /* For some discussion of why we also ignore EPIPE here, see
+   * http://lists.freedesktop.org/archives/dbus/2008-March/009526.html
+   */
+  
+  if (!_dbus_get_is_errno_eagain_or_ewouldblock () && !_dbus_get_is_errno_epipe ())
+    {
+      _dbus_verbose ("Error writing to remote app: %s\n",
+                     _dbus_strerror_from_errno ());
+      do_io_error (transport);
     }
 
  out:
@@ -1436,3 +1546,437 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
 
 /** @} */
 
+#if defined (DBUS_BUILD_TESTS) && defined (DBUS_UNIX)
+#include "dbus-test.h"
+#include <errno.h>
+
+#define MAX_TEST_WRITES 16
+
+/* One call that write_messages_vectored() made */
+typedef struct
+{
+  int bytes;     /* bytes it asked to write */
+  int n_vectors; /* number of vectors they were in */
+  int n_fds;     /* number of fds sent with them */
+  int written;   /* bytes actually written */
+} TestWrite;
+
+static struct
+{
+  dbus_bool_t blocked;  /* fail every write with EAGAIN */
+  int next_limit;       /* if > 0, most bytes the next write may write */
+  TestWrite writes[MAX_TEST_WRITES];
+  int n_writes;
+} test_writes;
+
+static int
+test_write_socket_vectored (int                          fd,
+                            const DBusSocketWriteVector *vectors,
+                            int                          n_vectors,
+                            const int                   *fds,
+                            int                          n_fds)
+{
+  DBusSocketWriteVector limited[_DBUS_MAX_SOCKET_WRITE_VECTORS];
+  TestWrite *w;
+  int remaining;
+  int n_limited;
+  int i;
+
+  if (test_writes.blocked)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+
+  _dbus_assert (n_vectors <= _DBUS_MAX_SOCKET_WRITE_VECTORS);
+  _dbus_assert (test_writes.n_writes < MAX_TEST_WRITES);
+  w = &test_writes.writes[test_writes.n_writes];
+  test_writes.n_writes += 1;
+
+  w->bytes = 0;
+  for (i = 0; i < n_vectors; i++)
+    w->bytes += vectors[i].len;
+  w->n_vectors = n_vectors;
+  w->n_fds = n_fds;
+
+  remaining = test_writes.next_limit > 0 ? test_writes.next_limit : w->bytes;
+  test_writes.next_limit = 0;
+
+  n_limited = 0;
+  for (i = 0; i < n_vectors && remaining > 0; i++)
+    {
+      limited[n_limited] = vectors[i];
+      limited[n_limited].len = MIN (vectors[i].len, remaining);
+      remaining -= limited[n_limited].len;
+      n_limited++;
+    }
+
+  w->written = _dbus_write_socket_vectored (fd, limited, n_limited,
+                                            fds, n_fds);
+  return w->written;
+}
+
+/* An authenticated pair of connections over a socketpair */
+typedef struct
+{
+  DBusConnection *client;
+  DBusConnection *server;
+  DBusTransportSocket *client_transport;
+  int fds_to_send[2];
+} TestPair;
+
+static DBusConnection *
+test_connection_new (int                   fd,
+                     const DBusString     *server_guid,
+                     const DBusString     *address,
+                     DBusTransportSocket **transport_p)
+{
+  DBusTransport *transport;
+  DBusConnection *connection;
+
+  transport = _dbus_transport_new_for_socket (fd, server_guid, address);
+  if (transport == NULL)
+    _dbus_assert_not_reached ("no memory for transport");
+
+  connection = _dbus_connection_new_for_transport (transport);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("no memory for connection");
+
+  if (transport_p != NULL)
+    *transport_p = (DBusTransportSocket *) transport;
+
+  /* the connection keeps it alive */
+  _dbus_transport_unref (transport);
+
+  return connection;
+}
+
+static void
+test_pair_open (TestPair *pair)
+{
+  DBusString address;
+  DBusString guid_hex;
+  DBusGUID guid;
+  int client_fd, server_fd;
+
+  if (!_dbus_full_duplex_pipe (&client_fd, &server_fd, FALSE, NULL) ||
+      !_dbus_full_duplex_pipe (&pair->fds_to_send[0], &pair->fds_to_send[1],
+                               FALSE, NULL))
+    _dbus_assert_not_reached ("could not create socket pair");
+
+  _dbus_generate_uuid (&guid);
+  if (!_dbus_string_init (&guid_hex) ||
+      !_dbus_uuid_encode (&guid, &guid_hex))
+    _dbus_assert_not_reached ("no memory for guid");
+
+  _dbus_string_init_const (&address, "test-vectored-write:");
+
+  pair->client = test_connection_new (client_fd, NULL, &address,
+                                      &pair->client_transport);
+  pair->server = test_connection_new (server_fd, &guid_hex, NULL, NULL);
+  _dbus_string_free (&guid_hex);
+
+  while (!dbus_connection_get_is_authenticated (pair->client) ||
+         !dbus_connection_get_is_authenticated (pair->server))
+    {
+      dbus_connection_read_write (pair->client, 0);
+      dbus_connection_read_write (pair->server, 0);
+    }
+}
+
+static void
+test_pair_close (TestPair *pair)
+{
+  dbus_connection_close (pair->client);
+  dbus_connection_unref (pair->client);
+  dbus_connection_close (pair->server);
+  dbus_connection_unref (pair->server);
+  _dbus_close_socket (pair->fds_to_send[0], NULL);
+  _dbus_close_socket (pair->fds_to_send[1], NULL);
+}
+
+/* Starts recording writes, and makes them fail until
+ * flush_test_messages() so that messages are queued */
+static void
+start_test_writes (void)
+{
+  _DBUS_ZERO (test_writes);
+  test_writes.blocked = TRUE;
+}
+
+/* Queues a message carrying @index and @padding bytes of string, and
+ * an fd if @with_fd. Returns the number of bytes it will take on the
+ * wire, and the size of its header in @header_len_p. */
+static int
+queue_test_message (TestPair     *pair,
+                    dbus_uint32_t index,
+                    int           padding,
+                    dbus_bool_t   with_fd,
+                    int          *header_len_p)
+{
+  DBusMessage *message;
+  const DBusString *header;
+  const DBusString *body;
+  char *str;
+  int len;
+
+  str = dbus_malloc (padding + 1);
+  if (str == NULL)
+    _dbus_assert_not_reached ("no memory for padding");
+  memset (str, 'x', padding);
+  str[padding] = '\0';
+
+  message = dbus_message_new_signal ("/a/b", "a.b", "C");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_UINT32, &index,
+                                 DBUS_TYPE_STRING, &str,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for message");
+
+  dbus_free (str);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (with_fd &&
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_UNIX_FD, &pair->fds_to_send[0],
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for fd");
+#else
+  _dbus_assert (!with_fd);
+#endif
+
+  if (!dbus_connection_send (pair->client, message, NULL))
+    _dbus_assert_not_reached ("no memory to send message");
+
+  _dbus_message_get_network_data (message, &header, &body);
+  if (header_len_p != NULL)
+    *header_len_p = _dbus_string_get_length (header);
+  len = _dbus_string_get_length (header) + _dbus_string_get_length (body);
+
+  dbus_message_unref (message);
+
+  return len;
+}
+
+/* Lets the queued messages be written, and checks that the other end
+ * gets @n_messages messages, numbered from @first_index, each with an
+ * fd if it should have one */
+static void
+flush_test_messages (TestPair     *pair,
+                     dbus_uint32_t first_index,
+                     int           n_messages,
+                     unsigned int  fd_mask)
+{
+  int i;
+
+  test_writes.blocked = FALSE;
+  dbus_connection_flush (pair->client);
+  _dbus_assert (!dbus_connection_has_messages_to_send (pair->client));
+
+  for (i = 0; i < n_messages; i++)
+    {
+      DBusMessage *message;
+      DBusError error = DBUS_ERROR_INIT;
+      dbus_uint32_t index;
+      const char *str;
+
+      while ((message = dbus_connection_pop_message (pair->server)) == NULL)
+        {
+          if (!dbus_connection_read_write (pair->server, -1))
+            _dbus_assert_not_reached ("disconnected while reading");
+        }
+
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_UINT32, &index,
+                                  DBUS_TYPE_STRING, &str,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached (error.message);
+
+      _dbus_assert (index == first_index + i);
+
+#ifdef HAVE_UNIX_FD_PASSING
+      if (fd_mask & (1 << i))
+        {
+          DBusMessageIter iter;
+          int fd;
+
+          _dbus_assert (dbus_message_iter_init (message, &iter));
+          _dbus_assert (dbus_message_iter_next (&iter));
+          _dbus_assert (dbus_message_iter_next (&iter));
+          _dbus_assert (dbus_message_iter_get_arg_type (&iter) ==
+                        DBUS_TYPE_UNIX_FD);
+          dbus_message_iter_get_basic (&iter, &fd);
+          _dbus_assert (fd >= 0);
+          _dbus_close_socket (fd, NULL);
+        }
+      else
+#endif
+        {
+          _dbus_assert (!dbus_message_contains_unix_fds (message));
+        }
+
+      dbus_message_unref (message);
+    }
+}
+
+/* A write that stops part-way is carried on from where it stopped,
+ * whether that's between two messages, in a header or in a body */
+static void
+check_partial_writes (TestPair *pair)
+{
+  int cut;
+
+  for (cut = 0; cut < 3; cut++)
+    {
+      int len0, len1, len2, header1_len;
+      int limit;
+
+      start_test_writes ();
+
+      len0 = queue_test_message (pair, 0, 100, FALSE, NULL);
+      len1 = queue_test_message (pair, 1, 100, FALSE, &header1_len);
+      len2 = queue_test_message (pair, 2, 100, FALSE, NULL);
+
+      if (cut == 0)
+        limit = len0;
+      else if (cut == 1)
+        limit = len0 + header1_len / 2;
+      else
+        limit = len0 + header1_len + 10;
+
+      test_writes.next_limit = limit;
+      flush_test_messages (pair, 0, 3, 0);
+
+      _dbus_assert (test_writes.n_writes == 2);
+      _dbus_assert (test_writes.writes[0].bytes == len0 + len1 + len2);
+      _dbus_assert (test_writes.writes[0].n_vectors == 6);
+      _dbus_assert (test_writes.writes[0].written == limit);
+      _dbus_assert (test_writes.writes[1].bytes == len0 + len1 + len2 - limit);
+      _dbus_assert (test_writes.writes[1].n_vectors == (cut == 2 ? 3 : 4));
+      _dbus_assert (test_writes.writes[1].written ==
+                    test_writes.writes[1].bytes);
+    }
+}
+
+/* A write takes no more messages than it has vectors for, and no more
+ * than the per-iteration budget, but always at least one */
+static void
+check_write_caps (TestPair *pair)
+{
+  int budget;
+  int len;
+  int i;
+
+  budget = pair->client_transport->max_bytes_written_per_iteration;
+
+  start_test_writes ();
+
+  for (i = 0; i < 5; i++)
+    len = queue_test_message (pair, i, 550, FALSE, NULL);
+
+  _dbus_assert (3 * len <= budget && 4 * len > budget);
+
+  flush_test_messages (pair, 0, 5, 0);
+
+  _dbus_assert (test_writes.n_writes == 3);
+  _dbus_assert (test_writes.writes[0].bytes == 3 * len);
+  _dbus_assert (test_writes.writes[1].bytes == len);
+  _dbus_assert (test_writes.writes[2].bytes == len);
+
+  pair->client_transport->max_bytes_written_per_iteration = _DBUS_INT_MAX / 2;
+  start_test_writes ();
+
+  for (i = 0; i < MAX_MESSAGES_PER_WRITE + 10; i++)
+    len = queue_test_message (pair, i, 0, FALSE, NULL);
+
+  flush_test_messages (pair, 0, MAX_MESSAGES_PER_WRITE + 10, 0);
+
+  _dbus_assert (test_writes.n_writes == 2);
+  _dbus_assert (test_writes.writes[0].n_vectors ==
+                _DBUS_MAX_SOCKET_WRITE_VECTORS);
+  _dbus_assert (test_writes.writes[0].bytes == MAX_MESSAGES_PER_WRITE * len);
+  _dbus_assert (test_writes.writes[1].n_vectors == 20);
+  _dbus_assert (test_writes.writes[1].bytes == 10 * len);
+
+  pair->client_transport->max_bytes_written_per_iteration = budget;
+}
+
+#ifdef HAVE_UNIX_FD_PASSING
+/* A message with fds only ever starts a write, and its fds are sent
+ * once, with its first byte */
+static void
+check_unix_fd_writes (TestPair *pair)
+{
+  int len[5];
+  int header_len;
+
+  if (!dbus_connection_can_send_type (pair->client, DBUS_TYPE_UNIX_FD))
+    return;
+
+  start_test_writes ();
+
+  len[0] = queue_test_message (pair, 0, 10, FALSE, NULL);
+  len[1] = queue_test_message (pair, 1, 10, TRUE, NULL);
+  len[2] = queue_test_message (pair, 2, 10, FALSE, NULL);
+  len[3] = queue_test_message (pair, 3, 10, TRUE, NULL);
+  len[4] = queue_test_message (pair, 4, 10, TRUE, NULL);
+
+  flush_test_messages (pair, 0, 5, (1 << 1) | (1 << 3) | (1 << 4));
+
+  _dbus_assert (test_writes.n_writes == 4);
+  _dbus_assert (test_writes.writes[0].bytes == len[0]);
+  _dbus_assert (test_writes.writes[0].n_fds == 0);
+  _dbus_assert (test_writes.writes[1].bytes == len[1] + len[2]);
+  _dbus_assert (test_writes.writes[1].n_fds == 1);
+  _dbus_assert (test_writes.writes[2].bytes == len[3]);
+  _dbus_assert (test_writes.writes[2].n_fds == 1);
+  _dbus_assert (test_writes.writes[3].bytes == len[4]);
+  _dbus_assert (test_writes.writes[3].n_fds == 1);
+
+  /* cut short inside a message with an fd */
+  start_test_writes ();
+
+  len[0] = queue_test_message (pair, 0, 10, TRUE, &header_len);
+  len[1] = queue_test_message (pair, 1, 10, FALSE, NULL);
+
+  test_writes.next_limit = header_len / 2;
+  flush_test_messages (pair, 0, 2, 1 << 0);
+
+  _dbus_assert (test_writes.n_writes == 2);
+  _dbus_assert (test_writes.writes[0].bytes == len[0] + len[1]);
+  _dbus_assert (test_writes.writes[0].n_fds == 1);
+  _dbus_assert (test_writes.writes[1].bytes ==
+                len[0] + len[1] - header_len / 2);
+  _dbus_assert (test_writes.writes[1].n_fds == 0);
+}
+#endif
+
+/**
+ * Unit test for writing several messages at once in the socket
+ * transport.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_transport_socket_test (void)
+{
+  TestPair pair;
+
+  test_pair_open (&pair);
+
+  write_socket_vectored_for_tests = test_write_socket_vectored;
+
+  check_partial_writes (&pair);
+  check_write_caps (&pair);
+#ifdef HAVE_UNIX_FD_PASSING
+  check_unix_fd_writes (&pair);
+#endif
+
+  write_socket_vectored_for_tests = NULL;
+
+  test_pair_close (&pair);
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS && DBUS_UNIX */
@@ -62,7 +62,12 @@ live_messages_notify (DBusCounter *counter,
                            void        *user_data)
 {
   DBusTransport *transport = user_data;
+  DBusConnection *connection = transport->connection;
 
+  /* The transport's refcount is protected by the connection lock, and
+   * messages can be released in a different thread from the one that
+   * reads and writes this transport */
+  _dbus_connection_lock (connection);
   _dbus_transport_ref (transport);
 
 #if 0
@@ -76,13 +81,10 @@ live_messages_notify (DBusCounter *counter,
    * required.
    */
   if (transport->vtable->live_messages_changed)
-    {
-      _dbus_connection_lock (transport->connection);
-      (* transport->vtable->live_messages_changed) (transport);
-      _dbus_connection_unlock (transport->connection);
-    }
+    (* transport->vtable->live_messages_changed) (transport);
 
   _dbus_transport_unref (transport);
+  _dbus_connection_unlock (connection);
 }
 
 /**
@@ -167,6 +169,7 @@ _dbus_transport_init_base (DBusTransport             *transport,
   transport->live_messages = counter;
   transport->authenticated = FALSE;
   transport->disconnected = FALSE;
+  transport->trust_incoming_data = FALSE;
   transport->is_server = (server_guid != NULL);
   transport->send_credentials_pending = !transport->is_server;
   transport->receive_credentials_pending = transport->is_server;
@@ -686,6 +689,70 @@ auth_via_default_rules (DBusTransport *transport)
 }
 
 
+/* Whether the other end is running as root or as the same user as us,
+ * by the same rule as auth_via_default_rules(). The server knows who
+ * the client authenticated as; the client has to ask the kernel who is
+ * on the other end of the socket, since the server never proves its
+ * identity in the auth conversation.
+ */
+static dbus_bool_t
+peer_is_trusted (DBusTransport *transport)
+{
+  DBusCredentials *peer_identity;
+  DBusCredentials *our_identity;
+  dbus_bool_t trusted;
+  int fd;
+
+  our_identity = _dbus_credentials_new_from_current_process ();
+  if (our_identity == NULL)
+    return FALSE;
+
+  if (transport->is_server)
+    {
+      peer_identity = _dbus_auth_get_identity (transport->auth);
+      _dbus_credentials_ref (peer_identity);
+    }
+  else
+    {
+      peer_identity = _dbus_credentials_new ();
+
+      if (peer_identity != NULL &&
+          !(_dbus_transport_get_socket_fd (transport, &fd) &&
+            _dbus_read_peer_credentials_socket (fd, peer_identity)))
+        _dbus_credentials_clear (peer_identity);
+    }
+
+  trusted = peer_identity != NULL &&
+    !_dbus_credentials_are_anonymous (peer_identity) &&
+    (_dbus_credentials_get_unix_uid (peer_identity) == 0 ||
+     _dbus_credentials_same_user (our_identity, peer_identity));
+
+  if (peer_identity != NULL)
+    _dbus_credentials_unref (peer_identity);
+
+  _dbus_credentials_unref (our_identity);
+
+  return trusted;
+}
+
+/* Called once authentication completes, and whenever the setting
+ * changes afterwards.
+ */
+static void
+update_loader_trust (DBusTransport *transport)
+{
+  dbus_bool_t trusted;
+
+  trusted = transport->trust_incoming_data &&
+    transport->authenticated &&
+    peer_is_trusted (transport);
+
+  _dbus_verbose ("%s messages from the other end\n",
+                 trusted ? "Not validating" : "Validating");
+
+  _dbus_message_loader_set_trusted (transport->loader, trusted);
+}
+
 /**
  * Returns #TRUE if we have been authenticated.  Will return #TRUE
  * even if the transport is disconnected.
@@ -782,6 +849,9 @@ _dbus_transport_get_is_authenticated (DBusTransport *transport)
 
       transport->authenticated = maybe_authenticated;
 
+      if (maybe_authenticated && transport->trust_incoming_data)
+        update_loader_trust (transport);
+
       _dbus_connection_unref_unlocked (transport->connection);
       return maybe_authenticated;
     }
@@ -1492,6 +1562,22 @@ _dbus_transport_set_allow_anonymous (DBusTransport              *transport,
   transport->allow_anonymous = value != FALSE;
 }
 
+/**
+ * See dbus_connection_set_trust_incoming_data()
+ *
+ * @param transport the transport
+ * @param value #TRUE to skip validating messages from a trusted peer
+ */
+void
+_dbus_transport_set_trust_incoming_data (DBusTransport *transport,
+                                         dbus_bool_t    value)
+{
+  transport->trust_incoming_data = value != FALSE;
+
+  if (transport->authenticated)
+    update_loader_trust (transport);
+}
+
 #ifdef DBUS_ENABLE_STATS
 void
 _dbus_transport_get_stats (DBusTransport  *transport,
@@ -50,7 +50,10 @@ struct DBusWatch
   void *data;                          /**< Application data. */
   DBusFreeFunction free_data_function; /**< Free the application data. */
   unsigned int enabled : 1;            /**< Whether it's enabled. */
-  unsigned int oom_last_time : 1;      /**< Whether it was OOM last time. */
+  /** Whether it was OOM last time. Not a bitfield next to enabled,
+   * because the main loop sets it without holding the lock that
+   * protects enabled. */
+  dbus_bool_t oom_last_time;
 };
 
 dbus_bool_t
@@ -0,0 +1,1337 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-bench.c  Message-level microbenchmarks for libdbus and dbus-daemon
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/* Each benchmark prints one line per case on stdout, as a JSON object:
+ *
+ *   {"benchmark":"marshal","case":"a{sv}","ops":16000,"p50_ns":...,
+ *    "p99_ns":...,"ops_per_sec":...,"bytes_per_sec":...,
+ *    "allocs_per_op":...}
+ *
+ * Times for the in-process benchmarks are taken over batches of
+ * BATCH_SIZE operations, because the monotonic clock only has
+ * microsecond resolution; p50/p99 are percentiles of the per-operation
+ * time within each batch. Round trips and bus deliveries are timed
+ * individually. Allocations are the dbus_malloc() family calls made by
+ * this process, so for "routing" they exclude the bus daemon's own.
+ *
+ * The "blocking" benchmark times dbus_connection_send_with_reply_and_block()
+ * calls to the bus driver while a backlog of undispatched signals sits in
+ * the caller's incoming queue.
+ *
+ * The "routing" and "blocking" benchmarks need a bus to talk to: run them under
+ * tools/run-with-tmp-session-bus.sh, or pass --address. With --trust,
+ * "peer" and "routing" connections are set up with
+ * dbus_connection_set_trust_incoming_data().
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#define DBUS_COMPILATION
+#include <dbus/dbus-marshal-byteswap.h>
+#include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-message-private.h>
+#include <dbus/dbus-string.h>
+#undef DBUS_COMPILATION
+
+#include <string.h>
+
+#define BENCH_PATH "/org/freedesktop/DBus/Bench"
+#define BENCH_INTERFACE "org.freedesktop.DBus.Bench"
+
+/* Operations timed together for each in-process sample */
+#define BATCH_SIZE 16
+
+/* Messages fed to a loader at once by the "loader" benchmark */
+#define LOADER_MESSAGES 64
+
+typedef struct
+{
+  int n_samples;
+  int n_clients;
+  int n_rules;
+  const char *address;
+  dbus_bool_t trust;    /**< skip validating messages from the peer or bus */
+} BenchOptions;
+
+typedef struct
+{
+  double *samples;      /**< nanoseconds per operation */
+  int n_samples;
+  long ops;
+  double bytes;
+  double elapsed_usec;
+  int allocations;
+} BenchResult;
+
+static double
+bench_now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  return (double) tv_sec * 1000000.0 + (double) tv_usec;
+}
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "dbus-bench: %s\n", message);
+  exit (1);
+}
+
+static void
+die_oom (void)
+{
+  die ("out of memory");
+}
+
+static void
+bench_result_init (BenchResult *result,
+                   int          n_samples)
+{
+  result->samples = dbus_new0 (double, n_samples);
+  if (result->samples == NULL)
+    die_oom ();
+
+  result->n_samples = 0;
+  result->ops = 0;
+  result->bytes = 0;
+  result->elapsed_usec = 0;
+  result->allocations = 0;
+}
+
+static void
+bench_result_add (BenchResult *result,
+                  double       usec,
+                  int          ops,
+                  double       bytes)
+{
+  result->samples[result->n_samples] = usec * 1000.0 / ops;
+  result->n_samples += 1;
+  result->ops += ops;
+  result->bytes += bytes;
+  result->elapsed_usec += usec;
+}
+
+static int
+compare_doubles (const void *a,
+                 const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile (const BenchResult *result,
+            int                percent)
+{
+  int i;
+
+  if (result->n_samples == 0)
+    return 0;
+
+  i = (result->n_samples * percent) / 100;
+  if (i >= result->n_samples)
+    i = result->n_samples - 1;
+
+  return result->samples[i];
+}
+
+static void
+bench_result_report (BenchResult *result,
+                     const char  *benchmark,
+                     const char  *name)
+{
+  double seconds;
+
+  qsort (result->samples, result->n_samples, sizeof (double),
+         compare_doubles);
+
+  seconds = result->elapsed_usec / 1000000.0;
+  if (seconds <= 0)
+    seconds = 1e-6;
+
+  printf ("{\"benchmark\":\"%s\",\"case\":\"%s\",\"ops\":%ld,"
+          "\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"ops_per_sec\":%.0f,"
+          "\"bytes_per_sec\":%.0f,\"allocs_per_op\":%.2f}\n",
+          benchmark, name, result->ops,
+          percentile (result, 50), percentile (result, 99),
+          result->ops / seconds, result->bytes / seconds,
+          result->ops > 0 ? (double) result->allocations / result->ops : 0);
+  fflush (stdout);
+
+  dbus_free (result->samples);
+  result->samples = NULL;
+}
+
+/* Message bodies, one per signature we care about; a suffix after ':'
+ * distinguishes bodies that share a signature but differ in size */
+
+typedef dbus_bool_t (* AppendFunction) (DBusMessageIter *iter);
+
+typedef struct
+{
+  const char *signature;
+  AppendFunction append;
+} BenchCase;
+
+static dbus_bool_t
+append_u (DBusMessageIter *iter)
+{
+  dbus_uint32_t u = 42;
+
+  return dbus_message_iter_append_basic (iter, DBUS_TYPE_UINT32, &u);
+}
+
+static dbus_bool_t
+append_s (DBusMessageIter *iter)
+{
+  const char *s = "The quick brown fox jumps over the lazy dog";
+
+  return dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &s);
+}
+
+static dbus_bool_t
+append_struct (DBusMessageIter *iter)
+{
+  DBusMessageIter sub;
+  dbus_int32_t i = -1;
+  dbus_uint32_t u = 1;
+  dbus_int64_t x = -2;
+  dbus_uint64_t t = 2;
+  double d = 3.5;
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_STRUCT, NULL,
+                                           &sub) &&
+    dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT32, &i) &&
+    dbus_message_iter_append_basic (&sub, DBUS_TYPE_UINT32, &u) &&
+    dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT64, &x) &&
+    dbus_message_iter_append_basic (&sub, DBUS_TYPE_UINT64, &t) &&
+    dbus_message_iter_append_basic (&sub, DBUS_TYPE_DOUBLE, &d) &&
+    dbus_message_iter_close_container (iter, &sub);
+}
+
+static dbus_bool_t
+append_as (DBusMessageIter *iter)
+{
+  static const char * const strings[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+    "hotel", "india", "juliet", "kilo", "lima", "mike", "november",
+    "oscar", "papa"
+  };
+  DBusMessageIter sub;
+  int i;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING, &sub))
+    return FALSE;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (strings); i++)
+    {
+      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
+                                           &strings[i]))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (iter, &sub);
+}
+
+static dbus_bool_t
+append_asv (DBusMessageIter *iter)
+{
+  static const char * const keys[] = {
+    "Name", "Id", "Path", "Enabled", "Size", "Vendor", "Serial", "Flags"
+  };
+  DBusMessageIter dict, entry, variant;
+  int i;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &dict))
+    return FALSE;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (keys); i++)
+    {
+      dbus_bool_t ok;
+
+      if (!dbus_message_iter_open_container (&dict, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING,
+                                           &keys[i]))
+        return FALSE;
+
+      if (i % 2 == 0)
+        {
+          ok = dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                                 DBUS_TYPE_STRING_AS_STRING,
+                                                 &variant) &&
+            dbus_message_iter_append_basic (&variant, DBUS_TYPE_STRING,
+                                            &keys[i]);
+        }
+      else
+        {
+          ok = dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                                 DBUS_TYPE_UINT32_AS_STRING,
+                                                 &variant) &&
+            dbus_message_iter_append_basic (&variant, DBUS_TYPE_UINT32, &i);
+        }
+
+      if (!ok ||
+          !dbus_message_iter_close_container (&entry, &variant) ||
+          !dbus_message_iter_close_container (&dict, &entry))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (iter, &dict);
+}
+
+static dbus_bool_t
+append_ay (DBusMessageIter *iter)
+{
+  static unsigned char bytes[4096];
+  const unsigned char *p = bytes;
+  DBusMessageIter sub;
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                           DBUS_TYPE_BYTE_AS_STRING, &sub) &&
+    dbus_message_iter_append_fixed_array (&sub, DBUS_TYPE_BYTE, &p,
+                                          sizeof (bytes)) &&
+    dbus_message_iter_close_container (iter, &sub);
+}
+
+/* Arrays of 2-, 4- and 8-byte numbers, like sensor readings */
+static dbus_bool_t
+append_numbers (DBusMessageIter *iter,
+                int              element_type,
+                const char      *element_signature)
+{
+  static dbus_uint64_t numbers[4096];
+  const dbus_uint64_t *p = numbers;
+  DBusMessageIter sub;
+  int i;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (numbers); i++)
+    numbers[i] = DBUS_UINT64_CONSTANT (0x0123456789abcdef) * i;
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                           element_signature, &sub) &&
+    dbus_message_iter_append_fixed_array (&sub, element_type, &p,
+                                          sizeof (numbers) /
+                                          _dbus_type_get_alignment (element_type)) &&
+    dbus_message_iter_close_container (iter, &sub);
+}
+
+static dbus_bool_t
+append_an (DBusMessageIter *iter)
+{
+  return append_numbers (iter, DBUS_TYPE_INT16, DBUS_TYPE_INT16_AS_STRING);
+}
+
+static dbus_bool_t
+append_ai (DBusMessageIter *iter)
+{
+  return append_numbers (iter, DBUS_TYPE_INT32, DBUS_TYPE_INT32_AS_STRING);
+}
+
+static dbus_bool_t
+append_ad (DBusMessageIter *iter)
+{
+  return append_numbers (iter, DBUS_TYPE_DOUBLE, DBUS_TYPE_DOUBLE_AS_STRING);
+}
+
+static dbus_bool_t
+append_ab (DBusMessageIter *iter)
+{
+  static dbus_bool_t bools[1024];
+  const dbus_bool_t *p = bools;
+  DBusMessageIter sub;
+  int i;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (bools); i++)
+    bools[i] = (i % 3 == 0);
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                           DBUS_TYPE_BOOLEAN_AS_STRING, &sub) &&
+    dbus_message_iter_append_fixed_array (&sub, DBUS_TYPE_BOOLEAN, &p,
+                                          _DBUS_N_ELEMENTS (bools)) &&
+    dbus_message_iter_close_container (iter, &sub);
+}
+
+static dbus_bool_t
+append_ao (DBusMessageIter *iter)
+{
+  static const char * const paths[] = {
+    "/org/freedesktop/NetworkManager/Devices/0",
+    "/org/freedesktop/NetworkManager/ActiveConnection/12",
+    "/org/freedesktop/UDisks2/block_devices/nvme0n1p2",
+    "/org/freedesktop/login1/session/_31",
+    "/org/freedesktop/systemd1/unit/dbus_2eservice",
+    "/org/freedesktop/systemd1/unit/systemd_2djournald_2eservice",
+    "/org/bluez/hci0/dev_00_11_22_33_44_55",
+    "/org/freedesktop/Accounts/User1000"
+  };
+  DBusMessageIter sub;
+  int i;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_OBJECT_PATH_AS_STRING, &sub))
+    return FALSE;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (paths); i++)
+    {
+      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_OBJECT_PATH,
+                                           &paths[i]))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (iter, &sub);
+}
+
+static dbus_bool_t
+append_long_s (DBusMessageIter *iter)
+{
+  static char text[4096];
+  const char *s = text;
+  int i;
+
+  /* Mostly ASCII prose with the occasional multi-byte character, which
+   * is what large string payloads on the bus usually look like */
+  for (i = 0; i < (int) sizeof (text) - 1; i++)
+    text[i] = 'a' + (i % 26);
+
+  for (i = 0; i + 2 < (int) sizeof (text) - 1; i += 512)
+    {
+      text[i] = '\xc3';
+      text[i + 1] = '\xa9';
+    }
+
+  text[sizeof (text) - 1] = '\0';
+
+  return dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &s);
+}
+
+static const BenchCase bench_cases[] = {
+  { "u", append_u },
+  { "s", append_s },
+  { "(iuxtd)", append_struct },
+  { "as", append_as },
+  { "a{sv}", append_asv },
+  { "ay", append_ay },
+  { "an:32768", append_an },
+  { "ai:32768", append_ai },
+  { "ad:32768", append_ad },
+  { "ab", append_ab },
+  { "ao", append_ao },
+  { "s:4096", append_long_s }
+};
+
+static DBusMessage *
+new_case_message (const BenchCase *bench_case)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+
+  message = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE, "Case");
+  if (message == NULL)
+    return NULL;
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!(* bench_case->append) (&iter))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  dbus_message_set_serial (message, 1);
+
+  return message;
+}
+
+static void
+read_all (DBusMessageIter *iter)
+{
+  int type;
+
+  while ((type = dbus_message_iter_get_arg_type (iter)) != DBUS_TYPE_INVALID)
+    {
+      if (dbus_type_is_container (type))
+        {
+          DBusMessageIter sub;
+
+          dbus_message_iter_recurse (iter, &sub);
+
+          if (type == DBUS_TYPE_ARRAY &&
+              dbus_type_is_fixed (dbus_message_iter_get_element_type (iter)))
+            {
+              const void *values;
+              int n_elements;
+
+              dbus_message_iter_get_fixed_array (&sub, &values, &n_elements);
+            }
+          else
+            {
+              read_all (&sub);
+            }
+        }
+      else
+        {
+          DBusBasicValue value;
+
+          dbus_message_iter_get_basic (iter, &value);
+        }
+
+      dbus_message_iter_next (iter);
+    }
+}
+
+static void
+bench_marshal (const BenchOptions *options)
+{
+  int c;
+
+  for (c = 0; c < (int) _DBUS_N_ELEMENTS (bench_cases); c++)
+    {
+      BenchResult result;
+      int allocations;
+      int s;
+
+      bench_result_init (&result, options->n_samples);
+      allocations = _dbus_get_malloc_allocations ();
+
+      for (s = 0; s < options->n_samples; s++)
+        {
+          double start;
+          double bytes = 0;
+          int i;
+
+          start = bench_now_usec ();
+
+          for (i = 0; i < BATCH_SIZE; i++)
+            {
+              DBusMessage *message;
+              char *data;
+              int len;
+
+              message = new_case_message (&bench_cases[c]);
+              if (message == NULL ||
+                  !dbus_message_marshal (message, &data, &len))
+                die_oom ();
+
+              bytes += len;
+              dbus_free (data);
+              dbus_message_unref (message);
+            }
+
+          bench_result_add (&result, bench_now_usec () - start, BATCH_SIZE,
+                            bytes);
+        }
+
+      result.allocations = _dbus_get_malloc_allocations () - allocations;
+      bench_result_report (&result, "marshal", bench_cases[c].signature);
+    }
+}
+
+static void
+bench_demarshal (const BenchOptions *options)
+{
+  int c;
+
+  for (c = 0; c < (int) _DBUS_N_ELEMENTS (bench_cases); c++)
+    {
+      BenchResult result;
+      DBusMessage *message;
+      char *data;
+      int len;
+      int allocations;
+      int s;
+
+      message = new_case_message (&bench_cases[c]);
+      if (message == NULL ||
+          !dbus_message_marshal (message, &data, &len))
+        die_oom ();
+      dbus_message_unref (message);
+
+      bench_result_init (&result, options->n_samples);
+      allocations = _dbus_get_malloc_allocations ();
+
+      for (s = 0; s < options->n_samples; s++)
+        {
+          double start;
+          int i;
+
+          start = bench_now_usec ();
+
+          for (i = 0; i < BATCH_SIZE; i++)
+            {
+              DBusMessageIter iter;
+
+              message = dbus_message_demarshal (data, len, NULL);
+              if (message == NULL)
+                die ("failed to demarshal a message we marshalled");
+
+              dbus_message_iter_init (message, &iter);
+              read_all (&iter);
+              dbus_message_unref (message);
+            }
+
+          bench_result_add (&result, bench_now_usec () - start, BATCH_SIZE,
+                            (double) len * BATCH_SIZE);
+        }
+
+      result.allocations = _dbus_get_malloc_allocations () - allocations;
+      bench_result_report (&result, "demarshal", bench_cases[c].signature);
+      dbus_free (data);
+    }
+}
+
+static void
+bench_validate (const BenchOptions *options)
+{
+  int c;
+
+  for (c = 0; c < (int) _DBUS_N_ELEMENTS (bench_cases); c++)
+    {
+      BenchResult result;
+      DBusMessage *message;
+      DBusString signature;
+      int body_len;
+      char byte_order;
+      int allocations;
+      int s;
+
+      message = new_case_message (&bench_cases[c]);
+      if (message == NULL)
+        die_oom ();
+
+      _dbus_string_init_const (&signature, dbus_message_get_signature (message));
+      body_len = _dbus_string_get_length (&message->body);
+      byte_order = _dbus_header_get_byte_order (&message->header);
+
+      bench_result_init (&result, options->n_samples);
+      allocations = _dbus_get_malloc_allocations ();
+
+      for (s = 0; s < options->n_samples; s++)
+        {
+          double start;
+          int i;
+
+          start = bench_now_usec ();
+
+          for (i = 0; i < BATCH_SIZE; i++)
+            {
+              DBusValidity validity;
+
+              validity = _dbus_validate_body_with_reason (&signature, 0,
+                                                          byte_order, NULL,
+                                                          &message->body, 0,
+                                                          body_len);
+              if (validity != DBUS_VALID)
+                die ("failed to validate a message body we marshalled");
+            }
+
+          bench_result_add (&result, bench_now_usec () - start, BATCH_SIZE,
+                            (double) body_len * BATCH_SIZE);
+        }
+
+      result.allocations = _dbus_get_malloc_allocations () - allocations;
+      bench_result_report (&result, "validate", bench_cases[c].signature);
+      dbus_message_unref (message);
+    }
+}
+
+/* Swaps each body to the other byte order and back, as a receiver has
+ * to before reading a message from a peer with the other byte order */
+static void
+bench_byteswap (const BenchOptions *options)
+{
+  int c;
+
+  for (c = 0; c < (int) _DBUS_N_ELEMENTS (bench_cases); c++)
+    {
+      BenchResult result;
+      DBusMessage *message;
+      DBusString signature;
+      int body_len;
+      char byte_order;
+      char other_byte_order;
+      int allocations;
+      int s;
+
+      message = new_case_message (&bench_cases[c]);
+      if (message == NULL)
+        die_oom ();
+
+      _dbus_string_init_const (&signature, dbus_message_get_signature (message));
+      body_len = _dbus_string_get_length (&message->body);
+      byte_order = _dbus_header_get_byte_order (&message->header);
+      other_byte_order = (byte_order == DBUS_LITTLE_ENDIAN ?
+                          DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN);
+
+      bench_result_init (&result, options->n_samples);
+      allocations = _dbus_get_malloc_allocations ();
+
+      for (s = 0; s < options->n_samples; s++)
+        {
+          double start;
+          int i;
+
+          start = bench_now_usec ();
+
+          for (i = 0; i < BATCH_SIZE; i++)
+            {
+              if (i % 2 == 0)
+                _dbus_marshal_byteswap (&signature, 0, byte_order,
+                                        other_byte_order, &message->body, 0);
+              else
+                _dbus_marshal_byteswap (&signature, 0, other_byte_order,
+                                        byte_order, &message->body, 0);
+            }
+
+          bench_result_add (&result, bench_now_usec () - start, BATCH_SIZE,
+                            (double) body_len * BATCH_SIZE);
+        }
+
+      result.allocations = _dbus_get_malloc_allocations () - allocations;
+      bench_result_report (&result, "byteswap", bench_cases[c].signature);
+      dbus_message_unref (message);
+    }
+}
+
+static void
+bench_loader (const BenchOptions *options)
+{
+  int c;
+
+  for (c = 0; c < (int) _DBUS_N_ELEMENTS (bench_cases); c++)
+    {
+      BenchResult result;
+      DBusMessage *message;
+      DBusString stream;
+      char *data;
+      int len;
+      int allocations;
+      int i, s;
+
+      message = new_case_message (&bench_cases[c]);
+      if (message == NULL ||
+          !dbus_message_marshal (message, &data, &len))
+        die_oom ();
+      dbus_message_unref (message);
+
+      if (!_dbus_string_init (&stream))
+        die_oom ();
+
+      for (i = 0; i < LOADER_MESSAGES; i++)
+        {
+          if (!_dbus_string_append_len (&stream, data, len))
+            die_oom ();
+        }
+
+      dbus_free (data);
+
+      bench_result_init (&result, options->n_samples);
+      allocations = _dbus_get_malloc_allocations ();
+
+      for (s = 0; s < options->n_samples; s++)
+        {
+          DBusMessageLoader *loader;
+          DBusString *buffer;
+          double start;
+
+          start = bench_now_usec ();
+
+          loader = _dbus_message_loader_new ();
+          if (loader == NULL)
+            die_oom ();
+
+          _dbus_message_loader_get_buffer (loader, &buffer);
+          if (!_dbus_string_copy (&stream, 0, buffer,
+                                  _dbus_string_get_length (buffer)))
+            die_oom ();
+          _dbus_message_loader_return_buffer (loader, buffer,
+                                              _dbus_string_get_length (&stream));
+
+          if (!_dbus_message_loader_queue_messages (loader))
+            die_oom ();
+
+          for (i = 0; i < LOADER_MESSAGES; i++)
+            {
+              message = _dbus_message_loader_pop_message (loader);
+              if (message == NULL)
+                die ("loader did not return a message we marshalled");
+
+              dbus_message_unref (message);
+            }
+
+          _dbus_message_loader_unref (loader);
+
+          bench_result_add (&result, bench_now_usec () - start,
+                            LOADER_MESSAGES,
+                            _dbus_string_get_length (&stream));
+        }
+
+      result.allocations = _dbus_get_malloc_allocations () - allocations;
+      bench_result_report (&result, "loader", bench_cases[c].signature);
+      _dbus_string_free (&stream);
+    }
+}
+
+/* Peer-to-peer round trips, client and server both in this process */
+
+typedef struct
+{
+  DBusLoop *loop;
+  DBusConnection *server_conn;
+  dbus_uint32_t awaited_serial;
+  dbus_bool_t got_reply;
+} PeerData;
+
+static DBusHandlerResult
+peer_server_filter (DBusConnection *connection,
+                    DBusMessage    *message,
+                    void           *user_data)
+{
+  DBusMessage *reply;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL || !dbus_connection_send (connection, reply, NULL))
+    die_oom ();
+
+  dbus_message_unref (reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+peer_client_filter (DBusConnection *connection,
+                    DBusMessage    *message,
+                    void           *user_data)
+{
+  PeerData *peer = user_data;
+
+  if (dbus_message_get_reply_serial (message) != peer->awaited_serial)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  peer->got_reply = TRUE;
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+peer_new_connection (DBusServer     *server,
+                     DBusConnection *new_connection,
+                     void           *user_data)
+{
+  PeerData *peer = user_data;
+
+  if (peer->server_conn != NULL)
+    return;
+
+  if (!test_connection_setup (peer->loop, new_connection) ||
+      !dbus_connection_add_filter (new_connection, peer_server_filter,
+                                   peer, NULL))
+    die_oom ();
+
+  peer->server_conn = dbus_connection_ref (new_connection);
+}
+
+static void
+bench_peer (const BenchOptions *options)
+{
+  static const char * const peer_cases[] = { "", "s", "ay" };
+  DBusError error = DBUS_ERROR_INIT;
+  DBusServer *server;
+  DBusConnection *client;
+  PeerData peer;
+  char *address;
+  int c;
+
+  peer.loop = _dbus_loop_new ();
+  peer.server_conn = NULL;
+  peer.awaited_serial = 0;
+  peer.got_reply = FALSE;
+
+  if (peer.loop == NULL)
+    die_oom ();
+
+  server = dbus_server_listen (TEST_LISTEN, &error);
+  if (server == NULL)
+    die (error.message);
+
+  dbus_server_set_new_connection_function (server, peer_new_connection,
+                                           &peer, NULL);
+  if (!test_server_setup (peer.loop, server))
+    die_oom ();
+
+  address = dbus_server_get_address (server);
+  if (address == NULL)
+    die_oom ();
+
+  client = dbus_connection_open_private (address, &error);
+  if (client == NULL)
+    die (error.message);
+
+  dbus_free (address);
+  dbus_connection_set_trust_incoming_data (client, options->trust);
+
+  if (!test_connection_setup (peer.loop, client) ||
+      !dbus_connection_add_filter (client, peer_client_filter, &peer, NULL))
+    die_oom ();
+
+  while (peer.server_conn == NULL)
+    _dbus_loop_iterate (peer.loop, TRUE);
+
+  dbus_connection_set_trust_incoming_data (peer.server_conn, options->trust);
+
+  for (c = 0; c < (int) _DBUS_N_ELEMENTS (peer_cases); c++)
+    {
+      BenchResult result;
+      const BenchCase *bench_case = NULL;
+      int allocations = 0;
+      int s, i;
+
+      for (i = 0; i < (int) _DBUS_N_ELEMENTS (bench_cases); i++)
+        {
+          if (strcmp (bench_cases[i].signature, peer_cases[c]) == 0)
+            bench_case = &bench_cases[i];
+        }
+
+      bench_result_init (&result, options->n_samples);
+
+      /* The first round trips also authenticate and fill caches */
+      for (s = -BATCH_SIZE; s < options->n_samples; s++)
+        {
+          DBusMessage *call;
+          DBusMessageIter iter;
+          double start;
+
+          if (s == 0)
+            allocations = _dbus_get_malloc_allocations ();
+
+          start = bench_now_usec ();
+
+          call = dbus_message_new_method_call (NULL, BENCH_PATH,
+                                               BENCH_INTERFACE, "Ping");
+          if (call == NULL)
+            die_oom ();
+
+          dbus_message_iter_init_append (call, &iter);
+
+          if (bench_case != NULL && !(* bench_case->append) (&iter))
+            die_oom ();
+
+          peer.got_reply = FALSE;
+
+          if (!dbus_connection_send (client, call, &peer.awaited_serial))
+            die_oom ();
+
+          dbus_message_unref (call);
+
+          while (!peer.got_reply)
+            _dbus_loop_iterate (peer.loop, TRUE);
+
+          if (s >= 0)
+            bench_result_add (&result, bench_now_usec () - start, 1, 0);
+        }
+
+      result.allocations = _dbus_get_malloc_allocations () - allocations;
+      bench_result_report (&result, "peer-round-trip",
+                           c == 0 ? "empty" : peer_cases[c]);
+    }
+
+  test_connection_shutdown (peer.loop, client);
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+
+  test_connection_shutdown (peer.loop, peer.server_conn);
+  dbus_connection_close (peer.server_conn);
+  dbus_connection_unref (peer.server_conn);
+
+  test_server_shutdown (peer.loop, server);
+  dbus_server_unref (server);
+
+  _dbus_loop_unref (peer.loop);
+}
+
+/* Signal routing through a bus daemon to N clients with M rules each */
+
+typedef struct
+{
+  int received;
+} RoutingData;
+
+static DBusHandlerResult
+routing_filter (DBusConnection *connection,
+                DBusMessage    *message,
+                void           *user_data)
+{
+  RoutingData *routing = user_data;
+
+  if (!dbus_message_is_signal (message, BENCH_INTERFACE, "Ping"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  routing->received += 1;
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusConnection *
+routing_connect (DBusLoop           *loop,
+                 const BenchOptions *options)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+
+  connection = dbus_connection_open_private (options->address, &error);
+  if (connection == NULL)
+    die (error.message);
+
+  dbus_connection_set_trust_incoming_data (connection, options->trust);
+
+  if (!dbus_bus_register (connection, &error))
+    die (error.message);
+
+  if (!test_connection_setup (loop, connection))
+    die_oom ();
+
+  return connection;
+}
+
+static void
+routing_disconnect (DBusLoop       *loop,
+                    DBusConnection *connection)
+{
+  test_connection_shutdown (loop, connection);
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+static void
+bench_routing (const BenchOptions *options)
+{
+  DBusLoop *loop;
+  DBusConnection *sender;
+  DBusConnection **receivers;
+  RoutingData routing;
+  BenchResult result;
+  char name[64];
+  int allocations = 0;
+  int i, s;
+
+  loop = _dbus_loop_new ();
+  receivers = dbus_new0 (DBusConnection *, options->n_clients);
+
+  if (loop == NULL || receivers == NULL)
+    die_oom ();
+
+  routing.received = 0;
+
+  sender = routing_connect (loop, options);
+
+  for (i = 0; i < options->n_clients; i++)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      char rule[128];
+      int r;
+
+      receivers[i] = routing_connect (loop, options);
+
+      if (!dbus_connection_add_filter (receivers[i], routing_filter,
+                                       &routing, NULL))
+        die_oom ();
+
+      /* All but the last rule are for other members, so the bus has to
+       * look at them and reject them
+       */
+      for (r = 0; r < options->n_rules; r++)
+        {
+          if (r == options->n_rules - 1)
+            snprintf (rule, sizeof (rule),
+                      "type='signal',interface='" BENCH_INTERFACE "',"
+                      "member='Ping'");
+          else
+            snprintf (rule, sizeof (rule),
+                      "type='signal',interface='" BENCH_INTERFACE "',"
+                      "member='Other%d'", r);
+
+          dbus_bus_add_match (receivers[i], rule, &error);
+          if (dbus_error_is_set (&error))
+            die (error.message);
+        }
+    }
+
+  bench_result_init (&result, options->n_samples);
+
+  for (s = -BATCH_SIZE; s < options->n_samples; s++)
+    {
+      DBusMessage *signal;
+      double start;
+
+      if (s == 0)
+        allocations = _dbus_get_malloc_allocations ();
+
+      start = bench_now_usec ();
+
+      signal = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE, "Ping");
+      if (signal == NULL || !dbus_connection_send (sender, signal, NULL))
+        die_oom ();
+
+      dbus_message_unref (signal);
+
+      routing.received = 0;
+
+      while (routing.received < options->n_clients)
+        _dbus_loop_iterate (loop, TRUE);
+
+      if (s >= 0)
+        bench_result_add (&result, bench_now_usec () - start, 1, 0);
+    }
+
+  result.allocations = _dbus_get_malloc_allocations () - allocations;
+  snprintf (name, sizeof (name), "%d-clients-%d-rules",
+            options->n_clients, options->n_rules);
+  bench_result_report (&result, "routing", name);
+
+  for (i = 0; i < options->n_clients; i++)
+    routing_disconnect (loop, receivers[i]);
+
+  routing_disconnect (loop, sender);
+  dbus_free (receivers);
+  _dbus_loop_unref (loop);
+}
+
+/* Blocking calls to the bus while signals are queued ahead of the reply */
+
+static void
+bench_blocking (const BenchOptions *options)
+{
+  static const int backlogs[] = { 0, 100, 10000 };
+  DBusLoop *loop;
+  DBusConnection *sender;
+  DBusConnection *caller;
+  DBusError error = DBUS_ERROR_INIT;
+  int queued = 0;
+  int b, s;
+
+  loop = _dbus_loop_new ();
+
+  if (loop == NULL)
+    die_oom ();
+
+  sender = routing_connect (loop, options);
+  caller = routing_connect (loop, options);
+
+  /* The loop is never run, so the signals are never dispatched */
+  dbus_bus_add_match (caller,
+                      "type='signal',interface='" BENCH_INTERFACE "',"
+                      "member='Ping'", &error);
+  if (dbus_error_is_set (&error))
+    die (error.message);
+
+  for (b = 0; b < (int) _DBUS_N_ELEMENTS (backlogs); b++)
+    {
+      BenchResult result;
+      char name[64];
+      int allocations = 0;
+
+      for (; queued < backlogs[b]; queued++)
+        {
+          DBusMessage *signal;
+
+          signal = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE,
+                                            "Ping");
+          if (signal == NULL || !dbus_connection_send (sender, signal, NULL))
+            die_oom ();
+
+          dbus_message_unref (signal);
+        }
+
+      dbus_connection_flush (sender);
+      bench_result_init (&result, options->n_samples);
+
+      /* The warm-up calls also pull the new signals into the queue */
+      for (s = -BATCH_SIZE; s < options->n_samples; s++)
+        {
+          DBusMessage *call;
+          DBusMessage *reply;
+          double start;
+
+          if (s == 0)
+            allocations = _dbus_get_malloc_allocations ();
+
+          call = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                               DBUS_PATH_DBUS,
+                                               DBUS_INTERFACE_DBUS, "GetId");
+          if (call == NULL)
+            die_oom ();
+
+          start = bench_now_usec ();
+          reply = dbus_connection_send_with_reply_and_block (caller, call,
+                                                             -1, &error);
+          if (s >= 0)
+            bench_result_add (&result, bench_now_usec () - start, 1, 0);
+
+          if (reply == NULL)
+            die (error.message);
+
+          dbus_message_unref (reply);
+          dbus_message_unref (call);
+        }
+
+      result.allocations = _dbus_get_malloc_allocations () - allocations;
+      snprintf (name, sizeof (name), "backlog-%d", backlogs[b]);
+      bench_result_report (&result, "blocking", name);
+    }
+
+  routing_disconnect (loop, caller);
+  routing_disconnect (loop, sender);
+  _dbus_loop_unref (loop);
+}
+
+typedef void (* BenchFunction) (const BenchOptions *options);
+
+static const struct
+{
+  const char *name;
+  BenchFunction function;
+} benchmarks[] = {
+  { "marshal", bench_marshal },
+  { "demarshal", bench_demarshal },
+  { "validate", bench_validate },
+  { "byteswap", bench_byteswap },
+  { "loader", bench_loader },
+  { "peer", bench_peer },
+  { "routing", bench_routing },
+  { "blocking", bench_blocking }
+};
+
+static void
+usage (void)
+{
+  int i;
+
+  fprintf (stderr,
+           "Usage: dbus-bench [--samples N] [--clients N] [--rules N]\n"
+           "                  [--address ADDRESS] [--trust] [BENCHMARK...]\n"
+           "Benchmarks:");
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (benchmarks); i++)
+    fprintf (stderr, " %s", benchmarks[i].name);
+
+  fprintf (stderr, "\n");
+  exit (1);
+}
+
+static int
+parse_count (const char *arg)
+{
+  long value;
+  char *end;
+
+  if (arg == NULL)
+    usage ();
+
+  value = strtol (arg, &end, 10);
+  if (*end != '\0' || value < 1 || value > 10000000)
+    usage ();
+
+  return value;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  BenchOptions options;
+  dbus_bool_t selected[_DBUS_N_ELEMENTS (benchmarks)];
+  dbus_bool_t any_selected = FALSE;
+  int i, b;
+
+  options.n_samples = 1000;
+  options.n_clients = 8;
+  options.n_rules = 16;
+  options.address = _dbus_getenv ("DBUS_SESSION_BUS_ADDRESS");
+  options.trust = FALSE;
+
+  memset (selected, 0, sizeof (selected));
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--samples") == 0)
+        options.n_samples = parse_count (argv[++i]);
+      else if (strcmp (arg, "--clients") == 0)
+        options.n_clients = parse_count (argv[++i]);
+      else if (strcmp (arg, "--rules") == 0)
+        options.n_rules = parse_count (argv[++i]);
+      else if (strcmp (arg, "--address") == 0 && i + 1 < argc)
+        options.address = argv[++i];
+      else if (strcmp (arg, "--trust") == 0)
+        options.trust = TRUE;
+      else
+        {
+          for (b = 0; b < (int) _DBUS_N_ELEMENTS (benchmarks); b++)
+            {
+              if (strcmp (arg, benchmarks[b].name) == 0)
+                break;
+            }
+
+          if (b == (int) _DBUS_N_ELEMENTS (benchmarks))
+            usage ();
+
+          selected[b] = TRUE;
+          any_selected = TRUE;
+        }
+    }
+
+  for (b = 0; b < (int) _DBUS_N_ELEMENTS (benchmarks); b++)
+    {
+      if (any_selected && !selected[b])
+        continue;
+
+      if ((benchmarks[b].function == bench_routing ||
+           benchmarks[b].function == bench_blocking) &&
+          options.address == NULL)
+        {
+          if (any_selected)
+            die ("this benchmark needs --address or DBUS_SESSION_BUS_ADDRESS");
+
+          fprintf (stderr, "dbus-bench: no bus address, skipping %s\n",
+                   benchmarks[b].name);
+          continue;
+        }
+
+      (* benchmarks[b].function) (&options);
+    }
+
+  dbus_shutdown ();
+
+  return 0;
+}